@@ -0,0 +1,137 @@
+/*
+ * Copyright (c) 2004 Regents of The University of Michigan.
+ * All Rights Reserved.  See COPYRIGHT.
+ */
+
+#include "config.h"
+
+#ifdef HAVE_LINKAT
+/* O_TMPFILE is a GNU extension in glibc */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif /* _GNU_SOURCE */
+#endif /* HAVE_LINKAT */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "atomfile.h"
+
+/*
+ * a cookie file is written whole before anyone can see it.  where
+ * there's O_TMPFILE, it's written with no name at all and linkat()
+ * gives it its name, so creating a cookie is an open, the writes and
+ * a link, and a crash leaves nothing behind.  only rename() replaces a
+ * file atomically, and it needs a name, so a file that will replace
+ * another, or any file where the filesystem won't, is written under a
+ * unique tmp name, linked or renamed into place, and the tmp name
+ * unlinked, as cosign always has.
+ */
+
+#if defined( HAVE_LINKAT ) && defined( O_TMPFILE )
+#define ATOMFILE_ANON
+static int	atomfile_proc = -1;
+#endif /* HAVE_LINKAT && O_TMPFILE */
+
+/*
+ * opens a new file for writing in dir, NULL meaning the working
+ * directory, to be put in place with atomfile_link().  flags is
+ * ATOMFILE_REPLACE if it may replace a file, as it must be when it's
+ * linked.  returns its fd, or -1 with errno set.
+ */
+    int
+atomfile_open( struct atomfile *af, char *dir, int mode, int flags )
+{
+    struct timeval	tv;
+    int			len;
+
+    af->af_fd = -1;
+    af->af_anon = 0;
+
+    if ( gettimeofday( &tv, NULL ) != 0 ) {
+	return( -1 );
+    }
+    if ( dir == NULL ) {
+	len = snprintf( af->af_tmp, sizeof( af->af_tmp ), "%x%x.%i",
+		(int)tv.tv_sec, (int)tv.tv_usec, (int)getpid());
+    } else {
+	len = snprintf( af->af_tmp, sizeof( af->af_tmp ), "%s/%x%x.%i",
+		dir, (int)tv.tv_sec, (int)tv.tv_usec, (int)getpid());
+    }
+    if ( len >= (int)sizeof( af->af_tmp )) {
+	errno = ENAMETOOLONG;
+	return( -1 );
+    }
+
+#ifdef ATOMFILE_ANON
+    /* linkat() finds an unnamed file through /proc */
+    if ( atomfile_proc < 0 ) {
+	atomfile_proc = ( access( "/proc/self/fd", X_OK ) == 0 );
+    }
+    if ( atomfile_proc && !( flags & ATOMFILE_REPLACE )) {
+	if (( af->af_fd = open(( dir == NULL ) ? "." : dir,
+		O_TMPFILE | O_WRONLY, mode )) >= 0 ) {
+	    af->af_anon = 1;
+	    return( af->af_fd );
+	}
+	/* the kernel or filesystem doesn't support it */
+	if ( errno != EISDIR && errno != EOPNOTSUPP && errno != EINVAL ) {
+	    return( -1 );
+	}
+    }
+#endif /* ATOMFILE_ANON */
+
+    af->af_fd = open( af->af_tmp, O_CREAT | O_EXCL | O_WRONLY, mode );
+    return( af->af_fd );
+}
+
+/*
+ * gives the written file the name path.  ATOMFILE_REPLACE, if it was
+ * given to atomfile_open() too, replaces whatever is there, otherwise
+ * -1 is returned with errno EEXIST if path exists.  the caller flushes
+ * what it wrote first, and still closes the fd after.  on failure,
+ * the file is left as it was, to be linked again or given up with
+ * atomfile_abort().
+ */
+    int
+atomfile_link( struct atomfile *af, char *path, int flags )
+{
+#ifdef ATOMFILE_ANON
+    char		fdpath[ 64 ];
+
+    if ( af->af_anon ) {
+	if ( flags & ATOMFILE_REPLACE ) {
+	    errno = EINVAL;
+	    return( -1 );
+	}
+	snprintf( fdpath, sizeof( fdpath ), "/proc/self/fd/%d", af->af_fd );
+	return( linkat( AT_FDCWD, fdpath, AT_FDCWD, path,
+		AT_SYMLINK_FOLLOW ));
+    }
+#endif /* ATOMFILE_ANON */
+
+    if ( flags & ATOMFILE_REPLACE ) {
+	return( rename( af->af_tmp, path ));
+    }
+    if ( link( af->af_tmp, path ) != 0 ) {
+	return( -1 );
+    }
+    (void)atomfile_abort( af );
+    return( 0 );
+}
+
+/* removes the tmp name, if there is one */
+    int
+atomfile_abort( struct atomfile *af )
+{
+    if ( af->af_anon ) {
+	return( 0 );
+    }
+    return( unlink( af->af_tmp ));
+}
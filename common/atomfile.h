@@ -0,0 +1,17 @@
+/*
+ * Copyright (c) 2004 Regents of The University of Michigan.
+ * All Rights Reserved.  See COPYRIGHT.
+ */
+
+/* a file written unnamed, or under a tmp name, then put in place */
+struct atomfile {
+    int		af_fd;
+    int		af_anon;	/* O_TMPFILE: no name until linked */
+    char	af_tmp[ 1024 ];	/* tmp name, if any */
+};
+
+#define ATOMFILE_REPLACE	0x01
+
+int	atomfile_open( struct atomfile *, char *, int, int );
+int	atomfile_link( struct atomfile *, char *, int );
+int	atomfile_abort( struct atomfile * );
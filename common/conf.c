@@ -100,76 +100,548 @@ cosign_config_get( char *key )
     return( NULL );
 }
 
-    struct servicelist *
-service_find( char *cookie, regmatch_t matches[], int nmatch )
+/*
+ * service and authlist patterns are compiled once, when the config is
+ * read, and indexed so a lookup needn't try every entry in turn:
+ * literal patterns are hashed, patterns of the form "prefix(.*)" are
+ * kept in a trie, patterns whose only special character is '.' are
+ * bucketed by length, and everything else is a regex, tried in order.
+ * the first entry in the config file to match still wins.
+ */
+#define PA_META		".[]()*+?{}|^$\\"
+
+struct mi_entry {
+    int			me_order;
+    struct pattern	*me_pattern;
+    void		*me_data;
+    struct mi_entry	*me_next;
+};
+
+struct mi_node {
+    int			mn_c;
+    struct mi_entry	*mn_entry;
+    struct mi_node	*mn_child;
+    struct mi_node	*mn_sibling;
+};
+
+struct matchindex {
+    int			mi_icase;
+    unsigned int	mi_mask;
+    struct mi_entry	**mi_literal;	/* hashed on text */
+    struct mi_entry	**mi_wild;	/* hashed on length */
+    struct mi_node	*mi_trie;
+    struct mi_entry	*mi_regex;
+};
+
+static struct matchindex	*serviceindex = NULL, *new_serviceindex;
+static struct matchindex	*authindex = NULL, *new_authindex;
+
+    static int
+pattern_compile( struct pattern *pa, char *text, int icase )
+{
+    char		*p, error[ 1024 ];
+    int			rc, ingroup = 0, wild = 0;
+
+    memset( pa, 0, sizeof( struct pattern ));
+    pa->pa_gso = pa->pa_geo = -1;
+    pa->pa_icase = icase;
+    if (( pa->pa_text = malloc( strlen( text ) + 1 )) == NULL ) {
+	perror( "malloc" );
+	return( -1 );
+    }
+
+    pa->pa_type = PA_LITERAL;
+    for ( p = text; *p != '\0'; p++ ) {
+	if ( *p == '\\' ) {
+	    if ( p[ 1 ] == '\0' || strchr( PA_META, p[ 1 ] ) == NULL ) {
+		pa->pa_type = PA_REGEX;
+		break;
+	    }
+	    pa->pa_text[ pa->pa_len++ ] = *++p;
+
+	} else if ( *p == '(' ) {
+	    if ( pa->pa_gso >= 0 ) {
+		pa->pa_type = PA_REGEX;
+		break;
+	    }
+	    pa->pa_gso = pa->pa_len;
+	    ingroup = 1;
+
+	} else if ( *p == ')' ) {
+	    if ( !ingroup ) {
+		pa->pa_type = PA_REGEX;
+		break;
+	    }
+	    pa->pa_geo = pa->pa_len;
+	    ingroup = 0;
+
+	} else if ( *p == '.' && p[ 1 ] == '*' ) {
+	    /* ".*" or "(.*)" must end the pattern */
+	    if ( !wild && (( !ingroup && p[ 2 ] == '\0' ) ||
+		    ( ingroup && p[ 2 ] == ')' && p[ 3 ] == '\0' ))) {
+		pa->pa_type = PA_PREFIX;
+		ingroup = 0;
+	    } else {
+		pa->pa_type = PA_REGEX;
+	    }
+	    break;
+
+	} else if ( *p == '.' ) {
+	    pa->pa_text[ pa->pa_len++ ] = '\0';
+	    wild = 1;
+
+	} else if ( strchr( PA_META, *p ) != NULL ) {
+	    pa->pa_type = PA_REGEX;
+	    break;
+
+	} else {
+	    pa->pa_text[ pa->pa_len++ ] = *p;
+	}
+    }
+    if ( ingroup ) {
+	pa->pa_type = PA_REGEX;
+    }
+    if ( pa->pa_type == PA_LITERAL && wild ) {
+	pa->pa_type = PA_WILD;
+    }
+
+    if ( pa->pa_type == PA_REGEX ) {
+	strcpy( pa->pa_text, text );
+	pa->pa_len = strlen( text );
+	pa->pa_gso = pa->pa_geo = -1;
+	if (( rc = regcomp( &pa->pa_preg, text,
+		REG_EXTENDED | ( icase ? REG_ICASE : 0 ))) != 0 ) {
+	    regerror( rc, &pa->pa_preg, error, sizeof( error ));
+	    fprintf( stderr, "regcomp %s failed: %s\n", text, error );
+	    /* never matches, as when it was compiled for every lookup */
+	    return( 0 );
+	}
+    }
+    pa->pa_compiled = 1;
+
+    return( 0 );
+}
+
+    static void
+pattern_free( struct pattern *pa )
+{
+    if ( pa->pa_type == PA_REGEX && pa->pa_compiled ) {
+	regfree( &pa->pa_preg );
+    }
+    if ( pa->pa_text != NULL ) {
+	free( pa->pa_text );
+	pa->pa_text = NULL;
+    }
+    pa->pa_compiled = 0;
+}
+
+/* compares len chars of s against pattern text t, '\0' in t matches any */
+    static int
+pattern_cmp( struct pattern *pa, char *s, int len )
+{
+    char	*t = pa->pa_text;
+    int		i;
+
+    for ( i = 0; i < len; i++ ) {
+	if ( t[ i ] == '\0' && pa->pa_type == PA_WILD ) {
+	    continue;
+	}
+	if ( pa->pa_icase ) {
+	    if ( tolower( (unsigned char)t[ i ] ) !=
+		    tolower( (unsigned char)s[ i ] )) {
+		return( 1 );
+	    }
+	} else if ( t[ i ] != s[ i ] ) {
+	    return( 1 );
+	}
+    }
+    return( 0 );
+}
+
+/* fill in matches[] as regexec() would for a whole-string match */
+    static void
+pattern_fill( struct pattern *pa, int len, regmatch_t matches[], int nmatch )
+{
+    int		i;
+
+    matches[ 0 ].rm_so = 0;
+    matches[ 0 ].rm_eo = len;
+    for ( i = 1; i < nmatch; i++ ) {
+	matches[ i ].rm_so = matches[ i ].rm_eo = -1;
+    }
+    if ( nmatch > 1 && pa->pa_gso >= 0 ) {
+	matches[ 1 ].rm_so = pa->pa_gso;
+	matches[ 1 ].rm_eo = ( pa->pa_geo >= 0 ) ? pa->pa_geo : len;
+    }
+}
+
+/* returns 1 if pa matches the whole of s, 0 if not */
+    static int
+pattern_exec( struct pattern *pa, char *s, int len,
+	regmatch_t matches[], int nmatch )
 {
-    struct servicelist	*cur = NULL;
-    regex_t		preg;
     char		error[ 1024 ];
     int			rc;
 
-    if ( nmatch < 1 || matches == NULL ) {
-	/* require at least one regmatch_t in the array */
-	return( NULL );
+    if ( !pa->pa_compiled ) {
+	return( 0 );
     }
 
-    for ( cur = servicelist; cur != NULL; cur = cur->sl_next ) {
-	if (( rc = regcomp( &preg, cur->sl_cookie, REG_EXTENDED )) != 0 ) {
-	    regerror( rc, &preg, error, sizeof( error ));
-	    fprintf( stderr, "regcomp %s failed: %s\n", cur->sl_cookie, error );
-	    continue;
+    switch ( pa->pa_type ) {
+    case PA_LITERAL :
+    case PA_WILD :
+	if ( len != pa->pa_len || pattern_cmp( pa, s, len ) != 0 ) {
+	    return( 0 );
 	}
+	break;
 
-	if (( rc = regexec( &preg, cookie, nmatch, matches, 0 )) == 0 ) {
-	    /* only match whole service names */
-	    if ( matches[ 0 ].rm_so == 0 &&
-		    matches[ 0 ].rm_eo == strlen( cookie )) {
-		regfree( &preg );
-		break;
+    case PA_PREFIX :
+	if ( len < pa->pa_len || pattern_cmp( pa, s, pa->pa_len ) != 0 ) {
+	    return( 0 );
+	}
+	break;
+
+    default :
+	if (( rc = regexec( &pa->pa_preg, s, nmatch, matches, 0 )) != 0 ) {
+	    if ( rc != REG_NOMATCH ) {
+		regerror( rc, &pa->pa_preg, error, sizeof( error ));
+		fprintf( stderr, "regexec failed: %s\n", error );
 	    }
-	} else if ( rc != REG_NOMATCH ) {
-	    regerror( rc, &preg, error, sizeof( error ));
-	    fprintf( stderr, "regexec failed: %s\n", error );
+	    return( 0 );
 	}
+	/* only match whole strings */
+	return( matches[ 0 ].rm_so == 0 && matches[ 0 ].rm_eo == len );
+    }
+
+    pattern_fill( pa, len, matches, nmatch );
+    return( 1 );
+}
 
-	regfree( &preg );
+    static unsigned int
+mi_hash( char *s, int len, int icase )
+{
+    unsigned int	h = 5381;
+    int			i;
+
+    for ( i = 0; i < len; i++ ) {
+	h = ( h << 5 ) + h + ( icase ? tolower( (unsigned char)s[ i ] ) :
+		(unsigned char)s[ i ] );
     }
+    return( h );
+}
 
-    return( cur );
+    static struct matchindex *
+matchindex_new( int n, int icase )
+{
+    struct matchindex	*mi;
+    unsigned int	size;
+
+    for ( size = 64; size < n * 2; size <<= 1 )
+	;
+
+    if (( mi = calloc( 1, sizeof( struct matchindex ))) == NULL ) {
+	perror( "malloc" );
+	return( NULL );
+    }
+    mi->mi_icase = icase;
+    mi->mi_mask = size - 1;
+    if (( mi->mi_literal = calloc( size, sizeof( struct mi_entry * )))
+	    == NULL ) {
+	perror( "malloc" );
+	free( mi );
+	return( NULL );
+    }
+    if (( mi->mi_wild = calloc( size, sizeof( struct mi_entry * )))
+	    == NULL ) {
+	perror( "malloc" );
+	free( mi->mi_literal );
+	free( mi );
+	return( NULL );
+    }
+    return( mi );
 }
 
-    struct authlist *
-authlist_find( char *hostname )
+    static void
+mi_node_free( struct mi_node *mn )
 {
-    struct authlist	*cur = NULL;
-    regex_t		preg;
-    regmatch_t		matches[ 1 ];
-    char		error[ 1024 ];
-    int			rc;
+    struct mi_node	*next;
 
-    for ( cur = authlist; cur != NULL; cur = cur->al_next ) {
-	/* case-insensitive matching */
-	if (( rc = regcomp( &preg, cur->al_hostname,
-		REG_EXTENDED | REG_ICASE )) != 0 ) {
-	    regerror( rc, &preg, error, sizeof( error ));
-	    fprintf( stderr, "regcomp %s failed: %s\n", cur->al_hostname,error);
-	    return( NULL );
+    for ( ; mn != NULL; mn = next ) {
+	next = mn->mn_sibling;
+	mi_node_free( mn->mn_child );
+	if ( mn->mn_entry != NULL ) {
+	    free( mn->mn_entry );
 	}
+	free( mn );
+    }
+}
+
+    static void
+mi_entry_free( struct mi_entry *me )
+{
+    struct mi_entry	*next;
+
+    for ( ; me != NULL; me = next ) {
+	next = me->me_next;
+	free( me );
+    }
+}
 
-	if (( rc = regexec( &preg, hostname, 1, matches, 0 )) == 0 ) {
-	    if ( matches[ 0 ].rm_so == 0 &&
-			matches[ 0 ].rm_eo == strlen( hostname )) {
-		regfree( &preg );
+    static void
+matchindex_free( struct matchindex **mi )
+{
+    unsigned int	i;
+
+    if ( *mi == NULL ) {
+	return;
+    }
+    for ( i = 0; i <= (*mi)->mi_mask; i++ ) {
+	mi_entry_free( (*mi)->mi_literal[ i ] );
+	mi_entry_free( (*mi)->mi_wild[ i ] );
+    }
+    free( (*mi)->mi_literal );
+    free( (*mi)->mi_wild );
+    mi_node_free( (*mi)->mi_trie );
+    mi_entry_free( (*mi)->mi_regex );
+    free( *mi );
+    *mi = NULL;
+}
+
+    static int
+matchindex_add( struct matchindex *mi, struct pattern *pa, void *data,
+	int order )
+{
+    struct mi_entry	*me, **mep;
+    struct mi_node	*mn = NULL, **mnp;
+    int			i, c;
+
+    if ( !pa->pa_compiled ) {
+	return( 0 );
+    }
+
+    if (( me = malloc( sizeof( struct mi_entry ))) == NULL ) {
+	perror( "malloc" );
+	return( -1 );
+    }
+    me->me_order = order;
+    me->me_pattern = pa;
+    me->me_data = data;
+    me->me_next = NULL;
+
+    switch ( pa->pa_type ) {
+    case PA_LITERAL :
+	mep = &mi->mi_literal[ mi_hash( pa->pa_text, pa->pa_len,
+		mi->mi_icase ) & mi->mi_mask ];
+	for ( ; *mep != NULL; mep = &(*mep)->me_next ) {
+	    /* an earlier duplicate always wins */
+	    if ( (*mep)->me_pattern->pa_len == pa->pa_len &&
+		    pattern_cmp( (*mep)->me_pattern, pa->pa_text,
+		    pa->pa_len ) == 0 ) {
+		free( me );
+		return( 0 );
+	    }
+	}
+	*mep = me;
+	break;
+
+    case PA_WILD :
+	for ( mep = &mi->mi_wild[ pa->pa_len & mi->mi_mask ]; *mep != NULL;
+		mep = &(*mep)->me_next )
+	    ;
+	*mep = me;
+	break;
+
+    case PA_PREFIX :
+	mnp = &mi->mi_trie;
+	for ( i = -1; i < pa->pa_len; i++ ) {
+	    /* the root is the empty prefix, for ".*" */
+	    c = ( i < 0 ) ? -1 : (unsigned char)pa->pa_text[ i ];
+	    if ( c >= 0 && mi->mi_icase ) {
+		c = tolower( c );
+	    }
+	    for ( mn = *mnp; mn != NULL; mn = mn->mn_sibling ) {
+		if ( mn->mn_c == c ) {
+		    break;
+		}
+	    }
+	    if ( mn == NULL ) {
+		if (( mn = calloc( 1, sizeof( struct mi_node ))) == NULL ) {
+		    perror( "malloc" );
+		    free( me );
+		    return( -1 );
+		}
+		mn->mn_c = c;
+		mn->mn_sibling = *mnp;
+		*mnp = mn;
+	    }
+	    mnp = &mn->mn_child;
+	}
+	if ( mn->mn_entry != NULL ) {
+	    free( me );
+	    return( 0 );
+	}
+	mn->mn_entry = me;
+	break;
+
+    default :
+	for ( mep = &mi->mi_regex; *mep != NULL; mep = &(*mep)->me_next )
+	    ;
+	*mep = me;
+	break;
+    }
+
+    return( 0 );
+}
+
+    static void *
+matchindex_find( struct matchindex *mi, char *s, regmatch_t matches[],
+	int nmatch )
+{
+    struct mi_entry	*me, *best = NULL;
+    struct mi_node	*mn;
+    int			len, i, c;
+
+    if ( mi == NULL ) {
+	return( NULL );
+    }
+    len = strlen( s );
+
+    for ( me = mi->mi_literal[ mi_hash( s, len, mi->mi_icase ) &
+	    mi->mi_mask ]; me != NULL; me = me->me_next ) {
+	if ( me->me_pattern->pa_len == len &&
+		pattern_cmp( me->me_pattern, s, len ) == 0 ) {
+	    best = me;
+	    break;
+	}
+    }
+
+    for ( me = mi->mi_wild[ len & mi->mi_mask ]; me != NULL;
+	    me = me->me_next ) {
+	if ( best != NULL && me->me_order > best->me_order ) {
+	    break;
+	}
+	if ( me->me_pattern->pa_len == len &&
+		pattern_cmp( me->me_pattern, s, len ) == 0 ) {
+	    best = me;
+	    break;
+	}
+    }
+
+    for ( mn = mi->mi_trie, i = -1; mn != NULL; ) {
+	c = ( i < 0 ) ? -1 : (unsigned char)s[ i ];
+	if ( c >= 0 && mi->mi_icase ) {
+	    c = tolower( c );
+	}
+	for ( ; mn != NULL; mn = mn->mn_sibling ) {
+	    if ( mn->mn_c == c ) {
 		break;
 	    }
-	} else if ( rc != REG_NOMATCH ) {
-	    regerror( rc, &preg, error, sizeof( error ));
-	    fprintf( stderr, "regexec failed: %s\n", error );
 	}
-	regfree( &preg );
+	if ( mn == NULL ) {
+	    break;
+	}
+	if ( mn->mn_entry != NULL && ( best == NULL ||
+		mn->mn_entry->me_order < best->me_order )) {
+	    best = mn->mn_entry;
+	}
+	if ( ++i >= len ) {
+	    break;
+	}
+	mn = mn->mn_child;
+    }
+
+    /* a regex only needs trying if it comes before what we've found */
+    for ( me = mi->mi_regex; me != NULL; me = me->me_next ) {
+	if ( best != NULL && me->me_order > best->me_order ) {
+	    break;
+	}
+	if ( pattern_exec( me->me_pattern, s, len, matches, nmatch )) {
+	    return( me->me_data );
+	}
+    }
+
+    if ( best == NULL ) {
+	return( NULL );
+    }
+    pattern_fill( best->me_pattern, len, matches, nmatch );
+    return( best->me_data );
+}
+
+/*
+ * compiles the patterns of a newly read config and builds its indexes.
+ */
+    static int
+config_index( void )
+{
+    struct servicelist	*sl;
+    struct authlist	*al;
+    int			n;
+
+    for ( n = 0, sl = new_servicelist; sl != NULL; sl = sl->sl_next, n++ ) {
+	if ( pattern_compile( &sl->sl_pattern, sl->sl_cookie, 0 ) != 0 ) {
+	    return( -1 );
+	}
+    }
+    if (( new_serviceindex = matchindex_new( n, 0 )) == NULL ) {
+	return( -1 );
+    }
+    for ( n = 0, sl = new_servicelist; sl != NULL; sl = sl->sl_next, n++ ) {
+	if ( matchindex_add( new_serviceindex, &sl->sl_pattern, sl, n ) != 0 ) {
+	    return( -1 );
+	}
+    }
+
+    for ( n = 0, al = new_authlist; al != NULL; al = al->al_next, n++ ) {
+	/* hostnames are looked up without regard to case */
+	if ( pattern_compile( &al->al_pattern, al->al_hostname, 1 ) != 0 ) {
+	    return( -1 );
+	}
+	if ( pattern_compile( &al->al_cnpattern, al->al_hostname, 0 ) != 0 ) {
+	    return( -1 );
+	}
+    }
+    if (( new_authindex = matchindex_new( n, 1 )) == NULL ) {
+	return( -1 );
+    }
+    for ( n = 0, al = new_authlist; al != NULL; al = al->al_next, n++ ) {
+	if ( matchindex_add( new_authindex, &al->al_pattern, al, n ) != 0 ) {
+	    return( -1 );
+	}
+    }
+
+    return( 0 );
+}
+
+    struct servicelist *
+service_find( char *cookie, regmatch_t matches[], int nmatch )
+{
+    if ( nmatch < 1 || matches == NULL ) {
+	/* require at least one regmatch_t in the array */
+	return( NULL );
     }
 
-    return( cur );
+    return( matchindex_find( serviceindex, cookie, matches, nmatch ));
+}
+
+    struct authlist *
+authlist_find( char *hostname )
+{
+    regmatch_t		matches[ 1 ];
+
+    /* case-insensitive matching */
+    return( matchindex_find( authindex, hostname, matches, 1 ));
+}
+
+/*
+ * returns 1 if hostname, compared with case, matches all of al's
+ * hostname pattern, filling in matches as regexec() would.
+ */
+    int
+authlist_match( struct authlist *al, char *hostname, regmatch_t matches[],
+	int nmatch )
+{
+    return( pattern_exec( &al->al_cnpattern, hostname, strlen( hostname ),
+	    matches, nmatch ));
 }
 
     int
@@ -356,6 +828,8 @@ authlist_free( struct authlist **al )
 
     for ( cur = *al; cur != NULL; cur = next ) {
 	free( cur->al_hostname );
+	pattern_free( &cur->al_pattern );
+	pattern_free( &cur->al_cnpattern );
 	for ( pcur = cur->al_proxies; pcur != NULL; pcur = pnext ) {
 	    free( pcur->pr_hostname );
 	    free( pcur->pr_cookie );
@@ -377,6 +851,7 @@ servicelist_free( struct servicelist **sl )
     for ( scur = *sl; scur != NULL; scur = snext ) {
 	free( scur->sl_cookie );
 	free( scur->sl_wkurl );
+	pattern_free( &scur->sl_pattern );
 	if ( scur->sl_cookiesub != NULL ) {
 	    free( scur->sl_cookiesub );
 	}
@@ -791,7 +1266,7 @@ read_config( char *path )
 		}
 
 		if (( al_new =
-			(struct authlist *)malloc( sizeof( struct authlist )))
+			(struct authlist *)calloc( 1, sizeof( struct authlist )))
 			== NULL ) {
 		    perror( "malloc" );
 		    return( -1 );
@@ -812,7 +1287,7 @@ read_config( char *path )
 		}
 
 
-		if (( sl_new = (struct servicelist *)malloc(
+		if (( sl_new = (struct servicelist *)calloc( 1,
 				sizeof( struct servicelist ))) == NULL ) {
 		    perror( "malloc" );
 		    return( -1 );
@@ -873,7 +1348,7 @@ read_config( char *path )
 		    }
 		}
 		if ( al_new == NULL ) {
-		    if (( al_new = (struct authlist *)malloc(
+		    if (( al_new = (struct authlist *)calloc( 1,
 				    sizeof( struct authlist ))) == NULL ) {
 			perror( "malloc" );
 			return( -1 );
@@ -904,7 +1379,7 @@ read_config( char *path )
 		    return( -1 );
 		}
 		if (( al_new =
-			(struct authlist *)malloc( sizeof( struct authlist )))
+			(struct authlist *)calloc( 1, sizeof( struct authlist )))
 			== NULL ) {
 		    perror( "malloc" );
 		    return( -1 );
@@ -955,13 +1430,19 @@ cosign_config( char *path )
 {
     struct authlist	*old_authlist;
     struct servicelist	*old_servicelist;
+    struct matchindex	*old_serviceindex, *old_authindex;
     struct cosigncfg	*old_cfg;
 
     new_authlist = NULL;
     new_servicelist = NULL;
+    new_serviceindex = NULL;
+    new_authindex = NULL;
     new_cfg = NULL;
     
-    if ( read_config( path ) != 0 ) {
+    if ( read_config( path ) != 0 || config_index() != 0 ) {
+	matchindex_free( &new_serviceindex );
+	matchindex_free( &new_authindex );
+
 	if ( new_authlist != NULL ) {
 	    authlist_free( &new_authlist );
 	}
@@ -976,13 +1457,21 @@ cosign_config( char *path )
 	return( -1 );
     }
 
+    /* nothing is swapped in until the whole config has been read */
     old_cfg = cfg;
     old_servicelist = servicelist;
     old_authlist = authlist;
+    old_serviceindex = serviceindex;
+    old_authindex = authindex;
 
     cfg = new_cfg;
     servicelist = new_servicelist;
     authlist = new_authlist;
+    serviceindex = new_serviceindex;
+    authindex = new_authindex;
+
+    matchindex_free( &old_serviceindex );
+    matchindex_free( &old_authindex );
 
     if ( old_authlist != NULL ) {
 	authlist_free( &old_authlist );
@@ -1068,6 +1557,22 @@ cosign_ssl( char *cryptofile, char *certfile, char *capath, SSL_CTX **ctx )
     SSL_CTX_set_verify( tmp,
 	    SSL_VERIFY_PEER | SSL_VERIFY_FAIL_IF_NO_PEER_CERT, NULL);
 
+    /*
+     * let peers resume sessions.  OpenSSL refuses to resume with a
+     * verified peer unless the session is tied to a context.  a server
+     * issues stateless session tickets, so any process forked from the
+     * one holding this SSL_CTX can resume them.  each call makes a new
+     * SSL_CTX with new ticket keys, so re-reading the config on HUP
+     * retires old tickets, and with them any trust in old certificates.
+     */
+    if ( SSL_CTX_set_session_id_context( tmp,
+	    (const unsigned char *)COSIGN_SSL_SESSION_ID,
+	    strlen( COSIGN_SSL_SESSION_ID )) != 1 ) {
+	fprintf( stderr, "SSL_CTX_set_session_id_context: %s\n",
+		ERR_error_string( ERR_get_error(), NULL ));
+	return( 1 );
+    }
+
     old = *ctx;
     *ctx = tmp;
 
@@ -18,6 +18,33 @@
 #define COSIGN_HANDLER_PATH	"/cosign/valid"
 
 #define COSIGN_MAXFACTORS	5
+
+#define COSIGN_SSL_SESSION_ID	"cosign"
+
+/*
+ * a service cookie or hostname pattern, compiled when the config is
+ * read.  only PA_REGEX patterns need regexec(), the rest are matched
+ * as plain text.  pa_text has '\0' for '.' in PA_WILD patterns, and is
+ * the text before ".*" in PA_PREFIX patterns.  pa_gso and pa_geo are
+ * where ( and ) fall in pa_text, -1 if there's no group, and pa_geo is
+ * also -1 if the group runs to the end of the string.
+ */
+#define PA_LITERAL	0
+#define PA_WILD		1
+#define PA_PREFIX	2
+#define PA_REGEX	3
+
+struct pattern {
+    int			pa_type;
+    char		*pa_text;
+    int			pa_len;
+    int			pa_gso;
+    int			pa_geo;
+    int			pa_icase;
+    int			pa_compiled;
+    regex_t		pa_preg;
+};
+
 struct servicelist {
     char		*sl_cookie;
     char		*sl_cookiesub;
@@ -25,6 +52,7 @@ struct servicelist {
     int			sl_flag;
     char		*sl_factors[ COSIGN_MAXFACTORS ];
     struct authlist	*sl_auth;
+    struct pattern	sl_pattern;
     struct servicelist	*sl_next;
 };
 
@@ -33,6 +61,8 @@ struct authlist {
     int			al_key;
     int			al_flag;
     struct proxies	*al_proxies;
+    struct pattern	al_pattern;	/* case-insensitive, for lookups */
+    struct pattern	al_cnpattern;	/* case-sensitive, for CN checks */
     struct authlist	*al_next;
 };
 
@@ -80,8 +110,27 @@ struct matchlist {
 #define COSIGNX509TKTSKEY       "cosignx509krbtkts"
 #define COSIGNKRBTKTSKEY	"cosignkrbtkts"
 #define COSIGNDBHASHLENKEY	"cosigndbhashlen"
+#define COSIGNDBREHASHKEY	"cosigndbrehash"
 #define COSIGNSTRICTCHECKKEY	"cosignstrictcheck"
 #define COSIGNHTTPONLYCOOKIESKEY	"cosignhttponlycookies"
+#define COSIGNDPREFORKKEY	"cosigndprefork"
+#define COSIGNDMINSPAREKEY	"cosigndminspare"
+#define COSIGNDMAXSPAREKEY	"cosigndmaxspare"
+#define COSIGNDMAXREQUESTSKEY	"cosigndmaxrequests"
+#define COSIGNDEVENTSKEY	"cosigndevents"
+#define COSIGNDBACKLOGKEY	"cosigndbacklog"
+#define COSIGNDREUSEPORTKEY	"cosigndreuseport"
+#define COSIGNDSTOREKEY		"cosigndstore"
+#define COSIGNDSHMKEY		"cosigndshm"
+#define COSIGNDSHMSLOTSKEY	"cosigndshmslots"
+#define COSIGNDLOGSEGMENTKEY	"cosigndlogsegment"
+#define COSIGNDTOUCHKEY		"cosigndtouchinterval"
+#define COSIGNDDURABILITYKEY	"cosigndurability"
+#define COSIGNDCOMMITWINDOWKEY	"cosigndcommitwindow"
+#define COSIGNDFILEIOKEY	"cosigndfileio"
+#define COSIGNMONSTERPROCSKEY	"cosignmonsterprocs"
+#define COSIGNMONSTERIOPSKEY	"cosignmonsteriops"
+#define COSIGNDSWEEPKEY		"cosigndsweep"
 
 #ifdef SQL_FRIEND
 #define MYSQLDBKEY	"mysqldb"
@@ -93,6 +142,7 @@ struct matchlist {
 int		cosign_ssl( char *, char *, char *, SSL_CTX ** );
 int		cosign_crl( SSL_CTX *, char * );
 struct authlist	*authlist_find( char * );
+int		authlist_match( struct authlist *, char *, regmatch_t [], int );
 struct servicelist	*service_find( char *, regmatch_t [], int );
 int		cosign_config( char * );
 char		*cosign_config_get( char * );
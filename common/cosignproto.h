@@ -8,7 +8,10 @@
  *
  * "220 2 Collaborative Web Single Sign-On [COSIGNv3 FACTORS=N REKEY ...]"
  *
- * 
+ * cosignd 3.2+ adds MCHECK, ahead of REKEY so that older clients, which
+ * expect the last capability they know to end the list, still see "]":
+ *
+ * "220 2 Collaborative Web Single Sign-On [COSIGNv3 FACTORS=N MCHECK REKEY]"
  */
 struct capability {
     char		*capa_name;
@@ -20,9 +23,14 @@ struct capability {
 #define COSIGN_CAPA_DEFAULTS	0
 #define COSIGN_CAPA_FACTORS	(1<<0)
 #define COSIGN_CAPA_REKEY	(1<<1)
+#define COSIGN_CAPA_MCHECK	(1<<2)
 
 #define COSIGN_CONN_SUPPORTS_FACTORS(c)	((c)->conn_capa & COSIGN_CAPA_FACTORS)
 #define COSIGN_CONN_SUPPORTS_REKEY(c)	((c)->conn_capa & COSIGN_CAPA_REKEY)
+#define COSIGN_CONN_SUPPORTS_MCHECK(c)	((c)->conn_capa & COSIGN_CAPA_MCHECK)
+
+/* most cookies a single MCHECK may ask about */
+#define COSIGN_MCHECK_MAX	64
 
 #define COSIGN_PROTO_V0		0
 #define COSIGN_PROTO_V2		2
@@ -105,7 +105,7 @@ mkcookie( int len, char *buf )
     int
 mkcookiepath( char *prefix, int hashlen, char *cookie, char *buf, int len )
 {
-    char	*p;
+    char	*p, dir[ 8 ];
     int		prefixlen, cookielen;
 
     if ( strchr( cookie, '/' ) != NULL ) {
@@ -121,53 +121,49 @@ mkcookiepath( char *prefix, int hashlen, char *cookie, char *buf, int len )
     }
     prefixlen = p - cookie;
 
-    if (( cookielen - prefixlen ) <= 2 ) {
+    if (( cookielen - prefixlen ) <= 2 ||
+	    ( cookielen - prefixlen ) <= hashlen ) {
 	return( -1 );
     }
 
-    if ( hashlen == 0 ) {
-	if ( prefix == NULL ) {
-	    if ( snprintf( buf, len, "%s", cookie ) >= len ) {
-		return( -1 );
-	    }
-	    return( 0 );
-	} else {
-	    if ( snprintf( buf, len, "%s/%s", prefix, cookie ) >= len ) {
-		return( -1 );
-	    }
-	    return( 0 );
-	}
+    /*
+     * the first hashlen characters of the value name the subdirectory:
+     * "a/" for 1, "ab/" for 2, and a second level for 3 and 4, "ab/c/"
+     * and "ab/cd/".
+     */
+    switch ( hashlen ) {
+    case 0 :
+	*dir = '\0';
+	break;
+
+    case 1 :
+	sprintf( dir, "%c/", p[ 1 ] );
+	break;
+
+    case 2 :
+	sprintf( dir, "%c%c/", p[ 1 ], p[ 2 ] );
+	break;
+
+    case 3 :
+	sprintf( dir, "%c%c/%c/", p[ 1 ], p[ 2 ], p[ 3 ] );
+	break;
+
+    case 4 :
+	sprintf( dir, "%c%c/%c%c/", p[ 1 ], p[ 2 ], p[ 3 ], p[ 4 ] );
+	break;
+
+    default :
+	return( -1 );
     }
 
-    if ( hashlen == 1 ) {
-	if ( prefix == NULL ) {
-	    if ( snprintf( buf, len, "%c/%s", p[ 1 ], cookie ) >= len ) {
-		return( -1 );
-	    }
-	    return( 0 );
-	} else {
-	    if ( snprintf( buf, len, "%s/%c/%s",
-		    prefix, p[ 1 ], cookie ) >= len ) {
-		return( -1 );
-	    }
-	    return( 0 );
+    if ( prefix == NULL ) {
+	if ( snprintf( buf, len, "%s%s", dir, cookie ) >= len ) {
+	    return( -1 );
 	}
-    }
-
-    if ( hashlen == 2 ) {
-	if ( prefix == NULL ) {
-	    if ( snprintf( buf, len, "%c%c/%s",
-		    p[ 1 ], p[ 2 ], cookie ) >= len ) {
-		return( -1 );
-	    }
-	    return( 0 );
-	} else {
-	    if ( snprintf( buf, len, "%s/%c%c/%s",
-		    prefix, p[ 1 ], p[ 2 ], cookie ) >= len ) {
-		return( -1 );
-	    }
-	    return( 0 );
+    } else {
+	if ( snprintf( buf, len, "%s/%s%s", prefix, dir, cookie ) >= len ) {
+	    return( -1 );
 	}
     }
-    return( -1 );
+    return( 0 );
 }
@@ -23,14 +23,13 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
-#include <utime.h>
+#include <pthread.h>
 
 #include <openssl/ssl.h>
 #include <openssl/err.h>
 
 #include <snet.h>
 
-#include "command.h"
 #include "conf.h"
 #include "cparse.h"
 #include "mkcookie.h"
@@ -38,6 +37,14 @@
 #include "rate.h"
 #include "argcargv.h"
 #include "wildcard.h"
+#include "listener.h"
+#include "stats.h"
+#include "store.h"
+#include "touch.h"
+#include "commit.h"
+#include "uindex.h"
+#include "journal.h"
+#include "command.h"
 
 #ifndef MIN
 #define MIN(a,b)        ((a)<(b)?(a):(b))
@@ -45,10 +52,9 @@
 
 extern int			idle_out_time;
 extern int			grey_time;
-extern int			hashlen;
 extern int			strict_checks;
 extern struct timeval		cosign_net_timeout;
-extern struct sockaddr_in	cosign_sin;
+extern struct sockaddr_storage	cosign_sin;
 extern char			*cosign_tickets;
 
 
@@ -64,44 +70,84 @@ static int	f_retr( SNET *, int, char *[], SNET * );
 static int	f_time( SNET *, int, char *[], SNET * );
 static int	f_daemon( SNET *, int, char *[], SNET * );
 static int	f_starttls( SNET *, int, char *[], SNET * );
-
-static int	do_register( char *, char *, char * );
+static int	f_stats( SNET *, int, char *[], SNET * );
+static int	f_mcheck( SNET *, int, char *[], SNET * );
+static int	f_sessions( SNET *, int, char *[], SNET * );
+static int	f_logoutuser( SNET *, int, char *[], SNET * );
+
+static int	factor_add( char *, size_t, char * );
+static int	do_register( char *, char *, time_t );
+static int	logout_cookie( char *, struct cinfo * );
+static int	sessions_cookie( char *, void * );
 static int	retr_ticket( SNET *, struct servicelist *, char * );
-static int	retr_proxy( SNET *, char *, SNET * );
+static int	retr_proxy( SNET *, char *, time_t, SNET * );
+static int	starttls_handshake( SNET * );
+static int	time_line( SNET *, char * );
+static int	mcheck_line( SNET *, char *, SNET * );
+static void	conn_cork( SNET *, int );
+static int	krb_size( SNET *, char * );
+static int	krb_data( SNET *, char *, int, SNET * );
+static int	krb_end( SNET *, char *, SNET * );
+static void	krb_clear( struct connstate * );
+static int	conn_command( SNET *, char *, SNET * );
+static void	conn_end( struct connstate *, int );
+static void	conn_stats( struct connstate *, int );
+static void	conn_load( struct connstate * );
+static void	conn_save( struct connstate * );
 
 struct command {
     char	*c_name;
     int		(*c_func)( SNET *, int, char *[], SNET * );
+    int		c_stat;		/* latency recorded as, or STATS_NONE */
 };
 
+/*
+ * commands return 0 on success and 1 after reporting an error to the
+ * client.  anything less than 0 ends the session: -1 for a server error,
+ * CMD_QUIT and CMD_DROP to hang up without saying anything more.
+ */
+#define CMD_QUIT	-2
+#define CMD_DROP	-3
+
+/* replies an event worker's client may leave unread before it's ignored */
+#define CONN_WQUEUE	(64 * 1024)
+
 struct command	unauth_commands[] = {
-    { "NOOP",		f_noop },
-    { "QUIT",		f_quit },
-    { "HELP",		f_help },
-    { "STARTTLS",	f_starttls },
-    { "LOGIN",		f_notauth },
-    { "LOGOUT",		f_notauth },
-    { "REGISTER",	f_notauth },
-    { "CHECK",		f_notauth },
-    { "REKEY",		f_notauth },
-    { "RETR",		f_notauth },
-    { "TIME",		f_notauth },
-    { "DAEMON",		f_notauth },
+    { "NOOP",		f_noop,		STATS_NONE },
+    { "QUIT",		f_quit,		STATS_NONE },
+    { "HELP",		f_help,		STATS_NONE },
+    { "STARTTLS",	f_starttls,	STATS_NONE },
+    { "LOGIN",		f_notauth,	STATS_NONE },
+    { "LOGOUT",		f_notauth,	STATS_NONE },
+    { "REGISTER",	f_notauth,	STATS_NONE },
+    { "CHECK",		f_notauth,	STATS_NONE },
+    { "REKEY",		f_notauth,	STATS_NONE },
+    { "MCHECK",		f_notauth,	STATS_NONE },
+    { "RETR",		f_notauth,	STATS_NONE },
+    { "TIME",		f_notauth,	STATS_NONE },
+    { "DAEMON",		f_notauth,	STATS_NONE },
+    { "STATS",		f_notauth,	STATS_NONE },
+    { "SESSIONS",	f_notauth,	STATS_NONE },
+    { "LOGOUTUSER",	f_notauth,	STATS_NONE },
 };
 
 struct command	auth_commands[] = {
-    { "NOOP",		f_noop },
-    { "QUIT",		f_quit },
-    { "HELP",		f_help },
-    { "STARTTLS",	f_starttls },
-    { "LOGIN",		f_login },
-    { "LOGOUT",		f_logout },
-    { "REGISTER",	f_register },
-    { "CHECK",		f_check },
-    { "REKEY",		f_check },
-    { "RETR",		f_retr },
-    { "TIME",		f_time },
-    { "DAEMON",		f_daemon },
+    { "NOOP",		f_noop,		STATS_NONE },
+    { "QUIT",		f_quit,		STATS_NONE },
+    { "HELP",		f_help,		STATS_NONE },
+    { "STARTTLS",	f_starttls,	STATS_NONE },
+    { "LOGIN",		f_login,	STATS_LOGIN },
+    { "LOGOUT",		f_logout,	STATS_LOGOUT },
+    { "REGISTER",	f_register,	STATS_REGISTER },
+    { "CHECK",		f_check,	STATS_CHECK },
+    { "REKEY",		f_check,	STATS_CHECK },
+    { "MCHECK",		f_mcheck,	STATS_MCHECK },
+    { "RETR",		f_retr,		STATS_RETR },
+    { "TIME",		f_time,		STATS_TIME },
+    { "DAEMON",		f_daemon,	STATS_NONE },
+    { "STATS",		f_stats,	STATS_NONE },
+    { "SESSIONS",	f_sessions,	STATS_NONE },
+    { "LOGOUTUSER",	f_logoutuser,	STATS_NONE },
 };
 
 extern char	*cosign_version;
@@ -119,11 +165,14 @@ int		protocol = COSIGN_PROTO_V0;
 unsigned int	client_capa = 0;
 int	ncommands = sizeof( unauth_commands ) / sizeof(unauth_commands[ 0 ] );
 
+/* the connection whose commands are being run */
+static struct connstate	*conn = NULL;
+
     int
 f_quit( SNET *sn, int ac, char *av[], SNET *pushersn )
 {
     snet_writef( sn, "%d Service closing transmission channel\r\n", 221 );
-    exit( 0 );
+    return( CMD_QUIT );
 }
 
     int
@@ -152,17 +201,13 @@ f_notauth( SNET *sn, int ac, char *av[], SNET *pushersn )
 banner( SNET *sn )
 {
     snet_writef( sn, "220 2 Collaborative Web Single Sign-On "
-		"[COSIGNv%d FACTORS=%d REKEY]\r\n",
+		"[COSIGNv%d FACTORS=%d MCHECK REKEY]\r\n",
 		COSIGN_PROTO_CURRENT, COSIGN_MAXFACTORS );
 }
 
     int
 f_starttls( SNET *sn, int ac, char *av[], SNET *pushersn )
 {
-    int				rc;
-    X509			*peer;
-    char			buf[ 1024 ];
-
     /* STARTTLS with no additional parameters is assumed to be protocol 0 */
     if ( ac >= 2 ) {
 	errno = 0;
@@ -183,15 +228,55 @@ f_starttls( SNET *sn, int ac, char *av[], SNET *pushersn )
 
     snet_writef( sn, "%d Ready to start TLS\r\n", 220 );
 
+    return( starttls_handshake( sn ));
+}
+
+/*
+ * called again each time a non-blocking client sends more of its
+ * handshake, until TLS is up or has failed.
+ */
+    static int
+starttls_handshake( SNET *sn )
+{
+    int				rc;
+    X509			*peer;
+    char			buf[ 1024 ];
+
+    /* the client won't begin until it has our 220 */
+    if ( snet_flush( sn, NULL ) < 0 ) {
+	syslog( LOG_ERR, "f_starttls: snet_flush: %m" );
+	return( -1 );
+    }
+    if ( snet_wpending( sn ) > 0 ) {
+	conn->cs_state = CS_TLS;
+	conn->cs_flag |= CS_WANTWRITE;
+	return( 0 );
+    }
+
     /*
      * Begin TLS
      */
     if (( rc = snet_starttls( sn, ctx, 1 )) != 1 ) {
+	if ( sn->sn_ssl != NULL ) {
+	    /* handshake isn't finished, wait for the client */
+	    conn->cs_state = CS_TLS;
+	    if ( SSL_get_error( sn->sn_ssl, rc ) == SSL_ERROR_WANT_WRITE ) {
+		conn->cs_flag |= CS_WANTWRITE;
+	    } else {
+		conn->cs_flag &= ~CS_WANTWRITE;
+	    }
+	    return( 0 );
+	}
+	conn->cs_state = CS_COMMAND;
+	conn->cs_flag &= ~CS_WANTWRITE;
 	syslog( LOG_ERR, "f_starttls: snet_starttls: %s",
 		ERR_error_string( ERR_get_error(), NULL ) );
 	snet_writef( sn, "%d SSL didn't work error!\r\n", 501 );
 	return( 1 );
     }
+    conn->cs_state = CS_COMMAND;
+    conn->cs_flag &= ~CS_WANTWRITE;
+
     if (( peer = SSL_get_peer_certificate( sn->sn_ssl ))
 	    == NULL ) {
 	syslog( LOG_ERR, "no peer certificate" );
@@ -204,17 +289,22 @@ f_starttls( SNET *sn, int ac, char *av[], SNET *pushersn )
     if (( al = authlist_find( buf )) == NULL ) {
 	syslog( LOG_ERR, "f_starttls: No access for %s", buf );
 	snet_writef( sn, "%d No access for %s\r\n", 401, buf );
-	exit( 1 );
+	return( CMD_DROP );
     }
 
     /* store CN for use with CHECK and RETR */
+    if ( remote_cn != NULL ) {
+	free( remote_cn );
+    }
     if (( remote_cn = strdup( buf )) == NULL ) {
 	syslog( LOG_ERR, "f_starttls: strdup %s: %m", buf );
 	return( -1 );
     }
 
-    syslog( LOG_INFO, "STARTTLS %s %d %s",
-	    inet_ntoa( cosign_sin.sin_addr ), protocol, buf );
+    syslog( LOG_INFO, "STARTTLS %s %d %s%s",
+	    listener_ntop( &cosign_sin ), protocol, buf,
+	    SSL_session_reused( sn->sn_ssl ) ? " resumed" : "" );
+    stats_tls( SSL_session_reused( sn->sn_ssl ));
 
     commands = auth_commands;
     ncommands = sizeof( auth_commands ) / sizeof( auth_commands[ 0 ] );
@@ -228,18 +318,14 @@ f_starttls( SNET *sn, int ac, char *av[], SNET *pushersn )
     int
 f_login( SNET *sn, int ac, char *av[], SNET *pushersn )
 {
-    FILE		*tmpfile;
     ACAV		*facav;
-    char		tmppath[ MAXCOOKIELEN ], path[ MAXPATHLEN ];
     char		tmpkrb[ 16 ], krbpath [ MAXPATHLEN ];
-    char                *sizebuf, *line;
     char                buf[ 8192 ];
     char		**fv;
     int			fd, i, j, fc, already_krb = 0;
-    int			krb = 0, err = 1, addinfo = 0, newinfo = 0;
+    int			krb = 0, addinfo = 0, newinfo = 0;
     struct timeval	tv;
-    struct cinfo	ci;
-    unsigned int        len, rc;
+    struct cinfo	ci, lci;
     extern int		errno;
 
     /*
@@ -284,13 +370,14 @@ f_login( SNET *sn, int ac, char *av[], SNET *pushersn )
 	}
     }
 
-    if ( mkcookiepath( NULL, hashlen, av[ 1 ], path, sizeof( path )) < 0 ) {
-	syslog( LOG_ERR, "f_login: mkcookiepath error" );
+    if ( store_valid( av[ 1 ] ) < 0 ) {
+	syslog( LOG_ERR, "f_login: invalid cookie name" );
 	snet_writef( sn, "%d LOGIN: Invalid cookie path.\r\n", 501 );
 	return( 1 );
     }
 
-    if ( read_cookie( path, &ci ) == 0 ) {
+    memset( &ci, 0, sizeof( struct cinfo ));
+    if ( store->so_get( av[ 1 ], &ci ) == 0 ) {
 	addinfo = 1;
 	if ( ci.ci_state == 0 ) {
 	    syslog( LOG_ERR,
@@ -312,54 +399,31 @@ f_login( SNET *sn, int ac, char *av[], SNET *pushersn )
 	return( -1 );
     }
 
-    if ( snprintf( tmppath, sizeof( tmppath ), "%x%x.%i",
-	    (int)tv.tv_sec, (int)tv.tv_usec, (int)getpid()) >=
-	    sizeof( tmppath )) {
-	syslog( LOG_ERR, "f_login: tmppath too long" );
-	return( -1 );
-    }
-
-    if (( fd = open( tmppath, O_CREAT|O_EXCL|O_WRONLY, 0644 )) < 0 ) {
-	syslog( LOG_ERR, "f_login: open: %s: %m", tmppath );
-	return( -1 );
-    }
+    memset( &lci, 0, sizeof( struct cinfo ));
+    lci.ci_version = 2;
+    lci.ci_state = 1;
 
-    if (( tmpfile = fdopen( fd, "w" )) == NULL ) {
-	/* close */
-	if ( unlink( tmppath ) != 0 ) {
-	    syslog( LOG_ERR, "f_login: unlink: %m" );
-	}
-	syslog( LOG_ERR, "f_login: fdopen: %m" );
-	return( -1 );
-    }
-
-    fprintf( tmpfile, "v2\n" );
-    fprintf( tmpfile, "s1\n" );	 /* 1 is logged in, 0 is logged out */
-
-    if ( strlen( av[ 2 ] ) >= sizeof( ci.ci_ipaddr )) {
+    if ( strlen( av[ 2 ] ) >= sizeof( lci.ci_ipaddr )) {
 	goto file_err;
     }
     if ( addinfo ) {
-	fprintf( tmpfile, "i%s\n", ci.ci_ipaddr );
-    } else {
-	fprintf( tmpfile, "i%s\n", av[ 2 ] );
-    }
-
-    if ( addinfo ) {
+	strcpy( lci.ci_ipaddr, ci.ci_ipaddr );
 	if ( strcmp( ci.ci_ipaddr_cur, av[ 2 ] ) != 0 ) {
 	    newinfo = 1;
 	}
+    } else {
+	strcpy( lci.ci_ipaddr, av[ 2 ] );
     }
-    if ( strlen( av[ 2 ] ) >= sizeof( ci.ci_ipaddr_cur )) {
+    if ( strlen( av[ 2 ] ) >= sizeof( lci.ci_ipaddr_cur )) {
 	goto file_err;
     }
-    fprintf( tmpfile, "j%s\n", av[ 2 ] );
+    strcpy( lci.ci_ipaddr_cur, av[ 2 ] );
 
-    if ( strlen( av[ 3 ] ) >= sizeof( ci.ci_user )) {
+    if ( strlen( av[ 3 ] ) >= sizeof( lci.ci_user )) {
 	goto file_err;
     }
-    fprintf( tmpfile, "p%s\n", av[ 3 ] );
-    if ( strlen( av[ 4 ] ) >= sizeof( ci.ci_realm )) {
+    strcpy( lci.ci_user, av[ 3 ] );
+    if ( strlen( av[ 4 ] ) >= sizeof( lci.ci_realm )) {
 	goto file_err;
     }
 
@@ -372,9 +436,12 @@ f_login( SNET *sn, int ac, char *av[], SNET *pushersn )
 	    syslog( LOG_ERR, "acav_parse: %m" );
 	    goto file_err;
 	}
-	fprintf( tmpfile, "r%s", fv[ 0 ] );
+	strcpy( lci.ci_realm, fv[ 0 ] );
 	for ( i = 1; i < fc; i++ ) {
-	    fprintf( tmpfile, " %s", fv[ i ] );
+	    if ( factor_add( lci.ci_realm, sizeof( lci.ci_realm ),
+		    fv[ i ] ) < 0 ) {
+		goto file_err;
+	    }
 	}
 	for ( i = 4; i < ac; i++ ) {
 	    for ( j = 0; j < fc; j++ ) {
@@ -383,69 +450,60 @@ f_login( SNET *sn, int ac, char *av[], SNET *pushersn )
 		}
 	    }
 	    if ( j >= fc ) {
-		fprintf( tmpfile, " %s", av[ i ] );
+		if ( factor_add( lci.ci_realm, sizeof( lci.ci_realm ),
+			av[ i ] ) < 0 ) {
+		    goto file_err;
+		}
 		newinfo = 1;
 	    }
 	}
 	if ( newinfo == 0 ) {
 	    snet_writef( sn, "%d LOGIN Cookie Already Stored.\r\n", 202 );
-	    if ( fclose ( tmpfile ) != 0 ) {
-		syslog( LOG_ERR, "f_login: fclose: %m" );
-	    }
-	    if ( unlink( tmppath ) != 0 ) {
-		syslog( LOG_ERR, "f_login: unlink %s: %m", tmppath );
-	    }
 	    return( 0 );
 	}
     } else {
-	fprintf( tmpfile, "r%s", av[ 4 ] );
+	strcpy( lci.ci_realm, av[ 4 ] );
 	for ( i = 5; i < ac; i++ ) {
-	    fprintf( tmpfile, " %s", av[ i ] );
+	    if ( factor_add( lci.ci_realm, sizeof( lci.ci_realm ),
+		    av[ i ] ) < 0 ) {
+		goto file_err;
+	    }
 	}
     }
-    fprintf( tmpfile, "\n" );
 
     if ( addinfo ) {
-	fprintf( tmpfile, "t%lu\n", ci.ci_itime);
+	snprintf( lci.ci_ctime, sizeof( lci.ci_ctime ), "%lu", ci.ci_itime );
     } else {
-	fprintf( tmpfile, "t%lu\n", tv.tv_sec );
+	snprintf( lci.ci_ctime, sizeof( lci.ci_ctime ), "%lu", tv.tv_sec );
     }
 
     if ( krb ) {
 	if (( addinfo ) && ( *ci.ci_krbtkt != '\0' )) {
-	    fprintf( tmpfile, "k%s\n", ci.ci_krbtkt );
+	    strcpy( lci.ci_krbtkt, ci.ci_krbtkt );
 	    already_krb = 1;
 	} else {
-	    fprintf( tmpfile, "k%s\n", krbpath );
+	    strcpy( lci.ci_krbtkt, krbpath );
 	}
     } else if ( *ci.ci_krbtkt != '\0' ) {
-	fprintf( tmpfile, "k%s\n", ci.ci_krbtkt );
+	strcpy( lci.ci_krbtkt, ci.ci_krbtkt );
 	already_krb = 1;
     }
 
-    if ( fclose ( tmpfile ) != 0 ) {
-	if ( unlink( tmppath ) != 0 ) {
-	    syslog( LOG_ERR, "f_login: unlink %s: %m", tmppath );
-	}
-	syslog( LOG_ERR, "f_login: fclose: %m" );
+    if ( store->so_put( av[ 1 ], &lci,
+	    addinfo ? STORE_REPLACE : STORE_CREATE ) != 0 ) {
+	syslog( LOG_ERR, "f_login: %s: not stored", av[ 1 ] );
 	return( -1 );
     }
-
-    if ( addinfo ) {
-	if ( rename( tmppath, path ) != 0 ) {
-	    syslog( LOG_ERR, "f_login: rename %s to %s: %m", tmppath, path );
-	    err = -1;
-	    goto file_err2;
-	}
-    } else {
-	if ( link( tmppath, path ) != 0 ) {
-	    syslog( LOG_ERR, "f_login: link %s to %s: %m", tmppath, path );
-	    err = -1;
-	    goto file_err2;
-	}
-	if ( unlink( tmppath ) != 0 ) {
-	    syslog( LOG_ERR, "f_login: unlink %s: %m", tmppath );
-	}
+    if ( commit_cookie( av[ 1 ] ) != 0 ) {
+	syslog( LOG_ERR, "f_login: %s: not committed", av[ 1 ] );
+	return( -1 );
+    }
+    if ( !replicated ) {
+	(void)journal_note( av[ 1 ] );
+    }
+    if ( !addinfo && ( uindex_add( lci.ci_user, av[ 1 ] ) < 0 ||
+	    eindex_add( tv.tv_sec, av[ 1 ] ) < 0 )) {
+	syslog( LOG_ERR, "f_login: %s: not indexed", av[ 1 ] );
     }
 
     if (( !krb ) || ( already_krb )) {
@@ -460,97 +518,151 @@ f_login( SNET *sn, int ac, char *av[], SNET *pushersn )
 	return( 0 );
     }
 
-    snet_writef( sn, "%d LOGIN: Send length then file.\r\n", 300 );
-
     if (( fd = open( krbpath, O_CREAT|O_EXCL|O_WRONLY, 0644 )) < 0 ) {
 	syslog( LOG_ERR, "f_login: open: %s: %m", krbpath );
 	return( -1 );
     }
 
-    tv = cosign_net_timeout;
-    if (( sizebuf = snet_getline( sn, &tv )) == NULL ) {
-        syslog( LOG_ERR, "f_login: snet_getline: %m" );
-        return( -1 );
+    /* the ticket arrives in the lines that follow, see krb_size() */
+    conn->cs_fd = fd;
+    conn->cs_len = 0;
+    if (( conn->cs_krbpath = strdup( krbpath )) == NULL ||
+	    ( conn->cs_cookie = strdup( av[ 1 ] )) == NULL ) {
+	syslog( LOG_ERR, "f_login: strdup: %m" );
+	krb_clear( conn );
+	return( -1 );
+    }
+    if ( snprintf( buf, sizeof( buf ), "LOGIN %s %s %s %s %s",
+	    av[ 1 ], av[ 2 ], av[ 3 ], av[ 4 ], av[ 5 ] ) >= sizeof( buf ) ||
+	    ( conn->cs_pushline = strdup( buf )) == NULL ) {
+	syslog( LOG_ERR, "f_login: pusher line: %m" );
+	krb_clear( conn );
+	return( -1 );
     }
+    if ( snprintf( buf, sizeof( buf ), "LOGIN %s %s %s",
+	    av[ 3 ], av [ 4 ], av [ 2 ] ) >= sizeof( buf ) ||
+	    ( conn->cs_logline = strdup( buf )) == NULL ) {
+	syslog( LOG_ERR, "f_login: log line: %m" );
+	krb_clear( conn );
+	return( -1 );
+    }
+    conn->cs_state = CS_KRBSIZE;
 
-    for ( len = atoi( sizebuf ); len > 0; len -= rc ) {
-        tv = cosign_net_timeout;
-        if (( rc = snet_read(
-                sn, buf, (int)MIN( len, sizeof( buf )), &tv )) <= 0 ) {
-            syslog( LOG_ERR, "f_login: snet_read: %m" );
-            return( -1 );
-        }
+    snet_writef( sn, "%d LOGIN: Send length then file.\r\n", 300 );
+    return( 0 );
 
-        if ( write( fd, buf, rc ) != rc ) {
-	    syslog( LOG_ERR, "f_login: write to %s: %m", krbpath );
-            snet_writef( sn, "%d %s: %s\r\n", 504, krbpath, strerror( errno ));
-            return( 1 );
-        }
+file_err:
+    syslog( LOG_ERR, "f_login: bad file format" );
+    snet_writef( sn, "%d LOGIN Syntax Error: Bad File Format\r\n", 504 );
+    return( 1 );
+}
+
+/* appends another factor to a space separated list */
+    static int
+factor_add( char *realm, size_t size, char *factor )
+{
+    size_t		len;
+
+    len = strlen( realm );
+    if ( snprintf( realm + len, size - len, " %s", factor ) >= size - len ) {
+	return( -1 );
     }
+    return( 0 );
+}
 
-    if ( close( fd ) < 0 ) {
-	syslog( LOG_ERR, "f_login: close %s: %m", krbpath );
-        snet_writef( sn, "%d %s: %s\r\n", 504, krbpath, strerror( errno ));
-        return( 1 );
+    static void
+krb_clear( struct connstate *cs )
+{
+    if ( cs->cs_fd >= 0 ) {
+	(void)close( cs->cs_fd );
+	cs->cs_fd = -1;
+    }
+    if ( cs->cs_krbpath != NULL ) {
+	free( cs->cs_krbpath );
+	cs->cs_krbpath = NULL;
+    }
+    if ( cs->cs_cookie != NULL ) {
+	free( cs->cs_cookie );
+	cs->cs_cookie = NULL;
     }
+    if ( cs->cs_pushline != NULL ) {
+	free( cs->cs_pushline );
+	cs->cs_pushline = NULL;
+    }
+    if ( cs->cs_logline != NULL ) {
+	free( cs->cs_logline );
+	cs->cs_logline = NULL;
+    }
+}
 
+    static int
+krb_size( SNET *sn, char *line )
+{
+    conn->cs_len = atoi( line );
+    if ( conn->cs_len > 0 ) {
+	conn->cs_state = CS_KRBDATA;
+    } else {
+	conn->cs_state = CS_KRBEND;
+    }
+    return( 0 );
+}
 
-    tv = cosign_net_timeout;
-    tv.tv_usec = 0;
-    if (( line = snet_getline( sn, &tv )) == NULL ) {
-        syslog( LOG_ERR, "f_login: snet_getline: %m" );
-        return( -1 );
+    static int
+krb_data( SNET *sn, char *buf, int len, SNET *pushersn )
+{
+    if ( write( conn->cs_fd, buf, len ) != len ) {
+	syslog( LOG_ERR, "f_login: write to %s: %m", conn->cs_krbpath );
+	snet_writef( sn, "%d %s: %s\r\n", 504, conn->cs_krbpath,
+		strerror( errno ));
+	krb_clear( conn );
+	conn->cs_state = CS_COMMAND;
+	return( 1 );
+    }
+    if (( conn->cs_len -= len ) > 0 ) {
+	return( 0 );
     }
 
+    if ( close( conn->cs_fd ) < 0 ) {
+	conn->cs_fd = -1;
+	syslog( LOG_ERR, "f_login: close %s: %m", conn->cs_krbpath );
+	snet_writef( sn, "%d %s: %s\r\n", 504, conn->cs_krbpath,
+		strerror( errno ));
+	krb_clear( conn );
+	conn->cs_state = CS_COMMAND;
+	return( 1 );
+    }
+    conn->cs_fd = -1;
+    conn->cs_state = CS_KRBEND;
+    return( 0 );
+}
+
+    static int
+krb_end( SNET *sn, char *line, SNET *pushersn )
+{
     /* make sure client agrees we're at the end */
     if ( strcmp( line, "." ) != 0 ) {
-        snet_writef( sn, "%d Length doesn't match sent data\r\n", 505 );
-        (void)unlink( krbpath );
+	snet_writef( sn, "%d Length doesn't match sent data\r\n", 505 );
+	(void)unlink( conn->cs_krbpath );
 
-	/* if the krb tkt didn't store, unlink the cookie as well */
-	if ( unlink( av[ 1 ] ) != 0 ) {
-	    syslog( LOG_ERR, "f_login: unlink: %m" );
-	}
+	/* if the krb tkt didn't store, remove the cookie as well */
+	(void)store->so_expire( conn->cs_cookie );
+	krb_clear( conn );
 
-        tv = cosign_net_timeout;
-        tv.tv_usec = 0;
-        for (;;) {
-            if (( line = snet_getline( sn, &tv )) == NULL ) {
-                syslog( LOG_ERR, "f_login: snet_getline: %m" );
-                exit( 1 );
-            }
-            if ( strcmp( line, "." ) == 0 ) {
-                break;
-            }
-        }
-        exit( 1 );
+	/* throw away whatever is left, then hang up */
+	conn->cs_state = CS_DRAIN;
+	return( 0 );
     }
 
-
     snet_writef( sn, "%d LOGIN successful: Cookie & Ticket Stored.\r\n", 201 );
     if (( pushersn != NULL ) && ( !replicated )) {
-	snet_writef( pushersn, "LOGIN %s %s %s %s %s\r\n",
-		av[ 1 ], av[ 2 ], av[ 3 ], av[ 4 ], av[ 5 ]);
+	snet_writef( pushersn, "%s\r\n", conn->cs_pushline );
     }
     if ( !replicated ) {
-	syslog( LOG_INFO, "LOGIN %s %s %s", av[ 3 ], av [ 4 ], av [ 2 ] );
+	syslog( LOG_INFO, "%s", conn->cs_logline );
     }
+    krb_clear( conn );
+    conn->cs_state = CS_COMMAND;
     return( 0 );
-
-file_err:
-    (void)fclose( tmpfile );
-    if ( unlink( tmppath ) != 0 ) {
-	syslog( LOG_ERR, "f_login: unlink: %m" );
-    }
-    syslog( LOG_ERR, "f_login: bad file format" );
-    snet_writef( sn, "%d LOGIN Syntax Error: Bad File Format\r\n", 504 );
-    return( 1 );
-
-file_err2:
-    if ( unlink( tmppath ) != 0 ) {
-	syslog( LOG_ERR, "f_login: unlink: %m" );
-    }
-    return( err );
 }
 
     int
@@ -590,15 +702,163 @@ f_daemon( SNET *sn, int ac, char *av[], SNET *pushersn )
 }
 
     int
-f_time( SNET *sn, int ac, char *av[], SNET *pushersn )
+f_stats( SNET *sn, int ac, char *av[], SNET *pushersn )
 {
-    struct utimbuf	new_time;
-    struct stat		st;
-    struct timeval	tv;
-    int			timestamp, state;
-    int			total = 0, fail = 0;
-    char		*line, path[ MAXPATHLEN ];
+    /* STATS */
+    /* 280-COMMAND count=... p50=... */
+    /* 280 STATS complete */
+
+    if ( al->al_key != CGI ) {
+	syslog( LOG_ERR, "%s not allowed to read stats", al->al_hostname );
+	snet_writef( sn, "%d STATS: %s not allowed to read stats.\r\n",
+		480, al->al_hostname );
+	return( 1 );
+    }
+
+    if ( ac != 1 ) {
+	syslog( LOG_ERR, "f_stats: expected 1 argument, got %d", ac );
+	snet_writef( sn, "%d STATS: Wrong number of args.\r\n", 580 );
+	return( 1 );
+    }
+
+    if ( stats_write( sn, 280, ( pushersn != NULL ) ?
+	    snet_fd( pushersn ) : -1 ) != 0 ) {
+	snet_writef( sn, "%d STATS: Not available.\r\n", 581 );
+	return( 1 );
+    }
+    snet_writef( sn, "%d STATS complete\r\n", 280 );
+    return( 0 );
+}
+
+struct sessions {
+    SNET	*ss_sn;
+    char	*ss_user;
+    time_t	ss_now;
+    int		ss_logout;
+    int		ss_count;
+};
+
+/*
+ * one of a user's login cookies, for SESSIONS and LOGOUTUSER.  returns
+ * 1 to drop it from the index, if it's gone, isn't the user's, or is
+ * logged out, here or earlier.
+ */
+    static int
+sessions_cookie( char *login, void *arg )
+{
+    struct sessions	*ss = (struct sessions *)arg;
+    struct cinfo	ci;
+    int			rc;
+
+    if (( rc = store->so_get( login, &ci )) != 0 ) {
+	return( rc > 0 );
+    }
+    if ( strcmp( ci.ci_user, ss->ss_user ) != 0 || ci.ci_state == 0 ) {
+	return( 1 );
+    }
+
+    if ( ss->ss_logout ) {
+	if ( store->so_logout( login ) < 0 ) {
+	    syslog( LOG_ERR, "f_logoutuser: %s: %m", login );
+	    return( 0 );
+	}
+	(void)eindex_add( ss->ss_now, login );
+	if ( !replicated ) {
+	    (void)journal_note( login );
+	}
+	ss->ss_count++;
+	return( 1 );
+    }
+
+    /* idle, and logged out at the next CHECK */
+    ci.ci_itime = touch_itime( login, ci.ci_itime );
+    if ( ss->ss_now - ci.ci_itime >= idle_out_time ) {
+	return( 0 );
+    }
+    snet_writef( ss->ss_sn, "%d-%s %s %s %d\r\n", 290, ci.ci_ipaddr_cur,
+	    ci.ci_realm, ci.ci_ctime, (int)( ss->ss_now - ci.ci_itime ));
+    ss->ss_count++;
+    return( 0 );
+}
+
+    int
+f_sessions( SNET *sn, int ac, char *av[], SNET *pushersn )
+{
+    struct sessions	ss;
+
+    /* SESSIONS user */
+    /* 290-ip realm ctime idle */
+    /* 290 n sessions */
 
+    if ( al->al_key != CGI ) {
+	syslog( LOG_ERR, "f_sessions: %s not allowed", al->al_hostname );
+	snet_writef( sn, "%d SESSIONS: %s not allowed to list sessions.\r\n",
+		490, al->al_hostname );
+	return( 1 );
+    }
+
+    if ( ac != 2 ) {
+	syslog( LOG_ERR, "f_sessions: expected 2 arguments, got %d", ac );
+	snet_writef( sn, "%d SESSIONS: Wrong number of args.\r\n", 590 );
+	return( 1 );
+    }
+
+    memset( &ss, 0, sizeof( struct sessions ));
+    ss.ss_sn = sn;
+    ss.ss_user = av[ 1 ];
+    ss.ss_now = time( NULL );
+    if ( uindex_iterate( av[ 1 ], sessions_cookie, &ss ) < 0 ) {
+	snet_writef( sn, "%d SESSIONS: Not available.\r\n", 591 );
+	return( 1 );
+    }
+    snet_writef( sn, "%d %d sessions\r\n", 290, ss.ss_count );
+    return( 0 );
+}
+
+    int
+f_logoutuser( SNET *sn, int ac, char *av[], SNET *pushersn )
+{
+    struct sessions	ss;
+
+    /* LOGOUTUSER user */
+
+    if ( al->al_key != CGI ) {
+	syslog( LOG_ERR, "f_logoutuser: %s not allowed", al->al_hostname );
+	snet_writef( sn, "%d LOGOUTUSER: %s not allowed to logout.\r\n",
+		491, al->al_hostname );
+	return( 1 );
+    }
+
+    if ( ac != 2 ) {
+	syslog( LOG_ERR, "f_logoutuser: expected 2 arguments, got %d", ac );
+	snet_writef( sn, "%d LOGOUTUSER: Wrong number of args.\r\n", 592 );
+	return( 1 );
+    }
+
+    memset( &ss, 0, sizeof( struct sessions ));
+    ss.ss_sn = sn;
+    ss.ss_user = av[ 1 ];
+    ss.ss_now = time( NULL );
+    ss.ss_logout = 1;
+    if ( uindex_iterate( av[ 1 ], sessions_cookie, &ss ) < 0 ) {
+	snet_writef( sn, "%d LOGOUTUSER: Not available.\r\n", 593 );
+	return( 1 );
+    }
+
+    snet_writef( sn, "%d LOGOUTUSER: %d sessions logged out\r\n",
+	    291, ss.ss_count );
+    if (( pushersn != NULL ) && ( !replicated )) {
+	snet_writef( pushersn, "LOGOUTUSER %s\r\n", av[ 1 ] );
+    }
+    if ( !replicated ) {
+	syslog( LOG_INFO, "LOGOUTUSER %s %d", av[ 1 ], ss.ss_count );
+    }
+    return( 0 );
+}
+
+    int
+f_time( SNET *sn, int ac, char *av[], SNET *pushersn )
+{
     /* TIME */
     /* 3xx */
     /* login_cookie timestamp state */
@@ -617,62 +877,75 @@ f_time( SNET *sn, int ac, char *av[], SNET *pushersn )
 	return( 1 );
     }
 
+    /* the timestamps are handled by time_line() as they arrive */
+    conn->cs_total = 0;
+    conn->cs_fail = 0;
+    conn->cs_state = CS_TIME;
+
     snet_writef( sn, "%d TIME: Send timestamps.\r\n", 360 );
+    return( 0 );
+}
 
-    tv = cosign_net_timeout;
-    while (( line = snet_getline( sn, &tv )) != NULL ) {
-	tv = cosign_net_timeout;
-	if (( ac = argcargv( line, &av )) < 0 ) {
-	    syslog( LOG_ERR, "argcargv: %m" );
-	    break;
-	}
+    static int
+time_line( SNET *sn, char *line )
+{
+    struct cinfo	ci;
+    int			ac, timestamp, state;
+    char		**av;
 
-	if ( strcmp( line, "." ) == 0 ) {
-	    break;
-	}
+    if (( ac = argcargv( line, &av )) < 0 ) {
+	syslog( LOG_ERR, "argcargv: %m" );
+	goto time_done;
+    }
 
-	if ( ac != 3 ) {
-	    syslog( LOG_ERR, "f_time: wrong number of args" );
-	    continue;
-	}
+    if ( strcmp( line, "." ) == 0 ) {
+	goto time_done;
+    }
 
-	if ( strncmp( av[ 0 ], "cosign=", 7 ) != 0 ) {
-	    syslog( LOG_ERR, "f_time: cookie name malformat" );
-	    continue;
-	}
+    if ( ac != 3 ) {
+	syslog( LOG_ERR, "f_time: wrong number of args" );
+	return( 0 );
+    }
 
-	if ( mkcookiepath( NULL, hashlen, av[ 0 ], path, sizeof( path )) < 0 ) {
-	    syslog( LOG_ERR, "f_time: path name malformat" );
-	    continue;
-	}
+    if ( strncmp( av[ 0 ], "cosign=", 7 ) != 0 ) {
+	syslog( LOG_ERR, "f_time: cookie name malformat" );
+	return( 0 );
+    }
 
-	total++;
-	if ( stat( path, &st ) != 0 ) {
-	    /* record a missing cookie here */
-	    fail++;
-	    continue;
-	}
+    if ( store_valid( av[ 0 ] ) < 0 ) {
+	syslog( LOG_ERR, "f_time: path name malformat" );
+	return( 0 );
+    }
 
-	state = atoi( av[ 2 ] );
-	/* We only need to call do_logout if it isn't already flagged SGID */
-	if (( state == 0 ) && (( st.st_mode & S_ISGID ) == 0 )) {
-	    if ( do_logout( path ) < 0 ) {
-		syslog( LOG_ERR, "f_time: %s should be logged out!", path );
-	    }
-	}
+    conn->cs_total++;
+    if ( store->so_get( av[ 0 ], &ci ) != 0 ) {
+	/* record a missing cookie here */
+	conn->cs_fail++;
+	return( 0 );
+    }
 
-	timestamp = atoi( av[ 1 ] ); 
-	if ( timestamp > st.st_mtime ) {
-	    new_time.modtime = timestamp;
-	    utime( path, &new_time );
+    state = atoi( av[ 2 ] );
+    /* We only need to log out if it isn't already */
+    if (( state == 0 ) && ( ci.ci_state != 0 )) {
+	if ( logout_cookie( av[ 0 ], &ci ) < 0 ) {
+	    syslog( LOG_ERR, "f_time: %s should be logged out!", av[ 0 ] );
 	}
     }
 
-    if ( total != 0 ) {
+    timestamp = atoi( av[ 1 ] ); 
+    if ( timestamp > ci.ci_itime ) {
+	(void)store->so_touch( av[ 0 ], timestamp );
+    }
+    return( 0 );
+
+time_done:
+    if ( conn->cs_total != 0 ) {
 	syslog( LOG_NOTICE, "STATS TIME %s: %d tried, %d%% success",
-		al->al_hostname, total, 100 * ( total - fail ) / total );
+		al->al_hostname, conn->cs_total,
+		100 * ( conn->cs_total - conn->cs_fail ) / conn->cs_total );
     }
     snet_writef( sn, "%d TIME successful: we are now up-to-date\r\n", 260 );
+    conn->cs_state = CS_COMMAND;
     return( 0 );
 }
 
@@ -680,7 +953,6 @@ f_time( SNET *sn, int ac, char *av[], SNET *pushersn )
 f_logout( SNET *sn, int ac, char *av[], SNET *pushersn )
 {
     struct cinfo	ci;
-    char		path[ MAXPATHLEN ];
 
     /* LOGOUT login_cookie ip */
 
@@ -697,13 +969,13 @@ f_logout( SNET *sn, int ac, char *av[], SNET *pushersn )
 	return( 1 );
     }
 
-    if ( mkcookiepath( NULL, hashlen, av[ 1 ], path, sizeof( path )) < 0 ) {
-	syslog( LOG_ERR, "f_login: mkcookiepath error" );
+    if ( store_valid( av[ 1 ] ) < 0 ) {
+	syslog( LOG_ERR, "f_logout: invalid cookie name" );
 	snet_writef( sn, "%d LOGIN: Invalid cookie path.\r\n", 511 );
 	return( 1 );
     }
 
-    if ( read_cookie( path, &ci ) != 0 ) {
+    if ( store->so_get( av[ 1 ], &ci ) != 0 ) {
 	snet_writef( sn, "%d LOGOUT error: Sorry\r\n", 513 );
 	return( 1 );
     }
@@ -715,8 +987,8 @@ f_logout( SNET *sn, int ac, char *av[], SNET *pushersn )
 	return( 1 );
     }
 
-    if ( do_logout( path ) < 0 ) {
-	syslog( LOG_ERR, "f_logout: %s: %m", path );
+    if ( logout_cookie( av[ 1 ], &ci ) < 0 ) {
+	syslog( LOG_ERR, "f_logout: %s: %m", av[ 1 ] );
 	return( -1 );
     }
 
@@ -732,74 +1004,48 @@ f_logout( SNET *sn, int ac, char *av[], SNET *pushersn )
 }
 
 /*
- * associate serivce with login
- * 0 = OK
- * -1 = unknown fatal error
- * 1 = already registered
+ * logs out a login cookie, drops it from its user's sessions, files it
+ * for monster to expire loggedout_cache from now, and if it's our own
+ * change, notes it for monster to send to replicas.
  */
-    int
-do_register( char *login, char *login_p, char *scookie_p )
+    static int
+logout_cookie( char *login, struct cinfo *ci )
 {
-    int			fd, rc;
-    char		tmppath[ MAXCOOKIELEN ];
-    FILE		*tmpfile;
-    struct timeval	tv;
-
-    if ( gettimeofday( &tv, NULL ) != 0 ){
-	syslog( LOG_ERR, "do_register: gettimeofday: %m" );
+    if ( store->so_logout( login ) < 0 ) {
 	return( -1 );
     }
-
-    if ( snprintf( tmppath, sizeof( tmppath ), "%x%x.%i",
-	    (int)tv.tv_sec, (int)tv.tv_usec, (int)getpid()) >=
-	    sizeof( tmppath )) {
-	syslog( LOG_ERR, "do_register: tmppath too long" );
-	return( -1 );
-    }
-
-    if (( fd = open( tmppath, O_CREAT|O_EXCL|O_WRONLY, 0644 )) < 0 ) {
-	syslog( LOG_ERR, "do_register: open: %s: %m", tmppath );
-	return( -1 );
-    }
-
-    if (( tmpfile = fdopen( fd, "w" )) == NULL ) {
-	syslog( LOG_ERR, "do_register: fdopen: %m" );
-	if ( unlink( tmppath ) != 0 ) {
-	    syslog( LOG_ERR, "do_register: unlink: %m" );
-	}
-	return( -1 );
+    (void)uindex_remove( ci->ci_user, login );
+    (void)eindex_add( time( NULL ), login );
+    if ( !replicated ) {
+	(void)journal_note( login );
     }
+    return( 0 );
+}
 
-    /* the service cookie file contains the login cookie only */
-    fprintf( tmpfile, "l%s\n", login );
-
-    if ( fclose( tmpfile ) != 0 ) {
-	syslog( LOG_ERR, "do_register: fclose: %m" );
-	if ( unlink( tmppath ) != 0 ) {
-	    syslog( LOG_ERR, "do_register: unlink: %m" );
-	}
-	return( -1 );
-    }
+/*
+ * associate serivce with login
+ * 0 = OK
+ * -1 = unknown fatal error
+ * 1 = already registered
+ */
+    static int
+do_register( char *login, char *scookie, time_t itime )
+{
+    int			rc;
 
-    if ( link( tmppath, scookie_p ) != 0 ) {
-	if ( errno == EEXIST ) {
-	    rc = 1;
-	} else {
-	    syslog( LOG_ERR, "do_register: link: %m" );
-	    rc = -1;
-	}
-	if ( unlink( tmppath ) != 0 ) {
-	    syslog( LOG_ERR, "do_register: unlink: %m" );
-	}
+    if (( rc = store->so_register( scookie, login )) != 0 ) {
 	return( rc );
     }
-
-    if ( unlink( tmppath ) != 0 ) {
-	syslog( LOG_ERR, "do_register: unlink: %m" );
+    if ( sindex_add( login, scookie ) < 0 ) {
+	/* monster's full pass will find it */
+	syslog( LOG_ERR, "do_register: %s: not indexed", scookie );
+    }
+    if ( commit_cookie( scookie ) != 0 ) {
+	syslog( LOG_ERR, "do_register: %s: not committed", scookie );
 	return( -1 );
     }
 
-    utime( login_p, NULL );
+    touch_note( login, itime, time( NULL ));
 
     return( 0 );
 }
@@ -810,7 +1056,6 @@ f_register( SNET *sn, int ac, char *av[], SNET *pushersn )
     struct cinfo	ci;
     struct timeval	tv;
     int			rc;
-    char		lpath[ MAXPATHLEN ], spath[ MAXPATHLEN ];
 
     /* REGISTER login_cookie ip service_cookie */
 
@@ -828,19 +1073,19 @@ f_register( SNET *sn, int ac, char *av[], SNET *pushersn )
 	return( 1 );
     }
 
-    if ( mkcookiepath( NULL, hashlen, av[ 1 ], lpath, sizeof( lpath )) < 0 ) {
-	syslog( LOG_ERR, "f_register: mkcookiepath login cookie error" );
+    if ( store_valid( av[ 1 ] ) < 0 ) {
+	syslog( LOG_ERR, "f_register: invalid login cookie name" );
 	snet_writef( sn, "%d REGISTER: Invalid cookie path.\r\n", 521 );
 	return( 1 );
     }
 
-    if ( mkcookiepath( NULL, hashlen, av[ 3 ], spath, sizeof( spath )) < 0 ) {
-	syslog( LOG_ERR, "f_register: mkcookiepath service cookie error" );
+    if ( store_valid( av[ 3 ] ) < 0 ) {
+	syslog( LOG_ERR, "f_register: invalid service cookie name" );
 	snet_writef( sn, "%d REGISTER: Invalid cookie path.\r\n", 522 );
 	return( 1 );
     }
 
-    if ( read_cookie( lpath, &ci ) != 0 ) {
+    if ( store->so_get( av[ 1 ], &ci ) != 0 ) {
 	snet_writef( sn, "%d REGISTER error: Sorry\r\n", 523 );
 	return( 1 );
     }
@@ -857,6 +1102,7 @@ f_register( SNET *sn, int ac, char *av[], SNET *pushersn )
 	syslog( LOG_ERR, "f_register: gettimeofday: %m" );
 	return( -1 );
     }
+    ci.ci_itime = touch_itime( av[ 1 ], ci.ci_itime );
 
     if ( tv.tv_sec - ci.ci_itime >= idle_out_time ) {
 	if ( tv.tv_sec - ci.ci_itime < ( idle_out_time + grey_time )) {
@@ -865,14 +1111,14 @@ f_register( SNET *sn, int ac, char *av[], SNET *pushersn )
 	    return( 1 );
 	}
 	snet_writef( sn, "%d REGISTER: Idle logged out\r\n", 422 );
-	if ( do_logout( lpath ) < 0 ) {
-	    syslog( LOG_ERR, "f_register: %s: %m", lpath );
+	if ( logout_cookie( av[ 1 ], &ci ) < 0 ) {
+	    syslog( LOG_ERR, "f_register: %s: %m", av[ 1 ] );
 	    return( -1 );
 	}
 	return( 1 );
     }
 
-    if (( rc = do_register( av[ 1 ], lpath, spath )) < 0 ) {
+    if (( rc = do_register( av[ 1 ], av[ 3 ], ci.ci_itime )) < 0 ) {
 	return( -1 );
     }
 
@@ -901,11 +1147,15 @@ f_register( SNET *sn, int ac, char *av[], SNET *pushersn )
 service_valid( char *service )
 {
     struct servicelist	*sl;
-    regex_t		preg;
     regmatch_t		svm[ 2 ];
     char		buf[ 1024 ];
     char		*p;
-    int			rc;
+
+    /* a NOTLS connection has no CN, so no cookies it may check */
+    if ( remote_cn == NULL ) {
+	syslog( LOG_ERR, "service_valid: no CN for %s", service );
+	return( NULL );
+    }
 
     /* limit access to CNs with matching cookies */
     if (( p = strchr( service, '=' )) == NULL ) {
@@ -919,38 +1169,17 @@ service_valid( char *service )
 	return( NULL );
     }
 
-    /* XXX cosign3 - save compiled regex in sl->sl_auth? */
-    if (( rc = regcomp( &preg, sl->sl_auth->al_hostname, REG_EXTENDED)) != 0 ) {
-	regerror( rc, &preg, buf, sizeof( buf ));
-	syslog( LOG_ERR, "service_valid: regcomp %s: %s",
-		sl->sl_auth->al_hostname, buf );
-	return( NULL );
-    }
-    if (( rc = regexec( &preg, remote_cn, 2, svm, 0 )) != 0 ) {
-	if ( rc == REG_NOMATCH ) {
-	    syslog( LOG_ERR, "service_valid: CN %s not allowed "
-			"access to cookie %s (no match)", remote_cn, service );
-	} else {
-	    regerror( rc, &preg, buf, sizeof( buf ));
-	    syslog( LOG_ERR, "service_valid: regexec: %s\n", buf );
-	}
-
-	sl = NULL;
-	goto service_valid_done;
-    }
-
-    /* only match whole CNs */
-    if ( svm[ 0 ].rm_so != 0 || svm[ 0 ].rm_eo != strlen( remote_cn )) {
+    /* only match whole CNs, the pattern was compiled with the config */
+    if ( !authlist_match( sl->sl_auth, remote_cn, svm, 2 )) {
 	syslog( LOG_ERR, "service_valid: CN %s not allowed "
-			 "access to cookie %s (partial match)",
-			 remote_cn, service );
+		    "access to cookie %s (no match)", remote_cn, service );
 	sl = NULL;
 	goto service_valid_done;
     }
 
     /*
      * if there's a custom cookie substitution pattern, use it.
-     * otherwise, the service_find call + the regexec above
+     * otherwise, the service_find call + the authlist_match above
      * verifies that the CN has access to the cookie.
      */
     if ( sl->sl_cookiesub != NULL ) {
@@ -972,7 +1201,6 @@ service_valid( char *service )
     *p = '=';
 
 service_valid_done:
-    regfree( &preg );
     return( sl );
 }
 
@@ -981,8 +1209,8 @@ f_check( SNET *sn, int ac, char *av[], SNET *pushersn )
 {
     struct cinfo 	ci;
     struct timeval	tv;
-    char		login[ MAXCOOKIELEN ], path[ MAXPATHLEN ];
-    char		rekeybuf[ 128 ], rcookie[ 256 ], scpath[ MAXPATHLEN ];
+    char		login[ MAXCOOKIELEN ], *lcookie;
+    char		rekeybuf[ 128 ], rcookie[ 256 ];
     char		*p;
     int			status;
     double		rate;
@@ -1016,8 +1244,8 @@ f_check( SNET *sn, int ac, char *av[], SNET *pushersn )
 	return( 1 );
     }
 
-    if ( mkcookiepath( NULL, hashlen, av[ 1 ], path, sizeof( path )) < 0 ) {
-	syslog( LOG_ERR, "f_check: mkcookiepath error" );
+    if ( store_valid( av[ 1 ] ) < 0 ) {
+	syslog( LOG_ERR, "f_check: invalid cookie name" );
 	snet_writef( sn, "%d %s: Invalid cookie name.\r\n", 531, av[ 0 ] );
 	return( 1 );
     }
@@ -1029,47 +1257,39 @@ f_check( SNET *sn, int ac, char *av[], SNET *pushersn )
 	}
 
 	status = 231;
-	if ( service_to_login( path, login ) != 0 ) {
+	if ( store->so_service( av[ 1 ], login ) != 0 ) {
 	    if (( rate = rate_tick( &checkunknown )) != 0.0 ) {
 		syslog( LOG_NOTICE, "STATS CHECK %s: UNKNOWN %.5f / sec",
-			inet_ntoa( cosign_sin.sin_addr), rate );
+			listener_ntop( &cosign_sin ), rate );
 	    }
 	    snet_writef( sn, "%d %s: cookie not in db!\r\n", 533, av[ 0 ] );
 	    return( 1 );
 	}
 	if ( COSIGN_PROTO_SUPPORTS_REKEY( protocol )) {
 	    if ( strcasecmp( av[ 0 ], "REKEY" ) == 0 ) {
-
-		/* save service cookie path for rekeying below. */
-		if ( strlen( path ) >= sizeof( scpath )) {
-		    syslog( LOG_ERR, "f_check: %s exceeds bounds.", path );
-		    snet_writef( sn, "%d %s: Invalid cookie name.\r\n",
-				 531, av[ 0 ]);
-		    return( 1 );
-		}
-		strcpy( scpath, path );
-
 		status = 233;
 	    }
 	}
 
-	if ( mkcookiepath( NULL, hashlen, login, path, sizeof( path )) < 0 ) {
-	    syslog( LOG_ERR, "f_check: mkcookiepath error.." );
+	if ( store_valid( login ) < 0 ) {
+	    syslog( LOG_ERR, "f_check: invalid cookie name.." );
 	    snet_writef( sn, "%d %s: Invalid cookie name.\r\n", 532, av[ 0 ] );
 	    return( 1 );
 	}
+	lcookie = login;
     } else if ( strncmp( av[ 1 ], "cosign=", 7 ) == 0 ) {
 	status = 232;
+	lcookie = av[ 1 ];
     } else {
 	syslog( LOG_ERR, "f_check: unknown cookie prefix." );
 	snet_writef( sn, "%d %s: unknown cookie prefix!\r\n", 432, av[ 0 ] );
 	return( 1 );
     }
 
-    if ( read_cookie( path, &ci ) != 0 ) {
+    if ( store->so_get( lcookie, &ci ) != 0 ) {
 	if (( rate = rate_tick( &checkunknown )) != 0.0 ) {
 	    syslog( LOG_NOTICE, "STATS CHECK %s: UNKNOWN %.5f / sec",
-		    inet_ntoa( cosign_sin.sin_addr), rate);
+		    listener_ntop( &cosign_sin ), rate);
 	}
 	snet_writef( sn, "%d %s: Who me? Dunno.\r\n", 534, av[ 0 ] );
 	return( 1 );
@@ -1078,7 +1298,7 @@ f_check( SNET *sn, int ac, char *av[], SNET *pushersn )
     if ( ci.ci_state == 0 ) {
 	if (( rate = rate_tick( &checkfail )) != 0.0 ) {
 	    syslog( LOG_NOTICE, "STATS CHECK %s: FAIL %.5f / sec",
-		    inet_ntoa( cosign_sin.sin_addr), rate);
+		    listener_ntop( &cosign_sin ), rate);
 	}
 	snet_writef( sn, "%d %s: Already logged out\r\n", 430, av[ 0 ] );
 	return( 1 );
@@ -1089,12 +1309,13 @@ f_check( SNET *sn, int ac, char *av[], SNET *pushersn )
 	syslog( LOG_ERR, "f_check: gettimeofday: %m" );
 	return( -1 );
     }
+    ci.ci_itime = touch_itime( lcookie, ci.ci_itime );
 
     if ( tv.tv_sec - ci.ci_itime >= idle_out_time ) {
 	if ( tv.tv_sec - ci.ci_itime < ( idle_out_time + grey_time )) {
 	    if (( rate = rate_tick( &checkunknown )) != 0.0 ) {
 		syslog( LOG_NOTICE, "STATS CHECK %s: UNKNOWN %.5f / sec",
-			inet_ntoa( cosign_sin.sin_addr ), rate );
+			listener_ntop( &cosign_sin ), rate );
 	    }
 	    syslog( LOG_NOTICE, "f_check: idle grey window" );
 	    snet_writef( sn, "%d %s: Idle Grey Window\r\n", 531, av[ 0 ] );
@@ -1102,22 +1323,22 @@ f_check( SNET *sn, int ac, char *av[], SNET *pushersn )
 	}
 	if (( rate = rate_tick( &checkfail )) != 0.0 ) {
 	    syslog( LOG_NOTICE, "STATS CHECK %s: FAIL %.5f / sec",
-		    inet_ntoa( cosign_sin.sin_addr), rate);
+		    listener_ntop( &cosign_sin ), rate);
 	}
 	snet_writef( sn, "%d %s: Idle logged out\r\n", 431, av[ 0 ] );
-	if ( do_logout( path ) < 0 ) {
-	    syslog( LOG_ERR, "f_check: %s: %m", login );
+	if ( logout_cookie( lcookie, &ci ) < 0 ) {
+	    syslog( LOG_ERR, "f_check: %s: %m", lcookie );
 	    return( -1 );
 	}
 	return( 1 );
     }
 
     /* prevent idle out if we are actually using it */
-    utime( path, NULL );
+    touch_note( lcookie, ci.ci_itime, tv.tv_sec );
 
     if (( rate = rate_tick( &checkpass )) != 0.0 ) {
 	syslog( LOG_NOTICE, "STATS CHECK %s: PASS %.5f / sec",
-		inet_ntoa( cosign_sin.sin_addr), rate);
+		listener_ntop( &cosign_sin ), rate);
     }
 
     if ( status == 233 ) {
@@ -1141,17 +1362,20 @@ f_check( SNET *sn, int ac, char *av[], SNET *pushersn )
 	    return( 1 );
 	}
 	*p = '=';
-	if ( mkcookiepath( NULL, hashlen, rcookie, path, sizeof( path )) < 0 ) {
-	    syslog( LOG_ERR, "f_check: rekey: mkcookiepath error." );
+	if ( store_valid( rcookie ) < 0 ) {
+	    syslog( LOG_ERR, "f_check: rekey: invalid cookie name." );
 	    snet_writef( sn, "%d %s: rekey failed.\r\n", 536, av[ 0 ] );
 	    return( 1 );
 	}
-	if ( rename( scpath, path ) != 0 ) {
-	    syslog( LOG_ERR, "f_check: rekey: rename %s to %s failed: %s.",
-			scpath, path, strerror( errno ));
+	if ( store->so_rekey( av[ 1 ], rcookie ) != 0 ) {
+	    syslog( LOG_ERR, "f_check: rekey: %s failed.", av[ 1 ] );
 	    snet_writef( sn, "%d %s: rekey failed.\r\n", 536, av[ 0 ] );
 	    return( 1 );
 	}
+	if ( sindex_add( login, rcookie ) < 0 ||
+		sindex_remove( login, av[ 1 ] ) < 0 ) {
+	    syslog( LOG_ERR, "f_check: rekey: %s: not indexed", rcookie );
+	}
     }
 
     if ( COSIGN_PROTO_SUPPORTS_FACTORS( protocol )) {
@@ -1172,13 +1396,98 @@ f_check( SNET *sn, int ac, char *av[], SNET *pushersn )
     return( 0 );
 }
 
+    int
+f_mcheck( SNET *sn, int ac, char *av[], SNET *pushersn )
+{
+    char		*end;
+    long		n;
+
+    /*
+     * C: MCHECK n
+     * C: cookie
+     *    ... n cookies in all
+     * S: one CHECK reply per cookie, in order
+     */
+
+    if ( ac != 2 ) {
+	syslog( LOG_ERR, "f_mcheck: %s: wrong number of args. "
+		"Expected 2, got %d", al->al_hostname, ac );
+	snet_writef( sn, "%d MCHECK: Wrong number of args.\r\n", 530 );
+	return( 1 );
+    }
+
+    errno = 0;
+    n = strtol( av[ 1 ], &end, 10 );
+    if ( errno != 0 || *end != '\0' || n < 1 || n > COSIGN_MCHECK_MAX ) {
+	syslog( LOG_ERR, "f_mcheck: %s: bad count %s",
+		al->al_hostname, av[ 1 ] );
+	snet_writef( sn, "%d MCHECK: Bad count, 1 to %d allowed.\r\n",
+		530, COSIGN_MCHECK_MAX );
+	return( 1 );
+    }
+
+    /* the cookies are handled by mcheck_line() as they arrive */
+    conn->cs_total = (int)n;
+    conn->cs_state = CS_MCHECK;
+
+    /* hold the replies until the last one, so they go out together */
+    conn_cork( sn, 1 );
+    return( 0 );
+}
+
+/*
+ * each cookie is checked exactly as CHECK would, and gets the same reply.
+ * a cookie we won't vouch for fails alone, not the rest of the batch.
+ */
+    static int
+mcheck_line( SNET *sn, char *line, SNET *pushersn )
+{
+    char		*av[ 2 ], **lav;
+    int			ac, rc = 0;
+
+    if (( ac = argcargv( line, &lav )) < 0 ) {
+	syslog( LOG_ERR, "argcargv: %m" );
+	rc = -1;
+    } else if ( ac != 1 ) {
+	syslog( LOG_ERR, "f_mcheck: %s: expected a cookie, got %d args",
+		al->al_hostname, ac );
+	snet_writef( sn, "%d CHECK: Wrong number of args.\r\n", 530 );
+    } else {
+	av[ 0 ] = "CHECK";
+	av[ 1 ] = lav[ 0 ];
+	if (( rc = f_check( sn, 2, av, pushersn )) > 0 ) {
+	    rc = 0;
+	}
+    }
+
+    if ( rc < 0 || --conn->cs_total <= 0 ) {
+	conn_cork( sn, 0 );
+	conn->cs_state = CS_COMMAND;
+    }
+    return( rc );
+}
+
+/*
+ * with TCP_CORK, partial segments are held back until it's turned off,
+ * when everything written meanwhile is sent.
+ */
+    static void
+conn_cork( SNET *sn, int on )
+{
+#ifdef TCP_CORK
+    if ( setsockopt( snet_fd( sn ), IPPROTO_TCP, TCP_CORK,
+	    &on, sizeof( on )) < 0 ) {
+	syslog( LOG_ERR, "setsockopt TCP_CORK: %m" );
+    }
+#endif /* TCP_CORK */
+}
+
     int
 f_retr( SNET *sn, int ac, char *av[], SNET *pushersn )
 {
     struct servicelist	*sl;
     struct cinfo        ci;
     struct timeval      tv;
-    char		lpath[ MAXPATHLEN ], spath[ MAXPATHLEN ];
     char		login[ MAXCOOKIELEN ];
 
     if (( al->al_key != CGI ) && ( al->al_key != SERVICE )) {
@@ -1199,24 +1508,24 @@ f_retr( SNET *sn, int ac, char *av[], SNET *pushersn )
 	return( 1 );
     }
 
-    if ( mkcookiepath( NULL, hashlen, av[ 1 ], spath, sizeof( spath )) < 0 ) {
-	syslog( LOG_ERR, "f_retr: mkcookiepath error" );
+    if ( store_valid( av[ 1 ] ) < 0 ) {
+	syslog( LOG_ERR, "f_retr: invalid cookie name" );
 	snet_writef( sn, "%d RETR: Invalid cookie name.\r\n", 541 );
 	return( 1 );
     }
 
-    if ( service_to_login( spath, login ) != 0 ) {
+    if ( store->so_service( av[ 1 ], login ) != 0 ) {
 	snet_writef( sn, "%d RETR: cookie not in db!\r\n", 543 );
 	return( 1 );
     }
 
-    if ( mkcookiepath( NULL, hashlen, login, lpath, sizeof( lpath )) < 0 ) {
-	syslog( LOG_ERR, "f_retr: mkcookiepath error" );
+    if ( store_valid( login ) < 0 ) {
+	syslog( LOG_ERR, "f_retr: invalid cookie name" );
 	snet_writef( sn, "%d RETR: Invalid cookie name.\r\n", 541 );
 	return( 1 );
     }
 
-    if ( read_cookie( lpath, &ci ) != 0 ) {
+    if ( store->so_get( login, &ci ) != 0 ) {
 	snet_writef( sn, "%d RETR: Who me? Dunno.\r\n", 544 );
 	return( 1 );
     }
@@ -1231,6 +1540,7 @@ f_retr( SNET *sn, int ac, char *av[], SNET *pushersn )
 	syslog( LOG_ERR, "f_retr: gettimeofday: %m" );
 	return( -1 );
     }
+    ci.ci_itime = touch_itime( login, ci.ci_itime );
 
     if ( tv.tv_sec - ci.ci_itime >= idle_out_time ) {
 	if ( tv.tv_sec - ci.ci_itime < ( idle_out_time + grey_time )) {
@@ -1239,7 +1549,7 @@ f_retr( SNET *sn, int ac, char *av[], SNET *pushersn )
 	    return( 1 );
 	}
 	snet_writef( sn, "%d RETR: Idle logged out\r\n", 441 );
-	if ( do_logout( lpath ) < 0 ) {
+	if ( logout_cookie( login, &ci ) < 0 ) {
 	    syslog( LOG_ERR, "f_retr: %s: %m", login );
 	    return( -1 );
 	}
@@ -1249,7 +1559,7 @@ f_retr( SNET *sn, int ac, char *av[], SNET *pushersn )
     if ( strcmp( av[ 2 ], "tgt") == 0 ) {
 	return( retr_ticket( sn, sl, ci.ci_krbtkt ));
     } else if ( strcmp( av[ 2 ], "cookies") == 0 ) {
-	return( retr_proxy( sn, login, pushersn ));
+	return( retr_proxy( sn, login, ci.ci_itime, pushersn ));
     }
 
     syslog( LOG_ERR, "f_retr: no such retrieve type: %s", av[ 1 ] );
@@ -1258,10 +1568,10 @@ f_retr( SNET *sn, int ac, char *av[], SNET *pushersn )
 }
 
     static int
-retr_proxy( SNET *sn, char *login, SNET *pushersn )
+retr_proxy( SNET *sn, char *login, time_t itime, SNET *pushersn )
 {
-    char		cookiebuf[ 128 ], lpath[ MAXPATHLEN ];
-    char		cbuf[ MAXCOOKIELEN ], spath[ MAXPATHLEN ];
+    char		cookiebuf[ 128 ];
+    char		cbuf[ MAXCOOKIELEN ];
     struct proxies	*proxy;
     int			rc;
 
@@ -1289,16 +1599,12 @@ retr_proxy( SNET *sn, char *login, SNET *pushersn )
 	    return( -1 );
 	}
 
-	if ( mkcookiepath( NULL, hashlen, cbuf, spath, sizeof( spath )) < 0 ) {
-	    syslog( LOG_ERR, "retr_proxy: mkcookiepath error" );
+	if ( store_valid( cbuf ) < 0 ) {
+	    syslog( LOG_ERR, "retr_proxy: invalid cookie name" );
 	    return( 1 );
 	}
 
-	if ( mkcookiepath( NULL, hashlen, login, lpath, sizeof( lpath )) < 0 ) {
-	    syslog( LOG_ERR, "retr_proxy: mkcookiepath error" );
-	    return( 1 );
-	}
-	if (( rc = do_register( login, lpath, spath )) < 0 ) {
+	if (( rc = do_register( login, cbuf, itime )) < 0 ) {
 	    continue;
 	}
 
@@ -1381,16 +1687,50 @@ retr_ticket( SNET *sn, struct servicelist *sl, char *krbpath )
 }
 
 
-    int
-command( int fd, SNET *pushersn )
+    static void
+conn_load( struct connstate *cs )
 {
-    SNET				*snet;
-    int					ac, i, zero = 0;
-    char				**av, *line;
-    struct timeval			tv;
-    extern int				errno;
-    double				rate;
+    conn = cs;
+    commands = cs->cs_commands;
+    ncommands = cs->cs_ncommands;
+    al = cs->cs_al;
+    remote_cn = cs->cs_remote_cn;
+    replicated = cs->cs_replicated;
+    protocol = cs->cs_protocol;
+    client_capa = cs->cs_capa;
+    checkpass = cs->cs_checkpass;
+    checkfail = cs->cs_checkfail;
+    checkunknown = cs->cs_checkunknown;
+    cosign_sin = cs->cs_sin;
+}
+
+    static void
+conn_save( struct connstate *cs )
+{
+    cs->cs_commands = commands;
+    cs->cs_ncommands = ncommands;
+    cs->cs_al = al;
+    cs->cs_remote_cn = remote_cn;
+    cs->cs_replicated = replicated;
+    cs->cs_protocol = protocol;
+    cs->cs_capa = client_capa;
+    cs->cs_checkpass = checkpass;
+    cs->cs_checkfail = checkfail;
+    cs->cs_checkunknown = checkunknown;
+    conn = NULL;
+}
+
+/*
+ * set up a new client connection and send it the banner.  for an event
+ * worker the socket is made non-blocking.  returns NULL, having closed
+ * fd, if the client can't be served.
+ */
+    struct connstate *
+conn_open( int fd, int nonblock )
+{
+    struct connstate			*cs;
     struct protoent			*proto;
+    int					flags, zero = 0;
 
     if (( proto = getprotobyname( "tcp" )) != NULL ) {
 	if ( setsockopt( fd, proto->p_proto, TCP_NODELAY,
@@ -1399,9 +1739,49 @@ command( int fd, SNET *pushersn )
 	}
     }
 
-    if (( snet = snet_attach( fd, 1024 * 1024 )) == NULL ) {
+    if (( cs = (struct connstate *)malloc( sizeof( struct connstate )))
+	    == NULL ) {
+	syslog( LOG_ERR, "conn_open: malloc: %m" );
+	(void)close( fd );
+	return( NULL );
+    }
+    memset( cs, 0, sizeof( struct connstate ));
+    cs->cs_state = CS_COMMAND;
+    cs->cs_fd = -1;
+    cs->cs_sin = cosign_sin;
+    cs->cs_commands = unauth_commands;
+    cs->cs_ncommands = sizeof( unauth_commands ) /
+	    sizeof( unauth_commands[ 0 ] );
+    cs->cs_protocol = COSIGN_PROTO_V0;
+    cs->cs_stat = STATS_NONE;
+
+    if (( cs->cs_sn = snet_attach( fd, 1024 * 1024 )) == NULL ) {
 	syslog( LOG_ERR, "snet_attach: %m" );
-	exit( 1 );
+	(void)close( fd );
+	free( cs );
+	return( NULL );
+    }
+    /*
+     * replies are queued and sent together once we've run out of
+     * commands to answer, so a client that pipelines its commands
+     * gets its replies in as few packets as possible.
+     */
+    snet_writebuffer( cs->cs_sn, 1 );
+
+    if ( nonblock ) {
+	if (( flags = fcntl( fd, F_GETFL )) < 0 ||
+		fcntl( fd, F_SETFL, flags | O_NONBLOCK ) < 0 ) {
+	    syslog( LOG_ERR, "conn_open: fcntl: %m" );
+	    (void)snet_close( cs->cs_sn );
+	    free( cs );
+	    return( NULL );
+	}
+	/*
+	 * replies wait in the queue for a client that's slow to read
+	 * them, rather than holding up the worker's other clients.
+	 */
+	snet_writequeue( cs->cs_sn );
+	cs->cs_flag |= CS_NEW;
     }
 
     /* for debugging, TLS not required but still available. we
@@ -1411,12 +1791,15 @@ command( int fd, SNET *pushersn )
      */
 
     if ( tlsopt ) {
-	commands = auth_commands;
-	ncommands = sizeof( auth_commands ) / sizeof( auth_commands[ 0 ] );
-	if (( al = authlist_find( "NOTLS" )) == NULL ) {
+	cs->cs_commands = auth_commands;
+	cs->cs_ncommands = sizeof( auth_commands ) /
+		sizeof( auth_commands[ 0 ] );
+	if (( cs->cs_al = authlist_find( "NOTLS" )) == NULL ) {
 	    syslog( LOG_ERR, "No debugging access" );
-	    snet_writef( snet, "%d No NOTLS access\r\n", 508 );
-	    exit( 1 );
+	    snet_writef( cs->cs_sn, "%d No NOTLS access\r\n", 508 );
+	    (void)snet_close( cs->cs_sn );
+	    free( cs );
+	    return( NULL );
 	}
     }
 
@@ -1428,67 +1811,298 @@ command( int fd, SNET *pushersn )
      * 
      * 220 2 Collaborative Web Single Sign-On [ CAPA1 CAPA2 ... ]\r\n
      */
-    banner( snet );
-
-    tv = cosign_net_timeout;
-    while (( line = snet_getline( snet, &tv )) != NULL ) {
-	/* log everything we get to stdout if we're debugging */
-	tv = cosign_net_timeout;
-	if ( debug ) {
-	    printf( "debug: %s\n", line );
-	}
-	if (( ac = argcargv( line, &av )) < 0 ) {
-	    syslog( LOG_ERR, "argcargv: %m" );
+    banner( cs->cs_sn );
+    if ( snet_flush( cs->cs_sn, NULL ) < 0 ) {
+	syslog( LOG_ERR, "conn_open: snet_flush: %m" );
+	(void)snet_close( cs->cs_sn );
+	free( cs );
+	return( NULL );
+    }
+    if ( snet_wpending( cs->cs_sn ) > 0 ) {
+	cs->cs_flag |= CS_WANTWRITE;
+    }
+
+    return( cs );
+}
+
+/* the session is over, say why if it's our fault */
+    static void
+conn_end( struct connstate *cs, int rc )
+{
+    switch ( rc ) {
+    case CMD_QUIT :
+	cs->cs_status = 0;
+	break;
+
+    case CMD_DROP :
+	cs->cs_status = 1;
+	break;
+
+    default :
+	snet_writef( cs->cs_sn,
+		"491 Service not available, closing transmission channel\r\n" );
+	cs->cs_status = 1;
+	break;
+    }
+    cs->cs_state = CS_DONE;
+}
+
+/*
+ * a command is over once the connection is ready for the next one,
+ * which for LOGIN and TIME is several lines after it began.
+ */
+    static void
+conn_stats( struct connstate *cs, int rc )
+{
+    if ( cs->cs_stat == STATS_NONE ) {
+	return;
+    }
+    if ( cs->cs_state != CS_COMMAND && cs->cs_state != CS_DONE ) {
+	return;
+    }
+    stats_command( cs->cs_stat, &cs->cs_start, rc != 0 );
+    cs->cs_stat = STATS_NONE;
+
+    /* a draining event worker may now hang up between commands */
+    cs->cs_flag &= ~CS_NEW;
+}
+
+    static int
+conn_command( SNET *sn, char *line, SNET *pushersn )
+{
+    char				**av;
+    int					ac, i;
+
+    /* log everything we get to stdout if we're debugging */
+    if ( debug ) {
+	printf( "debug: %s\n", line );
+    }
+    if (( ac = argcargv( line, &av )) < 0 ) {
+	syslog( LOG_ERR, "argcargv: %m" );
+	return( -1 );
+    }
+
+    if ( ac == 0 ) {
+	snet_writef( sn, "%d Command unrecognized\r\n", 501 );
+	return( 1 );
+    }
+
+    for ( i = 0; i < ncommands; i++ ) {
+	if ( strcasecmp( av[ 0 ], commands[ i ].c_name ) == 0 ) {
 	    break;
 	}
+    }
+    if ( i >= ncommands ) {
+	snet_writef( sn, "%d Command %s unregcognized\r\n", 500, av[ 0 ] );
+	return( 1 );
+    }
 
-	if ( ac == 0 ) {
-	    snet_writef( snet, "%d Command unrecognized\r\n", 501 );
-	    continue;
+    if (( conn->cs_stat = commands[ i ].c_stat ) != STATS_NONE ) {
+	(void)gettimeofday( &conn->cs_start, NULL );
+    }
+    return( (*(commands[ i ].c_func))( sn, ac, av, pushersn ));
+}
+
+/*
+ * run every command the client has sent.  blocking, this waits for
+ * input until the session ends.  otherwise it returns 0 as soon as it
+ * runs out of input, to be called again when there's more.  returns 1
+ * once the session is over.
+ */
+    int
+conn_process( struct connstate *cs, SNET *pushersn, int block )
+{
+    struct timeval			tv, *tvp = NULL;
+    char				*line, buf[ 8192 ];
+    ssize_t				len;
+    int					rc = 0;
+    extern int				errno;
+
+    conn_load( cs );
+
+    while ( cs->cs_state != CS_DONE ) {
+	/*
+	 * nothing more is read from a client that isn't taking its
+	 * replies, until they've all gone.
+	 */
+	if ( !block && cs->cs_state != CS_TLS &&
+		(( cs->cs_flag & CS_WANTWRITE ) ||
+		snet_wpending( cs->cs_sn ) >= CONN_WQUEUE )) {
+	    if ( snet_flush( cs->cs_sn, NULL ) < 0 ) {
+		syslog( LOG_ERR, "snet_flush: %m" );
+		cs->cs_status = 1;
+		cs->cs_state = CS_DONE;
+		break;
+	    }
+	    if ( snet_wpending( cs->cs_sn ) > 0 ) {
+		cs->cs_flag |= CS_WANTWRITE;
+		break;
+	    }
+	    cs->cs_flag &= ~CS_WANTWRITE;
 	}
 
-	for ( i = 0; i < ncommands; i++ ) {
-	    if ( strcasecmp( av[ 0 ], commands[ i ].c_name ) == 0 ) {
+	if ( block ) {
+	    tv = cosign_net_timeout;
+	    tvp = &tv;
+
+	    /* don't sit on activity while the client is quiet */
+	    if ( touch_pending() && tv.tv_sec > touch_interval ) {
+		tv.tv_sec = touch_interval;
+		tv.tv_usec = 0;
+	    }
+	}
+
+	if ( cs->cs_state == CS_TLS ) {
+	    if (( rc = starttls_handshake( cs->cs_sn )) < 0 ) {
+		conn_end( cs, rc );
+	    } else if ( cs->cs_state == CS_TLS ) {
 		break;
 	    }
+	    continue;
 	}
-	if ( i >= ncommands ) {
-	    snet_writef( snet, "%d Command %s unregcognized\r\n",
-		    500, av[ 0 ] );
+
+	if ( cs->cs_state == CS_KRBDATA ) {
+	    if (( len = snet_read( cs->cs_sn, buf,
+		    (int)MIN( cs->cs_len, sizeof( buf )), tvp )) <= 0 ) {
+		if ( len < 0 && !block && errno == EAGAIN ) {
+		    break;
+		}
+		syslog( LOG_ERR, "f_login: snet_read: %m" );
+		krb_clear( cs );
+		conn_end( cs, -1 );
+		continue;
+	    }
+	    if (( rc = krb_data( cs->cs_sn, buf, len, pushersn )) < 0 ) {
+		conn_end( cs, rc );
+	    }
+	    conn_stats( cs, rc );
 	    continue;
 	}
 
-	if ( (*(commands[ i ].c_func))( snet, ac, av, pushersn ) < 0 ) {
+	if (( line = snet_getline( cs->cs_sn, tvp )) == NULL ) {
+	    if ( snet_eof( cs->cs_sn )) {
+		cs->cs_status = 0;
+	    } else if ( !block && errno == EAGAIN ) {
+		break;
+	    } else if ( errno == ETIMEDOUT && touch_pending() &&
+		    time( NULL ) - cs->cs_activity <
+		    cosign_net_timeout.tv_sec ) {
+		touch_flush( time( NULL ), 1 );
+		continue;
+	    } else if ( errno == ETIMEDOUT ) {
+		cs->cs_status = 0;
+	    } else {
+		syslog( LOG_ERR, "snet_getline: %m" );
+		cs->cs_status = 1;
+	    }
+	    cs->cs_state = CS_DONE;
+	    continue;
+	}
+	if ( block ) {
+	    cs->cs_activity = time( NULL );
+	}
+
+	switch ( cs->cs_state ) {
+	case CS_TIME :
+	    rc = time_line( cs->cs_sn, line );
+	    break;
+
+	case CS_MCHECK :
+	    rc = mcheck_line( cs->cs_sn, line, pushersn );
+	    break;
+
+	case CS_KRBSIZE :
+	    rc = krb_size( cs->cs_sn, line );
+	    break;
+
+	case CS_KRBEND :
+	    rc = krb_end( cs->cs_sn, line, pushersn );
+	    break;
+
+	case CS_DRAIN :
+	    rc = ( strcmp( line, "." ) == 0 ) ? CMD_DROP : 0;
+	    break;
+
+	default :
+	    rc = conn_command( cs->cs_sn, line, pushersn );
 	    break;
 	}
+	if ( rc < 0 ) {
+	    conn_end( cs, rc );
+	}
+	conn_stats( cs, rc );
+	touch_flush( time( NULL ), 0 );
+    }
+
+    /* everything we've been sent has been answered */
+    if ( snet_flush( cs->cs_sn, NULL ) < 0 && cs->cs_state != CS_DONE ) {
+	syslog( LOG_ERR, "snet_flush: %m" );
+	cs->cs_status = 1;
+	cs->cs_state = CS_DONE;
+    } else if ( snet_wpending( cs->cs_sn ) > 0 ) {
+	/* the rest goes when the client has room for it */
+	cs->cs_flag |= CS_WANTWRITE;
     }
 
-    if (( rate = rate_get( &checkpass )) != 0.0 ) {
+    conn_save( cs );
+    return( cs->cs_state == CS_DONE );
+}
+
+/*
+ * log the connection's CHECK rates and hang up.  returns the exit
+ * status for a child serving just this connection.
+ */
+    int
+conn_close( struct connstate *cs )
+{
+    double				rate;
+    int					status;
+
+    if (( rate = rate_get( &cs->cs_checkpass )) != 0.0 ) {
 	syslog( LOG_NOTICE, "STATS CHECK %s: PASS %.5f / sec",
-		inet_ntoa( cosign_sin.sin_addr), rate );
+		listener_ntop( &cs->cs_sin ), rate );
     }
-    if (( rate = rate_get( &checkfail )) != 0.0 ) {
+    if (( rate = rate_get( &cs->cs_checkfail )) != 0.0 ) {
 	syslog( LOG_NOTICE, "STATS CHECK %s: FAIL %.5f / sec",
-		inet_ntoa( cosign_sin.sin_addr), rate );
+		listener_ntop( &cs->cs_sin ), rate );
     }
-    if (( rate = rate_get( &checkunknown )) != 0.0 ) {
+    if (( rate = rate_get( &cs->cs_checkunknown )) != 0.0 ) {
 	syslog( LOG_NOTICE, "STATS CHECK %s: UNKNOWN %.5f / sec",
-		inet_ntoa( cosign_sin.sin_addr), rate );
+		listener_ntop( &cs->cs_sin ), rate );
     }
 
-    if ( line != NULL ) {
-	snet_writef( snet,
-		"491 Service not available, closing transmission channel\r\n" );
-    } else {
-	if ( snet_eof( snet )) {
-	    exit( 0 );
-	} else if ( errno == ETIMEDOUT ) {
-	    exit( 0 );
-	} else {
-	    syslog( LOG_ERR, "snet_getline: %m" );
-	}
+    /* the client went away in the middle of a command */
+    if ( cs->cs_stat != STATS_NONE ) {
+	stats_command( cs->cs_stat, &cs->cs_start, 1 );
+    }
+
+    krb_clear( cs );
+    if ( cs->cs_remote_cn != NULL ) {
+	free( cs->cs_remote_cn );
     }
+    if ( snet_close( cs->cs_sn ) != 0 ) {
+	syslog( LOG_ERR, "snet_close: %m" );
+    }
+    status = cs->cs_status;
+    free( cs );
+
+    return( status );
+}
 
-    exit( 1 );
+/*
+ * serve one client connection, blocking.  the connection is closed
+ * and the exit status for the process returned, so that a pooled
+ * worker can go on to accept another connection.
+ */
+    int
+command( int fd, SNET *pushersn )
+{
+    struct connstate			*cs;
 
+    if (( cs = conn_open( fd, 0 )) == NULL ) {
+	return( 1 );
+    }
+    (void)conn_process( cs, pushersn, 1 );
+    touch_flush( time( NULL ), 1 );
+    return( conn_close( cs ));
 }
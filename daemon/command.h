@@ -5,5 +5,66 @@
 
 extern int	tlsopt;
 
-int		command( int, SNET * );
-int		argcargv( char *, char **[] );
+/* where a connection is in the protocol */
+#define CS_COMMAND	0	/* waiting for a command */
+#define CS_TLS		1	/* STARTTLS handshake in progress */
+#define CS_TIME		2	/* reading TIME timestamps */
+#define CS_KRBSIZE	3	/* reading LOGIN ticket length */
+#define CS_KRBDATA	4	/* reading LOGIN ticket data */
+#define CS_KRBEND	5	/* reading LOGIN ticket terminator */
+#define CS_DRAIN	6	/* discarding a bad LOGIN ticket */
+#define CS_MCHECK	7	/* reading MCHECK cookies */
+#define CS_DONE		8	/* session over */
+
+#define CS_WANTWRITE	(1<<0)
+#define CS_NEW		(1<<1)	/* hasn't yet had a command answered */
+
+struct command;
+
+/*
+ * everything we know about one client connection.  a blocking child
+ * serves a single connection start to finish, while an event worker
+ * holds many and feeds each one input as it arrives.
+ */
+struct connstate {
+    SNET		*cs_sn;
+    int			cs_state;
+    int			cs_flag;
+    int			cs_status;
+    time_t		cs_activity;
+    struct sockaddr_storage	cs_sin;
+
+    /* per-session protocol state */
+    struct command	*cs_commands;
+    int			cs_ncommands;
+    struct authlist	*cs_al;
+    char		*cs_remote_cn;
+    int			cs_replicated;
+    int			cs_protocol;
+    unsigned int	cs_capa;
+    struct rate		cs_checkpass;
+    struct rate		cs_checkfail;
+    struct rate		cs_checkunknown;
+
+    /* the command being timed */
+    int			cs_stat;
+    struct timeval	cs_start;
+
+    /* a multi-line command in progress */
+    int			cs_fd;
+    unsigned int	cs_len;
+    int			cs_total;
+    int			cs_fail;
+    char		*cs_krbpath;
+    char		*cs_cookie;
+    char		*cs_pushline;
+    char		*cs_logline;
+
+    struct connstate	*cs_prev;
+    struct connstate	*cs_next;
+};
+
+int			command( int, SNET * );
+struct connstate	*conn_open( int, int );
+int			conn_process( struct connstate *, SNET *, int );
+int			conn_close( struct connstate * );
@@ -0,0 +1,206 @@
+/*
+ * Copyright (c) 2004 Regents of The University of Michigan.
+ * All Rights Reserved.  See LICENSE.
+ */
+
+/*
+ * makes LOGIN and REGISTER writes durable before they're acknowledged,
+ * as cosigndurability says.  "write" commits each cookie on its own.
+ * "group" gathers cookies written by every worker into a batch in
+ * anonymous shared memory.  the first worker to find no commit in
+ * progress becomes the leader: it waits cosigndcommitwindow
+ * milliseconds, if any, for others to join, takes the batch, and
+ * commits it with one call to the store, while the rest wait for it
+ * to finish.  cookies arriving meanwhile gather in the next batch, so
+ * the slower the commit, the larger the batch.
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "store.h"
+#include "commit.h"
+
+struct commit {
+    pthread_mutex_t		cm_lock;
+    volatile int		cm_leader;	/* pid committing, or 0 */
+    volatile unsigned int	cm_open;	/* batch being gathered */
+    volatile unsigned int	cm_done;	/* last batch committed */
+    volatile int		cm_count;
+    volatile int		cm_result[ COMMIT_RING ];
+    char			cm_names[ COMMIT_BATCH ][ 256 ];
+};
+
+static int		commit_mode = COMMIT_NONE;
+static struct commit	*cm = NULL;
+static char		commit_names[ COMMIT_BATCH ][ 256 ];
+
+static int	commit_one( char * );
+static int	commit_lead( void );
+static void	commit_pause( long );
+
+/*
+ * called by the parent once the store is open, so every worker shares
+ * the batch.  name is "none", "group" or "write", NULL meaning "none".
+ */
+    int
+commit_init( char *name )
+{
+    if ( name == NULL || strcasecmp( name, "none" ) == 0 ) {
+	commit_mode = COMMIT_NONE;
+	return( 0 );
+    } else if ( strcasecmp( name, "write" ) == 0 ) {
+	commit_mode = COMMIT_WRITE;
+    } else if ( strcasecmp( name, "group" ) == 0 ) {
+	commit_mode = COMMIT_GROUP;
+    } else {
+	syslog( LOG_ERR, "commit_init: unknown durability %s", name );
+	return( -1 );
+    }
+
+    if ( store->so_commit == NULL ) {
+	syslog( LOG_NOTICE, "commit_init: %s store: durable only when "
+		"synced", store->so_name );
+	commit_mode = COMMIT_NONE;
+	return( 0 );
+    }
+    store_durable = 1;
+
+    if ( commit_mode == COMMIT_GROUP ) {
+	if (( cm = (struct commit *)mmap( NULL, sizeof( struct commit ),
+		PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANON, -1, 0 ))
+		== MAP_FAILED ) {
+	    syslog( LOG_ERR, "commit_init: mmap: %m" );
+	    cm = NULL;
+	    return( -1 );
+	}
+	memset( cm, 0, sizeof( struct commit ));
+	if ( store_lock_init( &cm->cm_lock ) < 0 ) {
+	    (void)munmap( cm, sizeof( struct commit ));
+	    cm = NULL;
+	    return( -1 );
+	}
+	cm->cm_open = 1;
+    }
+    return( 0 );
+}
+
+    static void
+commit_pause( long usec )
+{
+    struct timespec	ts;
+
+    ts.tv_sec = usec / 1000000;
+    ts.tv_nsec = ( usec % 1000000 ) * 1000;
+    (void)nanosleep( &ts, NULL );
+}
+
+    static int
+commit_one( char *cookie )
+{
+    return( (*store->so_commit)( &cookie, 1 ));
+}
+
+/*
+ * takes the open batch and commits it.  the result is recorded as
+ * failed first, so that if this process dies mid-commit, no one
+ * waiting on the batch is told it succeeded.
+ */
+    static int
+commit_lead( void )
+{
+    char		*names[ COMMIT_BATCH ];
+    unsigned int	batch;
+    int			i, n, rc;
+
+    if ( commit_window > 0 ) {
+	commit_pause( commit_window * 1000L );
+    }
+
+    store_lock( &cm->cm_lock );
+    batch = cm->cm_open++;
+    n = cm->cm_count;
+    for ( i = 0; i < n; i++ ) {
+	strcpy( commit_names[ i ], cm->cm_names[ i ] );
+	names[ i ] = commit_names[ i ];
+    }
+    cm->cm_count = 0;
+    cm->cm_result[ batch % COMMIT_RING ] = -1;
+    store_unlock( &cm->cm_lock );
+
+    rc = ( n > 0 ) ? (*store->so_commit)( names, n ) : 0;
+
+    store_lock( &cm->cm_lock );
+    cm->cm_result[ batch % COMMIT_RING ] = rc;
+    cm->cm_done = batch;
+    cm->cm_leader = 0;
+    store_unlock( &cm->cm_lock );
+
+    return( rc );
+}
+
+/*
+ * returns once cookie's last write is durable, 0 on success and -1 if
+ * it couldn't be made so.
+ */
+    int
+commit_cookie( char *cookie )
+{
+    unsigned int	batch;
+    int			rc, lead;
+
+    if ( commit_mode == COMMIT_NONE ) {
+	return( 0 );
+    }
+    if ( commit_mode == COMMIT_WRITE || cm == NULL ||
+	    strlen( cookie ) >= sizeof( cm->cm_names[ 0 ] )) {
+	return( commit_one( cookie ));
+    }
+
+    /* join the open batch, waiting for room if it's full */
+    for (;;) {
+	store_lock( &cm->cm_lock );
+	if ( cm->cm_count < COMMIT_BATCH ) {
+	    break;
+	}
+	store_unlock( &cm->cm_lock );
+	commit_pause( 100 );
+    }
+    strcpy( cm->cm_names[ cm->cm_count++ ], cookie );
+    batch = cm->cm_open;
+    store_unlock( &cm->cm_lock );
+
+    for (;;) {
+	store_lock( &cm->cm_lock );
+	if ((int)( cm->cm_done - batch ) >= 0 ) {
+	    rc = cm->cm_result[ batch % COMMIT_RING ];
+	    store_unlock( &cm->cm_lock );
+	    return( rc );
+	}
+	lead = 0;
+	if ( cm->cm_leader == 0 || ( kill( cm->cm_leader, 0 ) < 0 &&
+		errno == ESRCH )) {
+	    cm->cm_leader = getpid();
+	    lead = 1;
+	}
+	store_unlock( &cm->cm_lock );
+
+	if ( lead ) {
+	    /* a leader takes the batch it's in, or a later one */
+	    (void)commit_lead();
+	    continue;
+	}
+	commit_pause( 100 );
+    }
+}
@@ -0,0 +1,18 @@
+/*
+ * Copyright (c) 2004 Regents of The University of Michigan.
+ * All Rights Reserved.  See LICENSE.
+ */
+
+/* cosigndurability */
+#define COMMIT_NONE	0	/* leave it to the kernel */
+#define COMMIT_GROUP	1	/* batched across workers */
+#define COMMIT_WRITE	2	/* each write on its own */
+
+/* cookies per group commit, and results remembered */
+#define COMMIT_BATCH	128
+#define COMMIT_RING	64
+
+extern int	commit_window;
+
+int	commit_init( char * );
+int	commit_cookie( char * );
@@ -19,6 +19,7 @@
 
 #include "cparse.h"
 #include "mkcookie.h"
+#include "uring.h"
 
     int
 do_logout( char *path )
@@ -32,116 +33,163 @@ do_logout( char *path )
     return( 0 );
 }
 
-/* char *login passed in should be MAXCOOKIELEN */
-    int
-service_to_login( char *service, char *login )
+/*
+ * cookie files are small and written whole, so they're read whole: one
+ * pread() into the caller's buffer, sized by fstat(), or the same in
+ * one io_uring submission.  returns the length read, 0 if there's no
+ * such file, or -1.
+ */
+    static int
+cookie_slurp( char *path, char *buf, int size, struct stat *st )
 {
-    FILE	*scf;
-    char	buf[ MAXCOOKIELEN + 2 ];
-    char	*p;
-    int		len;
-    extern int	errno;
+    ssize_t		rc;
+    int			fd;
+
+    if (( fd = uring_slurp( path, buf, size, st )) != URING_UNAVAIL ) {
+	return( fd );
+    }
 
-    if (( scf = fopen( service, "r" )) == NULL ) {
-	if ( errno != ENOENT ) {
-	    syslog( LOG_ERR, "service_to_login: %s: %m", service  );
+    if (( fd = open( path, O_RDONLY, 0 )) < 0 ) {
+	if ( errno == ENOENT ) {
+	    return( 0 );
 	}
+	syslog( LOG_ERR, "cookie_slurp: %s: %m", path );
 	return( -1 );
     }
-
-    if ( fgets( buf, sizeof( buf ), scf ) == NULL ) {
-	syslog( LOG_ERR, "service_to_login: fgets: %m"  );
+    if ( fstat( fd, st ) != 0 ) {
+	syslog( LOG_ERR, "cookie_slurp: %s: %m", path );
 	goto error;
     }
-
-    len = strlen( buf );
-    if ( buf[ len - 1 ] != '\n' ) {
-	syslog( LOG_ERR, "service_to_login: line too long" );
+    if ( st->st_size >= size ) {
+	syslog( LOG_ERR, "cookie_slurp: %s: too long", path );
 	goto error;
     }
-    buf[ len - 1 ] = '\0';
-    p = buf + 1;
-
-    if ( *buf != 'l' ) {
-	syslog( LOG_ERR,
-		"service_to_login: file format error in %s", service );
+    if (( rc = pread( fd, buf, st->st_size, 0 )) != st->st_size ) {
+	if ( rc < 0 ) {
+	    syslog( LOG_ERR, "cookie_slurp: %s: %m", path );
+	} else {
+	    syslog( LOG_ERR, "cookie_slurp: %s: short read", path );
+	}
 	goto error;
     }
+    if ( close( fd ) != 0 ) {
+	syslog( LOG_ERR, "cookie_slurp: %s: %m", path );
+	return( -1 );
+    }
+    return( (int)rc );
 
-    strcpy( login, p );
+error:
+    (void)close( fd );
+    return( -1 );
+}
 
-    if ( fclose( scf ) != 0 ) {
-	syslog( LOG_ERR, "service_to_login: %s: %m", service );
+/*
+ * the next line of a slurped file, in place.  returns its start and
+ * sets *lenp to its length without the newline, or returns NULL at
+ * the end.  a last line without a newline was cut short, and is an
+ * error.
+ */
+    static char *
+cookie_line( char **pp, char *end, int *lenp )
+{
+    char		*line = *pp, *nl;
+
+    if ( line >= end ) {
+	*lenp = 0;
+	return( NULL );
+    }
+    if (( nl = memchr( line, '\n', end - line )) == NULL ) {
+	*lenp = -1;
+	return( NULL );
+    }
+    *lenp = nl - line;
+    *pp = nl + 1;
+    return( line );
+}
+
+/* copies a line's value, less its keyword, if it fits */
+    static int
+cookie_field( char *dst, int size, char *line, int len )
+{
+    if ( len - 1 >= size ) {
 	return( -1 );
     }
+    memcpy( dst, line + 1, len - 1 );
+    dst[ len - 1 ] = '\0';
     return( 0 );
+}
 
-error:
-    if ( fclose( scf ) != 0 ) {
-	syslog( LOG_ERR, "service_to_login: %s: %m", service );
+/* char *login passed in should be MAXCOOKIELEN */
+    int
+service_to_login( char *service, char *login )
+{
+    struct stat	st;
+    char	buf[ MAXCOOKIELEN + 2 ];
+    char	*p, *line;
+    int		rc, len;
+
+    if (( rc = cookie_slurp( service, buf, sizeof( buf ), &st )) <= 0 ) {
+	return( -1 );
     }
-    return( -1 );
 
+    p = buf;
+    if (( line = cookie_line( &p, buf + rc, &len )) == NULL ) {
+	syslog( LOG_ERR, "service_to_login: %s: line too long", service );
+	return( -1 );
+    }
+    if ( *line != 'l' ) {
+	syslog( LOG_ERR,
+		"service_to_login: file format error in %s", service );
+	return( -1 );
+    }
+    if ( cookie_field( login, MAXCOOKIELEN, line, len ) < 0 ) {
+	syslog( LOG_ERR, "service_to_login: %s: login too long", service );
+	return( -1 );
+    }
+
+    return( 0 );
 }
 
     int
 read_cookie( char *path, struct cinfo *ci )
 {
-    FILE		*cf;
     struct stat		st;
-    char		buf[ MAXPATHLEN + 2 ];
-    char		*p;
-    int			len;
-    extern int          errno;
+    char		buf[ MAXPATHLEN * 2 ];
+    char		*p, *end, *line;
+    int			rc, len;
 
-    memset( ci, 0, sizeof( struct cinfo ));
+    /* only the strings' first bytes need clearing, not all 5k */
+    ci->ci_version = ci->ci_state = 0;
+    *ci->ci_ipaddr = *ci->ci_ipaddr_cur = *ci->ci_user = '\0';
+    *ci->ci_realm = *ci->ci_ctime = *ci->ci_krbtkt = '\0';
 
-    if (( cf = fopen( path, "r" )) == NULL ) {
-	/* monster need this ENOENT return val */
-	if ( errno == ENOENT ) {
-	    return( 1 );
-	}
-	syslog( LOG_ERR, "read_cookie: %s: %m", path  );
+    if (( rc = cookie_slurp( path, buf, sizeof( buf ), &st )) < 0 ) {
 	return( -1 );
     }
-
-    if ( fstat( fileno( cf ), &st ) != 0 ) {
-	syslog( LOG_ERR, "read_cookie: %s: %m", path );
-	goto error;
+    /* monster need this ENOENT return val */
+    if ( rc == 0 ) {
+	return( 1 );
     }
 
     ci->ci_itime = st.st_mtime;
+    p = buf;
+    end = buf + rc;
 
     /* file ordering only matters for version and state */
-    if ( fgets( buf, sizeof( ci->ci_version ), cf ) == NULL ) {
-	syslog( LOG_ERR, "read_cookie: ci_version: %m"  );
-	goto error;
-    }
-
-    len = strlen( buf );
-    if ( buf[ len - 1 ] != '\n' ) {
-	syslog( LOG_ERR, "read_cookie: line too long" );
-	goto error;
-    }
-    buf[ len - 1 ] = '\0';
-
-    if ( *buf != 'v' ) {
-	syslog( LOG_ERR, "read_cookie: file format error" );
-	goto error;
+    if (( line = cookie_line( &p, end, &len )) == NULL || *line != 'v' ) {
+	syslog( LOG_ERR, "read_cookie: %s: file format error", path );
+	return( -1 );
     }
-    p = buf + 1;
-
-    ci->ci_version = atoi( p );
-
-    if ( ci->ci_version != 2 ) {
-	syslog( LOG_ERR, "read_cookie: file version mismatch" );
-	goto error;
+    if ( len != 2 || line[ 1 ] != '2' ) {
+	syslog( LOG_ERR, "read_cookie: %s: file version mismatch", path );
+	return( -1 );
     }
+    ci->ci_version = 2;
 
     /* legacy logout code, skip the s0/1 line */
-    if ( fgets( buf, sizeof( ci->ci_state ), cf ) == NULL ) {
-	syslog( LOG_ERR, "read_cookie: ci_state: %m"  );
-	goto error;
+    if ( cookie_line( &p, end, &len ) == NULL ) {
+	syslog( LOG_ERR, "read_cookie: %s: no state", path );
+	return( -1 );
     }
 
     /* new logout code */
@@ -151,58 +199,50 @@ read_cookie( char *path, struct cinfo *ci )
 	ci->ci_state = 1;
     }
 
-    /* we checked sizes when we wrote this data to a trusted file system */
-    while( fgets( buf, sizeof( buf ), cf ) != NULL ) {
-	len = strlen( buf );
-	if ( buf[ len - 1 ] != '\n' ) {
-	    syslog( LOG_ERR, "read_cookie: line too long");
-	    goto error;
-	}
-	buf[ len - 1 ] = '\0';
-	p = buf + 1;
-
-	switch( *buf ) {
-
+    while (( line = cookie_line( &p, end, &len )) != NULL ) {
+	switch( *line ) {
 	case 'i':
-	    strcpy( ci->ci_ipaddr, p );
+	    rc = cookie_field( ci->ci_ipaddr, sizeof( ci->ci_ipaddr ),
+		    line, len );
 	    break;
 
 	case 'j':
-	    strcpy( ci->ci_ipaddr_cur, p );
+	    rc = cookie_field( ci->ci_ipaddr_cur, sizeof( ci->ci_ipaddr_cur ),
+		    line, len );
 	    break;
 
 	case 'p':
-	    strcpy( ci->ci_user, p );
+	    rc = cookie_field( ci->ci_user, sizeof( ci->ci_user ), line, len );
 	    break;
 
 	case 'r':
-	    strcpy( ci->ci_realm, p );
+	    rc = cookie_field( ci->ci_realm, sizeof( ci->ci_realm ),
+		    line, len );
 	    break;
 
 	case 't':
-	    strcpy( ci->ci_ctime, p );
+	    rc = cookie_field( ci->ci_ctime, sizeof( ci->ci_ctime ),
+		    line, len );
 	    break;
 
 	case 'k':
-	    strcpy( ci->ci_krbtkt, p );
+	    rc = cookie_field( ci->ci_krbtkt, sizeof( ci->ci_krbtkt ),
+		    line, len );
 	    break;
 
 	default:
-	    syslog( LOG_ERR, "read_cookie: unknown keyword %c", *buf );
-	    goto error;
+	    syslog( LOG_ERR, "read_cookie: unknown keyword %c", *line );
+	    return( -1 );
+	}
+	if ( rc < 0 ) {
+	    syslog( LOG_ERR, "read_cookie: %s: %c line too long", path, *line );
+	    return( -1 );
 	}
     }
-
-    if ( fclose( cf ) != 0 ) {
-	syslog( LOG_ERR, "read_cookie: %s: %m", path );
+    if ( len < 0 ) {
+	syslog( LOG_ERR, "read_cookie: %s: line too long", path );
 	return( -1 );
     }
-    return( 0 );
 
-error:
-    if ( fclose( cf ) != 0 ) {
-	syslog( LOG_ERR, "read_cookie: %s: %m", path );
-    }
-    return( -1 );
+    return( 0 );
 }
-
@@ -0,0 +1,241 @@
+/*
+ * Copyright (c) 2004 Regents of The University of Michigan.
+ * All Rights Reserved.  See LICENSE.
+ */
+
+/*
+ * times read_cookie() and service_to_login() against the stdio parsers
+ * they replaced, on a login and a service cookie written to the current
+ * directory.  "make cparse_bench" builds it; it isn't installed.
+ *
+ * each mode can be run alone, to compare them under strace -c (system
+ * calls per lookup) or valgrind (heap allocations per lookup):
+ *
+ *	cparse_bench [ -m stdio | pread ] [ -n iterations ]
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "cparse.h"
+#include "mkcookie.h"
+
+#define BENCH_LOGIN	"cosign=cparse.bench.login"
+#define BENCH_SERVICE	"cosign-bench=cparse.bench.service"
+
+static int	stdio_read_cookie( char *, struct cinfo * );
+static int	stdio_service_to_login( char *, char * );
+static double	bench( int (*)( char *, struct cinfo * ),
+		    int (*)( char *, char * ), int );
+static void	bench_files( void );
+
+/* read_cookie() as it was, a line at a time through stdio */
+    static int
+stdio_read_cookie( char *path, struct cinfo *ci )
+{
+    FILE		*cf;
+    struct stat		st;
+    char		buf[ MAXPATHLEN + 2 ];
+    char		*p;
+    int			len;
+
+    memset( ci, 0, sizeof( struct cinfo ));
+
+    if (( cf = fopen( path, "r" )) == NULL ) {
+	return( errno == ENOENT ? 1 : -1 );
+    }
+    if ( fstat( fileno( cf ), &st ) != 0 ) {
+	goto error;
+    }
+    ci->ci_itime = st.st_mtime;
+
+    if ( fgets( buf, sizeof( ci->ci_version ), cf ) == NULL ) {
+	goto error;
+    }
+    len = strlen( buf );
+    if ( buf[ len - 1 ] != '\n' || *buf != 'v' ) {
+	goto error;
+    }
+    buf[ len - 1 ] = '\0';
+    if (( ci->ci_version = atoi( buf + 1 )) != 2 ) {
+	goto error;
+    }
+    if ( fgets( buf, sizeof( ci->ci_state ), cf ) == NULL ) {
+	goto error;
+    }
+    ci->ci_state = ( st.st_mode & S_ISGID ) ? 0 : 1;
+
+    while ( fgets( buf, sizeof( buf ), cf ) != NULL ) {
+	len = strlen( buf );
+	if ( buf[ len - 1 ] != '\n' ) {
+	    goto error;
+	}
+	buf[ len - 1 ] = '\0';
+	p = buf + 1;
+
+	switch( *buf ) {
+	case 'i':
+	    strcpy( ci->ci_ipaddr, p );
+	    break;
+	case 'j':
+	    strcpy( ci->ci_ipaddr_cur, p );
+	    break;
+	case 'p':
+	    strcpy( ci->ci_user, p );
+	    break;
+	case 'r':
+	    strcpy( ci->ci_realm, p );
+	    break;
+	case 't':
+	    strcpy( ci->ci_ctime, p );
+	    break;
+	case 'k':
+	    strcpy( ci->ci_krbtkt, p );
+	    break;
+	default:
+	    goto error;
+	}
+    }
+    return( fclose( cf ) == 0 ? 0 : -1 );
+
+error:
+    (void)fclose( cf );
+    return( -1 );
+}
+
+/* service_to_login() as it was */
+    static int
+stdio_service_to_login( char *service, char *login )
+{
+    FILE	*scf;
+    char	buf[ MAXCOOKIELEN + 2 ];
+    int		len;
+
+    if (( scf = fopen( service, "r" )) == NULL ) {
+	return( -1 );
+    }
+    if ( fgets( buf, sizeof( buf ), scf ) == NULL ) {
+	goto error;
+    }
+    len = strlen( buf );
+    if ( buf[ len - 1 ] != '\n' || *buf != 'l' ) {
+	goto error;
+    }
+    buf[ len - 1 ] = '\0';
+    strcpy( login, buf + 1 );
+    return( fclose( scf ) == 0 ? 0 : -1 );
+
+error:
+    (void)fclose( scf );
+    return( -1 );
+}
+
+    static void
+bench_files( void )
+{
+    FILE	*f;
+
+    if (( f = fopen( BENCH_LOGIN, "w" )) == NULL ) {
+	perror( BENCH_LOGIN );
+	exit( 1 );
+    }
+    fprintf( f, "v2\ns1\ni141.211.1.1\nj141.211.1.1\npbjensen\n"
+	    "rUMICH.EDU OTP\nt1262304000\nk/var/cosign/ticket/krb5cc_bench\n" );
+    if ( fclose( f ) != 0 ) {
+	perror( BENCH_LOGIN );
+	exit( 1 );
+    }
+
+    if (( f = fopen( BENCH_SERVICE, "w" )) == NULL ) {
+	perror( BENCH_SERVICE );
+	exit( 1 );
+    }
+    fprintf( f, "l%s\n", BENCH_LOGIN );
+    if ( fclose( f ) != 0 ) {
+	perror( BENCH_SERVICE );
+	exit( 1 );
+    }
+}
+
+/* a CHECK's worth of work, n times over.  returns ns per lookup */
+    static double
+bench( int (*rc)( char *, struct cinfo * ), int (*sl)( char *, char * ),
+	int n )
+{
+    struct cinfo	ci;
+    struct timeval	start, end;
+    char		login[ MAXCOOKIELEN ];
+    int			i;
+
+    gettimeofday( &start, NULL );
+    for ( i = 0; i < n; i++ ) {
+	if ( (*sl)( BENCH_SERVICE, login ) != 0 ||
+		(*rc)( login, &ci ) != 0 ) {
+	    fprintf( stderr, "cparse_bench: lookup failed\n" );
+	    exit( 1 );
+	}
+    }
+    gettimeofday( &end, NULL );
+
+    if ( strcmp( ci.ci_user, "bjensen" ) != 0 ||
+	    strcmp( ci.ci_realm, "UMICH.EDU OTP" ) != 0 ) {
+	fprintf( stderr, "cparse_bench: bad parse\n" );
+	exit( 1 );
+    }
+
+    return((( end.tv_sec - start.tv_sec ) * 1e9 +
+	    ( end.tv_usec - start.tv_usec ) * 1e3 ) / n );
+}
+
+    int
+main( int ac, char *av[] )
+{
+    char		*mode = NULL;
+    int			c, n = 100000;
+
+    while (( c = getopt( ac, av, "m:n:" )) != EOF ) {
+	switch ( c ) {
+	case 'm' :
+	    mode = optarg;
+	    break;
+
+	case 'n' :
+	    n = atoi( optarg );
+	    break;
+
+	default :
+	    fprintf( stderr, "usage: %s [ -m stdio | pread ] "
+		    "[ -n iterations ]\n", av[ 0 ] );
+	    exit( 1 );
+	}
+    }
+    if ( n <= 0 ) {
+	n = 1;
+    }
+
+    openlog( "cparse_bench", LOG_PERROR, LOG_USER );
+    bench_files();
+
+    if ( mode == NULL || strcmp( mode, "stdio" ) == 0 ) {
+	printf( "stdio: %d lookups, %.0f ns each\n", n,
+		bench( stdio_read_cookie, stdio_service_to_login, n ));
+    }
+    if ( mode == NULL || strcmp( mode, "pread" ) == 0 ) {
+	printf( "pread: %d lookups, %.0f ns each\n", n,
+		bench( read_cookie, service_to_login, n ));
+    }
+
+    (void)unlink( BENCH_LOGIN );
+    (void)unlink( BENCH_SERVICE );
+    exit( 0 );
+}
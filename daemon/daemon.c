@@ -22,21 +22,34 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <pthread.h>
 
 #include <openssl/ssl.h>
 #include <snet.h>
 
 #include "logname.h"
-#include "command.h"
 #include "conf.h"
 #include "rate.h"
+#include "journal.h"
+#include "command.h"
 #include "monster.h"
 #include "pusher.h"
+#include "pool.h"
+#include "listener.h"
+#include "stats.h"
+#include "store.h"
+#include "commit.h"
+#include "uring.h"
+#include "snapshot.h"
+#include "sweep.h"
 
 
 int		debug = 0;
-int		backlog = 5;
+int		backlog = SOMAXCONN;
+int		reuseport = 0;
 int		pusherpid;
+int		sweeperpid = 0;
+int		sweep_interval = 0;
 int		reconfig = 0;
 int		child_signal = 0;
 
@@ -45,8 +58,17 @@ int		tlsopt = 0;
 int		idle_out_time = 60 * 60 * 2;
 int		grey_time = 60 * 30;
 int		hashlen = 0;
+int		oldhashlen = -1;
 int		strict_checks = 1;
 char		*cosign_dir = _COSIGN_DIR;
+char		*store_name = NULL;
+char		*shm_name = "/cosignd";
+int		shm_nslots = 65536;
+int		log_segsize = 64;
+int		touch_interval = 60;
+char		*durability = NULL;
+char		*fileio = NULL;
+int		commit_window = 0;
 char		*cosign_tickets = _COSIGN_TICKET_CACHE;
 char		*cosign_conf = _COSIGN_CONF;
 char		*cryptofile = _COSIGN_TLS_KEY;
@@ -57,7 +79,12 @@ char		*replhost = NULL;
 struct timeval	cosign_net_timeout = { 60 * 4, 0 };
 unsigned short	cosign_port = 0;
 SSL_CTX		*ctx = NULL;
-struct sockaddr_in	cosign_sin;
+struct sockaddr_storage	cosign_sin;
+int		pool_max = 0;
+int		pool_minspare = 5;
+int		pool_maxspare = 10;
+int		pool_maxrequests = 1000;
+int		event_max = 0;
 
 void		hup( int );
 void		chld( int );
@@ -105,11 +132,89 @@ daemon_configure()
 	hashlen = atoi( val );
     }
 
+    if (( val = cosign_config_get( COSIGNDBREHASHKEY )) != NULL ) {
+	oldhashlen = atoi( val );
+    }
+
+    if (( val = cosign_config_get( COSIGNDSTOREKEY )) != NULL ) {
+	store_name = val;
+    }
+
+    if (( val = cosign_config_get( COSIGNDSHMKEY )) != NULL ) {
+	shm_name = val;
+    }
+
+    if (( val = cosign_config_get( COSIGNDSHMSLOTSKEY )) != NULL ) {
+	shm_nslots = atoi( val );
+    }
+
+    if (( val = cosign_config_get( COSIGNDLOGSEGMENTKEY )) != NULL ) {
+	log_segsize = atoi( val );
+    }
+
+    if (( val = cosign_config_get( COSIGNDDURABILITYKEY )) != NULL ) {
+	durability = val;
+    }
+
+    if (( val = cosign_config_get( COSIGNDCOMMITWINDOWKEY )) != NULL ) {
+	commit_window = atoi( val );
+    }
+
+    if (( val = cosign_config_get( COSIGNDFILEIOKEY )) != NULL ) {
+	fileio = val;
+    }
+
+    if (( val = cosign_config_get( COSIGNDSWEEPKEY )) != NULL ) {
+	sweep_interval = atoi( val );
+    }
+
+    if (( val = cosign_config_get( COSIGNMONSTERPROCSKEY )) != NULL ) {
+	sweep_procs = atoi( val );
+    }
+
+    if (( val = cosign_config_get( COSIGNMONSTERIOPSKEY )) != NULL ) {
+	sweep_iops = atoi( val );
+    }
+
+    if (( val = cosign_config_get( COSIGNDTOUCHKEY )) != NULL ) {
+	touch_interval = atoi( val );
+    }
+
     if (( val = cosign_config_get( COSIGNSTRICTCHECKKEY )) != NULL ) {
 	if ( strcasecmp( val, "off" ) == 0 ) {
 	    strict_checks = 0;
 	}
     }
+
+    if (( val = cosign_config_get( COSIGNDPREFORKKEY )) != NULL ) {
+	pool_max = atoi( val );
+    }
+
+    if (( val = cosign_config_get( COSIGNDMINSPAREKEY )) != NULL ) {
+	pool_minspare = atoi( val );
+    }
+
+    if (( val = cosign_config_get( COSIGNDMAXSPAREKEY )) != NULL ) {
+	pool_maxspare = atoi( val );
+    }
+
+    if (( val = cosign_config_get( COSIGNDMAXREQUESTSKEY )) != NULL ) {
+	pool_maxrequests = atoi( val );
+    }
+
+    if (( val = cosign_config_get( COSIGNDEVENTSKEY )) != NULL ) {
+	event_max = atoi( val );
+    }
+
+    if (( val = cosign_config_get( COSIGNDBACKLOGKEY )) != NULL ) {
+	backlog = atoi( val );
+    }
+
+    if (( val = cosign_config_get( COSIGNDREUSEPORTKEY )) != NULL ) {
+	if ( strcasecmp( val, "on" ) == 0 ) {
+	    reuseport = 1;
+	}
+    }
 }
 
     void
@@ -130,15 +235,13 @@ chld( int sig )
 main( int ac, char *av[] )
 {
     struct sigaction	sa, osahup, osachld;
-    struct sockaddr_in	sin;
     struct servent	*se;
     SNET		*pushersn = NULL;
     int			c, s, err = 0, fd;
-    socklen_t		sinlen;
     int			dontrun = 0, fds[ 2 ];
-    int			reuseaddr = 1, status;
+    int			lflags = 0, status;
     pid_t		pid;
-    char		*prog;
+    char		*prog, *snapshot = NULL;
     int                 facility = _COSIGN_LOG;
     int			level = LOG_INFO;
     int			fg = 0;
@@ -152,7 +255,7 @@ main( int ac, char *av[] )
     }
 
 
-#define	COSIGN_OPTS	"b:c:dD:F:fg:h:i:L:np:VXx:y:z:"
+#define	COSIGN_OPTS	"b:c:dD:F:fg:h:i:L:np:S:VXx:y:z:"
     while (( c = getopt( ac, av, COSIGN_OPTS )) != -1 ) {
 	switch ( c ) {
 	case 'c' :		/* config file */
@@ -229,6 +332,10 @@ main( int ac, char *av[] )
 	    cosign_port = htons( atoi( optarg ));
 	    break;
 
+	case 'S' :		/* dump or restore the store, and exit */
+	    snapshot = optarg;
+	    break;
+
 	case 'V' :		/* version */
 	    printf( "%s\n", cosign_version );
 	    exit( 0 );
@@ -260,11 +367,33 @@ main( int ac, char *av[] )
 	fprintf( stderr, "[ -F syslog-facility] " );
 	fprintf( stderr, "[ -g greywindowinsecs ] [ -h replication_host] " );
 	fprintf( stderr, "[ -i idletimeinsecs] [ -L syslog-level] " );
-	fprintf( stderr, "[ -p port ] [ -x ca dir ] " );
+	fprintf( stderr, "[ -p port ] [ -S dump | restore ] [ -x ca dir ] " );
 	fprintf( stderr, "[ -y cert file] [ -z private key file ]\n" );
 	exit( 1 );
     }
 
+    if ( snapshot != NULL ) {
+	if ( strcmp( snapshot, "dump" ) != 0 &&
+		strcmp( snapshot, "restore" ) != 0 ) {
+	    fprintf( stderr, "%s: -S %s: expected dump or restore\n",
+		    prog, snapshot );
+	    exit( 1 );
+	}
+	if ( chdir( cosign_dir ) < 0 ) {
+	    perror( cosign_dir );
+	    exit( 1 );
+	}
+	openlog( prog, LOG_PERROR, facility );
+	setlogmask( LOG_UPTO( level ));
+	if ( store_init( store_name ) != 0 ) {
+	    exit( 1 );
+	}
+	if ( *snapshot == 'd' ) {
+	    exit( snapshot_dump( 1 ) == 0 ? 0 : 1 );
+	}
+	exit( snapshot_restore( 0 ) == 0 ? 0 : 1 );
+    }
+
     SSL_load_error_strings();
     SSL_library_init();
 
@@ -279,6 +408,79 @@ main( int ac, char *av[] )
 	}
     }
 
+    if ( event_max > 0 ) {
+#ifndef HAVE_SYS_EPOLL_H
+	fprintf( stderr, "%s: %s: not supported on this system\n",
+		prog, COSIGNDEVENTSKEY );
+	exit( 1 );
+#endif /* HAVE_SYS_EPOLL_H */
+	/* event workers run in the pool, by default one per cpu */
+	if ( pool_max <= 0 ) {
+	    if (( pool_max = sysconf( _SC_NPROCESSORS_ONLN )) <= 0 ) {
+		pool_max = 1;
+	    }
+	}
+    }
+
+    if ( pool_max > 0 ) {
+	if ( pool_minspare < 1 ) {
+	    pool_minspare = 1;
+	}
+	if ( pool_minspare > pool_max ) {
+	    pool_minspare = pool_max;
+	}
+	if ( pool_maxspare < pool_minspare ) {
+	    pool_maxspare = pool_minspare;
+	}
+    }
+
+    /* activity held back mustn't matter to idle logouts */
+    if ( touch_interval < 0 ) {
+	touch_interval = 0;
+    }
+    if ( touch_interval > idle_out_time / 4 ||
+	    touch_interval > grey_time / 4 ) {
+	touch_interval = (( idle_out_time < grey_time ) ?
+		idle_out_time : grey_time ) / 4;
+	fprintf( stderr, "%s: %s: using %d\n",
+		prog, COSIGNDTOUCHKEY, touch_interval );
+    }
+
+    if ( sweep_interval < 0 || sweep_procs < 1 || sweep_iops < 0 ) {
+	fprintf( stderr, "%s: %s, %s and %s must be at least 0, 1 and 0\n",
+		prog, COSIGNDSWEEPKEY, COSIGNMONSTERPROCSKEY,
+		COSIGNMONSTERIOPSKEY );
+	exit( 1 );
+    }
+
+    /* without io_uring, cookies are read as they always were */
+    switch ( uring_config( fileio )) {
+    case 0 :
+	break;
+
+    case 1 :
+	fprintf( stderr, "%s: %s %s: not supported on this system\n",
+		prog, COSIGNDFILEIOKEY, fileio );
+	break;
+
+    default :
+	fprintf( stderr, "%s: %s %s: expected sync or uring\n",
+		prog, COSIGNDFILEIOKEY, fileio );
+	exit( 1 );
+    }
+
+    if ( reuseport ) {
+#ifndef SO_REUSEPORT
+	fprintf( stderr, "%s: %s: not supported on this system\n",
+		prog, COSIGNDREUSEPORTKEY );
+	exit( 1 );
+#endif /* SO_REUSEPORT */
+	/* only pool workers have listeners of their own */
+	if ( pool_max <= 0 ) {
+	    reuseport = 0;
+	}
+    }
+
     if ( dontrun ) {
 	exit( 0 );
     }
@@ -294,29 +496,15 @@ main( int ac, char *av[] )
     }
 
     /*
-     * Set up listener.
+     * Set up listener.  With reuseport the parent only holds the port,
+     * and each worker listens on a socket of its own.
      */
-    if (( s = socket( PF_INET, SOCK_STREAM, 0 )) < 0 ) {
-	perror( "socket" );
-	exit( 1 );
-    }
-    if ( reuseaddr ) {
-	if ( setsockopt( s, SOL_SOCKET, SO_REUSEADDR, (void*)&reuseaddr,
-		sizeof( int )) < 0 ) {
-	    perror("setsockopt");
-	}
+    if ( reuseport ) {
+	lflags = LISTENER_REUSEPORT | LISTENER_NOLISTEN;
     }
-
-    memset( &sin, 0, sizeof( struct sockaddr_in ));
-    sin.sin_family = AF_INET;
-    sin.sin_addr.s_addr = INADDR_ANY;
-    sin.sin_port = cosign_port;
-    if ( bind( s, (struct sockaddr *)&sin, sizeof( struct sockaddr_in )) < 0 ) {
-	perror( "bind" );
-	exit( 1 );
-    }
-    if ( listen( s, backlog ) < 0 ) {
-	perror( "listen" );
+    if (( s = listener_open( cosign_port, backlog, lflags )) < 0 ) {
+	fprintf( stderr, "%s: port %d: %s\n", prog, ntohs( cosign_port ),
+		strerror( errno ));
 	exit( 1 );
     }
 
@@ -378,7 +566,21 @@ main( int ac, char *av[] )
 
     syslog( LOG_INFO, "restart %s", cosign_version );
 
+    /* before the pusher is forked, so it can count replication too */
+    if ( stats_init() != 0 ) {
+	exit( 1 );
+    }
+
+    /* workers and the pusher inherit the store */
+    if ( store_init( store_name ) != 0 ) {
+	exit( 1 );
+    }
+    if ( commit_init( durability ) != 0 ) {
+	exit( 1 );
+    }
+
 	if ( replhost != NULL ) {
+    journal_enable();
     if ( pipe( fds ) < 0 ) {
 	syslog( LOG_ERR, "pusher pipe: %m" );
 	exit( 1 );
@@ -410,6 +612,42 @@ main( int ac, char *av[] )
     }
 	}
 
+    /*
+     * with cosigndsweep, we expire cookies and send replicas their
+     * activity ourselves, in place of monster, on the store we have.
+     */
+    if ( sweep_interval > 0 ) {
+	interval = sweep_interval;
+	idle_cache = grey_time + idle_out_time + loggedout_cache;
+
+	switch ( sweeperpid = fork()) {
+	case 0 :
+	    (void)close( s );
+	    exit( sweeper( pushersn ) < 0 ? 1 : 0 );
+
+	case -1 :
+	    syslog( LOG_ERR, "sweeper fork: %m" );
+	    exit( 1 );
+
+	default :
+	    syslog( LOG_INFO, "sweeper: a pass every %d seconds",
+		    sweep_interval );
+	    break;
+	}
+    }
+
+
+    if ( pool_max > 0 ) {
+	if ( pool_init( s ) != 0 ) {
+	    exit( 1 );
+	}
+	syslog( LOG_INFO, "prefork: %d workers, %d-%d spare, %d requests%s",
+		pool_max, pool_minspare, pool_maxspare, pool_maxrequests,
+		reuseport ? ", reuseport" : "" );
+	if ( event_max > 0 ) {
+	    syslog( LOG_INFO, "events: %d connections per worker", event_max );
+	}
+    }
 
     /* catch SIGHUP */
     memset( &sa, 0, sizeof( struct sigaction ));
@@ -444,6 +682,8 @@ syslog( LOG_DEBUG, "reload cosign_config %s", cosign_version );
 	    /* XXX need to reprocess command line args here */
 
 syslog( LOG_DEBUG, "reload cosign_ssl %s", cosign_version );
+	    /* new ticket keys, clients will negotiate new sessions */
+	    stats_log();
 	    if ( cosign_ssl( cryptofile, certfile, cadir, &ctx ) != 0 ) {
 		syslog( LOG_ERR, "%s: ssl re-config failed, continuing with"
 			" old ssl config", cosign_conf );
@@ -456,6 +696,9 @@ syslog( LOG_DEBUG, "reload kill %s", cosign_version );
 		    exit( 1 );
 	        }
 	    }
+	    if ( pool_max > 0 ) {
+		pool_reload();
+	    }
 	    syslog( LOG_INFO, "reload %s", cosign_version );
 	}
 
@@ -477,6 +720,13 @@ syslog( LOG_DEBUG, "reload kill %s", cosign_version );
 		    syslog( LOG_CRIT, "pusherpid %d died!", pusherpid );
 		    exit( 1 );
 		}
+		if ( pid == sweeperpid ) {
+		    syslog( LOG_CRIT, "sweeperpid %d died!", sweeperpid );
+		    exit( 1 );
+		}
+		if ( pool_max > 0 ) {
+		    (void)pool_reap( pid );
+		}
 	    }
 
 	    if ( pid < 0 && errno != ECHILD ) {
@@ -485,8 +735,20 @@ syslog( LOG_DEBUG, "reload kill %s", cosign_version );
 	    }
 	}
 
-	sinlen = sizeof( struct sockaddr_in );
-	if (( fd = accept( s, (struct sockaddr *)&cosign_sin, &sinlen )) < 0 ) {
+	/*
+	 * pre-forked workers accept for themselves.  the parent only
+	 * keeps the pool topped up, waking at least once a second or
+	 * whenever a signal arrives.
+	 */
+	if ( pool_max > 0 ) {
+	    (void)pool_maintain( s, pushersn );
+	    if ( reconfig == 0 && child_signal == 0 ) {
+		sleep( 1 );
+	    }
+	    continue;
+	}
+
+	if (( fd = listener_accept( s, &cosign_sin, 0 )) < 0 ) {
 	    if ( errno != EINTR ) {
 		syslog( LOG_ERR, "accept: %m" );
 	    }
@@ -496,7 +758,7 @@ syslog( LOG_DEBUG, "reload kill %s", cosign_version );
 	/* start child */
 	switch ( c = fork()) {
 	case 0 :
-	    syslog( LOG_INFO, "connect: %s", inet_ntoa( cosign_sin.sin_addr ));
+	    syslog( LOG_INFO, "connect: %s", listener_ntop( &cosign_sin ));
 
 	    (void)close( s );
 
@@ -0,0 +1,359 @@
+/*
+ * Copyright (c) 2004 Regents of The University of Michigan.
+ * All Rights Reserved.  See LICENSE.
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif /* HAVE_SYS_EPOLL_H */
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <openssl/ssl.h>
+#include <snet.h>
+
+#include "conf.h"
+#include "rate.h"
+#include "command.h"
+#include "pool.h"
+#include "event.h"
+#include "listener.h"
+#include "touch.h"
+#include "mkcookie.h"
+#include "store.h"
+#include "uring.h"
+
+extern int			event_max;
+extern int			pool_maxrequests;
+extern int			reuseport;
+extern struct timeval		cosign_net_timeout;
+extern struct sockaddr_storage	cosign_sin;
+
+#define EVENT_BATCH	64
+
+#ifdef HAVE_SYS_EPOLL_H
+static int	event_watch( int, int, struct connstate *, int );
+static void	event_hangup( int, struct connstate **, struct connstate *,
+			int * );
+static void	event_accept( int, int, struct connstate **, int *,
+			struct worker *, int );
+static int	event_cookies( struct connstate *, char (*)[ MAXCOOKIELEN ],
+			int );
+static void	event_prefetch( struct epoll_event *, int );
+
+    static int
+event_watch( int epfd, int op, struct connstate *cs, int fd )
+{
+    struct epoll_event		ev;
+
+    memset( &ev, 0, sizeof( struct epoll_event ));
+    ev.events = EPOLLIN;
+    if ( cs != NULL && ( cs->cs_flag & CS_WANTWRITE )) {
+	ev.events = EPOLLOUT;
+    }
+    ev.data.ptr = cs;
+
+    if ( epoll_ctl( epfd, op, fd, &ev ) < 0 ) {
+	syslog( LOG_ERR, "event_watch: epoll_ctl: %m" );
+	return( -1 );
+    }
+    return( 0 );
+}
+
+    static void
+event_hangup( int epfd, struct connstate **head, struct connstate *cs,
+	int *nconn )
+{
+    (void)epoll_ctl( epfd, EPOLL_CTL_DEL, snet_fd( cs->cs_sn ), NULL );
+
+    if ( cs->cs_prev != NULL ) {
+	cs->cs_prev->cs_next = cs->cs_next;
+    } else {
+	*head = cs->cs_next;
+    }
+    if ( cs->cs_next != NULL ) {
+	cs->cs_next->cs_prev = cs->cs_prev;
+    }
+    (*nconn)--;
+
+    (void)conn_close( cs );
+}
+
+/* takes new clients from s, until there are max or no more are queued */
+    static void
+event_accept( int epfd, int s, struct connstate **head, int *nconn,
+	struct worker *w, int max )
+{
+    struct connstate		*cs;
+    int				fd;
+
+    while ( *nconn < max ) {
+	if (( fd = listener_accept( s, &cosign_sin,
+		LISTENER_NONBLOCK )) < 0 ) {
+	    if ( errno == EINTR || errno == ECONNABORTED ) {
+		continue;
+	    }
+	    if ( errno != EAGAIN && errno != EWOULDBLOCK ) {
+		syslog( LOG_ERR, "event_worker: accept: %m" );
+	    }
+	    break;
+	}
+	w->w_requests++;
+	syslog( LOG_INFO, "connect: %s", listener_ntop( &cosign_sin ));
+
+	if (( cs = conn_open( fd, 1 )) == NULL ) {
+	    continue;
+	}
+	cs->cs_activity = time( NULL );
+	if ( event_watch( epfd, EPOLL_CTL_ADD, cs, fd ) < 0 ) {
+	    (void)conn_close( cs );
+	    continue;
+	}
+	if (( cs->cs_next = *head ) != NULL ) {
+	    (*head)->cs_prev = cs;
+	}
+	*head = cs;
+	(*nconn)++;
+    }
+}
+
+/*
+ * reads what cs has sent, and adds the cookies of the whole CHECK and
+ * MCHECK lines in it to names, as many as max.  lines are only looked
+ * at, and left for conn_process().  anything but a CHECK or MCHECK may
+ * change how what follows is read, so the looking stops there.
+ */
+    static int
+event_cookies( struct connstate *cs, char (*names)[ MAXCOOKIELEN ], int max )
+{
+    SNET			*sn = cs->cs_sn;
+    char			line[ MAXCOOKIELEN + 16 ], *p, *eol;
+    size_t			len;
+    int				n = 0, mcheck = 0;
+
+    if (( cs->cs_state != CS_COMMAND && cs->cs_state != CS_MCHECK ) ||
+	    ( cs->cs_flag & CS_WANTWRITE )) {
+	return( 0 );
+    }
+    if ( cs->cs_state == CS_MCHECK ) {
+	mcheck = cs->cs_total;
+    }
+    (void)snet_fill( sn );
+
+    for ( p = sn->sn_rcur; n < max; p = eol + 1 ) {
+	if (( eol = memchr( p, '\n', sn->sn_rend - p )) == NULL ) {
+	    break;
+	}
+	if (( len = eol - p ) > 0 && p[ len - 1 ] == '\r' ) {
+	    len--;
+	}
+	if ( len >= sizeof( line )) {
+	    break;
+	}
+	memcpy( line, p, len );
+	line[ len ] = '\0';
+
+	if ( len == 0 ) {
+	    continue;
+	} else if ( mcheck > 0 ) {
+	    mcheck--;
+	    p = line;
+	} else if ( strncasecmp( line, "CHECK ", 6 ) == 0 ) {
+	    p = line + 6;
+	} else if ( strncasecmp( line, "MCHECK ", 7 ) == 0 ) {
+	    mcheck = atoi( line + 7 );
+	    continue;
+	} else {
+	    break;
+	}
+	if ( strlen( p ) < MAXCOOKIELEN && store_valid( p ) == 0 ) {
+	    strcpy( names[ n++ ], p );
+	}
+    }
+    return( n );
+}
+
+/*
+ * gathers the cookies about to be checked on every connection with
+ * input, so the store can ready them all at once before the first
+ * command is run.
+ */
+    static void
+event_prefetch( struct epoll_event *events, int nevents )
+{
+    static char			names[ EVENT_BATCH ][ MAXCOOKIELEN ];
+    char			*list[ EVENT_BATCH ];
+    struct connstate		*cs;
+    int				i, n = 0;
+
+    if ( store->so_prefetch == NULL || !uring_ready()) {
+	return;
+    }
+    for ( i = 0; i < nevents && n < EVENT_BATCH; i++ ) {
+	if (( cs = (struct connstate *)events[ i ].data.ptr ) == NULL ||
+		( events[ i ].events & EPOLLIN ) == 0 ) {
+	    continue;
+	}
+	n += event_cookies( cs, names + n, EVENT_BATCH - n );
+    }
+    /* a lone lookup gains nothing from going first */
+    if ( n > 1 ) {
+	for ( i = 0; i < n; i++ ) {
+	    list[ i ] = names[ i ];
+	}
+	(void)(*store->so_prefetch)( list, n );
+    }
+}
+#endif /* HAVE_SYS_EPOLL_H */
+
+/*
+ * an event worker holds up to event_max client connections at once.
+ * sockets are non-blocking, and each connection is handed whatever
+ * input has arrived; its connstate remembers where it is in between.
+ * replies a client hasn't room for wait in its queue, and it isn't
+ * read from again until they've gone.  when told to exit, the worker
+ * stops accepting, hangs up on clients between commands once they
+ * have their replies, and lets any command in progress finish.  a
+ * client that hasn't had a command answered yet is served until it
+ * has.  the queue of a reuseport listener it's the last to hold is
+ * taken first.
+ */
+    void
+event_worker( int s, SNET *pushersn, struct worker *w, int *retire,
+	sigset_t *waitmask )
+{
+#ifdef HAVE_SYS_EPOLL_H
+    struct epoll_event		events[ EVENT_BATCH ];
+    struct connstate		*cs, *next, *head = NULL;
+    time_t			now, swept = 0;
+    int				epfd, i, n, flag;
+    int				nconn = 0, listening = 0, draining = 0;
+
+    if (( epfd = epoll_create( EVENT_BATCH )) < 0 ) {
+	syslog( LOG_ERR, "event_worker: epoll_create: %m" );
+	exit( 1 );
+    }
+
+    for (;;) {
+	if ( *retire || pool_orphaned() || ( pool_maxrequests > 0 &&
+		w->w_requests >= pool_maxrequests )) {
+	    draining = 1;
+	}
+
+	/* only listen while there's room for another client */
+	if ( !draining && nconn < event_max ) {
+	    if ( !listening ) {
+		if ( event_watch( epfd, EPOLL_CTL_ADD, NULL, s ) < 0 ) {
+		    exit( 1 );
+		}
+		listening = 1;
+	    }
+	    if ( w->w_state != W_RETIRING ) {
+		w->w_state = W_IDLE;
+	    }
+	} else {
+	    if ( listening ) {
+		(void)epoll_ctl( epfd, EPOLL_CTL_DEL, s, NULL );
+		listening = 0;
+	    }
+	    /*
+	     * once the parent has given up our reuseport listener, leave
+	     * the group so no more connections queue here.  closing it
+	     * resets any that already have, so they're taken first.
+	     */
+	    if ( draining && reuseport && w->w_closed && s >= 0 ) {
+		event_accept( epfd, s, &head, &nconn, w, INT_MAX );
+		(void)close( s );
+		s = -1;
+	    }
+	    if ( draining ) {
+		w->w_state = W_RETIRING;
+	    } else if ( w->w_state != W_RETIRING ) {
+		w->w_state = W_BUSY;
+	    }
+	}
+
+	if ( draining ) {
+	    for ( cs = head; cs != NULL; cs = next ) {
+		next = cs->cs_next;
+		if ( cs->cs_state == CS_COMMAND &&
+			( cs->cs_flag & CS_NEW ) == 0 &&
+			!snet_hasdata( cs->cs_sn ) &&
+			snet_wpending( cs->cs_sn ) == 0 ) {
+		    event_hangup( epfd, &head, cs, &nconn );
+		}
+	    }
+	    if ( nconn == 0 ) {
+		break;
+	    }
+	}
+
+	if (( n = epoll_pwait( epfd, events, EVENT_BATCH, 1000,
+		waitmask )) < 0 ) {
+	    if ( errno != EINTR ) {
+		syslog( LOG_ERR, "event_worker: epoll_wait: %m" );
+		exit( 1 );
+	    }
+	    continue;
+	}
+	now = time( NULL );
+	event_prefetch( events, n );
+
+	for ( i = 0; i < n; i++ ) {
+	    if (( cs = (struct connstate *)events[ i ].data.ptr ) == NULL ) {
+		if ( listening ) {
+		    event_accept( epfd, s, &head, &nconn, w, event_max );
+		}
+		continue;
+	    }
+
+	    cs->cs_activity = now;
+	    flag = cs->cs_flag & CS_WANTWRITE;
+	    if ( conn_process( cs, pushersn, 0 ) != 0 ) {
+		event_hangup( epfd, &head, cs, &nconn );
+		continue;
+	    }
+	    if (( cs->cs_flag & CS_WANTWRITE ) != flag ) {
+		if ( event_watch( epfd, EPOLL_CTL_MOD, cs,
+			snet_fd( cs->cs_sn )) < 0 ) {
+		    event_hangup( epfd, &head, cs, &nconn );
+		}
+	    }
+	}
+
+	/* hang up on clients that have been quiet too long */
+	if ( now != swept ) {
+	    swept = now;
+	    touch_flush( now, 0 );
+	    for ( cs = head; cs != NULL; cs = next ) {
+		next = cs->cs_next;
+		if ( now - cs->cs_activity >= cosign_net_timeout.tv_sec ) {
+		    event_hangup( epfd, &head, cs, &nconn );
+		}
+	    }
+	}
+    }
+
+    (void)close( epfd );
+    touch_flush( time( NULL ), 1 );
+    exit( 0 );
+#else /* HAVE_SYS_EPOLL_H */
+    syslog( LOG_ERR, "event_worker: not supported on this system" );
+    exit( 1 );
+#endif /* HAVE_SYS_EPOLL_H */
+}
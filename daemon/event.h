@@ -0,0 +1,6 @@
+/*
+ * Copyright (c) 2004 Regents of The University of Michigan.
+ * All Rights Reserved.  See COPYRIGHT.
+ */
+
+void	event_worker( int, SNET *, struct worker *, int *, sigset_t * );
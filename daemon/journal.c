@@ -0,0 +1,322 @@
+/*
+ * Copyright (c) 2004 Regents of The University of Michigan.
+ * All Rights Reserved.  See LICENSE.
+ */
+
+/*
+ * the change journal: when replicating, cosignd appends the name of
+ * each login cookie it logs in, logs out or marks active to
+ * journal/log in cosigndb, and monster sends each replica TIME for
+ * just the cookies named since the last pass it acknowledged, rather
+ * than reading through the store for them.
+ *
+ * monster alone reads the journal, and rotates it: journal/log is
+ * renamed to journal/N, N counting up, once it's JOURNAL_SEGMENT long,
+ * so the live log is always segment N + 1.  a place in the journal is
+ * a segment and an offset.  each replica's is kept in journal/peer.IP,
+ * so that monster picks up where it left off after a reconnect or a
+ * restart, and segments are removed once every replica is past them.
+ *
+ * an append made by a cosignd that opened journal/log just before it
+ * was renamed lands at the end of the renamed segment, so no one is
+ * moved past a segment in the pass that rotated it.
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "atomfile.h"
+#include "journal.h"
+
+#define JOURNAL_LIVE	JOURNAL_DIR "/log"
+
+static int	journal_on = 0;
+static long	journal_first = 1;	/* the oldest segment there may be */
+static long	journal_next = 1;	/* the live log's segment */
+static long	journal_fresh = -1;	/* the one rotated this pass */
+
+static int	journal_path( long, char *, int );
+
+/* cosignd notes changes only when replicating */
+    void
+journal_enable( void )
+{
+    journal_on = 1;
+}
+
+    static int
+journal_path( long seg, char *path, int len )
+{
+    if ( seg == journal_next ) {
+	return( snprintf( path, len, "%s", JOURNAL_LIVE ) >= len ? -1 : 0 );
+    }
+    return( snprintf( path, len, "%s/%ld", JOURNAL_DIR, seg ) >= len ?
+	    -1 : 0 );
+}
+
+/* login's activity or state has changed */
+    int
+journal_note( char *login )
+{
+    char		line[ MAXPATHLEN ];
+    int			fd, len, rc = 0;
+
+    if ( !journal_on ) {
+	return( 0 );
+    }
+    if (( len = snprintf( line, sizeof( line ), "%s\n", login ))
+	    >= (int)sizeof( line )) {
+	return( -1 );
+    }
+
+    if (( fd = open( JOURNAL_LIVE, O_WRONLY | O_APPEND | O_CREAT,
+	    0600 )) < 0 ) {
+	if ( errno != ENOENT || ( mkdir( JOURNAL_DIR, 0700 ) < 0 &&
+		errno != EEXIST ) || ( fd = open( JOURNAL_LIVE,
+		O_WRONLY | O_APPEND | O_CREAT, 0600 )) < 0 ) {
+	    syslog( LOG_ERR, "journal_note: %s: %m", JOURNAL_LIVE );
+	    return( -1 );
+	}
+    }
+    if ( write( fd, line, len ) != len ) {
+	syslog( LOG_ERR, "journal_note: write %s: %m", JOURNAL_LIVE );
+	rc = -1;
+    }
+    (void)close( fd );
+    return( rc );
+}
+
+/* monster finds the segments there are */
+    int
+journal_open( void )
+{
+    DIR			*dirp;
+    struct dirent	*de;
+    long		seg;
+    char		*end;
+
+    journal_first = LONG_MAX;
+    journal_next = 1;
+    if (( dirp = opendir( JOURNAL_DIR )) == NULL ) {
+	journal_first = 1;
+	if ( errno == ENOENT ) {
+	    return( 0 );
+	}
+	syslog( LOG_ERR, "journal_open: %s: %m", JOURNAL_DIR );
+	return( -1 );
+    }
+    while (( de = readdir( dirp )) != NULL ) {
+	seg = strtol( de->d_name, &end, 10 );
+	if ( *de->d_name == '\0' || *end != '\0' || seg < 1 ) {
+	    continue;
+	}
+	if ( seg < journal_first ) {
+	    journal_first = seg;
+	}
+	if ( seg >= journal_next ) {
+	    journal_next = seg + 1;
+	}
+    }
+    if ( journal_first == LONG_MAX ) {
+	journal_first = journal_next;
+    }
+    (void)closedir( dirp );
+    return( 0 );
+}
+
+/*
+ * where the journal ends, as a pass begins, rotating the live log
+ * first if it's long enough.
+ */
+    int
+journal_mark( struct jpos *mark )
+{
+    struct stat		st;
+    char		path[ MAXPATHLEN ];
+
+    journal_fresh = -1;
+    if ( stat( JOURNAL_LIVE, &st ) < 0 ) {
+	if ( errno != ENOENT ) {
+	    syslog( LOG_ERR, "journal_mark: %s: %m", JOURNAL_LIVE );
+	    return( -1 );
+	}
+	st.st_size = 0;
+    }
+
+    if ( st.st_size >= JOURNAL_SEGMENT ) {
+	snprintf( path, sizeof( path ), "%s/%ld", JOURNAL_DIR, journal_next );
+	if ( rename( JOURNAL_LIVE, path ) < 0 ) {
+	    syslog( LOG_ERR, "journal_mark: rename %s: %m", JOURNAL_LIVE );
+	    return( -1 );
+	}
+	journal_fresh = journal_next++;
+	st.st_size = 0;
+    }
+
+    mark->jp_seg = journal_next;
+    mark->jp_off = st.st_size;
+    return( 0 );
+}
+
+/*
+ * calls fn with each cookie named from pos up to mark, moving pos
+ * along.  returns -1 if pos can't be read from, as when the segment
+ * it names is gone, and the cookies since can't be known.
+ */
+    int
+journal_read( struct jpos *pos, struct jpos *mark,
+	int (*fn)( char *, void * ), void *arg )
+{
+    struct stat		st;
+    char		path[ MAXPATHLEN ], *buf, *line, *nl;
+    off_t		end;
+    ssize_t		len;
+    int			fd, rc = 0;
+
+    if ( pos->jp_seg < journal_first || pos->jp_seg > mark->jp_seg ) {
+	return( -1 );
+    }
+
+    for (;;) {
+	if ( journal_path( pos->jp_seg, path, sizeof( path )) < 0 ) {
+	    return( -1 );
+	}
+	if (( fd = open( path, O_RDONLY, 0 )) < 0 ) {
+	    if ( errno == ENOENT && pos->jp_seg == mark->jp_seg &&
+		    pos->jp_off == 0 ) {
+		/* nothing's been noted since the last rotation */
+		return( 0 );
+	    }
+	    syslog( LOG_ERR, "journal_read: %s: %m", path );
+	    return( -1 );
+	}
+	if ( fstat( fd, &st ) < 0 ) {
+	    syslog( LOG_ERR, "journal_read: fstat %s: %m", path );
+	    (void)close( fd );
+	    return( -1 );
+	}
+	end = ( pos->jp_seg == mark->jp_seg ) ? mark->jp_off : st.st_size;
+	if ( pos->jp_off > end ) {
+	    (void)close( fd );
+	    return( -1 );
+	}
+
+	if ( end > pos->jp_off ) {
+	    if (( buf = malloc( end - pos->jp_off + 1 )) == NULL ) {
+		syslog( LOG_ERR, "journal_read: malloc: %m" );
+		(void)close( fd );
+		return( -1 );
+	    }
+	    if (( len = pread( fd, buf, end - pos->jp_off,
+		    pos->jp_off )) < 0 ) {
+		syslog( LOG_ERR, "journal_read: pread %s: %m", path );
+		free( buf );
+		(void)close( fd );
+		return( -1 );
+	    }
+	    buf[ len ] = '\0';
+
+	    /* pos only moves past whole lines */
+	    for ( line = buf; ( nl = strchr( line, '\n' )) != NULL;
+		    line = nl + 1 ) {
+		*nl = '\0';
+		if ( *line != '\0' && ( rc = (*fn)( line, arg )) < 0 ) {
+		    break;
+		}
+		pos->jp_off += nl + 1 - line;
+	    }
+	    free( buf );
+	}
+	(void)close( fd );
+
+	if ( rc < 0 || pos->jp_seg == mark->jp_seg ||
+		pos->jp_seg == journal_fresh ) {
+	    return( rc < 0 ? rc : 0 );
+	}
+	pos->jp_seg++;
+	pos->jp_off = 0;
+    }
+}
+
+/* removes the segments before oldest, which everyone has read */
+    void
+journal_trim( struct jpos *oldest )
+{
+    char		path[ MAXPATHLEN ];
+
+    for ( ; journal_first < oldest->jp_seg &&
+	    journal_first < journal_next; journal_first++ ) {
+	snprintf( path, sizeof( path ), "%s/%ld", JOURNAL_DIR, journal_first );
+	if ( unlink( path ) < 0 && errno != ENOENT ) {
+	    syslog( LOG_ERR, "journal_trim: %s: %m", path );
+	    return;
+	}
+    }
+}
+
+/* a replica's place, as last saved.  returns -1 if there's none */
+    int
+journal_load( char *peer, struct jpos *pos )
+{
+    FILE		*f;
+    char		path[ MAXPATHLEN ];
+    long long		off;
+    int			rc = -1;
+
+    pos->jp_seg = -1;
+    snprintf( path, sizeof( path ), "%s/peer.%s", JOURNAL_DIR, peer );
+    if (( f = fopen( path, "r" )) == NULL ) {
+	return( -1 );
+    }
+    if ( fscanf( f, "%ld %lld", &pos->jp_seg, &off ) == 2 &&
+	    pos->jp_seg >= journal_first && pos->jp_seg <= journal_next ) {
+	pos->jp_off = (off_t)off;
+	rc = 0;
+    } else {
+	pos->jp_seg = -1;
+    }
+    (void)fclose( f );
+    return( rc );
+}
+
+    int
+journal_save( char *peer, struct jpos *pos )
+{
+    struct atomfile	af;
+    char		path[ MAXPATHLEN ], line[ 64 ];
+    int			len;
+
+    snprintf( path, sizeof( path ), "%s/peer.%s", JOURNAL_DIR, peer );
+    len = snprintf( line, sizeof( line ), "%ld %lld\n",
+	    pos->jp_seg, (long long)pos->jp_off );
+
+    if ( atomfile_open( &af, JOURNAL_DIR, 0600, ATOMFILE_REPLACE ) < 0 ) {
+	if ( errno != ENOENT || mkdir( JOURNAL_DIR, 0700 ) < 0 ||
+		atomfile_open( &af, JOURNAL_DIR, 0600,
+		ATOMFILE_REPLACE ) < 0 ) {
+	    syslog( LOG_ERR, "journal_save: %s: %m", path );
+	    return( -1 );
+	}
+    }
+    if ( write( af.af_fd, line, len ) != len ||
+	    atomfile_link( &af, path, ATOMFILE_REPLACE ) < 0 ) {
+	syslog( LOG_ERR, "journal_save: %s: %m", path );
+	(void)atomfile_abort( &af );
+	(void)close( af.af_fd );
+	return( -1 );
+    }
+    (void)close( af.af_fd );
+    return( 0 );
+}
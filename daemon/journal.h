@@ -0,0 +1,23 @@
+/*
+ * Copyright (c) 2004 Regents of The University of Michigan.
+ * All Rights Reserved.  See LICENSE.
+ */
+
+#define JOURNAL_DIR	"journal"
+#define JOURNAL_SEGMENT	( 8 * 1024 * 1024 )	/* bytes before rotating */
+
+/* a place in the journal: a segment, and an offset in it */
+struct jpos {
+    long	jp_seg;		/* -1 if unknown */
+    off_t	jp_off;
+};
+
+void	journal_enable( void );
+int	journal_note( char * );
+int	journal_open( void );
+int	journal_mark( struct jpos * );
+int	journal_read( struct jpos *, struct jpos *,
+		int (*)( char *, void * ), void * );
+void	journal_trim( struct jpos * );
+int	journal_load( char *, struct jpos * );
+int	journal_save( char *, struct jpos * );
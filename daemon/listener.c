@@ -0,0 +1,207 @@
+/*
+ * Copyright (c) 2004 Regents of The University of Michigan.
+ * All Rights Reserved.  See LICENSE.
+ */
+
+#include "config.h"
+
+#ifdef HAVE_ACCEPT4
+/* accept4() is a GNU extension in glibc */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif /* _GNU_SOURCE */
+#endif /* HAVE_ACCEPT4 */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "listener.h"
+
+static int	listener_flags( int, int );
+
+    static int
+listener_flags( int fd, int flags )
+{
+    int		fl;
+
+    if ( fcntl( fd, F_SETFD, FD_CLOEXEC ) < 0 ) {
+	return( -1 );
+    }
+    if (( fl = fcntl( fd, F_GETFL )) < 0 ) {
+	return( -1 );
+    }
+    if ( flags & LISTENER_NONBLOCK ) {
+	fl |= O_NONBLOCK;
+    } else {
+	fl &= ~O_NONBLOCK;
+    }
+    if ( fcntl( fd, F_SETFL, fl ) < 0 ) {
+	return( -1 );
+    }
+    return( 0 );
+}
+
+/*
+ * opens a TCP listener on port (network byte order) on every local
+ * address.  an IPv6 socket accepting IPv4-mapped connections is tried
+ * first, falling back to plain IPv4 where there's no IPv6.  with
+ * LISTENER_REUSEPORT, several sockets may be bound to the same port and
+ * the kernel spreads new connections across them; LISTENER_NOLISTEN
+ * only binds, holding the port without taking connections.  returns
+ * the socket, or -1 with errno set.
+ */
+    int
+listener_open( unsigned short port, int backlog, int flags )
+{
+    struct sockaddr_in	sin;
+    struct sockaddr_in6	sin6;
+    int			s, on = 1, off = 0, err;
+    int			family = AF_INET6;
+
+    if (( s = socket( PF_INET6, SOCK_STREAM, 0 )) >= 0 ) {
+	if ( setsockopt( s, IPPROTO_IPV6, IPV6_V6ONLY, (void *)&off,
+		sizeof( int )) < 0 ) {
+	    /* no dual-stack, better to take IPv4 only than IPv6 only */
+	    (void)close( s );
+	    s = -1;
+	}
+    }
+
+    if ( s < 0 ) {
+	if (( s = socket( PF_INET, SOCK_STREAM, 0 )) < 0 ) {
+	    return( -1 );
+	}
+	family = AF_INET;
+	memset( &sin, 0, sizeof( struct sockaddr_in ));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = INADDR_ANY;
+	sin.sin_port = port;
+    } else {
+	memset( &sin6, 0, sizeof( struct sockaddr_in6 ));
+	sin6.sin6_family = AF_INET6;
+	sin6.sin6_addr = in6addr_any;
+	sin6.sin6_port = port;
+    }
+
+    if ( setsockopt( s, SOL_SOCKET, SO_REUSEADDR, (void *)&on,
+	    sizeof( int )) < 0 ) {
+	goto error;
+    }
+    if ( flags & LISTENER_REUSEPORT ) {
+#ifdef SO_REUSEPORT
+	if ( setsockopt( s, SOL_SOCKET, SO_REUSEPORT, (void *)&on,
+		sizeof( int )) < 0 ) {
+	    goto error;
+	}
+#else /* SO_REUSEPORT */
+	errno = ENOPROTOOPT;
+	goto error;
+#endif /* SO_REUSEPORT */
+    }
+
+    if ( listener_flags( s, flags ) < 0 ) {
+	goto error;
+    }
+
+    if ( family == AF_INET6 ) {
+	if ( bind( s, (struct sockaddr *)&sin6,
+		sizeof( struct sockaddr_in6 )) < 0 ) {
+	    goto error;
+	}
+    } else {
+	if ( bind( s, (struct sockaddr *)&sin,
+		sizeof( struct sockaddr_in )) < 0 ) {
+	    goto error;
+	}
+    }
+
+    if (( flags & LISTENER_NOLISTEN ) == 0 ) {
+	if ( listen( s, backlog ) < 0 ) {
+	    goto error;
+	}
+    }
+
+    return( s );
+
+error:
+    err = errno;
+    (void)close( s );
+    errno = err;
+    return( -1 );
+}
+
+/*
+ * accepts a connection on s, close-on-exec and blocking unless
+ * LISTENER_NONBLOCK is given.  with accept4() this takes a single
+ * system call, and doesn't depend on whether the system passes the
+ * listener's O_NONBLOCK on to the new socket.
+ */
+    int
+listener_accept( int s, struct sockaddr_storage *sa, int flags )
+{
+    socklen_t		salen;
+    int			fd, err;
+
+    salen = sizeof( struct sockaddr_storage );
+#ifdef HAVE_ACCEPT4
+    if (( fd = accept4( s, (struct sockaddr *)sa, &salen, SOCK_CLOEXEC |
+	    (( flags & LISTENER_NONBLOCK ) ? SOCK_NONBLOCK : 0 ))) >= 0 ) {
+	return( fd );
+    }
+    if ( errno != ENOSYS ) {
+	return( -1 );
+    }
+    salen = sizeof( struct sockaddr_storage );
+#endif /* HAVE_ACCEPT4 */
+
+    if (( fd = accept( s, (struct sockaddr *)sa, &salen )) < 0 ) {
+	return( -1 );
+    }
+    if ( listener_flags( fd, flags ) < 0 ) {
+	err = errno;
+	(void)close( fd );
+	errno = err;
+	return( -1 );
+    }
+    return( fd );
+}
+
+/*
+ * like inet_ntoa(), returns a static buffer.  IPv4 clients of a
+ * dual-stack listener are shown as plain IPv4 addresses.
+ */
+    char *
+listener_ntop( struct sockaddr_storage *sa )
+{
+    static char		buf[ INET6_ADDRSTRLEN ];
+    struct sockaddr_in6	*sin6;
+    struct in_addr	in;
+
+    switch ( sa->ss_family ) {
+    case AF_INET :
+	return( inet_ntoa( ((struct sockaddr_in *)sa)->sin_addr ));
+
+    case AF_INET6 :
+	sin6 = (struct sockaddr_in6 *)sa;
+	if ( IN6_IS_ADDR_V4MAPPED( &sin6->sin6_addr )) {
+	    memcpy( &in, &sin6->sin6_addr.s6_addr[ 12 ], sizeof( in ));
+	    return( inet_ntoa( in ));
+	}
+	if ( inet_ntop( AF_INET6, &sin6->sin6_addr, buf, sizeof( buf ))
+		!= NULL ) {
+	    return( buf );
+	}
+	break;
+
+    default :
+	break;
+    }
+
+    return( "unknown" );
+}
@@ -0,0 +1,12 @@
+/*
+ * Copyright (c) 2004 Regents of The University of Michigan.
+ * All Rights Reserved.  See COPYRIGHT.
+ */
+
+#define LISTENER_REUSEPORT	(1<<0)
+#define LISTENER_NONBLOCK	(1<<1)
+#define LISTENER_NOLISTEN	(1<<2)
+
+int	listener_open( unsigned short, int, int );
+int	listener_accept( int, struct sockaddr_storage *, int );
+char	*listener_ntop( struct sockaddr_storage * );
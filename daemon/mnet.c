@@ -27,6 +27,7 @@
 
 #include "argcargv.h"
 #include "rate.h"
+#include "journal.h"
 #include "monster.h"
 
 static void (*logger)( char * ) = NULL;
@@ -68,6 +69,8 @@ connect_sn( struct connlist *cl, SSL_CTX *ctx, char *host, int delay )
 	(void)close( s );
 	return( -1 );
     }
+    /* commands go out together, and are flushed when we read a reply */
+    snet_writebuffer( cl->cl_sn, 1 );
 
     tv = cosign_net_timeout;
     if (( line = snet_getline_multi( cl->cl_sn, logger, &tv )) == NULL ) {
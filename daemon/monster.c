@@ -11,6 +11,7 @@
 #include <sys/param.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <arpa/inet.h>
 #include <string.h>
 #include <unistd.h>
 #include <syslog.h>
@@ -18,7 +19,7 @@
 #include <stdio.h>
 #include <netdb.h>
 #include <fcntl.h>
-#include <dirent.h>
+#include <pthread.h>
 
 #include <openssl/err.h>
 #include <openssl/ssl.h>
@@ -28,27 +29,27 @@
 #include "mkcookie.h"
 #include "logname.h"
 #include "rate.h"
+#include "journal.h"
 #include "monster.h"
 #include "conf.h"
+#include "store.h"
+#include "uindex.h"
+#include "uring.h"
+#include "sweep.h"
 
-/* idle_cache = (grey+idle) from cosignd, plus loggedout_cache here */
-int		idle_cache = (60 * 30) +  (60 * 60 * 2) + (60 * 60 * 2);
-int		interval = 0;
-int		hard_timeout = 60 * 60 * 12;
-int		loggedout_cache = 60 * 60 * 2;
 int             debug = 0;
-int		login_gone;
 int		hashlen = 0;
+int		oldhashlen = -1;
+char		*fileio = NULL;
 extern char	*cosign_version;
 
-int		login_total, login_sent, service_total, service_gone;
-
 static void (*logger)( char * ) = NULL;
 
-static int eat_cookie( char *, struct timeval *, time_t *, int * );
-static void do_dir( char *, struct connlist *, struct timeval * );
-
 char    	*cosign_dir = _COSIGN_DIR;
+char		*store_name = NULL;
+char		*shm_name = "/cosignd";
+int		shm_nslots = 65536;
+int		log_segsize = 64;
 char		*cryptofile = _COSIGN_TLS_KEY;
 char		*certfile = _COSIGN_TLS_CERT;
 char		*cadir = _COSIGN_TLS_CADIR;
@@ -90,6 +91,38 @@ monster_configure()
     if (( val = cosign_config_get( COSIGNDBHASHLENKEY )) != NULL ) {
 	hashlen = atoi( val );
     }
+
+    if (( val = cosign_config_get( COSIGNDBREHASHKEY )) != NULL ) {
+	oldhashlen = atoi( val );
+    }
+
+    if (( val = cosign_config_get( COSIGNDSTOREKEY )) != NULL ) {
+	store_name = val;
+    }
+
+    if (( val = cosign_config_get( COSIGNDSHMKEY )) != NULL ) {
+	shm_name = val;
+    }
+
+    if (( val = cosign_config_get( COSIGNDSHMSLOTSKEY )) != NULL ) {
+	shm_nslots = atoi( val );
+    }
+
+    if (( val = cosign_config_get( COSIGNDLOGSEGMENTKEY )) != NULL ) {
+	log_segsize = atoi( val );
+    }
+
+    if (( val = cosign_config_get( COSIGNDFILEIOKEY )) != NULL ) {
+	fileio = val;
+    }
+
+    if (( val = cosign_config_get( COSIGNMONSTERPROCSKEY )) != NULL ) {
+	sweep_procs = atoi( val );
+    }
+
+    if (( val = cosign_config_get( COSIGNMONSTERIOPSKEY )) != NULL ) {
+	sweep_iops = atoi( val );
+    }
 }
 
 
@@ -100,16 +133,15 @@ main( int ac, char **av )
     struct hostent	*he;
     struct connlist	*head = NULL,*new = NULL, *temp, *yacur = NULL;
     struct connlist	**tail = NULL, **cur;
+    struct sweep	sw;
     char		hostname[ MAXHOSTNAMELEN ];
-    char		hashdir[ 3 ];
-    char		*sixtyfourchars = "abcdefghijklmnopqrstuvwxyz"
-    					"ABCDEFGHIJKLMNOPQRSTUVWXYZ"
-					"0123456789+-";
     char		*prog, *line;
-    int			c, i, err = 0;
+    int			c, i, err = 0, pass = 0;
+    time_t		slot = 0;
+    struct jpos		mark, pos;
+    int			jok = 0;
     char           	*cosign_host = NULL;
     char		*cosign_conf = _COSIGN_CONF;
-    char		*p, *q;
     int                 facility = _COSIGN_LOG, level = LOG_INFO;
     int			fg = 0;
     SSL_CTX		*m_ctx = NULL;
@@ -233,6 +265,18 @@ main( int ac, char **av )
 	exit( -1 );
     }
 
+    if ( uring_config( fileio ) < 0 ) {
+	fprintf( stderr, "%s: %s %s: expected sync or uring\n",
+		prog, COSIGNDFILEIOKEY, fileio );
+	exit( -1 );
+    }
+
+    if ( sweep_procs < 1 || sweep_iops < 0 ) {
+	fprintf( stderr, "%s: %s and %s must be at least 1 and 0\n",
+		prog, COSIGNMONSTERPROCSKEY, COSIGNMONSTERIOPSKEY );
+	exit( -1 );
+    }
+
     if ( cosign_host != NULL ) {
 	if ( gethostname( hostname, sizeof( hostname )) < 0 ) {
 	    perror( "gethostname" );
@@ -321,6 +365,21 @@ main( int ac, char **av )
 
     syslog( LOG_INFO, "restart %s", cosign_version );
 
+    if ( store_init( store_name ) != 0 ) {
+	exit( 1 );
+    }
+
+    /* where each replica was in the change journal */
+    if ( head != NULL ) {
+	if ( journal_open() < 0 ) {
+	    exit( 1 );
+	}
+	for ( yacur = head; yacur != NULL; yacur = yacur->cl_next ) {
+	    (void)journal_load( inet_ntoa( yacur->cl_sin.sin_addr ),
+		    &yacur->cl_jpos );
+	}
+    }
+
 	for (;;) {
 
     sleep( interval );
@@ -331,6 +390,9 @@ main( int ac, char **av )
 	exit( -1 );
     }
 
+    /* replicas are sent what's changed up to here */
+    jok = ( head != NULL && journal_mark( &mark ) == 0 );
+
     /*
      * Usually, we'd write this as a nice neat for loop.  In this case,
      * since we have the ugly combination of a traversal and a possible
@@ -408,46 +470,50 @@ next:
 	cur = &(*cur)->cl_next;
     }
 
-    switch ( hashlen ) {
-    case 0 :
-        if ( interval == 0 ) {
-            sleep(120);
-        }
-	do_dir( ".", head, &now );
-	break;
-    
-    case 1 :
-	for ( p = sixtyfourchars; *p != '\0'; p++ ) {
-            if ( interval == 0 ) {
-                sleep(2);
-            }
-	    hashdir[ 0 ] = *p;
-	    hashdir[ 1 ] = '\0';
-	    do_dir( hashdir, head, &now );
-	}
-	break;
-
-    case 2 :
-	for ( p = sixtyfourchars; *p != '\0'; p++ ) {
-            if ( interval == 0 ) {
-                sleep(2);
-            }
-	    for ( q = sixtyfourchars; *q != '\0'; q++ ) {
-		hashdir[ 0 ] = *p;
-		hashdir[ 1 ] = *q;
-		hashdir[ 2 ] = '\0';
-		do_dir( hashdir, head, &now );
-	    }
-	}
-	break;
+    memset( &sw, 0, sizeof( struct sweep ));
+    sw.sw_head = head;
+    sw.sw_now = &now;
+    sw.sw_full = ( pass++ % MONSTER_FULLPASS == 0 );
+    sw.sw_journal = jok;
 
-    default :
-	syslog( LOG_ERR, "Illegal hashlen %d", hashlen );
+    /*
+     * the store is read through on full passes, and when there's a
+     * replica whose place in the journal isn't known.
+     */
+    sw.sw_walk = sw.sw_full;
+    for ( yacur = head; yacur != NULL; yacur = yacur->cl_next ) {
+	if ( yacur->cl_sn != NULL && ( !jok || yacur->cl_jpos.jp_seg < 0 )) {
+	    sw.sw_walk = 1;
+	}
+    }
+    if ( sweep_pass( &sw, &slot ) < 0 ) {
 	exit( 1 );
     }
 
     for ( yacur = head; yacur != NULL; yacur = yacur->cl_next ) {
 	if ( yacur->cl_sn != NULL ) {
+	    /*
+	     * a replica with a place in the journal is sent what it
+	     * names since.  one without was sent everything newer than
+	     * its last pass by reading through the store, and is now
+	     * up to the mark.
+	     */
+	    pos = yacur->cl_jpos;
+	    if ( jok && pos.jp_seg >= 0 ) {
+		if ( sweep_journal( &sw, yacur, &pos, &mark ) < 0 ) {
+		    syslog( LOG_NOTICE, "monster: %s: journal lost, "
+			    "sending everything next pass",
+			    inet_ntoa( yacur->cl_sin.sin_addr ));
+		    yacur->cl_jpos.jp_seg = -1;
+		    yacur->cl_last_time = 0;
+		    pos.jp_seg = -1;
+		}
+	    } else if ( jok && sw.sw_walk ) {
+		pos = mark;
+	    }
+	    if ( yacur->cl_sn == NULL ) {
+		continue;
+	    }
 	    snet_writef( yacur->cl_sn, ".\r\n" );
 	    if (( line = snet_getline_multi( yacur->cl_sn, logger, &tv ))
 		     == NULL ) {
@@ -468,149 +534,32 @@ next:
 		yacur->cl_sn = NULL;
 		continue;
 	    }
-	    yacur->cl_last_time = now.tv_sec;
-	}
-
-    }
-    syslog( LOG_NOTICE, "STATS MONSTER: %d/%d/%d login %d/%d service",
-	    login_gone, login_sent, login_total, service_gone, service_total );
-	} /* end forever loop */
-}
-
-    void
-do_dir( char *dir, struct connlist *head, struct timeval *now )
-{
-    DIR			*dirp;
-    struct dirent	*de;
-    char		path[ MAXPATHLEN ];
-    char		lpath[ MAXPATHLEN ];
-    struct connlist	*yacur;
-    char                login[ MAXCOOKIELEN ];
-    int			state = 0;
-    time_t		itime = 0;
-    int			rc;
-
-    if (( dirp = opendir( dir )) == NULL ) {
-	syslog( LOG_ERR, "%s: %m", cosign_dir);
-	exit( 1 );
-    }
-    while (( de = readdir( dirp )) != NULL ) {
-	/* is a login cookie */
-
-	if ( mkcookiepath( NULL, hashlen, de->d_name,
-		path, sizeof( path )) < 0 ) {
-	    continue;
-	}
-
-	if ( strncmp( de->d_name, "cosign=", 7 ) == 0 ) {
-	    login_total++;
-
-	    if (( rc = eat_cookie( path, now, &itime, &state )) < 0 ) {
-		syslog( LOG_ERR, "eat_cookie failure: %s", path );
-		continue;
-	    }
-	    if ( rc == 0 ) {
-		/* Cookie was deleted, so don't sync */
-		continue;
-	    }
-	    for ( yacur = head; yacur != NULL; yacur = yacur->cl_next ) {
-		if (( itime > yacur->cl_last_time ) &&
-			( yacur->cl_sn != NULL )) {
-		    login_sent++;
-		    if ( snet_writef( yacur->cl_sn, "%s %d %d\r\n",
-			    de->d_name, itime, state ) < 0 ) {
-			if ( snet_close( yacur->cl_sn ) != 0 ) {
-			    syslog( LOG_ERR, "snet_close: 11: %m" );
-			}
-			yacur->cl_sn = NULL;
-			continue;
-		    }
-		}
-	    }
-	} else if ( strncmp( de->d_name, "cosign-", 7 ) == 0 ) {
-	    service_total++;
-	    if ( service_to_login( path, login ) != 0 ) {
-		continue;
-	    }
-
-	    if ( mkcookiepath( NULL, hashlen, login,
-		    lpath, sizeof( lpath )) < 0 ) {
-		syslog( LOG_ERR, "do_dir: mkcookiepath error." );
-		exit( 1 );
+	    if ( !jok || pos.jp_seg >= 0 ) {
+		yacur->cl_last_time = now.tv_sec;
 	    }
-
-	    if (( rc = eat_cookie( lpath, now, &itime, &state )) < 0 ) {
-		syslog( LOG_ERR, "eat_cookie failure: %s", login );
-		continue;
+	    if ( jok && pos.jp_seg >= 0 ) {
+		yacur->cl_jpos = pos;
+		(void)journal_save( inet_ntoa( yacur->cl_sin.sin_addr ),
+			&yacur->cl_jpos );
 	    }
-	    if ( rc == 0 ) {
-		if ( unlink( path ) != 0 ) {
-		    syslog( LOG_ERR, "%s: 12: %m", path );
-		}
-		service_gone++;
-	    }
-	} else {
-	    continue;
 	}
-    }
-    closedir( dirp );
-}
-
-    int
-eat_cookie( char *name, struct timeval *now, time_t *itime, int *state )
-{
-    struct cinfo	ci;
-    int			rc, create = 0;
-    extern int		errno;
 
-
-    /* -1 is a serious error
-     * 0 means the cookie was deleted
-     * 1 means still good and time was updated
-     */
-
-    if (( rc = read_cookie( name, &ci )) < 0 ) {
-	syslog( LOG_ERR, "read_cookie error: %s", name );
-	return( -1 );
     }
 
-    /* login cookie gave us an ENOENT so we think it's gone */
-    if ( rc == 1 ) {
-	return( 0 );
-    }
-
-    /* logged out plus extra non-fail overtime */
-    if ( !ci.ci_state && (( now->tv_sec - ci.ci_itime ) > loggedout_cache )) {
-	goto delete_stuff;
-    }
-
-    /* idle out, plus gray window, plus non-failover */
-    if (( now->tv_sec - ci.ci_itime )  > idle_cache ) {
-	goto delete_stuff;
-    }
-
-    /* hard timeout */
-    create = atoi( ci.ci_ctime );
-    if (( now->tv_sec - create )  > hard_timeout ) {
-	goto delete_stuff;
-    }
-
-    *itime = ci.ci_itime; 
-    *state = ci.ci_state;
-    return( 1 );
-
-delete_stuff:
-
-    /* remove krb5 ticket and login cookie */
-    if ( *ci.ci_krbtkt != '\0' ) {
-	if ( unlink( ci.ci_krbtkt ) != 0 ) {
-	    syslog( LOG_ERR, "unlink krbtgt %s: %m", ci.ci_krbtkt );
+    /* segments every replica has are done with */
+    if ( jok ) {
+	pos = mark;
+	for ( yacur = head; yacur != NULL; yacur = yacur->cl_next ) {
+	    if ( yacur->cl_jpos.jp_seg >= 0 &&
+		    yacur->cl_jpos.jp_seg < pos.jp_seg ) {
+		pos = yacur->cl_jpos;
+	    }
 	}
+	journal_trim( &pos );
     }
-    if ( unlink( name ) != 0 ) {
-	syslog( LOG_ERR, "%s: %m", name );
-    } 
-    login_gone++;
-
-    return( 0 );
+    sweep_stats( &now );
+    if ( store_sync() < 0 ) {
+	syslog( LOG_ERR, "store_sync failed" );
+    }
+	} /* end forever loop */
 }
@@ -16,6 +16,7 @@ struct connlist {
     } cl_u;
     struct rate		cl_pushpass;
     struct rate		cl_pushfail;
+    struct jpos		cl_jpos;	/* monster: acknowledged to here */
 };
 
 int connect_sn( struct connlist *, SSL_CTX *, char *, int );
@@ -0,0 +1,407 @@
+/*
+ * Copyright (c) 2004 Regents of The University of Michigan.
+ * All Rights Reserved.  See LICENSE.
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include <openssl/ssl.h>
+#include <snet.h>
+
+#include "conf.h"
+#include "rate.h"
+#include "command.h"
+#include "pool.h"
+#include "event.h"
+#include "listener.h"
+
+extern int			pool_max;
+extern int			pool_minspare;
+extern int			pool_maxspare;
+extern int			pool_maxrequests;
+extern int			event_max;
+extern int			backlog;
+extern int			reuseport;
+extern unsigned short		cosign_port;
+extern struct sockaddr_storage	cosign_sin;
+
+static struct worker		*scoreboard = NULL;
+static int			*listeners = NULL;
+static int			retire = 0;
+static pid_t			parent = 0;
+
+static void	workerhup( int );
+static void	pool_worker( int, SNET *, struct worker * );
+static int	pool_listener( int, int );
+static void	pool_leave( int, SNET * );
+
+    static void
+workerhup( int sig )
+{
+    retire++;
+    return;
+}
+
+/*
+ * the scoreboard is mapped before any worker is forked, so the parent
+ * and every worker see the same slots.  the listener is made non-blocking
+ * so idle workers racing for a connection don't hang in accept().  with
+ * reuseport, s is only bound, and each slot has a listener of its own.
+ */
+    int
+pool_init( int s )
+{
+    int		i, flags;
+
+    if (( scoreboard = (struct worker *)mmap( NULL,
+	    pool_max * sizeof( struct worker ), PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_ANON, -1, 0 )) == MAP_FAILED ) {
+	syslog( LOG_ERR, "pool_init: mmap: %m" );
+	return( -1 );
+    }
+    memset( scoreboard, 0, pool_max * sizeof( struct worker ));
+    parent = getpid();
+
+    if (( listeners = (int *)malloc( pool_max * sizeof( int ))) == NULL ) {
+	syslog( LOG_ERR, "pool_init: malloc: %m" );
+	return( -1 );
+    }
+    for ( i = 0; i < pool_max; i++ ) {
+	listeners[ i ] = -1;
+    }
+
+    if (( flags = fcntl( s, F_GETFL )) < 0 ) {
+	syslog( LOG_ERR, "pool_init: fcntl: %m" );
+	return( -1 );
+    }
+    if ( fcntl( s, F_SETFL, flags | O_NONBLOCK ) < 0 ) {
+	syslog( LOG_ERR, "pool_init: fcntl: %m" );
+	return( -1 );
+    }
+
+    return( 0 );
+}
+
+/*
+ * called by the parent every time through its loop.  forks workers
+ * until there are at least pool_minspare idle, and asks idle workers
+ * beyond pool_maxspare to exit.
+ *
+ * with reuseport, the parent opens each slot's listener and keeps it
+ * from one worker to the next, so connections the kernel has queued on
+ * it wait for the slot's next worker rather than being reset when a
+ * worker exits.  a slot with a listener is never left without a
+ * worker.  only when a slot is given up is its listener closed, and
+ * then its last worker takes whatever is still queued.
+ */
+    int
+pool_maintain( int s, SNET *pushersn )
+{
+    struct worker	*w;
+    pid_t		pid;
+    int			i, idle = 0, alive = 0;
+
+    for ( i = 0; i < pool_max; i++ ) {
+	switch ( scoreboard[ i ].w_state ) {
+	case W_EMPTY :
+	    continue;
+
+	case W_IDLE :
+	    idle++;
+	    break;
+
+	default :
+	    break;
+	}
+	alive++;
+    }
+
+    for ( i = 0; i < pool_max && idle > pool_maxspare; i++ ) {
+	w = &scoreboard[ i ];
+	if ( w->w_state != W_IDLE || w->w_pid == 0 ) {
+	    continue;
+	}
+	w->w_state = W_RETIRING;
+	if ( listeners[ i ] >= 0 ) {
+	    (void)close( listeners[ i ] );
+	    listeners[ i ] = -1;
+	    w->w_closed = 1;
+	}
+	if ( kill( w->w_pid, SIGHUP ) < 0 ) {
+	    syslog( LOG_ERR, "pool_maintain: kill %d: %m", (int)w->w_pid );
+	}
+	idle--;
+    }
+
+    for ( i = 0; i < pool_max; i++ ) {
+	w = &scoreboard[ i ];
+	if ( w->w_state != W_EMPTY ) {
+	    continue;
+	}
+	if (( idle >= pool_minspare || alive >= pool_max ) &&
+		listeners[ i ] < 0 ) {
+	    continue;
+	}
+
+	if ( reuseport && listeners[ i ] < 0 ) {
+	    if (( listeners[ i ] = listener_open( cosign_port, backlog,
+		    LISTENER_REUSEPORT | LISTENER_NONBLOCK )) < 0 ) {
+		syslog( LOG_ERR, "pool_maintain: listener_open: %m" );
+		return( -1 );
+	    }
+	}
+
+	/* claim the slot before forking, the worker updates it from here */
+	w->w_pid = 0;
+	w->w_state = W_IDLE;
+	w->w_requests = 0;
+	w->w_closed = 0;
+
+	switch ( pid = fork()) {
+	case 0 :
+	    if ( reuseport ) {
+		s = pool_listener( s, i );
+	    }
+	    pool_worker( s, pushersn, w );
+	    exit( 0 );
+
+	case -1 :
+	    syslog( LOG_ERR, "pool_maintain: fork: %m" );
+	    w->w_state = W_EMPTY;
+	    return( -1 );
+
+	default :
+	    w->w_pid = pid;
+	    break;
+	}
+	idle++;
+	alive++;
+    }
+
+    return( 0 );
+}
+
+/*
+ * frees the slot of an exited worker.  returns -1 if pid wasn't a worker.
+ */
+    int
+pool_reap( pid_t pid )
+{
+    int		i;
+
+    for ( i = 0; i < pool_max; i++ ) {
+	if ( scoreboard[ i ].w_state != W_EMPTY &&
+		scoreboard[ i ].w_pid == pid ) {
+	    scoreboard[ i ].w_state = W_EMPTY;
+	    scoreboard[ i ].w_pid = 0;
+	    return( 0 );
+	}
+    }
+    return( -1 );
+}
+
+/*
+ * a worker whose parent has gone away stops taking connections, rather
+ * than holding on to the port after cosignd has been stopped.
+ */
+    int
+pool_orphaned( void )
+{
+    return( getppid() != parent );
+}
+
+/*
+ * after a HUP, every worker finishes the connection it is serving and
+ * exits.  pool_maintain() replaces them with workers forked from the
+ * reconfigured parent, just as new connections get new children in the
+ * fork-per-connection model.
+ */
+    void
+pool_reload( void )
+{
+    int		i;
+
+    for ( i = 0; i < pool_max; i++ ) {
+	if ( scoreboard[ i ].w_state == W_EMPTY ||
+		scoreboard[ i ].w_pid == 0 ) {
+	    continue;
+	}
+	scoreboard[ i ].w_state = W_RETIRING;
+	if ( kill( scoreboard[ i ].w_pid, SIGHUP ) < 0 ) {
+	    syslog( LOG_ERR, "pool_reload: kill %d: %m",
+		    (int)scoreboard[ i ].w_pid );
+	}
+    }
+}
+
+    static void
+pool_worker( int s, SNET *pushersn, struct worker *w )
+{
+    struct sigaction	sa;
+    sigset_t		hupmask, waitmask;
+    struct timespec	ts;
+    fd_set		fdset;
+    int			fd, n;
+
+    memset( &sa, 0, sizeof( struct sigaction ));
+    sa.sa_handler = SIG_DFL;
+    if ( sigaction( SIGCHLD, &sa, NULL ) < 0 ) {
+	syslog( LOG_ERR, "pool_worker: sigaction: %m" );
+	exit( 1 );
+    }
+    sa.sa_handler = workerhup;
+    if ( sigaction( SIGHUP, &sa, NULL ) < 0 ) {
+	syslog( LOG_ERR, "pool_worker: sigaction: %m" );
+	exit( 1 );
+    }
+
+    /*
+     * HUP is only delivered while we're waiting for a connection, so
+     * a worker never abandons a client in the middle of a session.
+     */
+    sigemptyset( &hupmask );
+    sigaddset( &hupmask, SIGHUP );
+    if ( sigprocmask( SIG_BLOCK, &hupmask, &waitmask ) < 0 ) {
+	syslog( LOG_ERR, "pool_worker: sigprocmask: %m" );
+	exit( 1 );
+    }
+    sigdelset( &waitmask, SIGHUP );
+
+    if ( event_max > 0 ) {
+	event_worker( s, pushersn, w, &retire, &waitmask );
+	exit( 0 );
+    }
+
+    while ( !retire && !pool_orphaned()) {
+	if ( w->w_state != W_RETIRING ) {
+	    w->w_state = W_IDLE;
+	}
+
+	FD_ZERO( &fdset );
+	FD_SET( s, &fdset );
+	ts.tv_sec = 1;
+	ts.tv_nsec = 0;
+	if (( n = pselect( s + 1, &fdset, NULL, NULL, &ts, &waitmask )) <= 0 ) {
+	    if ( n < 0 && errno != EINTR ) {
+		syslog( LOG_ERR, "pool_worker: select: %m" );
+		exit( 1 );
+	    }
+	    continue;
+	}
+
+	if (( fd = listener_accept( s, &cosign_sin, 0 )) < 0 ) {
+	    /* another worker got there first */
+	    if ( errno != EAGAIN && errno != EWOULDBLOCK &&
+		    errno != EINTR && errno != ECONNABORTED ) {
+		syslog( LOG_ERR, "pool_worker: accept: %m" );
+	    }
+	    continue;
+	}
+
+	if ( w->w_state != W_RETIRING ) {
+	    w->w_state = W_BUSY;
+	}
+	w->w_requests++;
+
+	syslog( LOG_INFO, "connect: %s", listener_ntop( &cosign_sin ));
+	(void)command( fd, pushersn );
+
+	if ( pool_maxrequests > 0 && w->w_requests >= pool_maxrequests ) {
+	    break;
+	}
+    }
+
+    if ( reuseport && w->w_closed ) {
+	pool_leave( s, pushersn );
+    }
+    exit( 0 );
+}
+
+/*
+ * a listener of our own, so the kernel hands each worker its share
+ * of new connections rather than waking every idle worker for each.
+ * the other slots' listeners are closed, so that one the parent gives
+ * up isn't kept open by a worker that won't accept on it.
+ */
+    static int
+pool_listener( int s, int slot )
+{
+    int		i;
+
+    (void)close( s );
+    for ( i = 0; i < pool_max; i++ ) {
+	if ( i != slot && listeners[ i ] >= 0 ) {
+	    (void)close( listeners[ i ] );
+	    listeners[ i ] = -1;
+	}
+    }
+    return( listeners[ slot ] );
+}
+
+/*
+ * closing the last reference to a reuseport listener resets every
+ * connection the kernel has queued on it.  the last worker of a slot
+ * the parent has given up takes them all first, then closes the
+ * listener so no more are queued, and serves what it took.
+ */
+    static void
+pool_leave( int s, SNET *pushersn )
+{
+    struct sockaddr_storage	*sins = NULL, *nsins;
+    int				*fds = NULL, *nfds;
+    int				fd, i, n = 0, max = 0;
+
+    for (;;) {
+	if (( fd = listener_accept( s, &cosign_sin, 0 )) < 0 ) {
+	    if ( errno == EINTR || errno == ECONNABORTED ) {
+		continue;
+	    }
+	    if ( errno != EAGAIN && errno != EWOULDBLOCK ) {
+		syslog( LOG_ERR, "pool_leave: accept: %m" );
+	    }
+	    break;
+	}
+	if ( n >= max ) {
+	    max += 16;
+	    if (( nfds = (int *)realloc( fds, max * sizeof( int ))) != NULL ) {
+		fds = nfds;
+	    }
+	    if (( nsins = (struct sockaddr_storage *)realloc( sins,
+		    max * sizeof( struct sockaddr_storage ))) != NULL ) {
+		sins = nsins;
+	    }
+	    if ( nfds == NULL || nsins == NULL ) {
+		syslog( LOG_ERR, "pool_leave: realloc: %m" );
+		(void)close( fd );
+		break;
+	    }
+	}
+	fds[ n ] = fd;
+	sins[ n ] = cosign_sin;
+	n++;
+    }
+    (void)close( s );
+
+    for ( i = 0; i < n; i++ ) {
+	cosign_sin = sins[ i ];
+	syslog( LOG_INFO, "connect: %s", listener_ntop( &cosign_sin ));
+	(void)command( fds[ i ], pushersn );
+    }
+    free( fds );
+    free( sins );
+}
@@ -0,0 +1,23 @@
+/*
+ * Copyright (c) 2004 Regents of The University of Michigan.
+ * All Rights Reserved.  See COPYRIGHT.
+ */
+
+#define W_EMPTY		0
+#define W_IDLE		1
+#define W_BUSY		2
+#define W_RETIRING	3
+
+/* one scoreboard slot per worker, kept in memory shared with the workers */
+struct worker {
+    pid_t		w_pid;
+    int			w_state;
+    unsigned int	w_requests;
+    int			w_closed;	/* the parent gave up its listener */
+};
+
+int	pool_init( int );
+int	pool_maintain( int, SNET * );
+int	pool_reap( pid_t );
+int	pool_orphaned( void );
+void	pool_reload( void );
@@ -15,6 +15,7 @@
 #include <netdb.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <pthread.h>
 
 #include <openssl/err.h>
 #include <openssl/ssl.h>
@@ -22,16 +23,18 @@
 
 #include "argcargv.h"
 #include "rate.h"
+#include "journal.h"
 #include "monster.h"
 #include "cparse.h"
 #include "mkcookie.h"
+#include "stats.h"
+#include "store.h"
 
 extern char		*cosign_version;
 extern char		*replhost;
 extern unsigned short	cosign_port;
 extern SSL_CTX		*ctx;
 extern struct timeval	cosign_net_timeout;
-extern int		hashlen;
 
 static struct connlist	*replhead = NULL;
 static int		reconfig = 0;
@@ -306,6 +309,7 @@ syslog( LOG_DEBUG, "reload pusher pusherhosts %s", cosign_version );
 
 		    case 1:
 			syslog( LOG_ERR, "CHILD %d transient failure", pid );
+			stats_repl( STATS_REPL_FAILED );
 			break;
 
 		    case 2:
@@ -349,6 +353,7 @@ syslog( LOG_DEBUG, "reload pusher pusherhosts %s", cosign_version );
 	    syslog( LOG_ERR, "pusherparent: snet_getline: %m" );
 	    exit( 1 );
 	}
+	stats_repl( STATS_REPL_QUEUED );
 
 	mkpushers( ppipe );
 
@@ -371,11 +376,13 @@ syslog( LOG_DEBUG, "reload pusher pusherhosts %s", cosign_version );
 	    if ( cur->cl_pid > 0 ) {
 		if ( FD_ISSET( snet_fd( cur->cl_psn ), &fdset )) {
 		    snet_writef( cur->cl_psn, "%s\r\n", line );
+		    stats_repl( STATS_REPL_SENT );
 		    if (( rate = rate_tick( &cur->cl_pushpass )) != 0.0 ) {
 			syslog( LOG_NOTICE, "STATS PUSH %s: PASS %.5f / sec",
 				inet_ntoa( cur->cl_sin.sin_addr ), rate );
 		    }
 		} else {
+		    stats_repl( STATS_REPL_SKIPPED );
 		    if (( rate = rate_tick( &cur->cl_pushfail )) != 0.0 ) {
 			syslog( LOG_NOTICE, "STATS PUSH %s: FAIL %.5f / sec",
 				inet_ntoa( cur->cl_sin.sin_addr ), rate );
@@ -391,8 +398,8 @@ pusher( int cpipe, struct connlist *cur )
 {
     SNET		*csn;
     char		buf[ 8192 ];
-    char		*line, **av, path[ MAXPATHLEN ];
-    int			rc, ac, krb = 0, fd = 0;
+    char		*line, **av;
+    int			rc, ac, krb = 0, tm = 0, fd = 0;
     ssize_t             rr, size = 0;
     struct timeval	tv;
     struct stat         st;
@@ -419,6 +426,7 @@ pusher( int cpipe, struct connlist *cur )
 
 	for ( ;; ) {
     krb = 0;
+    tm = 0;
     if (( line = snet_getline( csn, NULL )) == NULL ) {
 	syslog( LOG_ERR, "pusher: snet_getline: %m" );
 	exit( 1 );
@@ -450,6 +458,12 @@ pusher( int cpipe, struct connlist *cur )
 	break;
 
     case 4 :
+	/* a login cookie's activity, from cosignd's sweeper */
+	if (( strcasecmp( av[ 0 ], "time" )) == 0 ) {
+	    snet_writef( cur->cl_sn, "TIME\r\n" );
+	    tm = 1;
+	    break;
+	}
 	if (( strcasecmp( av[ 0 ], "register" )) != 0 ) {
 	    syslog( LOG_ERR, "pusher: %s: bad command", av[ 0 ] );
 	    exit( 1 );
@@ -466,6 +480,14 @@ pusher( int cpipe, struct connlist *cur )
 	snet_writef( cur->cl_sn, "LOGOUT %s %s\r\n", av[ 1 ], av[ 2 ] );
 	break;
 
+    case 2 :
+	if (( strcasecmp( av[ 0 ], "logoutuser" )) != 0 ) {
+	    syslog( LOG_ERR, "pusher: %s: bad command", av[ 0 ] );
+	    exit( 1 );
+	}
+	snet_writef( cur->cl_sn, "LOGOUTUSER %s\r\n", av[ 1 ] );
+	break;
+
     default :
 	syslog( LOG_ERR, "pusher: wrong number of args" );
 	exit( 1 );
@@ -479,6 +501,27 @@ pusher( int cpipe, struct connlist *cur )
 	exit( 1 );
     }
 
+    if ( tm ) {
+	if ( *line != '3' ) {
+	    syslog( LOG_ERR, "pusher: TIME: %s", line );
+	    goto error;
+	}
+	if ( snet_writef( cur->cl_sn, "%s %s %s\r\n.\r\n",
+		av[ 1 ], av[ 2 ], av[ 3 ] ) < 0 ) {
+	    syslog( LOG_ERR, "pusher: time %s failed: %m", av[ 1 ] );
+	    goto error;
+	}
+	tv = cosign_net_timeout;
+	if (( line = snet_getline_multi( cur->cl_sn, logger, &tv ))
+		== NULL ) {
+	    if ( !snet_eof( cur->cl_sn )) {
+		syslog( LOG_ERR, "pusher: getline: %m" );
+	    }
+	    exit( 1 );
+	}
+	goto done;
+    }
+
     /*
      * This is the branch of code where we'd expect a 3xx response, since
      * we're planning to send a kerberos ticket.  However, under conditions
@@ -497,13 +540,13 @@ pusher( int cpipe, struct connlist *cur )
         goto error;
     }
 
-    if ( mkcookiepath( NULL, hashlen, av[ 1 ], path, sizeof( path )) < 0 ) {
-	syslog( LOG_ERR, "pusher: mkcookiepath error: %s", av[ 1 ] );
+    if ( store_valid( av[ 1 ] ) < 0 ) {
+	syslog( LOG_ERR, "pusher: invalid cookie name: %s", av[ 1 ] );
         goto error;
     }
 
-    if (( rc = read_cookie( path, &ci )) != 0 ) {
-	syslog( LOG_ERR, "pusher: read_cookie error: %s", path );
+    if (( rc = store->so_get( av[ 1 ], &ci )) != 0 ) {
+	syslog( LOG_ERR, "pusher: %s: not in store", av[ 1 ] );
 	continue;
     }
 
@@ -571,6 +614,7 @@ done:
 	}
 	exit( 1 );
     }
+    stats_repl( STATS_REPL_DONE );
 	}
 
 error:
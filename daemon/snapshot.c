@@ -0,0 +1,490 @@
+/*
+ * Copyright (c) 2004 Regents of The University of Michigan.
+ * All Rights Reserved.  See LICENSE.
+ */
+
+/*
+ * "cosignd -S dump" writes every cookie in the store to stdout, and
+ * "cosignd -S restore" loads them from stdin, so that a node can be
+ * rebuilt from a stream rather than a copy of the cookie directory.
+ * either works with any store, and while cosignd is running.
+ *
+ * the stream is SNAP_MAGIC, then blocks of records, each no more than
+ * SNAP_BLOCK bytes and preceded by a header giving its length, the
+ * number of records and a CRC-32 of them, all in network byte order.
+ * an empty block ends the stream, so a truncated one is noticed.  a
+ * record is its type, its state, its time of last activity as eight
+ * bytes, most significant first, and then its fields, each terminated
+ * by a NUL.  a login has seven: the cookie, ip address, current ip
+ * address, user, realm, creation time and ticket path.  the tickets
+ * themselves aren't included.  a service has two: the cookie and its
+ * login cookie.
+ *
+ * each block is checked before any of it is restored, and its records
+ * are written in order of cookie value, which is the order of the file
+ * store's hash directories.  logins are written before services.
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include <netinet/in.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cparse.h"
+#include "mkcookie.h"
+#include "store.h"
+#include "uindex.h"
+#include "snapshot.h"
+
+#define SNAP_HDRLEN	10		/* type, state, itime */
+
+struct snap_block {
+    unsigned int	sb_len;
+    unsigned int	sb_nrec;
+    unsigned int	sb_crc;
+};
+
+struct snap {
+    int			sn_fd;
+    char		*sn_buf;
+    unsigned int	sn_len;
+    unsigned int	sn_nrec;
+    int			sn_logins;
+    int			sn_services;
+    int			sn_errors;
+};
+
+struct snap_rec {
+    int			sr_type;
+    int			sr_state;
+    time_t		sr_itime;
+    char		*sr_f[ 7 ];
+};
+
+static unsigned int	snap_crctab[ 256 ];
+
+static unsigned int	snap_crc( unsigned char *, unsigned int );
+static int	snap_write( int, char *, unsigned int );
+static int	snap_read( int, char *, unsigned int );
+static int	snap_flush( struct snap * );
+static int	snap_add( struct snap *, int, int, time_t, char **, int );
+static int	snap_cookie( char *, void * );
+static int	snap_parse( char *, unsigned int, unsigned int,
+			struct snap_rec * );
+static int	snap_reccmp( const void *, const void * );
+static int	snap_load( struct snap_rec *, int *, int * );
+
+    static unsigned int
+snap_crc( unsigned char *p, unsigned int len )
+{
+    unsigned int	c;
+    int			i, j;
+
+    if ( snap_crctab[ 1 ] == 0 ) {
+	for ( i = 0; i < 256; i++ ) {
+	    c = i;
+	    for ( j = 0; j < 8; j++ ) {
+		c = ( c & 1 ) ? 0xedb88320 ^ ( c >> 1 ) : c >> 1;
+	    }
+	    snap_crctab[ i ] = c;
+	}
+    }
+
+    c = 0xffffffff;
+    while ( len-- > 0 ) {
+	c = snap_crctab[ ( c ^ *p++ ) & 0xff ] ^ ( c >> 8 );
+    }
+    return( c ^ 0xffffffff );
+}
+
+    static int
+snap_write( int fd, char *buf, unsigned int len )
+{
+    ssize_t		rc;
+
+    while ( len > 0 ) {
+	if (( rc = write( fd, buf, len )) < 0 ) {
+	    if ( errno == EINTR ) {
+		continue;
+	    }
+	    syslog( LOG_ERR, "snapshot: write: %m" );
+	    return( -1 );
+	}
+	buf += rc;
+	len -= rc;
+    }
+    return( 0 );
+}
+
+/* 0 once len bytes are read, 1 at end of file, -1 on error */
+    static int
+snap_read( int fd, char *buf, unsigned int len )
+{
+    ssize_t		rc;
+    unsigned int	got = 0;
+
+    while ( got < len ) {
+	if (( rc = read( fd, buf + got, len - got )) < 0 ) {
+	    if ( errno == EINTR ) {
+		continue;
+	    }
+	    syslog( LOG_ERR, "snapshot: read: %m" );
+	    return( -1 );
+	}
+	if ( rc == 0 ) {
+	    if ( got > 0 ) {
+		syslog( LOG_ERR, "snapshot: truncated" );
+		return( -1 );
+	    }
+	    return( 1 );
+	}
+	got += rc;
+    }
+    return( 0 );
+}
+
+    static int
+snap_flush( struct snap *sn )
+{
+    struct snap_block	sb;
+
+    sb.sb_len = htonl( sn->sn_len );
+    sb.sb_nrec = htonl( sn->sn_nrec );
+    sb.sb_crc = htonl( snap_crc( (unsigned char *)sn->sn_buf, sn->sn_len ));
+    if ( snap_write( sn->sn_fd, (char *)&sb, sizeof( sb )) < 0 ||
+	    snap_write( sn->sn_fd, sn->sn_buf, sn->sn_len ) < 0 ) {
+	return( -1 );
+    }
+    sn->sn_len = 0;
+    sn->sn_nrec = 0;
+    return( 0 );
+}
+
+    static int
+snap_add( struct snap *sn, int type, int state, time_t itime,
+	char **f, int nf )
+{
+    unsigned char	*p;
+    unsigned int	len = SNAP_HDRLEN, flen;
+    int			i;
+
+    for ( i = 0; i < nf; i++ ) {
+	len += strlen( f[ i ] ) + 1;
+    }
+    if ( sn->sn_len + len > SNAP_BLOCK && snap_flush( sn ) < 0 ) {
+	return( -1 );
+    }
+
+    p = (unsigned char *)sn->sn_buf + sn->sn_len;
+    *p++ = type;
+    *p++ = state;
+    for ( i = 7; i >= 0; i-- ) {
+	*p++ = ((unsigned long long)itime >> ( i * 8 )) & 0xff;
+    }
+    for ( i = 0; i < nf; i++ ) {
+	flen = strlen( f[ i ] ) + 1;
+	memcpy( p, f[ i ], flen );
+	p += flen;
+    }
+    sn->sn_len += len;
+    sn->sn_nrec++;
+    return( 0 );
+}
+
+    static int
+snap_cookie( char *name, void *arg )
+{
+    struct snap		*sn = (struct snap *)arg;
+    struct cinfo	ci;
+    char		login[ MAXCOOKIELEN ];
+    char		*f[ 7 ];
+    int			rc;
+
+    if ( strncmp( name, "cosign=", 7 ) == 0 ) {
+	if (( rc = store->so_get( name, &ci )) != 0 ) {
+	    /* logged out and expired since it was listed */
+	    if ( rc < 0 ) {
+		sn->sn_errors++;
+	    }
+	    return( 0 );
+	}
+	f[ 0 ] = name;
+	f[ 1 ] = ci.ci_ipaddr;
+	f[ 2 ] = ci.ci_ipaddr_cur;
+	f[ 3 ] = ci.ci_user;
+	f[ 4 ] = ci.ci_realm;
+	f[ 5 ] = ci.ci_ctime;
+	f[ 6 ] = ci.ci_krbtkt;
+	if ( snap_add( sn, SNAP_LOGIN, ci.ci_state, ci.ci_itime, f, 7 ) < 0 ) {
+	    return( -1 );
+	}
+	sn->sn_logins++;
+    } else {
+	if ( store->so_service( name, login ) != 0 ) {
+	    return( 0 );
+	}
+	f[ 0 ] = name;
+	f[ 1 ] = login;
+	if ( snap_add( sn, SNAP_SERVICE, 1, 0, f, 2 ) < 0 ) {
+	    return( -1 );
+	}
+	sn->sn_services++;
+    }
+    return( 0 );
+}
+
+/* writes the whole store to fd */
+    int
+snapshot_dump( int fd )
+{
+    struct snap		sn;
+    int			i, nbuckets;
+
+    memset( &sn, 0, sizeof( struct snap ));
+    sn.sn_fd = fd;
+    if (( sn.sn_buf = malloc( SNAP_BLOCK )) == NULL ) {
+	syslog( LOG_ERR, "snapshot_dump: malloc: %m" );
+	return( -1 );
+    }
+
+    if ( snap_write( fd, SNAP_MAGIC, strlen( SNAP_MAGIC )) < 0 ) {
+	goto error;
+    }
+    nbuckets = store->so_buckets();
+    for ( i = 0; i < nbuckets; i++ ) {
+	if ( store->so_iterate( i, snap_cookie, &sn ) < 0 ) {
+	    goto error;
+	}
+    }
+    /* what's left, then the empty block that ends the stream */
+    if (( sn.sn_len > 0 && snap_flush( &sn ) < 0 ) ||
+	    snap_flush( &sn ) < 0 ) {
+	goto error;
+    }
+    free( sn.sn_buf );
+
+    syslog( LOG_NOTICE, "snapshot_dump: %d logins, %d services, "
+	    "%d unreadable", sn.sn_logins, sn.sn_services, sn.sn_errors );
+    return( 0 );
+
+error:
+    free( sn.sn_buf );
+    return( -1 );
+}
+
+/* the next record of a block, returning where the one after begins */
+    static int
+snap_parse( char *buf, unsigned int len, unsigned int off,
+	struct snap_rec *sr )
+{
+    unsigned char	*p = (unsigned char *)buf + off;
+    char		*end;
+    int			i, nf;
+
+    if ( off + SNAP_HDRLEN > len ) {
+	return( -1 );
+    }
+    sr->sr_type = *p++;
+    sr->sr_state = *p++;
+    sr->sr_itime = 0;
+    for ( i = 0; i < 8; i++ ) {
+	sr->sr_itime = ( sr->sr_itime << 8 ) | *p++;
+    }
+
+    switch ( sr->sr_type ) {
+    case SNAP_LOGIN :
+	nf = 7;
+	break;
+
+    case SNAP_SERVICE :
+	nf = 2;
+	break;
+
+    default :
+	return( -1 );
+    }
+
+    off += SNAP_HDRLEN;
+    for ( i = 0; i < nf; i++ ) {
+	if (( end = memchr( buf + off, '\0', len - off )) == NULL ) {
+	    return( -1 );
+	}
+	sr->sr_f[ i ] = buf + off;
+	off = end - buf + 1;
+    }
+    if ( store_valid( sr->sr_f[ 0 ] ) < 0 ||
+	    ( sr->sr_type == SNAP_SERVICE &&
+	    store_valid( sr->sr_f[ 1 ] ) < 0 )) {
+	return( -1 );
+    }
+    return( off );
+}
+
+/* logins first, then by the cookie's value */
+    static int
+snap_reccmp( const void *a, const void *b )
+{
+    struct snap_rec	*ra = (struct snap_rec *)a;
+    struct snap_rec	*rb = (struct snap_rec *)b;
+
+    if ( ra->sr_type != rb->sr_type ) {
+	return( ra->sr_type == SNAP_LOGIN ? -1 : 1 );
+    }
+    return( strcmp( strchr( ra->sr_f[ 0 ], '=' ),
+	    strchr( rb->sr_f[ 0 ], '=' )));
+}
+
+/* returns 1 if the cookie was already in the store */
+    static int
+snap_load( struct snap_rec *sr, int *logins, int *services )
+{
+    struct cinfo	ci;
+    int			rc;
+
+    if ( sr->sr_type == SNAP_SERVICE ) {
+	if (( rc = store->so_register( sr->sr_f[ 0 ], sr->sr_f[ 1 ] )) == 0 ) {
+	    (void)sindex_add( sr->sr_f[ 1 ], sr->sr_f[ 0 ] );
+	    (*services)++;
+	}
+	return( rc );
+    }
+
+    memset( &ci, 0, sizeof( struct cinfo ));
+    ci.ci_version = 2;
+    ci.ci_state = 1;
+    if ( strlen( sr->sr_f[ 1 ] ) >= sizeof( ci.ci_ipaddr ) ||
+	    strlen( sr->sr_f[ 2 ] ) >= sizeof( ci.ci_ipaddr_cur ) ||
+	    strlen( sr->sr_f[ 3 ] ) >= sizeof( ci.ci_user ) ||
+	    strlen( sr->sr_f[ 4 ] ) >= sizeof( ci.ci_realm ) ||
+	    strlen( sr->sr_f[ 5 ] ) >= sizeof( ci.ci_ctime ) ||
+	    strlen( sr->sr_f[ 6 ] ) >= sizeof( ci.ci_krbtkt )) {
+	syslog( LOG_ERR, "snapshot_restore: %s: bad record", sr->sr_f[ 0 ] );
+	return( -1 );
+    }
+    strcpy( ci.ci_ipaddr, sr->sr_f[ 1 ] );
+    strcpy( ci.ci_ipaddr_cur, sr->sr_f[ 2 ] );
+    strcpy( ci.ci_user, sr->sr_f[ 3 ] );
+    strcpy( ci.ci_realm, sr->sr_f[ 4 ] );
+    strcpy( ci.ci_ctime, sr->sr_f[ 5 ] );
+    strcpy( ci.ci_krbtkt, sr->sr_f[ 6 ] );
+
+    if (( rc = store->so_put( sr->sr_f[ 0 ], &ci, STORE_CREATE )) != 0 ) {
+	return( rc );
+    }
+    if ( sr->sr_state == 0 ) {
+	if ( store->so_logout( sr->sr_f[ 0 ] ) < 0 ) {
+	    return( -1 );
+	}
+    } else {
+	(void)uindex_add( ci.ci_user, sr->sr_f[ 0 ] );
+    }
+    (void)eindex_add( sr->sr_itime, sr->sr_f[ 0 ] );
+    if ( store->so_touch( sr->sr_f[ 0 ], sr->sr_itime ) < 0 ) {
+	return( -1 );
+    }
+    (*logins)++;
+    return( 0 );
+}
+
+/*
+ * loads a stream from fd into the store.  cookies already there are
+ * left as they are.
+ */
+    int
+snapshot_restore( int fd )
+{
+    struct snap_block	sb;
+    struct snap_rec	*recs = NULL;
+    char		magic[ 8 ], *buf;
+    unsigned int	len, nrec, off, i;
+    int			rc, logins = 0, services = 0, present = 0, failed = 0;
+
+    if (( buf = malloc( SNAP_BLOCK )) == NULL ||
+	    ( recs = malloc( sizeof( struct snap_rec ) *
+	    ( SNAP_BLOCK / SNAP_HDRLEN ))) == NULL ) {
+	syslog( LOG_ERR, "snapshot_restore: malloc: %m" );
+	goto error;
+    }
+
+    if ( snap_read( fd, magic, sizeof( magic )) != 0 ||
+	    memcmp( magic, SNAP_MAGIC, sizeof( magic )) != 0 ) {
+	syslog( LOG_ERR, "snapshot_restore: not a cosignd snapshot" );
+	goto error;
+    }
+
+    for (;;) {
+	if (( rc = snap_read( fd, (char *)&sb, sizeof( sb ))) != 0 ) {
+	    if ( rc > 0 ) {
+		syslog( LOG_ERR, "snapshot_restore: truncated" );
+	    }
+	    goto error;
+	}
+	len = ntohl( sb.sb_len );
+	nrec = ntohl( sb.sb_nrec );
+	if ( len == 0 ) {
+	    break;
+	}
+	if ( len > SNAP_BLOCK || nrec > SNAP_BLOCK / SNAP_HDRLEN ) {
+	    syslog( LOG_ERR, "snapshot_restore: bad block" );
+	    goto error;
+	}
+	if (( rc = snap_read( fd, buf, len )) != 0 ) {
+	    if ( rc > 0 ) {
+		syslog( LOG_ERR, "snapshot_restore: truncated" );
+	    }
+	    goto error;
+	}
+	if ( snap_crc( (unsigned char *)buf, len ) != ntohl( sb.sb_crc )) {
+	    syslog( LOG_ERR, "snapshot_restore: checksum mismatch" );
+	    goto error;
+	}
+
+	for ( i = 0, off = 0; i < nrec; i++ ) {
+	    if (( rc = snap_parse( buf, len, off, &recs[ i ] )) < 0 ) {
+		syslog( LOG_ERR, "snapshot_restore: bad record" );
+		goto error;
+	    }
+	    off = rc;
+	}
+	if ( off != len ) {
+	    syslog( LOG_ERR, "snapshot_restore: bad block" );
+	    goto error;
+	}
+
+	qsort( recs, nrec, sizeof( struct snap_rec ), snap_reccmp );
+	for ( i = 0; i < nrec; i++ ) {
+	    if (( rc = snap_load( &recs[ i ], &logins, &services )) < 0 ) {
+		failed++;
+	    } else if ( rc > 0 ) {
+		present++;
+	    }
+	}
+    }
+
+    free( buf );
+    free( recs );
+    (void)store_sync();
+
+    syslog( LOG_NOTICE, "snapshot_restore: %d logins, %d services, "
+	    "%d already present, %d failed", logins, services, present,
+	    failed );
+    return( failed ? -1 : 0 );
+
+error:
+    if ( buf != NULL ) {
+	free( buf );
+    }
+    if ( recs != NULL ) {
+	free( recs );
+    }
+    return( -1 );
+}
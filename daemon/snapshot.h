@@ -0,0 +1,14 @@
+/*
+ * Copyright (c) 2004 Regents of The University of Michigan.
+ * All Rights Reserved.  See LICENSE.
+ */
+
+#define SNAP_MAGIC	"cosignS1"
+#define SNAP_BLOCK	( 1024 * 1024 )
+
+/* a record's type */
+#define SNAP_LOGIN	'L'
+#define SNAP_SERVICE	'S'
+
+int	snapshot_dump( int );
+int	snapshot_restore( int );
@@ -0,0 +1,286 @@
+/*
+ * Copyright (c) 2004 Regents of The University of Michigan.
+ * All Rights Reserved.  See LICENSE.
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/statvfs.h>
+#include <sys/time.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <syslog.h>
+
+#include <openssl/ssl.h>
+#include <snet.h>
+
+#include "rate.h"
+#include "stats.h"
+
+/* children update the counters concurrently */
+#ifdef __GNUC__
+#define STATS_ADD( p, n )	__sync_add_and_fetch((p),(n))
+#else /* __GNUC__ */
+#define STATS_ADD( p, n )	(*(p) += (n))
+#endif /* __GNUC__ */
+
+static struct stats	*stats = NULL;
+
+static char		*stats_names[ STATS_NCMD ] = {
+    "LOGIN", "REGISTER", "CHECK", "RETR", "TIME", "LOGOUT", "MCHECK",
+};
+
+static char		*stats_repl_names[ STATS_NREPL ] = {
+    "queued", "sent", "skipped", "done", "failed",
+};
+
+/* percentiles reported by STATS, in tenths of a percent */
+static int		stats_pct[] = { 500, 900, 990, 999 };
+
+static int		stats_bucket( unsigned int );
+static unsigned int	stats_value( int );
+static void		stats_hist( SNET *, int, char *, struct stats_hist * );
+
+/*
+ * must be called before anything is forked, so every process counts
+ * into the same memory.
+ */
+    int
+stats_init( void )
+{
+    if (( stats = (struct stats *)mmap( NULL, sizeof( struct stats ),
+	    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANON, -1, 0 ))
+	    == MAP_FAILED ) {
+	syslog( LOG_ERR, "stats_init: mmap: %m" );
+	stats = NULL;
+	return( -1 );
+    }
+    memset( stats, 0, sizeof( struct stats ));
+    return( 0 );
+}
+
+/*
+ * counts a finished STARTTLS handshake, and whether the client resumed
+ * an earlier session rather than negotiating a new one.  every
+ * RATE_INTERVAL handshakes, the process that finished the last one
+ * logs the totals.
+ */
+    void
+stats_tls( int resumed )
+{
+    unsigned int	n;
+
+    if ( stats == NULL ) {
+	return;
+    }
+    if ( resumed ) {
+	STATS_ADD( &stats->st_tls_resumed, 1 );
+    }
+    if (( n = STATS_ADD( &stats->st_tls, 1 )) % RATE_INTERVAL == 0 ) {
+	stats_log();
+    }
+}
+
+    void
+stats_log( void )
+{
+    unsigned int	tls, resumed;
+
+    if ( stats == NULL ) {
+	return;
+    }
+    tls = stats->st_tls;
+    resumed = stats->st_tls_resumed;
+
+    syslog( LOG_NOTICE, "STATS STARTTLS: %u handshakes, %u resumed, "
+	    "%d%% hit rate", tls, resumed,
+	    tls ? (int)(( (double)resumed / tls ) * 100 ) : 0 );
+}
+
+    static int
+stats_bucket( unsigned int v )
+{
+    int		shift;
+
+    if ( v < STATS_SUB ) {
+	return( v );
+    }
+    for ( shift = 0; ( v >> shift ) >= STATS_SUB; shift++ )
+	;
+    return( STATS_SUB + ( shift - 1 ) * ( STATS_SUB / 2 ) +
+	    ( v >> shift ) - STATS_SUB / 2 );
+}
+
+/*
+ * the middle of bucket i, which is off by at most half the bucket's
+ * width from any value recorded in it.
+ */
+    static unsigned int
+stats_value( int i )
+{
+    unsigned long long	v;
+    int			shift;
+
+    if ( i < STATS_SUB ) {
+	return( i );
+    }
+    i -= STATS_SUB;
+    shift = i / ( STATS_SUB / 2 ) + 1;
+    v = (((unsigned long long)( i % ( STATS_SUB / 2 ) + STATS_SUB / 2 ))
+	    << shift ) + ( 1ULL << ( shift - 1 ));
+    return( v > UINT_MAX ? UINT_MAX : (unsigned int)v );
+}
+
+/*
+ * records a finished command begun at start.  fail is non-zero if the
+ * client was given an error.
+ */
+    void
+stats_command( int cmd, struct timeval *start, int fail )
+{
+    struct stats_hist	*sh;
+    struct timeval	now;
+    unsigned long long	usec;
+    unsigned int	v, max;
+
+    if ( stats == NULL || cmd < 0 || cmd >= STATS_NCMD ) {
+	return;
+    }
+    sh = &stats->st_cmd[ cmd ];
+
+    if ( gettimeofday( &now, NULL ) < 0 ) {
+	return;
+    }
+    if ( timercmp( &now, start, < )) {
+	usec = 0;
+    } else {
+	usec = ( now.tv_sec - start->tv_sec ) * 1000000ULL +
+		now.tv_usec - start->tv_usec;
+    }
+    v = ( usec > UINT_MAX ) ? UINT_MAX : (unsigned int)usec;
+
+    STATS_ADD( &sh->sh_bucket[ stats_bucket( v )], 1 );
+    STATS_ADD( &sh->sh_total, usec );
+    if ( fail ) {
+	STATS_ADD( &sh->sh_fail, 1 );
+    }
+    STATS_ADD( &sh->sh_count, 1 );
+
+    while (( max = sh->sh_max ) < v ) {
+#ifdef __GNUC__
+	if ( __sync_bool_compare_and_swap( &sh->sh_max, max, v )) {
+	    break;
+	}
+#else /* __GNUC__ */
+	sh->sh_max = v;
+#endif /* __GNUC__ */
+    }
+}
+
+    void
+stats_repl( int which )
+{
+    if ( stats == NULL || which < 0 || which >= STATS_NREPL ) {
+	return;
+    }
+    STATS_ADD( &stats->st_repl[ which ], 1 );
+}
+
+    static void
+stats_hist( SNET *sn, int code, char *name, struct stats_hist *sh )
+{
+    unsigned int	bucket[ STATS_BUCKETS ];
+    unsigned int	count = 0, seen, target, v, max;
+    char		buf[ 512 ];
+    int			i, p, len;
+
+    /* work from a copy, other processes are still counting */
+    memcpy( bucket, sh->sh_bucket, sizeof( bucket ));
+    max = sh->sh_max;
+    for ( i = 0; i < STATS_BUCKETS; i++ ) {
+	count += bucket[ i ];
+    }
+
+    len = snprintf( buf, sizeof( buf ), "count=%u fail=%u mean=%llu",
+	    sh->sh_count, sh->sh_fail, count ? sh->sh_total / count : 0ULL );
+    for ( p = 0; p < sizeof( stats_pct ) / sizeof( stats_pct[ 0 ] ); p++ ) {
+	target = (unsigned int)
+		((( unsigned long long)count * stats_pct[ p ] + 999 ) / 1000 );
+	for ( i = 0, seen = 0; i < STATS_BUCKETS; i++ ) {
+	    if (( seen += bucket[ i ] ) >= target && seen > 0 ) {
+		break;
+	    }
+	}
+	len += snprintf( buf + len, sizeof( buf ) - len, " p%d",
+		stats_pct[ p ] / 10 );
+	if ( stats_pct[ p ] % 10 ) {
+	    len += snprintf( buf + len, sizeof( buf ) - len, ".%d",
+		    stats_pct[ p ] % 10 );
+	}
+	v = ( i < STATS_BUCKETS ) ? stats_value( i ) : 0;
+	len += snprintf( buf + len, sizeof( buf ) - len, "=%u",
+		( v > max ) ? max : v );
+    }
+
+    snprintf( buf + len, sizeof( buf ) - len, " max=%u", max );
+
+    snet_writef( sn, "%d-%s %s\r\n", code, name, buf );
+}
+
+/*
+ * writes everything we're counting as a multi-line reply.  latencies
+ * are in microseconds.  the store is the filesystem holding cosignd's
+ * working directory, and fd, if not -1, is the pipe to the pusher.
+ */
+    int
+stats_write( SNET *sn, int code, int fd )
+{
+    struct statvfs	vfs;
+    char		buf[ 256 ];
+    int			i, len, queue = -1;
+
+    if ( stats == NULL ) {
+	return( -1 );
+    }
+
+    for ( i = 0; i < STATS_NCMD; i++ ) {
+	stats_hist( sn, code, stats_names[ i ], &stats->st_cmd[ i ] );
+    }
+
+    /* snet_writef() has no %u, lines are formatted here */
+    snprintf( buf, sizeof( buf ), "handshakes=%u resumed=%u",
+	    stats->st_tls, stats->st_tls_resumed );
+    snet_writef( sn, "%d-TLS %s\r\n", code, buf );
+
+    if ( statvfs( ".", &vfs ) == 0 ) {
+	snprintf( buf, sizeof( buf ), "blocks=%llu bfree=%llu files=%llu "
+		"ffree=%llu", (unsigned long long)vfs.f_blocks,
+		(unsigned long long)vfs.f_bfree,
+		(unsigned long long)vfs.f_files,
+		(unsigned long long)vfs.f_ffree );
+	snet_writef( sn, "%d-STORE %s\r\n", code, buf );
+    } else {
+	syslog( LOG_ERR, "stats_write: statvfs: %m" );
+    }
+
+    for ( i = 0, len = 0; i < STATS_NREPL; i++ ) {
+	len += snprintf( buf + len, sizeof( buf ) - len, " %s=%u",
+		stats_repl_names[ i ], stats->st_repl[ i ] );
+    }
+#ifdef FIONREAD
+    /* bytes written by workers that the pusher has yet to read */
+    if ( fd >= 0 && ioctl( fd, FIONREAD, &queue ) < 0 ) {
+	queue = -1;
+    }
+#endif /* FIONREAD */
+    if ( queue >= 0 ) {
+	snprintf( buf + len, sizeof( buf ) - len, " backlog=%d", queue );
+    }
+    snet_writef( sn, "%d-REPLICATION%s\r\n", code, buf );
+
+    return( 0 );
+}
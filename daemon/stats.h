@@ -0,0 +1,56 @@
+/*
+ * Copyright (c) 2004 Regents of The University of Michigan.
+ * All Rights Reserved.  See COPYRIGHT.
+ */
+
+/* commands whose latency is tracked */
+#define STATS_NONE	-1
+#define STATS_LOGIN	0
+#define STATS_REGISTER	1
+#define STATS_CHECK	2
+#define STATS_RETR	3
+#define STATS_TIME	4
+#define STATS_LOGOUT	5
+#define STATS_MCHECK	6
+#define STATS_NCMD	7
+
+/* replication counters */
+#define STATS_REPL_QUEUED	0	/* taken from the workers' pipe */
+#define STATS_REPL_SENT		1	/* handed to a replica's pusher */
+#define STATS_REPL_SKIPPED	2	/* replica's pusher was backed up */
+#define STATS_REPL_DONE		3	/* answered by a replica */
+#define STATS_REPL_FAILED	4	/* pusher gave up on a replica */
+#define STATS_NREPL		5
+
+/*
+ * latencies in microseconds, HDR style: exact below STATS_SUB, and
+ * above that STATS_SUB / 2 buckets for each power of two, each at most
+ * an eighth as wide as the values in it.  reported as the bucket's
+ * middle, every value is within about 6%, up to 2^32 usec.
+ */
+#define STATS_SUB_BITS	4
+#define STATS_SUB	( 1 << STATS_SUB_BITS )
+#define STATS_BUCKETS	( STATS_SUB + ( 32 - STATS_SUB_BITS ) * STATS_SUB / 2 )
+
+struct stats_hist {
+    unsigned int	sh_count;
+    unsigned int	sh_fail;
+    unsigned int	sh_max;
+    unsigned long long	sh_total;
+    unsigned int	sh_bucket[ STATS_BUCKETS ];
+};
+
+/* counters shared by the parent and every child, in anonymous memory */
+struct stats {
+    unsigned int	st_tls;
+    unsigned int	st_tls_resumed;
+    struct stats_hist	st_cmd[ STATS_NCMD ];
+    unsigned int	st_repl[ STATS_NREPL ];
+};
+
+int	stats_init( void );
+void	stats_tls( int );
+void	stats_command( int, struct timeval *, int );
+void	stats_repl( int );
+int	stats_write( SNET *, int, int );
+void	stats_log( void );
@@ -0,0 +1,168 @@
+/*
+ * Copyright (c) 2004 Regents of The University of Michigan.
+ * All Rights Reserved.  See LICENSE.
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "cparse.h"
+#include "mkcookie.h"
+#include "store.h"
+
+struct store_ops	*store = NULL;
+
+/* set by commit_init() when writes are to be made durable */
+int			store_durable = 0;
+
+static struct store_ops	*store_backends[] = {
+    &store_file,
+    &store_shm,
+    &store_log,
+    NULL,
+};
+
+/*
+ * picks the backend named in the config, the file store by default,
+ * and readies it.  called once, before cosignd or monster forks.
+ */
+    int
+store_init( char *name )
+{
+    int			i;
+
+    if ( name == NULL ) {
+	name = store_file.so_name;
+    }
+    for ( i = 0; store_backends[ i ] != NULL; i++ ) {
+	if ( strcasecmp( name, store_backends[ i ]->so_name ) == 0 ) {
+	    break;
+	}
+    }
+    if ( store_backends[ i ] == NULL ) {
+	syslog( LOG_ERR, "store_init: unknown store %s", name );
+	return( -1 );
+    }
+    store = store_backends[ i ];
+
+    return( (*store->so_init)());
+}
+
+/*
+ * whether a cookie name is fit to be stored, whatever the backend:
+ * name=value, with more than two characters of value, and nothing
+ * that could be taken for a path.  returns 0 if so, -1 if not.
+ */
+    int
+store_valid( char *cookie )
+{
+    char		*p;
+
+    if ( strchr( cookie, '/' ) != NULL ) {
+	return( -1 );
+    }
+    if ( strlen( cookie ) >= MAXCOOKIELEN ) {
+	return( -1 );
+    }
+    if (( p = strchr( cookie, '=' )) == NULL ) {
+	return( -1 );
+    }
+    if ( strlen( p ) <= 2 ) {
+	return( -1 );
+    }
+    return( 0 );
+}
+
+/*
+ * called by monster after each pass over the store.
+ */
+    int
+store_sync( void )
+{
+    if ( store->so_sync == NULL ) {
+	return( 0 );
+    }
+    return( (*store->so_sync)());
+}
+
+/* FNV-1a, for backends that hash cookie names */
+    unsigned int
+store_hash( char *name )
+{
+    unsigned int	h = 2166136261U;
+
+    for ( ; *name != '\0'; name++ ) {
+	h ^= (unsigned char)*name;
+	h *= 16777619U;
+    }
+    return( h );
+}
+
+/*
+ * a mutex in memory shared between processes, made once by whoever
+ * creates the memory.  it's robust, so a lock left behind by a process
+ * that died holding it passes to the next process to take it.
+ */
+    int
+store_lock_init( pthread_mutex_t *lock )
+{
+    pthread_mutexattr_t	attr;
+    int			rc;
+
+    if (( rc = pthread_mutexattr_init( &attr )) != 0 ) {
+	errno = rc;
+	syslog( LOG_ERR, "store_lock_init: pthread_mutexattr_init: %m" );
+	return( -1 );
+    }
+    if (( rc = pthread_mutexattr_setpshared( &attr,
+	    PTHREAD_PROCESS_SHARED )) != 0 ||
+	    ( rc = pthread_mutexattr_setrobust( &attr,
+	    PTHREAD_MUTEX_ROBUST )) != 0 ||
+	    ( rc = pthread_mutex_init( lock, &attr )) != 0 ) {
+	errno = rc;
+	syslog( LOG_ERR, "store_lock_init: %m" );
+	(void)pthread_mutexattr_destroy( &attr );
+	return( -1 );
+    }
+    (void)pthread_mutexattr_destroy( &attr );
+    return( 0 );
+}
+
+/*
+ * returns 1 if the lock was taken from a process that died holding it,
+ * so that what it guards may be half changed, and 0 otherwise.  going
+ * on without the lock would corrupt what it guards, so not getting it
+ * is fatal.
+ */
+    int
+store_lock( pthread_mutex_t *lock )
+{
+    int			rc;
+
+    if (( rc = pthread_mutex_lock( lock )) == 0 ) {
+	return( 0 );
+    }
+    if ( rc == EOWNERDEAD ) {
+	syslog( LOG_NOTICE, "store_lock: taken from an exited process" );
+	if (( rc = pthread_mutex_consistent( lock )) == 0 ) {
+	    return( 1 );
+	}
+    }
+    errno = rc;
+    syslog( LOG_ERR, "store_lock: %m" );
+    exit( 1 );
+}
+
+    void
+store_unlock( pthread_mutex_t *lock )
+{
+    (void)pthread_mutex_unlock( lock );
+}
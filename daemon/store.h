@@ -0,0 +1,83 @@
+/*
+ * Copyright (c) 2004 Regents of The University of Michigan.
+ * All Rights Reserved.  See COPYRIGHT.
+ */
+
+/*
+ * a session store holds login cookies, and the service cookies
+ * registered to them.  cookies are always named in full, "cosign=..."
+ * or "cosign-service=...", and each backend keeps them as it likes.
+ *
+ * so_get() returns 0 if the login cookie was found, 1 if it wasn't and
+ * -1 on error.  so_put() and so_register() return 1 if asked to create
+ * a cookie that already exists.  so_service() returns -1 if the service
+ * cookie can't be found, logging only real errors.  so_touch() sets the
+ * time of last activity, to now if given 0.  so_iterate() calls its
+ * function with the name of every cookie in a bucket, stopping early if
+ * the function returns less than 0.  so_sync(), which may be NULL,
+ * writes out whatever a backend needs to survive a restart.
+ * so_commit(), which may also be NULL, makes the last writes to each of
+ * a list of cookies durable, and can be called from any process.
+ * so_peek(), which may be NULL, is so_get() for monster: only the
+ * login cookie's state, itime and ctime need be filled in, and a
+ * backend that can tell those without reading the rest does.
+ * so_prefetch(), which may be NULL, is told of cookies about to be
+ * looked up, for a backend that can ready them all at once.
+ * so_index_add(), so_index_iterate() and so_index_keys(), which may be
+ * NULL together, keep uindex.c's indexes in the store, for a backend
+ * that would rather not have a file made for each key.  so_index_add()
+ * files a cookie under a key, so_index_iterate() calls its function
+ * with each cookie filed under a key, dropping those for which it
+ * returns more than 0, and so_index_keys() calls its function with
+ * every key that has cookies filed under it, perhaps more than once.
+ * both stop early if the function returns less than 0, and neither
+ * holds a lock while calling it.  everything else returns 0 or -1.
+ */
+struct cinfo;
+
+struct store_ops {
+    char	*so_name;
+    int		(*so_init)( void );
+    int		(*so_get)( char *, struct cinfo * );
+    int		(*so_put)( char *, struct cinfo *, int );
+    int		(*so_logout)( char * );
+    int		(*so_touch)( char *, time_t );
+    int		(*so_register)( char *, char * );
+    int		(*so_service)( char *, char * );
+    int		(*so_rekey)( char *, char * );
+    int		(*so_buckets)( void );
+    int		(*so_iterate)( int, int (*)( char *, void * ), void * );
+    int		(*so_expire)( char * );
+    int		(*so_sync)( void );
+    int		(*so_commit)( char **, int );
+    int		(*so_peek)( char *, struct cinfo * );
+    int		(*so_prefetch)( char **, int );
+    int		(*so_index_add)( int, char *, char * );
+    int		(*so_index_iterate)( int, char *,
+		    int (*)( char *, void * ), void * );
+    int		(*so_index_keys)( int, int (*)( char *, void * ), void * );
+};
+
+/* so_put() flags */
+#define STORE_CREATE	0
+#define STORE_REPLACE	1
+
+/* so_index_*() indexes */
+#define STORE_USERS	0
+#define STORE_SERVICES	1
+#define STORE_EXPIRE	2
+#define STORE_INDEXES	3
+
+extern struct store_ops	*store;
+extern int		store_durable;
+extern struct store_ops	store_file;
+extern struct store_ops	store_shm;
+extern struct store_ops	store_log;
+
+int	store_init( char * );
+int	store_valid( char * );
+int	store_sync( void );
+unsigned int	store_hash( char * );
+int	store_lock_init( pthread_mutex_t * );
+int	store_lock( pthread_mutex_t * );
+void	store_unlock( pthread_mutex_t * );
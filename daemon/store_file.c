@@ -0,0 +1,839 @@
+/*
+ * Copyright (c) 2004 Regents of The University of Michigan.
+ * All Rights Reserved.  See LICENSE.
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/param.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <utime.h>
+#ifdef HAVE_SYS_XATTR_H
+#include <sys/xattr.h>
+#endif /* HAVE_SYS_XATTR_H */
+
+#include "cparse.h"
+#include "atomfile.h"
+#include "mkcookie.h"
+#include "store.h"
+#include "commit.h"
+#include "uring.h"
+
+/*
+ * the original store: a file per cookie in the working directory, or
+ * in 64 or 4096 subdirectories named for the first characters of the
+ * cookie's value, as cosigndbhashlen says, with a second level of 64
+ * or 4096 under each of the 4096 for 3 and 4.  the second level is
+ * made as it's needed.  a login cookie is logged out when its setgid
+ * bit is set, and its mtime is the time of last activity.  its ctime
+ * is kept in an extended attribute as well, where the filesystem will,
+ * so that monster can tell whether it's expired without opening it.  a
+ * service cookie holds the name of its login cookie.
+ *
+ * while cosigndbrehash names the hashlen the store had before, cookies
+ * are moved from that layout to the new one as they're looked up, and
+ * iterating moves each of the old layout's buckets after the new ones,
+ * so that monster empties the old layout within a pass.
+ *
+ * a directory made for a cookie is only there after a crash once its
+ * parent is synced too.  where writes are made durable, the ones made
+ * since the last commit are kept in memory shared by every worker, and
+ * the next commit syncs their parents along with its cookies.
+ */
+
+extern int	hashlen;
+extern int	oldhashlen;
+
+#define FILE_CTIME_XATTR	"user.cosign.ctime"
+
+/* directories made and not yet committed, at most "xx/yy" each */
+#define FILE_NEWDIRS		64
+
+struct file_newdirs {
+    pthread_mutex_t	fn_lock;
+    int			fn_count;
+    char		fn_dirs[ FILE_NEWDIRS ][ 6 ];
+};
+
+static struct file_newdirs	*newdirs = NULL;
+
+static char	*sixtyfourchars = "abcdefghijklmnopqrstuvwxyz"
+				    "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+				    "0123456789+-";
+
+static int	file_init( void );
+static int	file_get( char *, struct cinfo * );
+static int	file_put( char *, struct cinfo *, int );
+static int	file_logout( char * );
+static int	file_touch( char *, time_t );
+static int	file_register( char *, char * );
+static int	file_service( char *, char * );
+static int	file_rekey( char *, char * );
+static int	file_buckets( void );
+static int	file_iterate( int, int (*)( char *, void * ), void * );
+static int	file_expire( char * );
+static int	file_commit( char **, int );
+static int	file_peek( char *, struct cinfo * );
+static int	file_prefetch( char **, int );
+static int	file_path( char *, char *, int );
+static int	file_move( char *, char * );
+static int	file_mkdirs( char * );
+static int	file_newdir( char * );
+static int	file_syncnew( void );
+static int	file_syncdir( char * );
+static int	file_nbuckets( int );
+static int	file_scan( char *, int, int (*)( char *, void * ), void * );
+static FILE	*file_tmp( struct atomfile *, int );
+static int	file_link( struct atomfile *, FILE *, char *, int );
+
+struct store_ops	store_file = {
+    "file",
+    file_init,
+    file_get,
+    file_put,
+    file_logout,
+    file_touch,
+    file_register,
+    file_service,
+    file_rekey,
+    file_buckets,
+    file_iterate,
+    file_expire,
+    NULL,
+    file_commit,
+    file_peek,
+    file_prefetch,
+    NULL,
+    NULL,
+    NULL,
+};
+
+    static int
+file_init( void )
+{
+    if ( hashlen < 0 || hashlen > 4 ) {
+	syslog( LOG_ERR, "Illegal hashlen %d", hashlen );
+	return( -1 );
+    }
+    if ( oldhashlen == hashlen ) {
+	oldhashlen = -1;
+    }
+    if ( oldhashlen < -1 || oldhashlen > 4 ) {
+	syslog( LOG_ERR, "Illegal rehash from hashlen %d", oldhashlen );
+	return( -1 );
+    }
+    if ( oldhashlen >= 0 ) {
+	syslog( LOG_NOTICE, "rehashing from hashlen %d to %d",
+		oldhashlen, hashlen );
+    }
+
+    if ( newdirs == NULL ) {
+	if (( newdirs = (struct file_newdirs *)mmap( NULL,
+		sizeof( struct file_newdirs ), PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_ANON, -1, 0 )) == MAP_FAILED ) {
+	    syslog( LOG_ERR, "file_init: mmap: %m" );
+	    newdirs = NULL;
+	    return( -1 );
+	}
+	memset( newdirs, 0, sizeof( struct file_newdirs ));
+	if ( store_lock_init( &newdirs->fn_lock ) < 0 ) {
+	    (void)munmap( newdirs, sizeof( struct file_newdirs ));
+	    newdirs = NULL;
+	    return( -1 );
+	}
+    }
+    return( 0 );
+}
+
+    static int
+file_path( char *cookie, char *path, int len )
+{
+    if ( mkcookiepath( NULL, hashlen, cookie, path, len ) < 0 ) {
+	syslog( LOG_ERR, "file_path: %s: mkcookiepath error", cookie );
+	return( -1 );
+    }
+    if ( oldhashlen >= 0 && file_move( cookie, path ) < 0 ) {
+	return( -1 );
+    }
+    return( 0 );
+}
+
+/*
+ * while rehashing, moves cookie from its old path to path, its new one,
+ * if it's not already there.  linking rather than renaming means a
+ * cookie already written to path is never replaced by the old copy.
+ * where writes are durable, the new link, and any directory made for
+ * it, is synced before the old one goes.
+ */
+    static int
+file_move( char *cookie, char *path )
+{
+    struct stat		st;
+    char		oldpath[ MAXPATHLEN ];
+
+    if ( lstat( path, &st ) == 0 || errno != ENOENT ) {
+	return( 0 );
+    }
+    if ( mkcookiepath( NULL, oldhashlen, cookie, oldpath,
+	    sizeof( oldpath )) < 0 ) {
+	syslog( LOG_ERR, "file_move: %s: mkcookiepath error", cookie );
+	return( -1 );
+    }
+    if ( link( oldpath, path ) != 0 ) {
+	if ( errno == EEXIST ) {
+	    /* moved, or written anew, since we looked */
+	} else if ( errno != ENOENT || lstat( oldpath, &st ) != 0 ) {
+	    /* not in the old layout either */
+	    return( 0 );
+	} else if ( file_mkdirs( path ) < 0 || link( oldpath, path ) != 0 ) {
+	    if ( errno != EEXIST ) {
+		syslog( LOG_ERR, "file_move: link %s to %s: %m",
+			oldpath, path );
+		return( -1 );
+	    }
+	}
+    }
+    if ( store_durable && ( file_syncdir( path ) != 0 ||
+	    file_syncnew() != 0 )) {
+	return( -1 );
+    }
+    if ( unlink( oldpath ) != 0 && errno != ENOENT ) {
+	syslog( LOG_ERR, "file_move: unlink %s: %m", oldpath );
+	return( -1 );
+    }
+    return( 0 );
+}
+
+/* makes the directories path will be in */
+    static int
+file_mkdirs( char *path )
+{
+    char		*p;
+
+    for ( p = strchr( path, '/' ); p != NULL; p = strchr( p + 1, '/' )) {
+	*p = '\0';
+	if ( mkdir( path, 0755 ) == 0 ) {
+	    if ( file_newdir( path ) != 0 ) {
+		*p = '/';
+		return( -1 );
+	    }
+	} else if ( errno != EEXIST ) {
+	    syslog( LOG_ERR, "file_mkdirs: %s: %m", path );
+	    *p = '/';
+	    return( -1 );
+	}
+	*p = '/';
+    }
+    return( 0 );
+}
+
+/*
+ * remembers dir, just made, for the next commit to sync its parent, or
+ * syncs it now if there's no room.
+ */
+    static int
+file_newdir( char *dir )
+{
+    if ( !store_durable ) {
+	return( 0 );
+    }
+    if ( newdirs != NULL && strlen( dir ) < sizeof( newdirs->fn_dirs[ 0 ] )) {
+	if ( store_lock( &newdirs->fn_lock ) != 0 &&
+		( newdirs->fn_count < 0 ||
+		newdirs->fn_count > FILE_NEWDIRS )) {
+	    newdirs->fn_count = 0;
+	}
+	if ( newdirs->fn_count < FILE_NEWDIRS ) {
+	    strcpy( newdirs->fn_dirs[ newdirs->fn_count ], dir );
+	    newdirs->fn_count++;
+	    store_unlock( &newdirs->fn_lock );
+	    return( 0 );
+	}
+	store_unlock( &newdirs->fn_lock );
+    }
+    return( file_syncdir( dir ));
+}
+
+/*
+ * syncs the parent of each directory made since the last commit, once
+ * however many were made in it.  the lock is held throughout, so that
+ * no commit returns while another is still syncing its directories.
+ */
+    static int
+file_syncnew( void )
+{
+    char		*p, *q;
+    int			i, j, len, rc = 0;
+
+    if ( newdirs == NULL ) {
+	return( 0 );
+    }
+    if ( store_lock( &newdirs->fn_lock ) != 0 &&
+	    ( newdirs->fn_count < 0 || newdirs->fn_count > FILE_NEWDIRS )) {
+	newdirs->fn_count = FILE_NEWDIRS;
+    }
+    for ( i = 0; i < newdirs->fn_count; i++ ) {
+	newdirs->fn_dirs[ i ][ sizeof( newdirs->fn_dirs[ i ] ) - 1 ] = '\0';
+	p = strrchr( newdirs->fn_dirs[ i ], '/' );
+	len = ( p == NULL ) ? 0 : p - newdirs->fn_dirs[ i ];
+	for ( j = 0; j < i; j++ ) {
+	    q = strrchr( newdirs->fn_dirs[ j ], '/' );
+	    if ((( q == NULL ) ? 0 : q - newdirs->fn_dirs[ j ]) == len &&
+		    strncmp( newdirs->fn_dirs[ j ],
+		    newdirs->fn_dirs[ i ], len ) == 0 ) {
+		break;
+	    }
+	}
+	if ( j == i && file_syncdir( newdirs->fn_dirs[ i ] ) != 0 ) {
+	    rc = -1;
+	}
+    }
+    newdirs->fn_count = 0;
+    store_unlock( &newdirs->fn_lock );
+
+    return( rc );
+}
+
+/* fsyncs the directory path is in */
+    static int
+file_syncdir( char *path )
+{
+    char		dir[ MAXPATHLEN ], *p;
+    int			fd, rc = 0;
+
+    if (( p = strrchr( path, '/' )) == NULL ) {
+	strcpy( dir, "." );
+    } else if ( p - path >= (int)sizeof( dir )) {
+	syslog( LOG_ERR, "file_syncdir: %s: path too long", path );
+	return( -1 );
+    } else {
+	memcpy( dir, path, p - path );
+	dir[ p - path ] = '\0';
+    }
+
+    if (( fd = open( dir, O_RDONLY )) < 0 ) {
+	syslog( LOG_ERR, "file_syncdir: %s: %m", dir );
+	return( -1 );
+    }
+    if ( fsync( fd ) != 0 ) {
+	syslog( LOG_ERR, "file_syncdir: fsync %s: %m", dir );
+	rc = -1;
+    }
+    (void)close( fd );
+    return( rc );
+}
+
+/*
+ * a new file in the working directory, to be written and then put in
+ * place by file_link() with the same flags.
+ */
+    static FILE *
+file_tmp( struct atomfile *af, int flags )
+{
+    FILE		*tmpfile;
+    int			fd;
+
+    if (( fd = atomfile_open( af, NULL, 0644,
+	    ( flags & STORE_REPLACE ) ? ATOMFILE_REPLACE : 0 )) < 0 ) {
+	syslog( LOG_ERR, "file_tmp: open: %m" );
+	return( NULL );
+    }
+
+    if (( tmpfile = fdopen( fd, "w" )) == NULL ) {
+	syslog( LOG_ERR, "file_tmp: fdopen: %m" );
+	(void)close( fd );
+	if ( atomfile_abort( af ) != 0 ) {
+	    syslog( LOG_ERR, "file_tmp: unlink: %m" );
+	}
+	return( NULL );
+    }
+
+    return( tmpfile );
+}
+
+/*
+ * puts a finished tmp file in place, and closes it.  STORE_REPLACE
+ * replaces whatever is there, otherwise 1 is returned if path already
+ * exists.
+ */
+    static int
+file_link( struct atomfile *af, FILE *tmpfile, char *path, int flags )
+{
+    int			aflags = 0, rc = 0;
+
+    if ( flags & STORE_REPLACE ) {
+	aflags = ATOMFILE_REPLACE;
+    }
+
+    if ( fflush( tmpfile ) != 0 ) {
+	syslog( LOG_ERR, "file_link: fflush: %m" );
+	rc = -1;
+    } else if ( atomfile_link( af, path, aflags ) != 0 && ( errno != ENOENT ||
+	    file_mkdirs( path ) != 0 || atomfile_link( af, path, aflags ) != 0 )) {
+	if ( errno == EEXIST && !( flags & STORE_REPLACE )) {
+	    rc = 1;
+	} else {
+	    syslog( LOG_ERR, "file_link: %s: %m", path );
+	    rc = -1;
+	}
+    }
+
+    if ( rc != 0 && atomfile_abort( af ) != 0 ) {
+	syslog( LOG_ERR, "file_link: unlink %s: %m", af->af_tmp );
+    }
+    if ( fclose( tmpfile ) != 0 ) {
+	syslog( LOG_ERR, "file_link: fclose: %m" );
+    }
+    return( rc );
+}
+
+    static int
+file_get( char *cookie, struct cinfo *ci )
+{
+    char		path[ MAXPATHLEN ];
+
+    if ( file_path( cookie, path, sizeof( path )) < 0 ) {
+	return( -1 );
+    }
+    return( read_cookie( path, ci ));
+}
+
+    static int
+file_put( char *cookie, struct cinfo *ci, int flags )
+{
+    char		path[ MAXPATHLEN ];
+    struct atomfile	af;
+    FILE		*tmpfile;
+
+    if ( file_path( cookie, path, sizeof( path )) < 0 ) {
+	return( -1 );
+    }
+    if (( tmpfile = file_tmp( &af, flags )) == NULL ) {
+	return( -1 );
+    }
+
+    fprintf( tmpfile, "v2\n" );
+    fprintf( tmpfile, "s1\n" );	 /* 1 is logged in, 0 is logged out */
+    fprintf( tmpfile, "i%s\n", ci->ci_ipaddr );
+    fprintf( tmpfile, "j%s\n", ci->ci_ipaddr_cur );
+    fprintf( tmpfile, "p%s\n", ci->ci_user );
+    fprintf( tmpfile, "r%s\n", ci->ci_realm );
+    fprintf( tmpfile, "t%s\n", ci->ci_ctime );
+    if ( *ci->ci_krbtkt != '\0' ) {
+	fprintf( tmpfile, "k%s\n", ci->ci_krbtkt );
+    }
+
+#ifdef HAVE_SYS_XATTR_H
+    /* without it, file_peek() reads the cookie */
+    (void)fsetxattr( af.af_fd, FILE_CTIME_XATTR, ci->ci_ctime,
+	    strlen( ci->ci_ctime ), 0 );
+#endif /* HAVE_SYS_XATTR_H */
+
+    return( file_link( &af, tmpfile, path, flags ));
+}
+
+/*
+ * a login cookie's state and itime are its mode and mtime, and its
+ * ctime is in an extended attribute, so a stat() and a getxattr() are
+ * enough.  a cookie without the attribute is read.
+ */
+    static int
+file_peek( char *cookie, struct cinfo *ci )
+{
+    char		path[ MAXPATHLEN ];
+#ifdef HAVE_SYS_XATTR_H
+    struct stat		st;
+    ssize_t		len;
+#endif /* HAVE_SYS_XATTR_H */
+
+    if ( file_path( cookie, path, sizeof( path )) < 0 ) {
+	return( -1 );
+    }
+
+#ifdef HAVE_SYS_XATTR_H
+    if ( stat( path, &st ) != 0 ) {
+	if ( errno == ENOENT ) {
+	    return( 1 );
+	}
+	syslog( LOG_ERR, "file_peek: %s: %m", path );
+	return( -1 );
+    }
+    if (( len = getxattr( path, FILE_CTIME_XATTR, ci->ci_ctime,
+	    sizeof( ci->ci_ctime ) - 1 )) > 0 ) {
+	ci->ci_ctime[ len ] = '\0';
+	ci->ci_version = 2;
+	ci->ci_state = (( st.st_mode & S_ISGID ) == 0 );
+	ci->ci_itime = st.st_mtime;
+	*ci->ci_ipaddr = *ci->ci_ipaddr_cur = *ci->ci_user = '\0';
+	*ci->ci_realm = *ci->ci_krbtkt = '\0';
+	return( 0 );
+    }
+#endif /* HAVE_SYS_XATTR_H */
+
+    return( read_cookie( path, ci ));
+}
+
+    static int
+file_logout( char *cookie )
+{
+    char		path[ MAXPATHLEN ];
+
+    if ( file_path( cookie, path, sizeof( path )) < 0 ) {
+	return( -1 );
+    }
+    return( do_logout( path ));
+}
+
+    static int
+file_touch( char *cookie, time_t when )
+{
+    struct utimbuf	ut;
+    char		path[ MAXPATHLEN ];
+    int			rc;
+
+    if ( file_path( cookie, path, sizeof( path )) < 0 ) {
+	return( -1 );
+    }
+    if ( when == 0 ) {
+	rc = utime( path, NULL );
+    } else {
+	ut.actime = ut.modtime = when;
+	rc = utime( path, &ut );
+    }
+    if ( rc < 0 && errno != ENOENT ) {
+	syslog( LOG_ERR, "file_touch: %s: %m", path );
+    }
+    return( rc );
+}
+
+    static int
+file_register( char *scookie, char *login )
+{
+    char		path[ MAXPATHLEN ];
+    struct atomfile	af;
+    FILE		*tmpfile;
+
+    if ( file_path( scookie, path, sizeof( path )) < 0 ) {
+	return( -1 );
+    }
+    if (( tmpfile = file_tmp( &af, STORE_CREATE )) == NULL ) {
+	return( -1 );
+    }
+
+    /* the service cookie file contains the login cookie only */
+    fprintf( tmpfile, "l%s\n", login );
+
+    return( file_link( &af, tmpfile, path, STORE_CREATE ));
+}
+
+    static int
+file_service( char *scookie, char *login )
+{
+    char		path[ MAXPATHLEN ];
+
+    if ( file_path( scookie, path, sizeof( path )) < 0 ) {
+	return( -1 );
+    }
+    return( service_to_login( path, login ));
+}
+
+    static int
+file_rekey( char *scookie, char *newcookie )
+{
+    char		path[ MAXPATHLEN ], newpath[ MAXPATHLEN ];
+
+    if ( file_path( scookie, path, sizeof( path )) < 0 ||
+	    file_path( newcookie, newpath, sizeof( newpath )) < 0 ) {
+	return( -1 );
+    }
+    if ( rename( path, newpath ) != 0 && ( errno != ENOENT ||
+	    file_mkdirs( newpath ) != 0 || rename( path, newpath ) != 0 )) {
+	syslog( LOG_ERR, "file_rekey: rename %s to %s: %m", path, newpath );
+	return( -1 );
+    }
+    return( 0 );
+}
+
+/*
+ * a bucket is a hash directory, or for 3 and 4 one of the 4096 with
+ * everything under it.  while rehashing, the old layout's buckets
+ * follow the new one's.
+ */
+    static int
+file_nbuckets( int len )
+{
+    switch ( len ) {
+    case 1 :
+	return( 64 );
+
+    case 2 :
+    case 3 :
+    case 4 :
+	return( 64 * 64 );
+
+    default :
+	return( 1 );
+    }
+}
+
+    static int
+file_buckets( void )
+{
+    if ( oldhashlen >= 0 ) {
+	return( file_nbuckets( hashlen ) + file_nbuckets( oldhashlen ));
+    }
+    return( file_nbuckets( hashlen ));
+}
+
+    static int
+file_iterate( int bucket, int (*fn)( char *, void * ), void *arg )
+{
+    DIR			*dirp;
+    struct dirent	*de;
+    char		dir[ 3 ], sub[ MAXPATHLEN ];
+    int			len = hashlen, rc = 0;
+
+    if ( bucket >= file_nbuckets( hashlen )) {
+	bucket -= file_nbuckets( hashlen );
+	len = oldhashlen;
+    }
+
+    switch ( len ) {
+    case 1 :
+	dir[ 0 ] = sixtyfourchars[ bucket ];
+	dir[ 1 ] = '\0';
+	break;
+
+    case 2 :
+    case 3 :
+    case 4 :
+	dir[ 0 ] = sixtyfourchars[ bucket / 64 ];
+	dir[ 1 ] = sixtyfourchars[ bucket % 64 ];
+	dir[ 2 ] = '\0';
+	break;
+
+    default :
+	strcpy( dir, "." );
+	break;
+    }
+
+    if ( len <= 2 ) {
+	return( file_scan( dir, len, fn, arg ));
+    }
+
+    /* the second level, made as it's needed */
+    if (( dirp = opendir( dir )) == NULL ) {
+	if ( errno == ENOENT ) {
+	    return( 0 );
+	}
+	syslog( LOG_ERR, "file_iterate: %s: %m", dir );
+	return( -1 );
+    }
+    while (( de = readdir( dirp )) != NULL ) {
+	if ((int)strlen( de->d_name ) != len - 2 ||
+		(int)strspn( de->d_name, sixtyfourchars ) != len - 2 ) {
+	    continue;
+	}
+	snprintf( sub, sizeof( sub ), "%s/%s", dir, de->d_name );
+	if (( rc = file_scan( sub, len, fn, arg )) < 0 ) {
+	    break;
+	}
+    }
+    if ( closedir( dirp ) != 0 ) {
+	syslog( LOG_ERR, "file_iterate: closedir %s: %m", dir );
+	return( -1 );
+    }
+
+    return( rc < 0 ? rc : 0 );
+}
+
+/*
+ * calls fn with each cookie in dir, which is in the layout for len.
+ * while rehashing, layouts can share a directory, so a cookie is only
+ * taken as in dir if its path for len says so, and cookies found in
+ * the old layout are moved to the new one first.
+ */
+    static int
+file_scan( char *dir, int len, int (*fn)( char *, void * ), void *arg )
+{
+    DIR			*dirp;
+    struct dirent	*de;
+    char		path[ MAXPATHLEN ], *p;
+    int			rc = 0, moved = 0;
+
+    /* buckets are made as they're needed, one never written is empty */
+    if (( dirp = opendir( dir )) == NULL ) {
+	if ( errno == ENOENT ) {
+	    return( 0 );
+	}
+	syslog( LOG_ERR, "file_iterate: %s: %m", dir );
+	return( -1 );
+    }
+    while (( de = readdir( dirp )) != NULL ) {
+	/* skip tmp files and anything else that isn't a cookie */
+	if ( strncmp( de->d_name, "cosign", 6 ) != 0 ||
+		store_valid( de->d_name ) < 0 ) {
+	    continue;
+	}
+#ifdef DT_REG
+	if ( de->d_type != DT_REG && de->d_type != DT_UNKNOWN ) {
+	    continue;
+	}
+#endif /* DT_REG */
+	if ( oldhashlen >= 0 ) {
+	    if ( mkcookiepath( NULL, len, de->d_name, path,
+		    sizeof( path )) < 0 ) {
+		continue;
+	    }
+	    if (( p = strrchr( path, '/' )) == NULL ) {
+		strcpy( path, "." );
+	    } else {
+		*p = '\0';
+	    }
+	    if ( strcmp( path, dir ) != 0 ) {
+		continue;
+	    }
+	    if ( len != hashlen ) {
+		if ( file_path( de->d_name, path, sizeof( path )) < 0 ) {
+		    continue;
+		}
+		moved++;
+	    }
+	}
+	if (( rc = (*fn)( de->d_name, arg )) < 0 ) {
+	    break;
+	}
+    }
+    if ( closedir( dirp ) != 0 ) {
+	syslog( LOG_ERR, "file_iterate: closedir %s: %m", dir );
+	return( -1 );
+    }
+    if ( moved > 0 ) {
+	syslog( LOG_INFO, "file_iterate: %s: moved %d cookies to hashlen %d",
+		dir, moved, hashlen );
+    }
+
+    return( rc < 0 ? rc : 0 );
+}
+
+    static int
+file_expire( char *cookie )
+{
+    char		path[ MAXPATHLEN ];
+
+    if ( file_path( cookie, path, sizeof( path )) < 0 ) {
+	return( -1 );
+    }
+    if ( unlink( path ) != 0 ) {
+	syslog( LOG_ERR, "file_expire: %s: %m", path );
+	return( -1 );
+    }
+    return( 0 );
+}
+
+/*
+ * fsyncs each cookie, and then each bucket directory once however many
+ * of the batch's cookies are in it, and the parent of each directory
+ * made since the last commit.  a bucket's name is at most "xx/yy".
+ */
+    static int
+file_commit( char **cookies, int n )
+{
+    char		path[ MAXPATHLEN ], dirs[ COMMIT_BATCH ][ 6 ];
+    char		*p;
+    int			i, j, fd, ndirs = 0, rc = 0;
+
+    for ( i = 0; i < n; i++ ) {
+	if ( file_path( cookies[ i ], path, sizeof( path )) < 0 ) {
+	    rc = -1;
+	    continue;
+	}
+	if (( fd = open( path, O_RDONLY )) < 0 ) {
+	    /* already gone, expired or replaced */
+	    if ( errno != ENOENT ) {
+		syslog( LOG_ERR, "file_commit: %s: %m", path );
+		rc = -1;
+	    }
+	    continue;
+	}
+	if ( fsync( fd ) != 0 ) {
+	    syslog( LOG_ERR, "file_commit: fsync %s: %m", path );
+	    rc = -1;
+	}
+	(void)close( fd );
+
+	/* the directory it's linked into */
+	if (( p = strrchr( path, '/' )) == NULL ) {
+	    strcpy( path, "." );
+	} else {
+	    *p = '\0';
+	}
+	for ( j = 0; j < ndirs; j++ ) {
+	    if ( strcmp( dirs[ j ], path ) == 0 ) {
+		break;
+	    }
+	}
+	if ( j < ndirs ) {
+	    continue;
+	}
+	if ( ndirs < COMMIT_BATCH && strlen( path ) < sizeof( dirs[ 0 ] )) {
+	    strcpy( dirs[ ndirs++ ], path );
+	}
+	if (( fd = open( path, O_RDONLY )) < 0 ) {
+	    syslog( LOG_ERR, "file_commit: %s: %m", path );
+	    rc = -1;
+	    continue;
+	}
+	if ( fsync( fd ) != 0 ) {
+	    syslog( LOG_ERR, "file_commit: fsync %s: %m", path );
+	    rc = -1;
+	}
+	(void)close( fd );
+    }
+
+    /* and the parents of any directories made for them */
+    if ( file_syncnew() != 0 ) {
+	rc = -1;
+    }
+
+    return( rc );
+}
+
+/*
+ * looks up the cookies' files together through io_uring, so that each
+ * one's lookup to come finds it cached.  while rehashing, a cookie not
+ * yet moved is looked for where it's going to be, and isn't warmed.
+ */
+    static int
+file_prefetch( char **cookies, int n )
+{
+    char		paths[ URING_BATCH ][ MAXPATHLEN ];
+    char		*p[ URING_BATCH ];
+    int			i, j;
+
+    for ( i = 0; i < n; i += j ) {
+	for ( j = 0; j < URING_BATCH && i + j < n; j++ ) {
+	    if ( mkcookiepath( NULL, hashlen, cookies[ i + j ],
+		    paths[ j ], sizeof( paths[ j ] )) < 0 ) {
+		return( -1 );
+	    }
+	    p[ j ] = paths[ j ];
+	}
+	if ( uring_prefetch( p, j ) != 0 ) {
+	    return( -1 );
+	}
+    }
+    return( 0 );
+}
@@ -0,0 +1,1477 @@
+/*
+ * Copyright (c) 2004 Regents of The University of Michigan.
+ * All Rights Reserved.  See LICENSE.
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cparse.h"
+#include "mkcookie.h"
+#include "store.h"
+
+/*
+ * cookies kept as records appended to numbered segment files in
+ * cosigndb, "log.00000001" and so on.  a login or service cookie is
+ * written once in full, and logouts, touches and expiries are appended
+ * after it as small delta records.  the newest segment is appended to
+ * until it's cosigndlogsegment megabytes, and then a new one is begun.
+ *
+ * an index in a POSIX shared memory segment maps each cookie's hash to
+ * the segment and offset of its full record, and holds its current
+ * state and time of last activity, so a read takes one pread().  the
+ * index is split into stripes, locked as in the shm store, and all
+ * appends are made under one more lock.  the logs are the truth: a
+ * process that finds no index creates one and replays every segment
+ * into it, as after a reboot.
+ *
+ * monster compacts after each pass.  the oldest segment is rewritten,
+ * its live records appended to the newest with their current state,
+ * and then removed, for as long as the oldest is less than half live.
+ * segments are only ever compacted oldest first, so no delta record is
+ * dropped while the full record it applies to remains.
+ *
+ * the users, services and expire indexes of uindex.c are kept in the
+ * log too.  filing a cookie under a key appends an index record, with
+ * an entry in the index as for a cookie, and dropping it appends an
+ * unindex delta.  as in the shm store, a key's entries are spread
+ * over LOG_KEYSTRIPES stripes in a row from the one its hash picks,
+ * and each holds the key's hash, so that a key's cookies are found
+ * without reading the records of others.
+ */
+
+extern char	*shm_name;
+extern int	shm_nslots;
+extern int	log_segsize;
+
+#define LOG_MAGIC	"cosignl3"
+#define LOG_PREFIX	"log."
+#define LOG_RECMAGIC	0xc051
+
+#define LOG_STRIPES	256
+#define LOG_MINSTRIPE	16
+#define LOG_KEYSTRIPES	16	/* stripes an index key is spread over */
+#define LOG_MAXREC	8192
+#define LOG_NFD		8
+
+/* lr_type */
+#define LOG_LOGIN	'L'
+#define LOG_SERVICE	'S'
+#define LOG_TOUCH	'T'
+#define LOG_LOGOUT	'O'
+#define LOG_EXPIRE	'X'
+#define LOG_INDEX	'I'
+#define LOG_UNINDEX	'U'
+
+/* le_seg */
+#define LOG_EMPTY	0
+#define LOG_DELETED	0xffffffff
+
+/*
+ * every record is padded to 8 bytes.  a login record is followed by
+ * the cookie name, ipaddr, ipaddr_cur, user, realm, ctime and krbtkt,
+ * each NUL terminated, a service record by its name and its login
+ * cookie's name, and a delta by the cookie name alone.  index and
+ * unindex records have the key and the cookie, with the index as their
+ * state.
+ */
+struct log_rec {
+    unsigned short	lr_magic;
+    unsigned char	lr_type;
+    unsigned char	lr_state;
+    unsigned int	lr_len;
+    time_t		lr_itime;
+};
+
+struct log_ent {
+    unsigned int	le_hash;
+    unsigned int	le_seg;
+    unsigned int	le_off;
+    unsigned int	le_key;		/* index entries' key hash */
+    int			le_type;
+    int			le_state;
+    time_t		le_itime;
+};
+
+struct log_header {
+    char		lh_magic[ 8 ];
+    unsigned int	lh_nslots;
+    unsigned int	lh_stripelen;
+    unsigned int	lh_active;
+    unsigned int	lh_end;
+    unsigned int	lh_oldest;
+    pthread_mutex_t	lh_loglock;
+    pthread_mutex_t	lh_lock[ LOG_STRIPES ];
+};
+
+#define LOG_HDRSIZE	(( sizeof( struct log_header ) + 63 ) & ~63 )
+#define LOG_PAD( len )	(((len) + 7 ) & ~7 )
+#define LOG_STRIPE( hash )	((hash) % LOG_STRIPES )
+
+static struct log_header	*lh = NULL;
+static struct log_ent		*log_ents = NULL;
+static char			log_buf[ LOG_MAXREC ];
+static struct {
+    unsigned int	lf_seg;
+    int			lf_fd;
+}				log_fds[ LOG_NFD ];
+static int			log_nextfd = 0;
+
+static int		log_init( void );
+static int		log_get( char *, struct cinfo * );
+static int		log_put( char *, struct cinfo *, int );
+static int		log_logout( char * );
+static int		log_touch( char *, time_t );
+static int		log_register( char *, char * );
+static int		log_service( char *, char * );
+static int		log_rekey( char *, char * );
+static int		log_buckets( void );
+static int		log_iterate( int, int (*)( char *, void * ), void * );
+static int		log_expire( char * );
+static int		log_sync( void );
+static int		log_commit( char **, int );
+static int		log_index_add( int, char *, char * );
+static int		log_index_iterate( int, char *,
+			    int (*)( char *, void * ), void * );
+static int		log_index_keys( int, int (*)( char *, void * ),
+			    void * );
+static int		log_fd( unsigned int, int );
+static int		log_syncdir( void );
+static int		log_append( int, int, time_t, char **, int,
+			    unsigned int *, unsigned int * );
+static struct log_rec	*log_read( unsigned int, unsigned int );
+static int		log_fields( struct log_rec *, char **, int );
+static struct log_ent	*log_find( char *, unsigned int, struct log_ent ** );
+static struct log_ent	*log_ifind( int, char **, unsigned int,
+			    struct log_ent ** );
+static unsigned int	log_ihash( char *, char * );
+static unsigned int	log_rechash( struct log_rec *, char ** );
+static struct log_ent	*log_live( unsigned int, unsigned int, unsigned int );
+static void		log_delete( struct log_ent * );
+static int		log_segments( unsigned int ** );
+static int		log_scan( unsigned int, unsigned int *,
+			    int (*)( unsigned int, unsigned int,
+			    struct log_rec *, void * ), void * );
+static int		log_replay( unsigned int, unsigned int,
+			    struct log_rec *, void * );
+static int		log_count( unsigned int, unsigned int,
+			    struct log_rec *, void * );
+static int		log_move( unsigned int, unsigned int,
+			    struct log_rec *, void * );
+
+struct store_ops	store_log = {
+    "log",
+    log_init,
+    log_get,
+    log_put,
+    log_logout,
+    log_touch,
+    log_register,
+    log_service,
+    log_rekey,
+    log_buckets,
+    log_iterate,
+    log_expire,
+    log_sync,
+    log_commit,
+    NULL,
+    NULL,
+    log_index_add,
+    log_index_iterate,
+    log_index_keys,
+};
+
+/*
+ * attaches to the index, creating it and replaying the logs into it if
+ * need be.  as with the shm store, this is done under flock().
+ */
+    static int
+log_init( void )
+{
+    struct stat		st;
+    size_t		size;
+    unsigned int	stripelen, *segs = NULL;
+    int			fd, i, nsegs, created = 0;
+
+    if ( log_segsize <= 0 ) {
+	syslog( LOG_ERR, "Illegal log segment size %d", log_segsize );
+	return( -1 );
+    }
+    for ( i = 0; i < LOG_NFD; i++ ) {
+	log_fds[ i ].lf_fd = -1;
+    }
+
+    stripelen = LOG_MINSTRIPE;
+    while ( stripelen * LOG_STRIPES < (unsigned int)shm_nslots ) {
+	stripelen <<= 1;
+    }
+
+    if (( fd = shm_open( shm_name, O_RDWR | O_CREAT, 0600 )) < 0 ) {
+	syslog( LOG_ERR, "log_init: shm_open %s: %m", shm_name );
+	return( -1 );
+    }
+    if ( flock( fd, LOCK_EX ) < 0 ) {
+	syslog( LOG_ERR, "log_init: flock %s: %m", shm_name );
+	goto error;
+    }
+    if ( fstat( fd, &st ) < 0 ) {
+	syslog( LOG_ERR, "log_init: fstat %s: %m", shm_name );
+	goto error;
+    }
+
+    if ( st.st_size == 0 ) {
+	size = LOG_HDRSIZE +
+		(size_t)stripelen * LOG_STRIPES * sizeof( struct log_ent );
+	if ( ftruncate( fd, size ) < 0 ) {
+	    syslog( LOG_ERR, "log_init: ftruncate %s: %m", shm_name );
+	    goto error;
+	}
+	created = 1;
+    } else {
+	size = st.st_size;
+    }
+
+    if (( lh = (struct log_header *)mmap( NULL, size,
+	    PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 )) == MAP_FAILED ) {
+	syslog( LOG_ERR, "log_init: mmap %s: %m", shm_name );
+	lh = NULL;
+	goto error;
+    }
+    log_ents = (struct log_ent *)((char *)lh + LOG_HDRSIZE );
+
+    if ( created ) {
+	if ( store_lock_init( &lh->lh_loglock ) < 0 ) {
+	    goto unmap;
+	}
+	for ( i = 0; i < LOG_STRIPES; i++ ) {
+	    if ( store_lock_init( &lh->lh_lock[ i ] ) < 0 ) {
+		goto unmap;
+	    }
+	}
+	lh->lh_stripelen = stripelen;
+	lh->lh_nslots = stripelen * LOG_STRIPES;
+	lh->lh_active = 1;
+	lh->lh_end = 0;
+
+	if (( nsegs = log_segments( &segs )) < 0 ) {
+	    goto unmap;
+	}
+	for ( i = 0; i < nsegs; i++ ) {
+	    if ( log_scan( segs[ i ], &lh->lh_end, log_replay, NULL ) < 0 ) {
+		free( segs );
+		goto unmap;
+	    }
+	}
+	if ( nsegs > 0 ) {
+	    lh->lh_oldest = segs[ 0 ];
+	    lh->lh_active = segs[ nsegs - 1 ];
+	    syslog( LOG_INFO, "log_init: replayed %d segments", nsegs );
+	}
+	free( segs );
+	memcpy( lh->lh_magic, LOG_MAGIC, sizeof( lh->lh_magic ));
+    } else if ( size < LOG_HDRSIZE ||
+	    memcmp( lh->lh_magic, LOG_MAGIC, sizeof( lh->lh_magic )) != 0 ||
+	    size != LOG_HDRSIZE +
+	    (size_t)lh->lh_nslots * sizeof( struct log_ent )) {
+	syslog( LOG_ERR, "log_init: %s is not a cosignd log index, remove it "
+		"to start over", shm_name );
+	(void)munmap( lh, size );
+	lh = NULL;
+	goto error;
+    }
+
+    if ( flock( fd, LOCK_UN ) < 0 ) {
+	syslog( LOG_ERR, "log_init: flock %s: %m", shm_name );
+    }
+    (void)close( fd );
+    return( 0 );
+
+unmap:
+    (void)munmap( lh, size );
+    lh = NULL;
+    (void)shm_unlink( shm_name );
+error:
+    (void)close( fd );
+    return( -1 );
+}
+
+/*
+ * an fd for a segment, opened on first use and kept until compaction
+ * removes the segment.
+ */
+    static int
+log_fd( unsigned int seg, int create )
+{
+    char		path[ MAXPATHLEN ];
+    int			i, fd;
+
+    for ( i = 0; i < LOG_NFD; i++ ) {
+	if ( log_fds[ i ].lf_fd < 0 ) {
+	    continue;
+	}
+	if ( log_fds[ i ].lf_seg < lh->lh_oldest ) {
+	    (void)close( log_fds[ i ].lf_fd );
+	    log_fds[ i ].lf_fd = -1;
+	    continue;
+	}
+	if ( log_fds[ i ].lf_seg == seg ) {
+	    return( log_fds[ i ].lf_fd );
+	}
+    }
+
+    snprintf( path, sizeof( path ), "%s%08x", LOG_PREFIX, seg );
+    if (( fd = open( path, O_RDWR | ( create ? O_CREAT : 0 ), 0600 )) < 0 ) {
+	syslog( LOG_ERR, "log_fd: %s: %m", path );
+	return( -1 );
+    }
+
+    i = log_nextfd;
+    log_nextfd = ( log_nextfd + 1 ) % LOG_NFD;
+    if ( log_fds[ i ].lf_fd >= 0 ) {
+	(void)close( log_fds[ i ].lf_fd );
+    }
+    log_fds[ i ].lf_seg = seg;
+    log_fds[ i ].lf_fd = fd;
+    return( fd );
+}
+
+/* makes a new segment's name durable */
+    static int
+log_syncdir( void )
+{
+    int			fd, rc = 0;
+
+    if (( fd = open( ".", O_RDONLY )) < 0 ) {
+	syslog( LOG_ERR, "log_syncdir: open: %m" );
+	return( -1 );
+    }
+    if ( fsync( fd ) != 0 ) {
+	syslog( LOG_ERR, "log_syncdir: fsync: %m" );
+	rc = -1;
+    }
+    (void)close( fd );
+    return( rc );
+}
+
+/*
+ * writes a record of nf strings at the end of the log, starting a new
+ * segment if this one is full, and returns where it went.
+ */
+    static int
+log_append( int type, int state, time_t itime, char **f, int nf,
+	unsigned int *segp, unsigned int *offp )
+{
+    char		rec[ LOG_MAXREC ];
+    struct log_rec	*lr = (struct log_rec *)rec;
+    unsigned int	len = sizeof( struct log_rec ), flen;
+    int			i, fd;
+    ssize_t		rc;
+
+    for ( i = 0; i < nf; i++ ) {
+	flen = strlen( f[ i ] ) + 1;
+	if ( len + flen > sizeof( rec )) {
+	    syslog( LOG_ERR, "log_append: %s: record too long", f[ 0 ] );
+	    return( -1 );
+	}
+	memcpy( rec + len, f[ i ], flen );
+	len += flen;
+    }
+    memset( rec + len, 0, LOG_PAD( len ) - len );
+
+    memset( lr, 0, sizeof( struct log_rec ));
+    lr->lr_magic = LOG_RECMAGIC;
+    lr->lr_type = type;
+    lr->lr_state = state;
+    lr->lr_len = len = LOG_PAD( len );
+    lr->lr_itime = itime;
+
+    store_lock( &lh->lh_loglock );
+    if ( lh->lh_end > 0 &&
+	    lh->lh_end + len > (unsigned int)log_segsize * 1024 * 1024 ) {
+	/* so that log_commit() need only sync the active segment */
+	if (( fd = log_fd( lh->lh_active, 0 )) < 0 || fsync( fd ) != 0 ) {
+	    syslog( LOG_ERR, "log_append: fsync segment %x: %m",
+		    lh->lh_active );
+	    store_unlock( &lh->lh_loglock );
+	    return( -1 );
+	}
+	lh->lh_active++;
+	lh->lh_end = 0;
+    }
+    if (( fd = log_fd( lh->lh_active, 1 )) < 0 ) {
+	store_unlock( &lh->lh_loglock );
+	return( -1 );
+    }
+    if ( lh->lh_end == 0 && log_syncdir() != 0 ) {
+	store_unlock( &lh->lh_loglock );
+	return( -1 );
+    }
+    if (( rc = pwrite( fd, rec, len, lh->lh_end )) != (ssize_t)len ) {
+	if ( rc < 0 ) {
+	    syslog( LOG_ERR, "log_append: pwrite: %m" );
+	} else {
+	    syslog( LOG_ERR, "log_append: short pwrite" );
+	}
+	store_unlock( &lh->lh_loglock );
+	return( -1 );
+    }
+    if ( segp != NULL ) {
+	*segp = lh->lh_active;
+	*offp = lh->lh_end;
+    }
+    lh->lh_end += len;
+    store_unlock( &lh->lh_loglock );
+
+    return( 0 );
+}
+
+/* reads the record at seg and off into log_buf */
+    static struct log_rec *
+log_read( unsigned int seg, unsigned int off )
+{
+    struct log_rec	*lr = (struct log_rec *)log_buf;
+    ssize_t		rc;
+    int			fd;
+
+    if (( fd = log_fd( seg, 0 )) < 0 ) {
+	return( NULL );
+    }
+    /* most records fit in the first read */
+    if (( rc = pread( fd, log_buf, 1024, off )) < 0 ) {
+	syslog( LOG_ERR, "log_read: pread: %m" );
+	return( NULL );
+    }
+    if ( rc < (ssize_t)sizeof( struct log_rec ) ||
+	    lr->lr_magic != LOG_RECMAGIC || lr->lr_len > LOG_MAXREC ||
+	    lr->lr_len < sizeof( struct log_rec )) {
+	syslog( LOG_ERR, "log_read: %s%08x: bad record at %u",
+		LOG_PREFIX, seg, off );
+	return( NULL );
+    }
+    if ( lr->lr_len > rc ) {
+	if ( pread( fd, log_buf + rc, lr->lr_len - rc, off + rc ) !=
+		(ssize_t)( lr->lr_len - rc )) {
+	    syslog( LOG_ERR, "log_read: %s%08x: short record at %u",
+		    LOG_PREFIX, seg, off );
+	    return( NULL );
+	}
+    }
+    return( lr );
+}
+
+/*
+ * points f at the first nf strings of a record.  returns how many
+ * there were, or -1 if the record is malformed.  the padding at the
+ * end may read as empty strings, so callers ask for the number of
+ * strings the record type has.
+ */
+    static int
+log_fields( struct log_rec *lr, char **f, int nf )
+{
+    char		*p = (char *)( lr + 1 ), *end = (char *)lr + lr->lr_len;
+    char		*nul;
+    int			i;
+
+    for ( i = 0; i < nf && p < end; i++ ) {
+	if (( nul = memchr( p, '\0', end - p )) == NULL ) {
+	    return( -1 );
+	}
+	f[ i ] = p;
+	p = nul + 1;
+    }
+    return( i );
+}
+
+/*
+ * looks for the cookie name's entry in its stripe, which the caller
+ * has locked, passing over index entries and reading records to tell
+ * apart names with the same hash.  on success the entry's record is in
+ * log_buf.  if emptyp isn't NULL, it gets the first entry an insert
+ * could use, or NULL if the stripe is full.
+ */
+    static struct log_ent *
+log_find( char *name, unsigned int hash, struct log_ent **emptyp )
+{
+    struct log_ent	*base, *le;
+    struct log_rec	*lr;
+    unsigned int	i, n, mask = lh->lh_stripelen - 1;
+    char		*f[ 1 ];
+
+    if ( emptyp != NULL ) {
+	*emptyp = NULL;
+    }
+    base = log_ents + LOG_STRIPE( hash ) * lh->lh_stripelen;
+    i = ( hash / LOG_STRIPES ) & mask;
+    for ( n = 0; n < lh->lh_stripelen; n++, i = ( i + 1 ) & mask ) {
+	le = &base[ i ];
+	if ( le->le_seg == LOG_EMPTY ) {
+	    if ( emptyp != NULL && *emptyp == NULL ) {
+		*emptyp = le;
+	    }
+	    return( NULL );
+	}
+	if ( le->le_seg == LOG_DELETED ) {
+	    if ( emptyp != NULL && *emptyp == NULL ) {
+		*emptyp = le;
+	    }
+	    continue;
+	}
+	if ( le->le_hash != hash || le->le_type == LOG_INDEX ) {
+	    continue;
+	}
+	if (( lr = log_read( le->le_seg, le->le_off )) == NULL ||
+		log_fields( lr, f, 1 ) != 1 ) {
+	    continue;
+	}
+	if ( strcmp( f[ 0 ], name ) == 0 ) {
+	    return( le );
+	}
+    }
+    return( NULL );
+}
+
+/* as shm_ihash() */
+    static unsigned int
+log_ihash( char *key, char *cookie )
+{
+    unsigned int	hash = store_hash( cookie );
+
+    return( LOG_STRIPE( store_hash( key ) +
+	    ( hash >> 24 ) % LOG_KEYSTRIPES ) +
+	    ( hash / LOG_STRIPES ) * LOG_STRIPES );
+}
+
+/* the hash of the entry for a full record with fields f */
+    static unsigned int
+log_rechash( struct log_rec *lr, char **f )
+{
+    if ( lr->lr_type == LOG_INDEX ) {
+	return( log_ihash( f[ 0 ], f[ 1 ] ));
+    }
+    return( store_hash( f[ 0 ] ));
+}
+
+/* as log_find(), for the entry filing f[ 1 ] under the key f[ 0 ] */
+    static struct log_ent *
+log_ifind( int index, char **f, unsigned int hash, struct log_ent **emptyp )
+{
+    struct log_ent	*base, *le;
+    struct log_rec	*lr;
+    unsigned int	i, n, key, mask = lh->lh_stripelen - 1;
+    char		*rf[ 2 ];
+
+    if ( emptyp != NULL ) {
+	*emptyp = NULL;
+    }
+    key = store_hash( f[ 0 ] );
+    base = log_ents + LOG_STRIPE( hash ) * lh->lh_stripelen;
+    i = ( hash / LOG_STRIPES ) & mask;
+    for ( n = 0; n < lh->lh_stripelen; n++, i = ( i + 1 ) & mask ) {
+	le = &base[ i ];
+	if ( le->le_seg == LOG_EMPTY ) {
+	    if ( emptyp != NULL && *emptyp == NULL ) {
+		*emptyp = le;
+	    }
+	    return( NULL );
+	}
+	if ( le->le_seg == LOG_DELETED ) {
+	    if ( emptyp != NULL && *emptyp == NULL ) {
+		*emptyp = le;
+	    }
+	    continue;
+	}
+	if ( le->le_hash != hash || le->le_type != LOG_INDEX ||
+		le->le_state != index || le->le_key != key ) {
+	    continue;
+	}
+	if (( lr = log_read( le->le_seg, le->le_off )) == NULL ||
+		log_fields( lr, rf, 2 ) != 2 ) {
+	    continue;
+	}
+	if ( strcmp( rf[ 0 ], f[ 0 ] ) == 0 &&
+		strcmp( rf[ 1 ], f[ 1 ] ) == 0 ) {
+	    return( le );
+	}
+    }
+    return( NULL );
+}
+
+/* the entry whose full record is at seg and off, if it's still live */
+    static struct log_ent *
+log_live( unsigned int hash, unsigned int seg, unsigned int off )
+{
+    struct log_ent	*base, *le;
+    unsigned int	i, n, mask = lh->lh_stripelen - 1;
+
+    base = log_ents + LOG_STRIPE( hash ) * lh->lh_stripelen;
+    i = ( hash / LOG_STRIPES ) & mask;
+    for ( n = 0; n < lh->lh_stripelen; n++, i = ( i + 1 ) & mask ) {
+	le = &base[ i ];
+	if ( le->le_seg == LOG_EMPTY ) {
+	    return( NULL );
+	}
+	if ( le->le_seg == seg && le->le_off == off ) {
+	    return( le );
+	}
+    }
+    return( NULL );
+}
+
+/* as shm_delete() */
+    static void
+log_delete( struct log_ent *le )
+{
+    struct log_ent	*base;
+    unsigned int	i, mask = lh->lh_stripelen - 1;
+
+    base = log_ents + (( le - log_ents ) / lh->lh_stripelen ) *
+	    lh->lh_stripelen;
+    i = le - base;
+
+    le->le_seg = LOG_DELETED;
+    if ( base[ ( i + 1 ) & mask ].le_seg != LOG_EMPTY ) {
+	return;
+    }
+    while ( base[ i ].le_seg == LOG_DELETED ) {
+	base[ i ].le_seg = LOG_EMPTY;
+	i = ( i - 1 ) & mask;
+    }
+}
+
+    static int
+log_get( char *cookie, struct cinfo *ci )
+{
+    struct log_ent	*le;
+    char		*f[ 7 ];
+    unsigned int	hash = store_hash( cookie );
+    int			stripe = LOG_STRIPE( hash );
+
+    memset( ci, 0, sizeof( struct cinfo ));
+
+    store_lock( &lh->lh_lock[ stripe ] );
+    if (( le = log_find( cookie, hash, NULL )) == NULL ||
+	    le->le_type != LOG_LOGIN ) {
+	store_unlock( &lh->lh_lock[ stripe ] );
+	return( 1 );
+    }
+    if ( log_fields( (struct log_rec *)log_buf, f, 7 ) != 7 ) {
+	store_unlock( &lh->lh_lock[ stripe ] );
+	syslog( LOG_ERR, "log_get: %s: bad record", cookie );
+	return( -1 );
+    }
+    ci->ci_version = 2;
+    ci->ci_state = le->le_state;
+    ci->ci_itime = le->le_itime;
+    strncpy( ci->ci_ipaddr, f[ 1 ], sizeof( ci->ci_ipaddr ) - 1 );
+    strncpy( ci->ci_ipaddr_cur, f[ 2 ], sizeof( ci->ci_ipaddr_cur ) - 1 );
+    strncpy( ci->ci_user, f[ 3 ], sizeof( ci->ci_user ) - 1 );
+    strncpy( ci->ci_realm, f[ 4 ], sizeof( ci->ci_realm ) - 1 );
+    strncpy( ci->ci_ctime, f[ 5 ], sizeof( ci->ci_ctime ) - 1 );
+    strncpy( ci->ci_krbtkt, f[ 6 ], sizeof( ci->ci_krbtkt ) - 1 );
+    store_unlock( &lh->lh_lock[ stripe ] );
+
+    return( 0 );
+}
+
+    static int
+log_put( char *cookie, struct cinfo *ci, int flags )
+{
+    struct log_ent	*le, *empty;
+    char		*f[ 7 ];
+    unsigned int	hash = store_hash( cookie ), seg, off;
+    int			stripe = LOG_STRIPE( hash );
+    time_t		now = time( NULL );
+
+    f[ 0 ] = cookie;
+    f[ 1 ] = ci->ci_ipaddr;
+    f[ 2 ] = ci->ci_ipaddr_cur;
+    f[ 3 ] = ci->ci_user;
+    f[ 4 ] = ci->ci_realm;
+    f[ 5 ] = ci->ci_ctime;
+    f[ 6 ] = ci->ci_krbtkt;
+
+    store_lock( &lh->lh_lock[ stripe ] );
+    if (( le = log_find( cookie, hash, &empty )) != NULL ) {
+	if ( !( flags & STORE_REPLACE )) {
+	    store_unlock( &lh->lh_lock[ stripe ] );
+	    return( 1 );
+	}
+    } else if (( le = empty ) == NULL ) {
+	store_unlock( &lh->lh_lock[ stripe ] );
+	syslog( LOG_ERR, "log_put: %s: stripe %d full", cookie, stripe );
+	return( -1 );
+    }
+
+    if ( log_append( LOG_LOGIN, 1, now, f, 7, &seg, &off ) < 0 ) {
+	store_unlock( &lh->lh_lock[ stripe ] );
+	return( -1 );
+    }
+    le->le_hash = hash;
+    le->le_off = off;
+    le->le_type = LOG_LOGIN;
+    le->le_state = 1;
+    le->le_itime = now;
+    le->le_seg = seg;
+    store_unlock( &lh->lh_lock[ stripe ] );
+
+    return( 0 );
+}
+
+    static int
+log_logout( char *cookie )
+{
+    struct log_ent	*le;
+    unsigned int	hash = store_hash( cookie );
+    int			stripe = LOG_STRIPE( hash );
+    time_t		now = time( NULL );
+
+    store_lock( &lh->lh_lock[ stripe ] );
+    if (( le = log_find( cookie, hash, NULL )) == NULL ||
+	    le->le_type != LOG_LOGIN ) {
+	store_unlock( &lh->lh_lock[ stripe ] );
+	syslog( LOG_ERR, "log_logout: %s: not found", cookie );
+	return( -1 );
+    }
+    if ( log_append( LOG_LOGOUT, 0, now, &cookie, 1, NULL, NULL ) < 0 ) {
+	store_unlock( &lh->lh_lock[ stripe ] );
+	return( -1 );
+    }
+    le->le_state = 0;
+    le->le_itime = now;
+    store_unlock( &lh->lh_lock[ stripe ] );
+
+    return( 0 );
+}
+
+    static int
+log_touch( char *cookie, time_t when )
+{
+    struct log_ent	*le;
+    unsigned int	hash = store_hash( cookie );
+    int			stripe = LOG_STRIPE( hash );
+
+    if ( when == 0 ) {
+	when = time( NULL );
+    }
+
+    store_lock( &lh->lh_lock[ stripe ] );
+    if (( le = log_find( cookie, hash, NULL )) == NULL ) {
+	store_unlock( &lh->lh_lock[ stripe ] );
+	errno = ENOENT;
+	return( -1 );
+    }
+    if ( log_append( LOG_TOUCH, le->le_state, when, &cookie, 1,
+	    NULL, NULL ) < 0 ) {
+	store_unlock( &lh->lh_lock[ stripe ] );
+	return( -1 );
+    }
+    le->le_itime = when;
+    store_unlock( &lh->lh_lock[ stripe ] );
+
+    return( 0 );
+}
+
+    static int
+log_register( char *scookie, char *login )
+{
+    struct log_ent	*le, *empty;
+    char		*f[ 2 ];
+    unsigned int	hash = store_hash( scookie ), seg, off;
+    int			stripe = LOG_STRIPE( hash );
+    time_t		now = time( NULL );
+
+    f[ 0 ] = scookie;
+    f[ 1 ] = login;
+
+    store_lock( &lh->lh_lock[ stripe ] );
+    if (( le = log_find( scookie, hash, &empty )) != NULL ) {
+	store_unlock( &lh->lh_lock[ stripe ] );
+	return( 1 );
+    }
+    if (( le = empty ) == NULL ) {
+	store_unlock( &lh->lh_lock[ stripe ] );
+	syslog( LOG_ERR, "log_register: %s: stripe %d full", scookie, stripe );
+	return( -1 );
+    }
+
+    if ( log_append( LOG_SERVICE, 1, now, f, 2, &seg, &off ) < 0 ) {
+	store_unlock( &lh->lh_lock[ stripe ] );
+	return( -1 );
+    }
+    le->le_hash = hash;
+    le->le_off = off;
+    le->le_type = LOG_SERVICE;
+    le->le_state = 1;
+    le->le_itime = now;
+    le->le_seg = seg;
+    store_unlock( &lh->lh_lock[ stripe ] );
+
+    return( 0 );
+}
+
+/* login should be MAXCOOKIELEN */
+    static int
+log_service( char *scookie, char *login )
+{
+    struct log_ent	*le;
+    char		*f[ 2 ];
+    unsigned int	hash = store_hash( scookie );
+    int			stripe = LOG_STRIPE( hash );
+
+    store_lock( &lh->lh_lock[ stripe ] );
+    if (( le = log_find( scookie, hash, NULL )) == NULL ||
+	    le->le_type != LOG_SERVICE ||
+	    log_fields( (struct log_rec *)log_buf, f, 2 ) != 2 ||
+	    strlen( f[ 1 ] ) >= MAXCOOKIELEN ) {
+	store_unlock( &lh->lh_lock[ stripe ] );
+	return( -1 );
+    }
+    strcpy( login, f[ 1 ] );
+    store_unlock( &lh->lh_lock[ stripe ] );
+
+    return( 0 );
+}
+
+/*
+ * written as a new service record under the new name, and an expiry
+ * of the old one.  as in the shm store, the two stripes aren't locked
+ * together.
+ */
+    static int
+log_rekey( char *scookie, char *newcookie )
+{
+    char		login[ MAXCOOKIELEN ];
+    int			rc;
+
+    if ( log_service( scookie, login ) != 0 ) {
+	syslog( LOG_ERR, "log_rekey: %s: not found", scookie );
+	return( -1 );
+    }
+    if (( rc = log_register( newcookie, login )) != 0 ) {
+	if ( rc > 0 ) {
+	    syslog( LOG_ERR, "log_rekey: %s: already exists", newcookie );
+	}
+	return( -1 );
+    }
+    return( log_expire( scookie ));
+}
+
+/* a bucket is a stripe of the index */
+    static int
+log_buckets( void )
+{
+    return( LOG_STRIPES );
+}
+
+/*
+ * the stripe's names are read out under its lock, so fn is free to
+ * call back into the store.
+ */
+    static int
+log_iterate( int bucket, int (*fn)( char *, void * ), void *arg )
+{
+    struct log_ent	*base;
+    struct log_rec	*lr;
+    char		*names = NULL, *p, *f[ 1 ];
+    size_t		len = 0, size = 0, flen;
+    unsigned int	i;
+    int			rc = 0;
+
+    base = log_ents + bucket * lh->lh_stripelen;
+    store_lock( &lh->lh_lock[ bucket ] );
+    for ( i = 0; i < lh->lh_stripelen; i++ ) {
+	if ( base[ i ].le_seg == LOG_EMPTY ||
+		base[ i ].le_seg == LOG_DELETED ||
+		base[ i ].le_type == LOG_INDEX ) {
+	    continue;
+	}
+	if (( lr = log_read( base[ i ].le_seg, base[ i ].le_off )) == NULL ||
+		log_fields( lr, f, 1 ) != 1 ) {
+	    continue;
+	}
+	flen = strlen( f[ 0 ] ) + 1;
+	if ( len + flen > size ) {
+	    size = size * 2 + MAXCOOKIELEN;
+	    if (( p = (char *)realloc( names, size )) == NULL ) {
+		store_unlock( &lh->lh_lock[ bucket ] );
+		syslog( LOG_ERR, "log_iterate: realloc: %m" );
+		free( names );
+		return( -1 );
+	    }
+	    names = p;
+	}
+	memcpy( names + len, f[ 0 ], flen );
+	len += flen;
+    }
+    store_unlock( &lh->lh_lock[ bucket ] );
+
+    for ( p = names; p < names + len; p += strlen( p ) + 1 ) {
+	if (( rc = (*fn)( p, arg )) < 0 ) {
+	    break;
+	}
+    }
+    free( names );
+
+    return( rc < 0 ? rc : 0 );
+}
+
+    static int
+log_expire( char *cookie )
+{
+    struct log_ent	*le;
+    unsigned int	hash = store_hash( cookie );
+    int			stripe = LOG_STRIPE( hash );
+
+    store_lock( &lh->lh_lock[ stripe ] );
+    if (( le = log_find( cookie, hash, NULL )) == NULL ) {
+	store_unlock( &lh->lh_lock[ stripe ] );
+	syslog( LOG_ERR, "log_expire: %s: not found", cookie );
+	return( -1 );
+    }
+    if ( log_append( LOG_EXPIRE, 0, time( NULL ), &cookie, 1,
+	    NULL, NULL ) < 0 ) {
+	store_unlock( &lh->lh_lock[ stripe ] );
+	return( -1 );
+    }
+    log_delete( le );
+    store_unlock( &lh->lh_lock[ stripe ] );
+
+    return( 0 );
+}
+
+    static int
+log_segcmp( const void *a, const void *b )
+{
+    unsigned int	x = *(unsigned int *)a, y = *(unsigned int *)b;
+
+    return( x < y ? -1 : x > y );
+}
+
+/* the numbers of every segment in cosigndb, oldest first */
+    static int
+log_segments( unsigned int **segsp )
+{
+    DIR			*dirp;
+    struct dirent	*de;
+    unsigned int	*segs = NULL, *s, seg;
+    int			n = 0, size = 0;
+    char		*end;
+
+    if (( dirp = opendir( "." )) == NULL ) {
+	syslog( LOG_ERR, "log_segments: opendir: %m" );
+	return( -1 );
+    }
+    while (( de = readdir( dirp )) != NULL ) {
+	if ( strncmp( de->d_name, LOG_PREFIX, strlen( LOG_PREFIX )) != 0 ) {
+	    continue;
+	}
+	seg = strtoul( de->d_name + strlen( LOG_PREFIX ), &end, 16 );
+	if ( *end != '\0' || seg == LOG_EMPTY || seg == LOG_DELETED ) {
+	    continue;
+	}
+	if ( n >= size ) {
+	    size = size * 2 + 16;
+	    if (( s = (unsigned int *)realloc( segs,
+		    size * sizeof( unsigned int ))) == NULL ) {
+		syslog( LOG_ERR, "log_segments: realloc: %m" );
+		free( segs );
+		(void)closedir( dirp );
+		return( -1 );
+	    }
+	    segs = s;
+	}
+	segs[ n++ ] = seg;
+    }
+    if ( closedir( dirp ) != 0 ) {
+	syslog( LOG_ERR, "log_segments: closedir: %m" );
+    }
+
+    if ( n > 0 ) {
+	qsort( segs, n, sizeof( unsigned int ), log_segcmp );
+    }
+    *segsp = segs;
+    return( n );
+}
+
+/*
+ * calls fn with every record in a segment, in order.  a partly written
+ * record at the end, as a crash can leave, ends the scan, and *endp
+ * gets the offset after the last good record.
+ */
+    static int
+log_scan( unsigned int seg, unsigned int *endp,
+	int (*fn)( unsigned int, unsigned int, struct log_rec *, void * ),
+	void *arg )
+{
+    FILE		*f;
+    char		path[ MAXPATHLEN ], rec[ LOG_MAXREC ];
+    struct log_rec	*lr = (struct log_rec *)rec;
+    unsigned int	off = 0;
+    int			rc = 0;
+
+    snprintf( path, sizeof( path ), "%s%08x", LOG_PREFIX, seg );
+    if (( f = fopen( path, "r" )) == NULL ) {
+	syslog( LOG_ERR, "log_scan: %s: %m", path );
+	return( -1 );
+    }
+    while ( fread( lr, sizeof( struct log_rec ), 1, f ) == 1 ) {
+	if ( lr->lr_magic != LOG_RECMAGIC || lr->lr_len > LOG_MAXREC ||
+		lr->lr_len < sizeof( struct log_rec ) ||
+		fread( rec + sizeof( struct log_rec ),
+		lr->lr_len - sizeof( struct log_rec ), 1, f ) != 1 ) {
+	    syslog( LOG_NOTICE, "log_scan: %s: bad record at %u, skipping"
+		    " the rest", path, off );
+	    break;
+	}
+	if (( rc = (*fn)( seg, off, lr, arg )) < 0 ) {
+	    break;
+	}
+	off += lr->lr_len;
+    }
+    if ( ferror( f )) {
+	syslog( LOG_ERR, "log_scan: %s: %m", path );
+	rc = -1;
+    }
+    (void)fclose( f );
+
+    if ( endp != NULL ) {
+	*endp = off;
+    }
+    return( rc < 0 ? rc : 0 );
+}
+
+/* applies a record to a new index, while it's being built */
+    static int
+log_replay( unsigned int seg, unsigned int off, struct log_rec *lr,
+	void *arg )
+{
+    struct log_ent	*le, *empty;
+    char		*f[ 2 ];
+    unsigned int	hash;
+
+    if ( lr->lr_type == LOG_INDEX || lr->lr_type == LOG_UNINDEX ) {
+	if ( log_fields( lr, f, 2 ) != 2 ) {
+	    return( 0 );
+	}
+	hash = log_ihash( f[ 0 ], f[ 1 ] );
+	le = log_ifind( lr->lr_state, f, hash, &empty );
+    } else {
+	if ( log_fields( lr, f, 1 ) != 1 ) {
+	    return( 0 );
+	}
+	hash = store_hash( f[ 0 ] );
+	le = log_find( f[ 0 ], hash, &empty );
+    }
+
+    switch ( lr->lr_type ) {
+    case LOG_LOGIN :
+    case LOG_SERVICE :
+    case LOG_INDEX :
+	if ( le == NULL && ( le = empty ) == NULL ) {
+	    syslog( LOG_ERR, "log_replay: %s: stripe full", f[ 0 ] );
+	    return( 0 );
+	}
+	le->le_hash = hash;
+	le->le_key = ( lr->lr_type == LOG_INDEX ) ? store_hash( f[ 0 ] ) : 0;
+	le->le_seg = seg;
+	le->le_off = off;
+	le->le_type = lr->lr_type;
+	le->le_state = lr->lr_state;
+	le->le_itime = lr->lr_itime;
+	break;
+
+    case LOG_TOUCH :
+	if ( le != NULL ) {
+	    le->le_itime = lr->lr_itime;
+	}
+	break;
+
+    case LOG_LOGOUT :
+	if ( le != NULL ) {
+	    le->le_state = 0;
+	    le->le_itime = lr->lr_itime;
+	}
+	break;
+
+    case LOG_EXPIRE :
+    case LOG_UNINDEX :
+	if ( le != NULL ) {
+	    log_delete( le );
+	}
+	break;
+
+    default :
+	syslog( LOG_ERR, "log_replay: unknown record type %c", lr->lr_type );
+	break;
+    }
+    return( 0 );
+}
+
+struct log_compact {
+    unsigned int	lc_live;
+    unsigned int	lc_moved;
+};
+
+/* adds up the live full records in a segment */
+    static int
+log_count( unsigned int seg, unsigned int off, struct log_rec *lr,
+	void *arg )
+{
+    struct log_compact	*lc = (struct log_compact *)arg;
+    char		*f[ 2 ];
+    unsigned int	hash;
+    int			stripe, nf;
+
+    if ( lr->lr_type == LOG_LOGIN || lr->lr_type == LOG_SERVICE ) {
+	nf = 1;
+    } else if ( lr->lr_type == LOG_INDEX ) {
+	nf = 2;
+    } else {
+	return( 0 );
+    }
+    if ( log_fields( lr, f, nf ) != nf ) {
+	return( 0 );
+    }
+    hash = log_rechash( lr, f );
+    stripe = LOG_STRIPE( hash );
+    store_lock( &lh->lh_lock[ stripe ] );
+    if ( log_live( hash, seg, off ) != NULL ) {
+	lc->lc_live += lr->lr_len;
+    }
+    store_unlock( &lh->lh_lock[ stripe ] );
+    return( 0 );
+}
+
+/* copies a live full record to the end of the log, as it stands now */
+    static int
+log_move( unsigned int seg, unsigned int off, struct log_rec *lr,
+	void *arg )
+{
+    struct log_compact	*lc = (struct log_compact *)arg;
+    struct log_ent	*le;
+    char		*f[ 7 ];
+    unsigned int	hash, nseg, noff;
+    int			stripe, nf;
+
+    if ( lr->lr_type == LOG_LOGIN ) {
+	nf = 7;
+    } else if ( lr->lr_type == LOG_SERVICE || lr->lr_type == LOG_INDEX ) {
+	nf = 2;
+    } else {
+	return( 0 );
+    }
+    if ( log_fields( lr, f, nf ) != nf ) {
+	return( 0 );
+    }
+    hash = log_rechash( lr, f );
+    stripe = LOG_STRIPE( hash );
+    store_lock( &lh->lh_lock[ stripe ] );
+    if (( le = log_live( hash, seg, off )) != NULL ) {
+	if ( log_append( lr->lr_type, le->le_state, le->le_itime,
+		f, nf, &nseg, &noff ) < 0 ) {
+	    store_unlock( &lh->lh_lock[ stripe ] );
+	    return( -1 );
+	}
+	le->le_seg = nseg;
+	le->le_off = noff;
+	lc->lc_moved++;
+    }
+    store_unlock( &lh->lh_lock[ stripe ] );
+    return( 0 );
+}
+
+/*
+ * files cookie under key.  it may already be there, as it may be in
+ * the files the other stores keep.
+ */
+    static int
+log_index_add( int index, char *key, char *cookie )
+{
+    struct log_ent	*le, *empty;
+    char		*f[ 2 ];
+    unsigned int	hash, seg, off;
+    int			stripe;
+    time_t		now = time( NULL );
+
+    f[ 0 ] = key;
+    f[ 1 ] = cookie;
+    hash = log_ihash( key, cookie );
+    stripe = LOG_STRIPE( hash );
+
+    store_lock( &lh->lh_lock[ stripe ] );
+    if (( le = log_ifind( index, f, hash, &empty )) != NULL ) {
+	store_unlock( &lh->lh_lock[ stripe ] );
+	return( 0 );
+    }
+    if (( le = empty ) == NULL ) {
+	store_unlock( &lh->lh_lock[ stripe ] );
+	syslog( LOG_ERR, "log_index_add: %s: stripe %d full", key, stripe );
+	return( -1 );
+    }
+
+    if ( log_append( LOG_INDEX, index, now, f, 2, &seg, &off ) < 0 ) {
+	store_unlock( &lh->lh_lock[ stripe ] );
+	return( -1 );
+    }
+    le->le_hash = hash;
+    le->le_off = off;
+    le->le_key = store_hash( key );
+    le->le_type = LOG_INDEX;
+    le->le_state = index;
+    le->le_itime = now;
+    le->le_seg = seg;
+    store_unlock( &lh->lh_lock[ stripe ] );
+
+    return( 0 );
+}
+
+/*
+ * key's cookies are read out under each of its stripes' locks in turn,
+ * as in log_iterate(), and those fn drops are unindexed one by one
+ * after.
+ */
+    static int
+log_index_iterate( int index, char *key, int (*fn)( char *, void * ),
+	void *arg )
+{
+    struct log_ent	*base, *le;
+    struct log_rec	*lr;
+    char		*names = NULL, *p, *f[ 2 ];
+    size_t		len = 0, size = 0, flen;
+    unsigned int	i, k, hash = store_hash( key );
+    int			stripe, rc = 0;
+
+    for ( k = 0; k < LOG_KEYSTRIPES; k++ ) {
+	stripe = LOG_STRIPE( hash + k );
+	base = log_ents + stripe * lh->lh_stripelen;
+	store_lock( &lh->lh_lock[ stripe ] );
+	for ( i = 0; i < lh->lh_stripelen; i++ ) {
+	    if ( base[ i ].le_seg == LOG_EMPTY ||
+		    base[ i ].le_seg == LOG_DELETED ||
+		    base[ i ].le_type != LOG_INDEX ||
+		    base[ i ].le_state != index ||
+		    base[ i ].le_key != hash ) {
+		continue;
+	    }
+	    if (( lr = log_read( base[ i ].le_seg,
+		    base[ i ].le_off )) == NULL ||
+		    log_fields( lr, f, 2 ) != 2 ||
+		    strcmp( f[ 0 ], key ) != 0 ) {
+		continue;
+	    }
+	    flen = strlen( f[ 1 ] ) + 1;
+	    if ( len + flen > size ) {
+		size = size * 2 + MAXCOOKIELEN;
+		if (( p = (char *)realloc( names, size )) == NULL ) {
+		    store_unlock( &lh->lh_lock[ stripe ] );
+		    syslog( LOG_ERR, "log_index_iterate: realloc: %m" );
+		    free( names );
+		    return( -1 );
+		}
+		names = p;
+	    }
+	    memcpy( names + len, f[ 1 ], flen );
+	    len += flen;
+	}
+	store_unlock( &lh->lh_lock[ stripe ] );
+    }
+
+    f[ 0 ] = key;
+    for ( p = names; p < names + len; p += strlen( p ) + 1 ) {
+	if (( rc = (*fn)( p, arg )) < 0 ) {
+	    break;
+	}
+	if ( rc == 0 ) {
+	    continue;
+	}
+	f[ 1 ] = p;
+	hash = log_ihash( key, p );
+	stripe = LOG_STRIPE( hash );
+	store_lock( &lh->lh_lock[ stripe ] );
+	if (( le = log_ifind( index, f, hash, NULL )) != NULL &&
+		log_append( LOG_UNINDEX, index, time( NULL ), f, 2,
+		NULL, NULL ) == 0 ) {
+	    log_delete( le );
+	}
+	store_unlock( &lh->lh_lock[ stripe ] );
+    }
+    free( names );
+
+    return( rc < 0 ? rc : 0 );
+}
+
+/*
+ * a stripe at a time, reading each key once a stripe, as
+ * shm_index_keys().
+ */
+    static int
+log_index_keys( int index, int (*fn)( char *, void * ), void *arg )
+{
+    struct log_ent	*base;
+    struct log_rec	*lr;
+    char		*names = NULL, *p, *f[ 1 ];
+    size_t		len, size = 0, flen;
+    unsigned int	i, j, n, *keys;
+    int			stripe, rc = 0;
+
+    if (( keys = (unsigned int *)malloc(
+	    lh->lh_stripelen * sizeof( unsigned int ))) == NULL ) {
+	syslog( LOG_ERR, "log_index_keys: malloc: %m" );
+	return( -1 );
+    }
+
+    for ( stripe = 0; stripe < LOG_STRIPES && rc >= 0; stripe++ ) {
+	base = log_ents + stripe * lh->lh_stripelen;
+	len = 0;
+	n = 0;
+	store_lock( &lh->lh_lock[ stripe ] );
+	for ( i = 0; i < lh->lh_stripelen; i++ ) {
+	    if ( base[ i ].le_seg == LOG_EMPTY ||
+		    base[ i ].le_seg == LOG_DELETED ||
+		    base[ i ].le_type != LOG_INDEX ||
+		    base[ i ].le_state != index ) {
+		continue;
+	    }
+	    if (( lr = log_read( base[ i ].le_seg,
+		    base[ i ].le_off )) == NULL ||
+		    log_fields( lr, f, 1 ) != 1 ) {
+		continue;
+	    }
+	    for ( j = 0, p = names; j < n; j++, p += strlen( p ) + 1 ) {
+		if ( keys[ j ] == base[ i ].le_key &&
+			strcmp( p, f[ 0 ] ) == 0 ) {
+		    break;
+		}
+	    }
+	    if ( j < n ) {
+		continue;
+	    }
+	    flen = strlen( f[ 0 ] ) + 1;
+	    if ( len + flen > size ) {
+		size = size * 2 + MAXCOOKIELEN;
+		if (( p = (char *)realloc( names, size )) == NULL ) {
+		    store_unlock( &lh->lh_lock[ stripe ] );
+		    syslog( LOG_ERR, "log_index_keys: realloc: %m" );
+		    free( names );
+		    free( keys );
+		    return( -1 );
+		}
+		names = p;
+	    }
+	    memcpy( names + len, f[ 0 ], flen );
+	    len += flen;
+	    keys[ n++ ] = base[ i ].le_key;
+	}
+	store_unlock( &lh->lh_lock[ stripe ] );
+
+	for ( p = names; p < names + len; p += strlen( p ) + 1 ) {
+	    if (( rc = (*fn)( p, arg )) < 0 ) {
+		break;
+	    }
+	}
+    }
+    free( names );
+    free( keys );
+
+    return( rc < 0 ? rc : 0 );
+}
+
+/*
+ * compacts the oldest segments, for as long as they're less than half
+ * live.  the segment being appended to is left alone.
+ */
+    static int
+log_sync( void )
+{
+    struct log_compact	lc;
+    struct stat		st;
+    char		path[ MAXPATHLEN ];
+    unsigned int	*segs = NULL, active;
+    int			i, nsegs, rolled;
+
+    if (( nsegs = log_segments( &segs )) < 0 ) {
+	return( -1 );
+    }
+    for ( i = 0; i < nsegs && segs[ i ] != lh->lh_active; i++ ) {
+	snprintf( path, sizeof( path ), "%s%08x", LOG_PREFIX, segs[ i ] );
+	if ( stat( path, &st ) < 0 ) {
+	    syslog( LOG_ERR, "log_sync: %s: %m", path );
+	    break;
+	}
+
+	memset( &lc, 0, sizeof( struct log_compact ));
+	if ( log_scan( segs[ i ], NULL, log_count, &lc ) < 0 ) {
+	    break;
+	}
+	if ( (off_t)lc.lc_live * 2 >= st.st_size ) {
+	    break;
+	}
+	store_lock( &lh->lh_loglock );
+	active = lh->lh_active;
+	store_unlock( &lh->lh_loglock );
+	if ( log_scan( segs[ i ], NULL, log_move, &lc ) < 0 ) {
+	    break;
+	}
+
+	/* what was moved has to be on disk before the original is gone */
+	if ( lc.lc_moved > 0 && log_commit( NULL, 0 ) != 0 ) {
+	    break;
+	}
+	store_lock( &lh->lh_loglock );
+	rolled = ( lh->lh_active != active );
+	store_unlock( &lh->lh_loglock );
+	if ( rolled && log_syncdir() != 0 ) {
+	    break;
+	}
+	if ( unlink( path ) != 0 ) {
+	    syslog( LOG_ERR, "log_sync: unlink %s: %m", path );
+	    break;
+	}
+	lh->lh_oldest = segs[ i ] + 1;
+	syslog( LOG_INFO, "log_sync: compacted %s, %u records moved",
+		path, lc.lc_moved );
+    }
+    free( segs );
+
+    return( 0 );
+}
+
+/*
+ * every record before the active segment was synced when it filled,
+ * so however many cookies there are, one fsync() of the active segment
+ * commits them all.
+ */
+    static int
+log_commit( char **cookies, int n )
+{
+    unsigned int	seg;
+    int			fd;
+
+    store_lock( &lh->lh_loglock );
+    seg = lh->lh_active;
+    store_unlock( &lh->lh_loglock );
+
+    if (( fd = log_fd( seg, 1 )) < 0 ) {
+	return( -1 );
+    }
+    if ( fsync( fd ) != 0 ) {
+	syslog( LOG_ERR, "log_commit: fsync segment %x: %m", seg );
+	return( -1 );
+    }
+    return( 0 );
+}
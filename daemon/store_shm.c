@@ -0,0 +1,1089 @@
+/*
+ * Copyright (c) 2004 Regents of The University of Michigan.
+ * All Rights Reserved.  See LICENSE.
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cparse.h"
+#include "mkcookie.h"
+#include "store.h"
+
+/*
+ * cookies kept in a POSIX shared memory segment, shared by every
+ * cosignd process and by monster.  the segment is a fixed-size open
+ * addressing hash table, split into SHM_STRIPES stripes of equal
+ * size.  a cookie's hash picks its stripe and where in the stripe to
+ * start probing, and probes wrap within the stripe, so each operation
+ * takes a single stripe's lock.  a slot holds a login or a service
+ * cookie in fixed-width fields, so names and values that don't fit
+ * are refused rather than truncated.
+ *
+ * the segment outlives cosignd, but not a reboot.  shm_sync(), called
+ * by monster after each pass, writes the table out to SHM_SNAPSHOT in
+ * cosigndb, and a process that finds no segment creates one and loads
+ * the snapshot into it.
+ *
+ * the stripe locks are robust, so a process dying in the middle of a
+ * change leaves a stripe that can be put right.  a slot's type is
+ * written last, so a slot half filled isn't yet in use, and a cookie
+ * being replaced is written to a free slot before the old one is
+ * deleted.  whoever next takes the lock drops any slot left with a
+ * field that isn't terminated.
+ *
+ * the users, services and expire indexes of uindex.c are kept in the
+ * table too, a slot for each cookie filed under a key, with the key as
+ * its name and the cookie as its login.  a key's cookies are spread
+ * over SHM_KEYSTRIPES stripes in a row from the one its hash picks, so
+ * that finding them takes only those stripes' locks, and no one key
+ * can fill a stripe.
+ */
+
+extern char	*shm_name;
+extern int	shm_nslots;
+
+#define SHM_MAGIC	"cosignd2"
+#define SHM_SNAPMAGIC	"cosigns1"
+#define SHM_SNAPSHOT	"shm.snapshot"
+
+#define SHM_STRIPES	256
+#define SHM_MINSTRIPE	16
+#define SHM_KEYSTRIPES	16	/* stripes an index key is spread over */
+
+#define SHM_NAMELEN	256
+#define SHM_IPLEN	64
+#define SHM_USERLEN	130
+#define SHM_REALMLEN	256
+#define SHM_CTIMELEN	12
+#define SHM_TKTLEN	256
+
+/* sl_type */
+#define SHM_EMPTY	0
+#define SHM_DELETED	1
+#define SHM_LOGIN	2
+#define SHM_SERVICE	3
+#define SHM_INDEX	4	/* plus the so_index_*() index */
+
+struct shm_slot {
+    int			sl_type;
+    unsigned int	sl_hash;
+    time_t		sl_itime;
+    char		sl_name[ SHM_NAMELEN ];
+    union {
+	struct {
+	    int		su_state;
+	    char	su_ipaddr[ SHM_IPLEN ];
+	    char	su_ipaddr_cur[ SHM_IPLEN ];
+	    char	su_user[ SHM_USERLEN ];
+	    char	su_realm[ SHM_REALMLEN ];
+	    char	su_ctime[ SHM_CTIMELEN ];
+	    char	su_krbtkt[ SHM_TKTLEN ];
+	} su_login;
+	char		su_service[ SHM_NAMELEN ];
+    } sl_u;
+};
+
+#define sl_state	sl_u.su_login.su_state
+#define sl_ipaddr	sl_u.su_login.su_ipaddr
+#define sl_ipaddr_cur	sl_u.su_login.su_ipaddr_cur
+#define sl_user		sl_u.su_login.su_user
+#define sl_realm	sl_u.su_login.su_realm
+#define sl_ctime	sl_u.su_login.su_ctime
+#define sl_krbtkt	sl_u.su_login.su_krbtkt
+#define sl_login	sl_u.su_service
+
+struct shm_header {
+    char		sh_magic[ 8 ];
+    unsigned int	sh_slotsize;
+    unsigned int	sh_nslots;
+    unsigned int	sh_stripelen;
+    pthread_mutex_t	sh_lock[ SHM_STRIPES ];
+};
+
+/* slots start on a cache line after the header */
+#define SHM_HDRSIZE	(( sizeof( struct shm_header ) + 63 ) & ~63 )
+
+struct shm_snapheader {
+    char		ss_magic[ 8 ];
+    unsigned int	ss_slotsize;
+};
+
+static struct shm_header	*shm = NULL;
+static struct shm_slot		*shm_slots = NULL;
+static struct shm_slot		*shm_copy = NULL;
+
+static int		shm_init( void );
+static int		shm_get( char *, struct cinfo * );
+static int		shm_put( char *, struct cinfo *, int );
+static int		shm_logout( char * );
+static int		shm_touch( char *, time_t );
+static int		shm_register( char *, char * );
+static int		shm_service( char *, char * );
+static int		shm_rekey( char *, char * );
+static int		shm_buckets( void );
+static int		shm_iterate( int, int (*)( char *, void * ), void * );
+static int		shm_expire( char * );
+static int		shm_sync( void );
+static int		shm_index_add( int, char *, char * );
+static int		shm_index_iterate( int, char *,
+			    int (*)( char *, void * ), void * );
+static int		shm_index_keys( int, int (*)( char *, void * ),
+			    void * );
+static void		shm_lock( int );
+static struct shm_slot	*shm_find( char *, unsigned int, struct shm_slot ** );
+static struct shm_slot	*shm_ifind( int, char *, char *, unsigned int,
+			    struct shm_slot ** );
+static unsigned int	shm_ihash( char *, char * );
+static void		shm_delete( struct shm_slot * );
+static void		shm_write( struct shm_slot *, struct shm_slot *,
+			    struct shm_slot * );
+static int		shm_slotok( struct shm_slot * );
+static int		shm_insert( struct shm_slot * );
+static int		shm_load( void );
+static int		shm_fits( char *, int );
+
+struct store_ops	store_shm = {
+    "shm",
+    shm_init,
+    shm_get,
+    shm_put,
+    shm_logout,
+    shm_touch,
+    shm_register,
+    shm_service,
+    shm_rekey,
+    shm_buckets,
+    shm_iterate,
+    shm_expire,
+    shm_sync,
+    NULL,
+    NULL,
+    NULL,
+    shm_index_add,
+    shm_index_iterate,
+    shm_index_keys,
+};
+
+#define SHM_STRIPE( hash )	((hash) % SHM_STRIPES )
+
+/*
+ * attaches to the segment, creating it if need be.  creation and the
+ * header check are done under flock(), so cosignd and monster starting
+ * together agree on who builds the table.
+ */
+    static int
+shm_init( void )
+{
+    struct stat		st;
+    size_t		size;
+    unsigned int	stripelen;
+    int			fd, i, created = 0;
+
+    /* a power of two slots per stripe, at least shm_nslots in all */
+    stripelen = SHM_MINSTRIPE;
+    while ( stripelen * SHM_STRIPES < (unsigned int)shm_nslots ) {
+	stripelen <<= 1;
+    }
+
+    if (( fd = shm_open( shm_name, O_RDWR | O_CREAT, 0600 )) < 0 ) {
+	syslog( LOG_ERR, "shm_init: shm_open %s: %m", shm_name );
+	return( -1 );
+    }
+    if ( flock( fd, LOCK_EX ) < 0 ) {
+	syslog( LOG_ERR, "shm_init: flock %s: %m", shm_name );
+	goto error;
+    }
+    if ( fstat( fd, &st ) < 0 ) {
+	syslog( LOG_ERR, "shm_init: fstat %s: %m", shm_name );
+	goto error;
+    }
+
+    if ( st.st_size == 0 ) {
+	size = SHM_HDRSIZE +
+		(size_t)stripelen * SHM_STRIPES * sizeof( struct shm_slot );
+	if ( ftruncate( fd, size ) < 0 ) {
+	    syslog( LOG_ERR, "shm_init: ftruncate %s: %m", shm_name );
+	    goto error;
+	}
+	created = 1;
+    } else {
+	size = st.st_size;
+    }
+
+    if (( shm = (struct shm_header *)mmap( NULL, size,
+	    PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 )) == MAP_FAILED ) {
+	syslog( LOG_ERR, "shm_init: mmap %s: %m", shm_name );
+	shm = NULL;
+	goto error;
+    }
+    shm_slots = (struct shm_slot *)((char *)shm + SHM_HDRSIZE );
+
+    if ( created ) {
+	shm->sh_slotsize = sizeof( struct shm_slot );
+	shm->sh_stripelen = stripelen;
+	shm->sh_nslots = stripelen * SHM_STRIPES;
+	for ( i = 0; i < SHM_STRIPES; i++ ) {
+	    if ( store_lock_init( &shm->sh_lock[ i ] ) < 0 ) {
+		break;
+	    }
+	}
+	if ( i < SHM_STRIPES || shm_load() < 0 ) {
+	    (void)munmap( shm, size );
+	    shm = NULL;
+	    (void)shm_unlink( shm_name );
+	    goto error;
+	}
+	memcpy( shm->sh_magic, SHM_MAGIC, sizeof( shm->sh_magic ));
+    } else if ( size < SHM_HDRSIZE ||
+	    memcmp( shm->sh_magic, SHM_MAGIC, sizeof( shm->sh_magic )) != 0 ||
+	    shm->sh_slotsize != sizeof( struct shm_slot ) ||
+	    size != SHM_HDRSIZE +
+	    (size_t)shm->sh_nslots * sizeof( struct shm_slot )) {
+	syslog( LOG_ERR, "shm_init: %s is not a cosignd store, remove it "
+		"to start over", shm_name );
+	(void)munmap( shm, size );
+	shm = NULL;
+	goto error;
+    } else if ( shm->sh_nslots != stripelen * SHM_STRIPES ) {
+	syslog( LOG_NOTICE, "shm_init: %s has %u slots, not %u",
+		shm_name, shm->sh_nslots, stripelen * SHM_STRIPES );
+    }
+
+    if (( shm_copy = (struct shm_slot *)malloc(
+	    shm->sh_stripelen * sizeof( struct shm_slot ))) == NULL ) {
+	syslog( LOG_ERR, "shm_init: malloc: %m" );
+	goto error;
+    }
+
+    if ( flock( fd, LOCK_UN ) < 0 ) {
+	syslog( LOG_ERR, "shm_init: flock %s: %m", shm_name );
+    }
+    (void)close( fd );
+    return( 0 );
+
+error:
+    (void)close( fd );
+    return( -1 );
+}
+
+/*
+ * locks a stripe, first dropping any slot a process that died holding
+ * the lock left half written.
+ */
+    static void
+shm_lock( int stripe )
+{
+    struct shm_slot	*base;
+    unsigned int	i;
+    int			lost = 0;
+
+    if ( store_lock( &shm->sh_lock[ stripe ] ) == 0 ) {
+	return;
+    }
+    base = shm_slots + stripe * shm->sh_stripelen;
+    for ( i = 0; i < shm->sh_stripelen; i++ ) {
+	if ( base[ i ].sl_type != SHM_EMPTY &&
+		base[ i ].sl_type != SHM_DELETED &&
+		!shm_slotok( &base[ i ] )) {
+	    base[ i ].sl_type = SHM_DELETED;
+	    lost++;
+	}
+    }
+    if ( lost > 0 ) {
+	syslog( LOG_ERR, "shm_lock: stripe %d: %d cookies lost", stripe, lost );
+    }
+}
+
+/*
+ * looks for the cookie name in its stripe, which the caller has locked,
+ * passing over index entries.  if freep
+ * isn't NULL, it gets the first slot an insert could use, or NULL if
+ * the stripe is full.  if name is found, that's the first slot other
+ * than its own, for a replacement to be written to.
+ */
+    static struct shm_slot *
+shm_find( char *name, unsigned int hash, struct shm_slot **freep )
+{
+    struct shm_slot	*base, *sl;
+    unsigned int	i, n, mask = shm->sh_stripelen - 1;
+
+    if ( freep != NULL ) {
+	*freep = NULL;
+    }
+    base = shm_slots + SHM_STRIPE( hash ) * shm->sh_stripelen;
+    i = ( hash / SHM_STRIPES ) & mask;
+    for ( n = 0; n < shm->sh_stripelen; n++, i = ( i + 1 ) & mask ) {
+	sl = &base[ i ];
+	if ( sl->sl_type == SHM_EMPTY ) {
+	    if ( freep != NULL && *freep == NULL ) {
+		*freep = sl;
+	    }
+	    return( NULL );
+	}
+	if ( sl->sl_type == SHM_DELETED ) {
+	    if ( freep != NULL && *freep == NULL ) {
+		*freep = sl;
+	    }
+	    continue;
+	}
+	if ( sl->sl_hash == hash && sl->sl_type < SHM_INDEX &&
+		strcmp( sl->sl_name, name ) == 0 ) {
+	    break;
+	}
+    }
+    if ( n == shm->sh_stripelen ) {
+	return( NULL );
+    }
+
+    /* found, so look on for a slot to write its replacement to */
+    if ( freep != NULL && *freep == NULL ) {
+	for ( n = 1; n < shm->sh_stripelen; n++ ) {
+	    if ( base[ ( i + n ) & mask ].sl_type == SHM_EMPTY ||
+		    base[ ( i + n ) & mask ].sl_type == SHM_DELETED ) {
+		*freep = &base[ ( i + n ) & mask ];
+		break;
+	    }
+	}
+    }
+    return( sl );
+}
+
+/*
+ * where cookie is filed under key, in any index: in one of the
+ * SHM_KEYSTRIPES stripes from the key's, picked by the top of the
+ * cookie's hash, which neither an expire key's shard nor where to
+ * start probing depends on.
+ */
+    static unsigned int
+shm_ihash( char *key, char *cookie )
+{
+    unsigned int	hash = store_hash( cookie );
+
+    return( SHM_STRIPE( store_hash( key ) +
+	    ( hash >> 24 ) % SHM_KEYSTRIPES ) +
+	    ( hash / SHM_STRIPES ) * SHM_STRIPES );
+}
+
+/*
+ * as shm_find(), for cookie's entry under key in an index.  an entry
+ * is never replaced, so freep is only set if it isn't found.
+ */
+    static struct shm_slot *
+shm_ifind( int index, char *key, char *cookie, unsigned int hash,
+	struct shm_slot **freep )
+{
+    struct shm_slot	*base, *sl;
+    unsigned int	i, n, mask = shm->sh_stripelen - 1;
+
+    if ( freep != NULL ) {
+	*freep = NULL;
+    }
+    base = shm_slots + SHM_STRIPE( hash ) * shm->sh_stripelen;
+    i = ( hash / SHM_STRIPES ) & mask;
+    for ( n = 0; n < shm->sh_stripelen; n++, i = ( i + 1 ) & mask ) {
+	sl = &base[ i ];
+	if ( sl->sl_type == SHM_EMPTY ) {
+	    if ( freep != NULL && *freep == NULL ) {
+		*freep = sl;
+	    }
+	    return( NULL );
+	}
+	if ( sl->sl_type == SHM_DELETED ) {
+	    if ( freep != NULL && *freep == NULL ) {
+		*freep = sl;
+	    }
+	    continue;
+	}
+	if ( sl->sl_hash == hash && sl->sl_type == SHM_INDEX + index &&
+		strcmp( sl->sl_name, key ) == 0 &&
+		strcmp( sl->sl_login, cookie ) == 0 ) {
+	    if ( freep != NULL ) {
+		*freep = NULL;
+	    }
+	    return( sl );
+	}
+    }
+    return( NULL );
+}
+
+/*
+ * marks a slot deleted.  if the slot after it is empty, no probe can
+ * pass through it, so it and any deleted slots before it are emptied.
+ */
+    static void
+shm_delete( struct shm_slot *sl )
+{
+    struct shm_slot	*base;
+    unsigned int	i, mask = shm->sh_stripelen - 1;
+
+    base = shm_slots + (( sl - shm_slots ) / shm->sh_stripelen ) *
+	    shm->sh_stripelen;
+    i = sl - base;
+
+    sl->sl_type = SHM_DELETED;
+    if ( base[ ( i + 1 ) & mask ].sl_type != SHM_EMPTY ) {
+	return;
+    }
+    while ( base[ i ].sl_type == SHM_DELETED ) {
+	base[ i ].sl_type = SHM_EMPTY;
+	i = ( i - 1 ) & mask;
+    }
+}
+
+/*
+ * writes new to the empty slot, setting its type last, and then deletes
+ * old, the cookie it replaces, if there is one.  with no empty slot, old
+ * is rewritten in place, keeping its type throughout.  the caller has
+ * the stripe locked.
+ */
+    static void
+shm_write( struct shm_slot *old, struct shm_slot *empty, struct shm_slot *new )
+{
+    struct shm_slot	*sl;
+
+    sl = ( empty != NULL ) ? empty : old;
+    memcpy( &sl->sl_hash, &new->sl_hash,
+	    sizeof( struct shm_slot ) - offsetof( struct shm_slot, sl_hash ));
+    __sync_synchronize();
+    sl->sl_type = new->sl_type;
+    if ( old != NULL && sl != old ) {
+	shm_delete( old );
+    }
+}
+
+/* copies a whole slot in, replacing any cookie of the same name */
+    static int
+shm_insert( struct shm_slot *new )
+{
+    struct shm_slot	*sl, *empty;
+    int			stripe = SHM_STRIPE( new->sl_hash );
+
+    shm_lock( stripe );
+    if ( new->sl_type >= SHM_INDEX ) {
+	sl = shm_ifind( new->sl_type - SHM_INDEX, new->sl_name,
+		new->sl_login, new->sl_hash, &empty );
+	if ( sl != NULL ) {
+	    store_unlock( &shm->sh_lock[ stripe ] );
+	    return( 0 );
+	}
+    } else {
+	sl = shm_find( new->sl_name, new->sl_hash, &empty );
+    }
+    if ( sl == NULL && empty == NULL ) {
+	store_unlock( &shm->sh_lock[ stripe ] );
+	syslog( LOG_ERR, "shm_insert: %s: stripe %d full",
+		new->sl_name, stripe );
+	return( -1 );
+    }
+    shm_write( sl, empty, new );
+    store_unlock( &shm->sh_lock[ stripe ] );
+    return( 0 );
+}
+
+/* a slot whose strings each end within their fields */
+    static int
+shm_slotok( struct shm_slot *sl )
+{
+    if ( memchr( sl->sl_name, '\0', SHM_NAMELEN ) == NULL ) {
+	return( 0 );
+    }
+    switch ( sl->sl_type ) {
+    case SHM_LOGIN :
+	return( memchr( sl->sl_ipaddr, '\0', SHM_IPLEN ) != NULL &&
+		memchr( sl->sl_ipaddr_cur, '\0', SHM_IPLEN ) != NULL &&
+		memchr( sl->sl_user, '\0', SHM_USERLEN ) != NULL &&
+		memchr( sl->sl_realm, '\0', SHM_REALMLEN ) != NULL &&
+		memchr( sl->sl_ctime, '\0', SHM_CTIMELEN ) != NULL &&
+		memchr( sl->sl_krbtkt, '\0', SHM_TKTLEN ) != NULL );
+
+    case SHM_SERVICE :
+	return( memchr( sl->sl_login, '\0', SHM_NAMELEN ) != NULL );
+
+    default :
+	return( sl->sl_type >= SHM_INDEX &&
+		sl->sl_type < SHM_INDEX + STORE_INDEXES &&
+		memchr( sl->sl_login, '\0', SHM_NAMELEN ) != NULL );
+    }
+}
+
+    static int
+shm_fits( char *s, int len )
+{
+    return( strlen( s ) < (size_t)len ? 0 : -1 );
+}
+
+    static int
+shm_get( char *cookie, struct cinfo *ci )
+{
+    struct shm_slot	*sl;
+    unsigned int	hash = store_hash( cookie );
+    int			stripe = SHM_STRIPE( hash );
+
+    memset( ci, 0, sizeof( struct cinfo ));
+
+    shm_lock( stripe );
+    if (( sl = shm_find( cookie, hash, NULL )) == NULL ||
+	    sl->sl_type != SHM_LOGIN ) {
+	store_unlock( &shm->sh_lock[ stripe ] );
+	return( 1 );
+    }
+    ci->ci_version = 2;
+    ci->ci_state = sl->sl_state;
+    strcpy( ci->ci_ipaddr, sl->sl_ipaddr );
+    strcpy( ci->ci_ipaddr_cur, sl->sl_ipaddr_cur );
+    strcpy( ci->ci_user, sl->sl_user );
+    strcpy( ci->ci_realm, sl->sl_realm );
+    strcpy( ci->ci_ctime, sl->sl_ctime );
+    strcpy( ci->ci_krbtkt, sl->sl_krbtkt );
+    ci->ci_itime = sl->sl_itime;
+    store_unlock( &shm->sh_lock[ stripe ] );
+
+    return( 0 );
+}
+
+    static int
+shm_put( char *cookie, struct cinfo *ci, int flags )
+{
+    struct shm_slot	*sl, *empty, new;
+    unsigned int	hash = store_hash( cookie );
+    int			stripe = SHM_STRIPE( hash );
+
+    if ( shm_fits( cookie, SHM_NAMELEN ) < 0 ||
+	    shm_fits( ci->ci_ipaddr, SHM_IPLEN ) < 0 ||
+	    shm_fits( ci->ci_ipaddr_cur, SHM_IPLEN ) < 0 ||
+	    shm_fits( ci->ci_user, SHM_USERLEN ) < 0 ||
+	    shm_fits( ci->ci_realm, SHM_REALMLEN ) < 0 ||
+	    shm_fits( ci->ci_ctime, SHM_CTIMELEN ) < 0 ||
+	    shm_fits( ci->ci_krbtkt, SHM_TKTLEN ) < 0 ) {
+	syslog( LOG_ERR, "shm_put: %s: too long for the shm store", cookie );
+	return( -1 );
+    }
+
+    memset( &new, 0, sizeof( struct shm_slot ));
+    new.sl_type = SHM_LOGIN;
+    new.sl_hash = hash;
+    new.sl_itime = time( NULL );
+    strcpy( new.sl_name, cookie );
+    new.sl_state = 1;
+    strcpy( new.sl_ipaddr, ci->ci_ipaddr );
+    strcpy( new.sl_ipaddr_cur, ci->ci_ipaddr_cur );
+    strcpy( new.sl_user, ci->ci_user );
+    strcpy( new.sl_realm, ci->ci_realm );
+    strcpy( new.sl_ctime, ci->ci_ctime );
+    strcpy( new.sl_krbtkt, ci->ci_krbtkt );
+
+    shm_lock( stripe );
+    if (( sl = shm_find( cookie, hash, &empty )) != NULL &&
+	    !( flags & STORE_REPLACE )) {
+	store_unlock( &shm->sh_lock[ stripe ] );
+	return( 1 );
+    }
+    if ( sl == NULL && empty == NULL ) {
+	store_unlock( &shm->sh_lock[ stripe ] );
+	syslog( LOG_ERR, "shm_put: %s: stripe %d full", cookie, stripe );
+	return( -1 );
+    }
+    shm_write( sl, empty, &new );
+    store_unlock( &shm->sh_lock[ stripe ] );
+
+    return( 0 );
+}
+
+    static int
+shm_logout( char *cookie )
+{
+    struct shm_slot	*sl;
+    unsigned int	hash = store_hash( cookie );
+    int			stripe = SHM_STRIPE( hash );
+
+    shm_lock( stripe );
+    if (( sl = shm_find( cookie, hash, NULL )) == NULL ||
+	    sl->sl_type != SHM_LOGIN ) {
+	store_unlock( &shm->sh_lock[ stripe ] );
+	syslog( LOG_ERR, "shm_logout: %s: not found", cookie );
+	return( -1 );
+    }
+    sl->sl_state = 0;
+    sl->sl_itime = time( NULL );
+    store_unlock( &shm->sh_lock[ stripe ] );
+
+    return( 0 );
+}
+
+    static int
+shm_touch( char *cookie, time_t when )
+{
+    struct shm_slot	*sl;
+    unsigned int	hash = store_hash( cookie );
+    int			stripe = SHM_STRIPE( hash );
+
+    if ( when == 0 ) {
+	when = time( NULL );
+    }
+
+    shm_lock( stripe );
+    if (( sl = shm_find( cookie, hash, NULL )) == NULL ) {
+	store_unlock( &shm->sh_lock[ stripe ] );
+	errno = ENOENT;
+	return( -1 );
+    }
+    sl->sl_itime = when;
+    store_unlock( &shm->sh_lock[ stripe ] );
+
+    return( 0 );
+}
+
+    static int
+shm_register( char *scookie, char *login )
+{
+    struct shm_slot	*sl, *empty, new;
+    unsigned int	hash = store_hash( scookie );
+    int			stripe = SHM_STRIPE( hash );
+
+    if ( shm_fits( scookie, SHM_NAMELEN ) < 0 ||
+	    shm_fits( login, SHM_NAMELEN ) < 0 ) {
+	syslog( LOG_ERR, "shm_register: %s: too long for the shm store",
+		scookie );
+	return( -1 );
+    }
+
+    memset( &new, 0, sizeof( struct shm_slot ));
+    new.sl_type = SHM_SERVICE;
+    new.sl_hash = hash;
+    new.sl_itime = time( NULL );
+    strcpy( new.sl_name, scookie );
+    strcpy( new.sl_login, login );
+
+    shm_lock( stripe );
+    if (( sl = shm_find( scookie, hash, &empty )) != NULL ) {
+	store_unlock( &shm->sh_lock[ stripe ] );
+	return( 1 );
+    }
+    if ( empty == NULL ) {
+	store_unlock( &shm->sh_lock[ stripe ] );
+	syslog( LOG_ERR, "shm_register: %s: stripe %d full", scookie, stripe );
+	return( -1 );
+    }
+    shm_write( NULL, empty, &new );
+    store_unlock( &shm->sh_lock[ stripe ] );
+
+    return( 0 );
+}
+
+/* login should be MAXCOOKIELEN */
+    static int
+shm_service( char *scookie, char *login )
+{
+    struct shm_slot	*sl;
+    unsigned int	hash = store_hash( scookie );
+    int			stripe = SHM_STRIPE( hash );
+
+    shm_lock( stripe );
+    if (( sl = shm_find( scookie, hash, NULL )) == NULL ||
+	    sl->sl_type != SHM_SERVICE ) {
+	store_unlock( &shm->sh_lock[ stripe ] );
+	return( -1 );
+    }
+    strcpy( login, sl->sl_login );
+    store_unlock( &shm->sh_lock[ stripe ] );
+
+    return( 0 );
+}
+
+/*
+ * the two names usually hash to different stripes, and taking both
+ * locks at once would risk deadlock, so the slot is copied out, put
+ * in under its new name and then removed from under the old one.
+ */
+    static int
+shm_rekey( char *scookie, char *newcookie )
+{
+    struct shm_slot	*sl, new;
+    unsigned int	hash = store_hash( scookie );
+    int			stripe = SHM_STRIPE( hash );
+
+    if ( shm_fits( newcookie, SHM_NAMELEN ) < 0 ) {
+	syslog( LOG_ERR, "shm_rekey: %s: too long for the shm store",
+		newcookie );
+	return( -1 );
+    }
+
+    shm_lock( stripe );
+    if (( sl = shm_find( scookie, hash, NULL )) == NULL ) {
+	store_unlock( &shm->sh_lock[ stripe ] );
+	syslog( LOG_ERR, "shm_rekey: %s: not found", scookie );
+	return( -1 );
+    }
+    memcpy( &new, sl, sizeof( struct shm_slot ));
+    store_unlock( &shm->sh_lock[ stripe ] );
+
+    new.sl_hash = store_hash( newcookie );
+    strcpy( new.sl_name, newcookie );
+    if ( shm_insert( &new ) < 0 ) {
+	return( -1 );
+    }
+
+    shm_lock( stripe );
+    if (( sl = shm_find( scookie, hash, NULL )) != NULL ) {
+	shm_delete( sl );
+    }
+    store_unlock( &shm->sh_lock[ stripe ] );
+
+    return( 0 );
+}
+
+/* a bucket is a stripe */
+    static int
+shm_buckets( void )
+{
+    return( SHM_STRIPES );
+}
+
+/*
+ * the stripe is copied out under its lock, so fn is free to call back
+ * into the store.
+ */
+    static int
+shm_iterate( int bucket, int (*fn)( char *, void * ), void *arg )
+{
+    struct shm_slot	*base;
+    unsigned int	i, n = 0;
+    int			rc = 0;
+
+    base = shm_slots + bucket * shm->sh_stripelen;
+    shm_lock( bucket );
+    for ( i = 0; i < shm->sh_stripelen; i++ ) {
+	if ( base[ i ].sl_type == SHM_LOGIN ||
+		base[ i ].sl_type == SHM_SERVICE ) {
+	    strcpy( shm_copy[ n++ ].sl_name, base[ i ].sl_name );
+	}
+    }
+    store_unlock( &shm->sh_lock[ bucket ] );
+
+    for ( i = 0; i < n; i++ ) {
+	if (( rc = (*fn)( shm_copy[ i ].sl_name, arg )) < 0 ) {
+	    break;
+	}
+    }
+
+    return( rc < 0 ? rc : 0 );
+}
+
+    static int
+shm_expire( char *cookie )
+{
+    struct shm_slot	*sl;
+    unsigned int	hash = store_hash( cookie );
+    int			stripe = SHM_STRIPE( hash );
+
+    shm_lock( stripe );
+    if (( sl = shm_find( cookie, hash, NULL )) == NULL ) {
+	store_unlock( &shm->sh_lock[ stripe ] );
+	syslog( LOG_ERR, "shm_expire: %s: not found", cookie );
+	return( -1 );
+    }
+    shm_delete( sl );
+    store_unlock( &shm->sh_lock[ stripe ] );
+
+    return( 0 );
+}
+
+/*
+ * files cookie under key.  it may already be there, as it may be in
+ * the files the other stores keep.
+ */
+    static int
+shm_index_add( int index, char *key, char *cookie )
+{
+    struct shm_slot	*empty, new;
+    unsigned int	hash;
+    int			stripe;
+
+    if ( shm_fits( key, SHM_NAMELEN ) < 0 ||
+	    shm_fits( cookie, SHM_NAMELEN ) < 0 ) {
+	syslog( LOG_ERR, "shm_index_add: %s: too long for the shm store",
+		key );
+	return( -1 );
+    }
+    hash = shm_ihash( key, cookie );
+    stripe = SHM_STRIPE( hash );
+
+    memset( &new, 0, sizeof( struct shm_slot ));
+    new.sl_type = SHM_INDEX + index;
+    new.sl_hash = hash;
+    new.sl_itime = time( NULL );
+    strcpy( new.sl_name, key );
+    strcpy( new.sl_login, cookie );
+
+    shm_lock( stripe );
+    if ( shm_ifind( index, key, cookie, hash, &empty ) != NULL ) {
+	store_unlock( &shm->sh_lock[ stripe ] );
+	return( 0 );
+    }
+    if ( empty == NULL ) {
+	store_unlock( &shm->sh_lock[ stripe ] );
+	syslog( LOG_ERR, "shm_index_add: %s: stripe %d full", key, stripe );
+	return( -1 );
+    }
+    shm_write( NULL, empty, &new );
+    store_unlock( &shm->sh_lock[ stripe ] );
+
+    return( 0 );
+}
+
+/*
+ * key's cookies are copied out under each of its stripes' locks in
+ * turn, as in shm_iterate(), and those fn drops are deleted one by one
+ * after.  the copy is made for each call, since fn may iterate another
+ * key.
+ */
+    static int
+shm_index_iterate( int index, char *key, int (*fn)( char *, void * ),
+	void *arg )
+{
+    struct shm_slot	*base, *sl;
+    char		*names = NULL, *p;
+    size_t		len = 0, size = 0, flen;
+    unsigned int	i, k, hash = store_hash( key );
+    int			stripe, rc = 0;
+
+    for ( k = 0; k < SHM_KEYSTRIPES; k++ ) {
+	stripe = SHM_STRIPE( hash + k );
+	base = shm_slots + stripe * shm->sh_stripelen;
+	shm_lock( stripe );
+	for ( i = 0; i < shm->sh_stripelen; i++ ) {
+	    if ( base[ i ].sl_type != SHM_INDEX + index ||
+		    strcmp( base[ i ].sl_name, key ) != 0 ) {
+		continue;
+	    }
+	    flen = strlen( base[ i ].sl_login ) + 1;
+	    if ( len + flen > size ) {
+		size = size * 2 + SHM_NAMELEN;
+		if (( p = (char *)realloc( names, size )) == NULL ) {
+		    store_unlock( &shm->sh_lock[ stripe ] );
+		    syslog( LOG_ERR, "shm_index_iterate: realloc: %m" );
+		    free( names );
+		    return( -1 );
+		}
+		names = p;
+	    }
+	    memcpy( names + len, base[ i ].sl_login, flen );
+	    len += flen;
+	}
+	store_unlock( &shm->sh_lock[ stripe ] );
+    }
+
+    for ( p = names; p < names + len; p += strlen( p ) + 1 ) {
+	if (( rc = (*fn)( p, arg )) < 0 ) {
+	    break;
+	}
+	if ( rc == 0 ) {
+	    continue;
+	}
+	hash = shm_ihash( key, p );
+	stripe = SHM_STRIPE( hash );
+	shm_lock( stripe );
+	if (( sl = shm_ifind( index, key, p, hash, NULL )) != NULL ) {
+	    shm_delete( sl );
+	}
+	store_unlock( &shm->sh_lock[ stripe ] );
+    }
+    free( names );
+
+    return( rc < 0 ? rc : 0 );
+}
+
+/*
+ * a stripe at a time, as shm_index_iterate().  a key is passed to fn
+ * once for each stripe it has cookies in.
+ */
+    static int
+shm_index_keys( int index, int (*fn)( char *, void * ), void *arg )
+{
+    struct shm_slot	*base;
+    char		*names;
+    unsigned int	i, j, n;
+    int			stripe, rc = 0;
+
+    if (( names = (char *)malloc(
+	    (size_t)shm->sh_stripelen * SHM_NAMELEN )) == NULL ) {
+	syslog( LOG_ERR, "shm_index_keys: malloc: %m" );
+	return( -1 );
+    }
+
+    for ( stripe = 0; stripe < SHM_STRIPES && rc >= 0; stripe++ ) {
+	base = shm_slots + stripe * shm->sh_stripelen;
+	n = 0;
+	shm_lock( stripe );
+	for ( i = 0; i < shm->sh_stripelen; i++ ) {
+	    if ( base[ i ].sl_type != SHM_INDEX + index ) {
+		continue;
+	    }
+	    for ( j = 0; j < n; j++ ) {
+		if ( strcmp( names + j * SHM_NAMELEN,
+			base[ i ].sl_name ) == 0 ) {
+		    break;
+		}
+	    }
+	    if ( j == n ) {
+		strcpy( names + n++ * SHM_NAMELEN, base[ i ].sl_name );
+	    }
+	}
+	store_unlock( &shm->sh_lock[ stripe ] );
+
+	for ( i = 0; i < n; i++ ) {
+	    if (( rc = (*fn)( names + i * SHM_NAMELEN, arg )) < 0 ) {
+		break;
+	    }
+	}
+    }
+    free( names );
+
+    return( rc < 0 ? rc : 0 );
+}
+
+/*
+ * writes every cookie and index entry to a tmp file, a stripe at a
+ * time, and renames it over the snapshot.  each stripe is consistent,
+ * the whole need not be.
+ */
+    static int
+shm_sync( void )
+{
+    struct shm_snapheader	ss;
+    struct shm_slot		*base;
+    FILE			*f;
+    char			tmppath[ MAXPATHLEN ];
+    unsigned int		i, n;
+    int				stripe, fd;
+
+    if ( snprintf( tmppath, sizeof( tmppath ), "%s.%i",
+	    SHM_SNAPSHOT, (int)getpid()) >= sizeof( tmppath )) {
+	syslog( LOG_ERR, "shm_sync: tmppath too long" );
+	return( -1 );
+    }
+    if (( fd = open( tmppath, O_CREAT|O_TRUNC|O_WRONLY, 0600 )) < 0 ) {
+	syslog( LOG_ERR, "shm_sync: open %s: %m", tmppath );
+	return( -1 );
+    }
+    if (( f = fdopen( fd, "w" )) == NULL ) {
+	syslog( LOG_ERR, "shm_sync: fdopen: %m" );
+	(void)close( fd );
+	goto error;
+    }
+
+    memset( &ss, 0, sizeof( struct shm_snapheader ));
+    memcpy( ss.ss_magic, SHM_SNAPMAGIC, sizeof( ss.ss_magic ));
+    ss.ss_slotsize = sizeof( struct shm_slot );
+    (void)fwrite( &ss, sizeof( struct shm_snapheader ), 1, f );
+
+    for ( stripe = 0; stripe < SHM_STRIPES; stripe++ ) {
+	base = shm_slots + stripe * shm->sh_stripelen;
+	n = 0;
+	shm_lock( stripe );
+	for ( i = 0; i < shm->sh_stripelen; i++ ) {
+	    if ( base[ i ].sl_type != SHM_EMPTY &&
+		    base[ i ].sl_type != SHM_DELETED ) {
+		memcpy( &shm_copy[ n++ ], &base[ i ], sizeof( struct shm_slot ));
+	    }
+	}
+	store_unlock( &shm->sh_lock[ stripe ] );
+
+	if ( n > 0 &&
+		fwrite( shm_copy, sizeof( struct shm_slot ), n, f ) != n ) {
+	    break;
+	}
+    }
+
+    if ( fflush( f ) != 0 || ferror( f ) || fsync( fileno( f )) != 0 ) {
+	syslog( LOG_ERR, "shm_sync: write %s: %m", tmppath );
+	(void)fclose( f );
+	goto error;
+    }
+    if ( fclose( f ) != 0 ) {
+	syslog( LOG_ERR, "shm_sync: fclose %s: %m", tmppath );
+	goto error;
+    }
+    if ( rename( tmppath, SHM_SNAPSHOT ) != 0 ) {
+	syslog( LOG_ERR, "shm_sync: rename %s to %s: %m",
+		tmppath, SHM_SNAPSHOT );
+	goto error;
+    }
+    return( 0 );
+
+error:
+    if ( unlink( tmppath ) != 0 ) {
+	syslog( LOG_ERR, "shm_sync: unlink %s: %m", tmppath );
+    }
+    return( -1 );
+}
+
+/*
+ * fills a new segment from the snapshot, if there is one.  cookies are
+ * hashed in again, so the table may have changed size since.
+ */
+    static int
+shm_load( void )
+{
+    struct shm_snapheader	ss;
+    struct shm_slot		sl;
+    FILE			*f;
+    int				n = 0, lost = 0;
+
+    if (( f = fopen( SHM_SNAPSHOT, "r" )) == NULL ) {
+	if ( errno == ENOENT ) {
+	    return( 0 );
+	}
+	syslog( LOG_ERR, "shm_load: %s: %m", SHM_SNAPSHOT );
+	return( -1 );
+    }
+
+    if ( fread( &ss, sizeof( struct shm_snapheader ), 1, f ) != 1 ||
+	    memcmp( ss.ss_magic, SHM_SNAPMAGIC, sizeof( ss.ss_magic )) != 0 ||
+	    ss.ss_slotsize != sizeof( struct shm_slot )) {
+	syslog( LOG_ERR, "shm_load: %s: not a cosignd snapshot", SHM_SNAPSHOT );
+	(void)fclose( f );
+	return( -1 );
+    }
+
+    while ( fread( &sl, sizeof( struct shm_slot ), 1, f ) == 1 ) {
+	if ( !shm_slotok( &sl )) {
+	    lost++;
+	    continue;
+	}
+	if ( sl.sl_type >= SHM_INDEX ) {
+	    sl.sl_hash = shm_ihash( sl.sl_name, sl.sl_login );
+	} else {
+	    sl.sl_hash = store_hash( sl.sl_name );
+	}
+	if ( shm_insert( &sl ) < 0 ) {
+	    lost++;
+	    continue;
+	}
+	n++;
+    }
+    if ( ferror( f )) {
+	syslog( LOG_ERR, "shm_load: %s: %m", SHM_SNAPSHOT );
+    }
+    (void)fclose( f );
+
+    syslog( LOG_INFO, "shm_load: %d slots from %s, %d lost",
+	    n, SHM_SNAPSHOT, lost );
+    return( 0 );
+}
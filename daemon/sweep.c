@@ -0,0 +1,742 @@
+/*
+ * Copyright (c) 2004 Regents of The University of Michigan.
+ * All Rights Reserved.  See LICENSE.
+ */
+
+/*
+ * monster's passes through the store: login cookies that have timed
+ * out are expired, with their tickets and service cookies, and the last
+ * activity of the rest is sent to replicas.  monster runs them against
+ * its connections to each replica.  cosignd runs them itself, in a
+ * sweeper forked like the pusher, when cosigndsweep is set, on the
+ * store it already has open, handing what's changed to the pusher to
+ * send on to the replicas it's connected to.
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <string.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+
+#include <openssl/ssl.h>
+#include <snet.h>
+
+#include "cparse.h"
+#include "mkcookie.h"
+#include "rate.h"
+#include "journal.h"
+#include "monster.h"
+#include "store.h"
+#include "uindex.h"
+#include "sweep.h"
+
+/* idle_cache = (grey+idle) from cosignd, plus loggedout_cache here */
+int		idle_cache = (60 * 30) +  (60 * 60 * 2) + (60 * 60 * 2);
+int		interval = 0;
+int		hard_timeout = 60 * 60 * 12;
+int		loggedout_cache = 60 * 60 * 2;
+int		sweep_procs = 1;
+int		sweep_iops = 0;
+
+int		login_total, login_sent, login_gone;
+int		service_total, service_gone;
+
+/* the cookies named in the journal since a replica's place in it */
+struct jnames {
+    char		**jn_names;
+    int			jn_count;
+    int			jn_size;
+};
+
+static int eat_cookie( char *, struct timeval *, time_t *, int *, time_t * );
+static int do_cookie( char *, void * );
+static int due_cookie( char *, void * );
+static int expire_service( char *, void * );
+static void push_time( struct sweep *, char *, time_t, int );
+static void sweep_send( struct sweep *, struct connlist *, char *,
+	time_t, int );
+static void sweep_pace( struct sweep * );
+static int sweep_buckets( struct sweep * );
+static int sweep_fork( struct sweep * );
+static void sweep_line( struct sweep *, char * );
+static int journal_name( char *, void * );
+static int jnames_cmp( const void *, const void * );
+
+/*
+ * reads through the store if sw_walk says to, by as many sweepers as
+ * cosignmonsterprocs says, sharing cosignmonsteriops, then the slots of
+ * the expiry wheel that have come due since *slot.  the caller fills
+ * in the rest of sw.
+ */
+    int
+sweep_pass( struct sweep *sw, time_t *slot )
+{
+    time_t		last;
+    int			first;
+
+    sw->sw_nprocs = sweep_procs;
+    sw->sw_start = *sw->sw_now;
+
+    /*
+     * nothing in a slot of the expiry wheel can expire until the
+     * shortest of the timeouts after the slot ends.  the first pass
+     * starts from the oldest slot that could hold a live cookie, after
+     * clearing any older slots left from before.
+     */
+    sw->sw_window = idle_cache;
+    if ( loggedout_cache < sw->sw_window ) {
+	sw->sw_window = loggedout_cache;
+    }
+    if ( hard_timeout < sw->sw_window ) {
+	sw->sw_window = hard_timeout;
+    }
+    last = ( sw->sw_now->tv_sec - sw->sw_window ) / EINDEX_SLOT;
+    if (( first = ( *slot == 0 ))) {
+	*slot = ( sw->sw_now->tv_sec - hard_timeout - sw->sw_window ) /
+		EINDEX_SLOT;
+    }
+
+    if ( sw->sw_walk ) {
+	sw->sw_rate = ( sweep_iops + sweep_procs - 1 ) / sweep_procs;
+	if ( sweep_procs > 1 ) {
+	    if ( sweep_fork( sw ) < 0 ) {
+		return( -1 );
+	    }
+	} else if ( sweep_buckets( sw ) < 0 ) {
+	    return( -1 );
+	}
+    } else if ( interval == 0 && sweep_iops == 0 ) {
+	sleep( 120 );
+    }
+
+    sw->sw_rate = sweep_iops;
+    sw->sw_reads = 0;
+    if ( gettimeofday( &sw->sw_start, NULL ) != 0 ) {
+	syslog( LOG_ERR, "gettimeofday: %m" );
+	return( -1 );
+    }
+    if ( first && eindex_before( *slot, due_cookie, sw ) < 0 ) {
+	syslog( LOG_ERR, "monster: expiry slots before %lu failed",
+		(unsigned long)*slot );
+    }
+    for ( ; *slot < last; (*slot)++ ) {
+	if ( eindex_iterate( *slot, due_cookie, sw ) < 0 ) {
+	    syslog( LOG_ERR, "monster: expiry slot %lu failed",
+		    (unsigned long)*slot );
+	}
+    }
+    return( 0 );
+}
+
+/* logs the counts, and the rates, of the pass begun at start */
+    void
+sweep_stats( struct timeval *start )
+{
+    struct timeval	end;
+    double		secs;
+
+    syslog( LOG_NOTICE, "STATS MONSTER: %d/%d/%d login %d/%d service",
+	    login_gone, login_sent, login_total, service_gone, service_total );
+    if ( gettimeofday( &end, NULL ) != 0 ) {
+	syslog( LOG_ERR, "gettimeofday: %m" );
+	return;
+    }
+    secs = ( end.tv_sec - start->tv_sec ) +
+	    ( end.tv_usec - start->tv_usec ) / 1000000.0;
+    if ( secs < 0.001 ) {
+	secs = 0.001;
+    }
+    syslog( LOG_NOTICE, "STATS MONSTER PASS: %.3fs %.0f cookies/s "
+	    "%.0f deletes/s", secs, ( login_total + service_total ) / secs,
+	    ( login_gone + service_gone ) / secs );
+}
+
+/*
+ * cosignd's sweeper, a pass every interval seconds.  with replication,
+ * push is the pipe to the pusher, and the cookies noted in the journal
+ * since the last pass are handed to it as "time" lines, for each of
+ * its connections to send on as a TIME.  lines the pusher couldn't
+ * send to a replica are lost, so full passes hand it everything used
+ * since the last full pass instead.
+ */
+    int
+sweeper( SNET *push )
+{
+    struct connlist	pusher, *head = NULL;
+    struct sweep	sw;
+    struct timeval	now;
+    struct jpos		mark, pos;
+    time_t		slot = 0, full = 0;
+    pid_t		parent = getppid();
+    int			pass = 0, jok;
+
+    memset( &pusher, 0, sizeof( struct connlist ));
+    pusher.cl_jpos.jp_seg = -1;
+    if ( push != NULL ) {
+	if ( journal_open() < 0 ) {
+	    return( -1 );
+	}
+	pusher.cl_sn = push;
+	head = &pusher;
+    }
+
+    for (;;) {
+	sleep( interval );
+
+	/* and holding the pusher's pipe open after cosignd has gone */
+	if ( getppid() != parent ) {
+	    syslog( LOG_NOTICE, "sweeper: cosignd has exited" );
+	    return( 0 );
+	}
+	login_total = service_total = login_gone = service_gone = 0;
+	login_sent = 0;
+
+	if ( gettimeofday( &now, NULL ) != 0 ) {
+	    syslog( LOG_ERR, "gettimeofday: %m" );
+	    return( -1 );
+	}
+	jok = ( head != NULL && journal_mark( &mark ) == 0 );
+
+	memset( &sw, 0, sizeof( struct sweep ));
+	sw.sw_head = ( pusher.cl_sn != NULL ) ? head : NULL;
+	sw.sw_now = &now;
+	sw.sw_full = ( pass++ % MONSTER_FULLPASS == 0 );
+	sw.sw_journal = jok;
+	sw.sw_pusher = 1;
+	if ( sw.sw_full ) {
+	    pusher.cl_jpos.jp_seg = -1;
+	    pusher.cl_last_time = full;
+	    full = now.tv_sec;
+	}
+	sw.sw_walk = ( sw.sw_full ||
+		( sw.sw_head != NULL && pusher.cl_jpos.jp_seg < 0 ));
+
+	if ( sweep_pass( &sw, &slot ) < 0 ) {
+	    return( -1 );
+	}
+
+	if ( sw.sw_head != NULL ) {
+	    pos = pusher.cl_jpos;
+	    if ( jok && pos.jp_seg >= 0 ) {
+		if ( sweep_journal( &sw, &pusher, &pos, &mark ) < 0 ) {
+		    syslog( LOG_NOTICE, "sweeper: journal lost, "
+			    "sending everything next pass" );
+		    pusher.cl_last_time = 0;
+		    pos.jp_seg = -1;
+		}
+	    } else if ( jok ) {
+		pos = mark;
+	    }
+	    if ( !jok || pos.jp_seg >= 0 ) {
+		pusher.cl_last_time = now.tv_sec;
+	    }
+	    pusher.cl_jpos = pos;
+	    if ( pos.jp_seg >= 0 ) {
+		journal_trim( &pos );
+	    }
+	}
+
+	sweep_stats( &now );
+	if ( store_sync() < 0 ) {
+	    syslog( LOG_ERR, "store_sync failed" );
+	}
+    }
+}
+
+/*
+ * reads through this sweeper's share of the store's buckets.  without
+ * an interval or a budget, the pass is spread over about two minutes,
+ * pausing every 64th of the way through.
+ */
+    static int
+sweep_buckets( struct sweep *sw )
+{
+    int			i, j, nbuckets, pace;
+
+    nbuckets = store->so_buckets();
+    if (( pace = nbuckets / sw->sw_nprocs / 64 ) < 1 ) {
+	pace = 1;
+    }
+    for ( i = sw->sw_proc, j = 0; i < nbuckets; i += sw->sw_nprocs, j++ ) {
+	if ( interval == 0 && sw->sw_rate == 0 ) {
+	    if ( nbuckets == 1 ) {
+		sleep( 120 );
+	    } else if ( j % pace == 0 ) {
+		sleep( 2 );
+	    }
+	}
+	if ( store->so_iterate( i, do_cookie, sw ) < 0 ) {
+	    return( -1 );
+	}
+    }
+    return( 0 );
+}
+
+/*
+ * forks a sweeper for each share of the buckets.  each sends back the
+ * last activity to push to replicas, which only we're connected to,
+ * and its counts.  returns -1 if any of them failed.
+ */
+    static int
+sweep_fork( struct sweep *sw )
+{
+    struct pollfd	*pfd;
+    SNET		**sn;
+    pid_t		*pid;
+    char		*line;
+    int			fds[ 2 ], i, k, left, status, rc = 0;
+
+    if (( pfd = calloc( sw->sw_nprocs, sizeof( struct pollfd ))) == NULL ||
+	    ( sn = calloc( sw->sw_nprocs, sizeof( SNET * ))) == NULL ||
+	    ( pid = calloc( sw->sw_nprocs, sizeof( pid_t ))) == NULL ) {
+	syslog( LOG_ERR, "sweep_fork: calloc: %m" );
+	return( -1 );
+    }
+
+    for ( k = 0; k < sw->sw_nprocs; k++ ) {
+	if ( pipe( fds ) < 0 ) {
+	    syslog( LOG_ERR, "sweep_fork: pipe: %m" );
+	    exit( 1 );
+	}
+	switch ( pid[ k ] = fork()) {
+	case 0 :
+	    for ( i = 0; i < k; i++ ) {
+		(void)close( pfd[ i ].fd );
+	    }
+	    (void)close( fds[ 0 ] );
+	    if (( sw->sw_out = fdopen( fds[ 1 ], "w" )) == NULL ) {
+		syslog( LOG_ERR, "sweep_fork: fdopen: %m" );
+		_exit( 1 );
+	    }
+	    sw->sw_proc = k;
+	    rc = sweep_buckets( sw );
+	    fprintf( sw->sw_out, "= %d %d %d %d\n", login_gone, login_total,
+		    service_gone, service_total );
+	    if ( fclose( sw->sw_out ) != 0 ) {
+		rc = -1;
+	    }
+	    _exit( rc < 0 ? 1 : 0 );
+
+	case -1 :
+	    syslog( LOG_ERR, "sweep_fork: fork: %m" );
+	    exit( 1 );
+
+	default :
+	    (void)close( fds[ 1 ] );
+	    if (( sn[ k ] = snet_attach( fds[ 0 ], 1024 * 1024 )) == NULL ) {
+		syslog( LOG_ERR, "sweep_fork: snet_attach: %m" );
+		exit( 1 );
+	    }
+	    pfd[ k ].fd = fds[ 0 ];
+	    pfd[ k ].events = POLLIN;
+	    break;
+	}
+    }
+
+    /* a sweeper mid-line is writing the rest, so waiting for it is safe */
+    for ( left = sw->sw_nprocs; left > 0; ) {
+	if ( poll( pfd, sw->sw_nprocs, -1 ) < 0 ) {
+	    if ( errno == EINTR ) {
+		continue;
+	    }
+	    syslog( LOG_ERR, "sweep_fork: poll: %m" );
+	    exit( 1 );
+	}
+	for ( k = 0; k < sw->sw_nprocs; k++ ) {
+	    if ( pfd[ k ].fd < 0 || pfd[ k ].revents == 0 ) {
+		continue;
+	    }
+	    do {
+		if (( line = snet_getline( sn[ k ], NULL )) == NULL ) {
+		    (void)snet_close( sn[ k ] );
+		    pfd[ k ].fd = -1;
+		    left--;
+		    break;
+		}
+		sweep_line( sw, line );
+	    } while ( snet_hasdata( sn[ k ] ));
+	}
+    }
+
+    for ( k = 0; k < sw->sw_nprocs; k++ ) {
+	while ( waitpid( pid[ k ], &status, 0 ) < 0 ) {
+	    if ( errno != EINTR ) {
+		syslog( LOG_ERR, "sweep_fork: waitpid: %m" );
+		exit( 1 );
+	    }
+	}
+	if ( !WIFEXITED( status ) || WEXITSTATUS( status ) != 0 ) {
+	    syslog( LOG_ERR, "sweep_fork: sweeper %d failed", k );
+	    rc = -1;
+	}
+    }
+    free( pfd );
+    free( sn );
+    free( pid );
+    return( rc );
+}
+
+/* "name itime state" to push, or "= counts" once a sweeper is done */
+    static void
+sweep_line( struct sweep *sw, char *line )
+{
+    char		*p;
+    time_t		itime;
+    int			lg, lt, sg, st;
+
+    if ( *line == '=' ) {
+	if ( sscanf( line, "= %d %d %d %d", &lg, &lt, &sg, &st ) == 4 ) {
+	    login_gone += lg;
+	    login_total += lt;
+	    service_gone += sg;
+	    service_total += st;
+	}
+	return;
+    }
+    if (( p = strchr( line, ' ' )) == NULL ) {
+	syslog( LOG_ERR, "sweep_line: %s: bad line", line );
+	return;
+    }
+    *p++ = '\0';
+    itime = (time_t)strtol( p, &p, 10 );
+    push_time( sw, line, itime, atoi( p ));
+}
+
+/*
+ * sends a login cookie's last activity to each replica that hasn't
+ * had it, or from a sweeper, to the parent to send.
+ */
+    static void
+push_time( struct sweep *sw, char *name, time_t itime, int state )
+{
+    struct connlist	*yacur;
+
+    for ( yacur = sw->sw_head; yacur != NULL; yacur = yacur->cl_next ) {
+	if (( itime <= yacur->cl_last_time ) || ( yacur->cl_sn == NULL )) {
+	    continue;
+	}
+	if ( sw->sw_journal && yacur->cl_jpos.jp_seg >= 0 ) {
+	    /* sweep_journal() has it */
+	    continue;
+	}
+	if ( sw->sw_out != NULL ) {
+	    fprintf( sw->sw_out, "%s %ld %d\n", name, (long)itime, state );
+	    return;
+	}
+	sweep_send( sw, yacur, name, itime, state );
+    }
+}
+
+/* to a replica, in a TIME, or to cosignd's pusher, a line each */
+    static void
+sweep_send( struct sweep *sw, struct connlist *cl, char *name,
+	time_t itime, int state )
+{
+    login_sent++;
+    if ( snet_writef( cl->cl_sn, "%s%s %d %d\r\n", sw->sw_pusher ?
+	    "time " : "", name, itime, state ) < 0 ) {
+	if ( snet_close( cl->cl_sn ) != 0 ) {
+	    syslog( LOG_ERR, "snet_close: 11: %m" );
+	}
+	cl->cl_sn = NULL;
+    }
+}
+
+    static int
+journal_name( char *name, void *arg )
+{
+    struct jnames	*jn = (struct jnames *)arg;
+    char		**names;
+
+    if ( jn->jn_count == jn->jn_size ) {
+	if (( names = realloc( jn->jn_names, ( jn->jn_size * 2 + 64 ) *
+		sizeof( char * ))) == NULL ) {
+	    syslog( LOG_ERR, "journal_name: realloc: %m" );
+	    return( -1 );
+	}
+	jn->jn_names = names;
+	jn->jn_size = jn->jn_size * 2 + 64;
+    }
+    if (( jn->jn_names[ jn->jn_count ] = strdup( name )) == NULL ) {
+	syslog( LOG_ERR, "journal_name: strdup: %m" );
+	return( -1 );
+    }
+    jn->jn_count++;
+    return( 0 );
+}
+
+    static int
+jnames_cmp( const void *a, const void *b )
+{
+    return( strcmp( *(char **)a, *(char **)b ));
+}
+
+/*
+ * sends a replica the last activity of each login cookie the journal
+ * names from pos up to mark, once each, moving pos along.  returns -1
+ * if the journal can't say what's changed since pos.
+ */
+    int
+sweep_journal( struct sweep *sw, struct connlist *cl, struct jpos *pos,
+	struct jpos *mark )
+{
+    struct jnames	jn;
+    struct cinfo	ci;
+    int			i, rc;
+
+    memset( &jn, 0, sizeof( struct jnames ));
+    if (( rc = journal_read( pos, mark, journal_name, &jn )) == 0 ) {
+	qsort( jn.jn_names, jn.jn_count, sizeof( char * ), jnames_cmp );
+    }
+
+    for ( i = 0; i < jn.jn_count; i++ ) {
+	if ( rc < 0 || cl->cl_sn == NULL || ( i > 0 &&
+		strcmp( jn.jn_names[ i ], jn.jn_names[ i - 1 ] ) == 0 )) {
+	    continue;
+	}
+	if ( store_valid( jn.jn_names[ i ] ) < 0 ||
+		( store->so_peek != NULL ?
+		store->so_peek( jn.jn_names[ i ], &ci ) :
+		store->so_get( jn.jn_names[ i ], &ci )) != 0 ) {
+	    /* gone, and expired there too in time */
+	    continue;
+	}
+	sweep_send( sw, cl, jn.jn_names[ i ], ci.ci_itime, ci.ci_state );
+    }
+
+    for ( i = 0; i < jn.jn_count; i++ ) {
+	free( jn.jn_names[ i ] );
+    }
+    free( jn.jn_names );
+    return( rc );
+}
+
+/* holds a sweeper to its share of cosignmonsteriops */
+    static void
+sweep_pace( struct sweep *sw )
+{
+    struct timeval	tv;
+    struct timespec	ts;
+    double		ahead;
+
+    if ( sw->sw_rate <= 0 ) {
+	return;
+    }
+    sw->sw_reads++;
+    if ( gettimeofday( &tv, NULL ) != 0 ) {
+	return;
+    }
+    ahead = (double)sw->sw_reads / sw->sw_rate -
+	    (( tv.tv_sec - sw->sw_start.tv_sec ) +
+	    ( tv.tv_usec - sw->sw_start.tv_usec ) / 1000000.0 );
+    if ( ahead > 0 ) {
+	ts.tv_sec = (time_t)ahead;
+	ts.tv_nsec = (long)(( ahead - ts.tv_sec ) * 1000000000.0 );
+	(void)nanosleep( &ts, NULL );
+    }
+}
+
+    static int
+do_cookie( char *name, void *arg )
+{
+    struct sweep	*sw = (struct sweep *)arg;
+    char                login[ MAXCOOKIELEN ];
+    int			state = 0;
+    time_t		itime = 0, due;
+    int			rc;
+
+    /* is a login cookie */
+    if ( strncmp( name, "cosign=", 7 ) == 0 ) {
+	login_total++;
+	sweep_pace( sw );
+
+	if (( rc = eat_cookie( name, sw->sw_now, &itime, &state,
+		&due )) < 0 ) {
+	    syslog( LOG_ERR, "eat_cookie failure: %s", name );
+	    return( 0 );
+	}
+	if ( rc == 0 ) {
+	    /* Cookie was deleted, so don't sync */
+	    return( 0 );
+	}
+	push_time( sw, name, itime, state );
+    } else if ( strncmp( name, "cosign-", 7 ) == 0 ) {
+	service_total++;
+	if ( !sw->sw_full ) {
+	    return( 0 );
+	}
+	sweep_pace( sw );
+	if ( store->so_service( name, login ) != 0 ) {
+	    return( 0 );
+	}
+
+	if ( store_valid( login ) < 0 ) {
+	    syslog( LOG_ERR, "do_cookie: invalid login cookie %s", login );
+	    exit( 1 );
+	}
+
+	if (( rc = eat_cookie( login, sw->sw_now, &itime, &state,
+		&due )) < 0 ) {
+	    syslog( LOG_ERR, "eat_cookie failure: %s", login );
+	    return( 0 );
+	}
+	if ( rc == 0 ) {
+	    /* and any others the index has for login, if not already */
+	    (void)sindex_iterate( login, expire_service, login );
+	    (void)expire_service( name, login );
+	}
+    }
+    return( 0 );
+}
+
+/*
+ * a login cookie from a due slot of the expiry wheel.  one that hasn't
+ * expired, because it was used since or isn't logged out, is filed
+ * again for when it next could.  it's dropped from this slot either
+ * way: the full pass finds any that errors leave out.
+ */
+    static int
+due_cookie( char *name, void *arg )
+{
+    struct sweep	*sw = (struct sweep *)arg;
+    int			state;
+    time_t		itime, due;
+
+    if ( strncmp( name, "cosign=", 7 ) != 0 || store_valid( name ) < 0 ) {
+	return( 1 );
+    }
+    login_total++;
+    sweep_pace( sw );
+    if ( eat_cookie( name, sw->sw_now, &itime, &state, &due ) == 1 &&
+	    eindex_add( due - sw->sw_window, name ) < 0 ) {
+	syslog( LOG_ERR, "due_cookie: %s: not indexed", name );
+    }
+    return( 1 );
+}
+
+/*
+ * one of the service cookies indexed for the login cookie arg, which
+ * is gone.  the index may name service cookies that are gone too, or
+ * were rekeyed, so each is looked for first.
+ */
+    static int
+expire_service( char *name, void *arg )
+{
+    char		login[ MAXCOOKIELEN ];
+
+    if ( store->so_service( name, login ) != 0 ||
+	    strcmp( login, (char *)arg ) != 0 ) {
+	return( 1 );
+    }
+    if ( store->so_expire( name ) == 0 ) {
+	service_gone++;
+    }
+    return( 1 );
+}
+
+    static int
+eat_cookie( char *name, struct timeval *now, time_t *itime, int *state,
+	time_t *due )
+{
+    struct cinfo	ci;
+    int			rc, create = 0, peek;
+    extern int		errno;
+
+
+    /* -1 is a serious error
+     * 0 means the cookie was deleted
+     * 1 means still good and time was updated, and due is the first
+     *   second at which it could expire
+     */
+
+    /*
+     * state, itime and ctime are all it takes to tell, and where the
+     * store can give us those alone, the cookie is only read in full
+     * to delete it.
+     */
+    peek = ( store->so_peek != NULL );
+    if ( peek ) {
+	rc = store->so_peek( name, &ci );
+    } else {
+	rc = store->so_get( name, &ci );
+    }
+    if ( rc < 0 ) {
+	syslog( LOG_ERR, "read_cookie error: %s", name );
+	return( -1 );
+    }
+
+    /* login cookie gave us an ENOENT so we think it's gone */
+    if ( rc == 1 ) {
+	return( 0 );
+    }
+
+check:
+    /* logged out plus extra non-fail overtime */
+    if ( !ci.ci_state && (( now->tv_sec - ci.ci_itime ) > loggedout_cache )) {
+	goto delete_stuff;
+    }
+
+    /* idle out, plus gray window, plus non-failover */
+    if (( now->tv_sec - ci.ci_itime )  > idle_cache ) {
+	goto delete_stuff;
+    }
+
+    /* hard timeout */
+    create = atoi( ci.ci_ctime );
+    if (( now->tv_sec - create )  > hard_timeout ) {
+	goto delete_stuff;
+    }
+
+    *itime = ci.ci_itime; 
+    *state = ci.ci_state;
+    *due = ci.ci_itime + idle_cache;
+    if ( create + hard_timeout < *due ) {
+	*due = create + hard_timeout;
+    }
+    if ( !ci.ci_state && ci.ci_itime + loggedout_cache < *due ) {
+	*due = ci.ci_itime + loggedout_cache;
+    }
+    (*due)++;
+    return( 1 );
+
+delete_stuff:
+    if ( peek ) {
+	peek = 0;
+	if (( rc = store->so_get( name, &ci )) < 0 ) {
+	    syslog( LOG_ERR, "read_cookie error: %s", name );
+	    return( -1 );
+	}
+	if ( rc == 1 ) {
+	    return( 0 );
+	}
+	/* it may have been used since */
+	goto check;
+    }
+
+    /* remove krb5 ticket and login cookie */
+    if ( *ci.ci_krbtkt != '\0' ) {
+	if ( unlink( ci.ci_krbtkt ) != 0 ) {
+	    syslog( LOG_ERR, "unlink krbtgt %s: %m", ci.ci_krbtkt );
+	}
+    }
+    (void)store->so_expire( name );
+    (void)uindex_remove( ci.ci_user, name );
+    (void)sindex_iterate( name, expire_service, name );
+    login_gone++;
+
+    return( 0 );
+}
@@ -0,0 +1,44 @@
+/*
+ * Copyright (c) 2004 Regents of The University of Michigan.
+ * All Rights Reserved.  See LICENSE.
+ */
+
+/*
+ * service cookies are expired with their login cookie, through the
+ * login cookie's index of them.  every this many passes, and on the
+ * first, each service cookie is also checked against its login cookie,
+ * for those the index missed.
+ */
+#define MONSTER_FULLPASS	16
+
+/* what a pass, and do_cookie() and due_cookie() in it, need to know */
+struct sweep {
+    struct connlist	*sw_head;
+    struct timeval	*sw_now;
+    int			sw_full;
+    int			sw_walk;	/* read through the whole store */
+    time_t		sw_window;
+    int			sw_proc;	/* this sweeper's share of buckets */
+    int			sw_nprocs;
+    FILE		*sw_out;	/* to the parent, in a sweeper */
+    int			sw_rate;	/* cookies a second, 0 unlimited */
+    int			sw_reads;
+    struct timeval	sw_start;
+    int			sw_journal;	/* replicas known to it are sent */
+    int			sw_pusher;	/* sw_head is cosignd's pusher */
+};
+
+extern int	idle_cache;
+extern int	interval;
+extern int	hard_timeout;
+extern int	loggedout_cache;
+extern int	sweep_procs;
+extern int	sweep_iops;
+extern int	login_total, login_sent, login_gone;
+extern int	service_total, service_gone;
+
+int	sweep_pass( struct sweep *, time_t * );
+int	sweep_journal( struct sweep *, struct connlist *, struct jpos *,
+		struct jpos * );
+void	sweep_stats( struct timeval * );
+int	sweeper( SNET * );
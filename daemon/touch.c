@@ -0,0 +1,135 @@
+/*
+ * Copyright (c) 2004 Regents of The University of Michigan.
+ * All Rights Reserved.  See LICENSE.
+ */
+
+/*
+ * every CHECK and REGISTER marks its login cookie active, so that it
+ * doesn't idle out.  rather than writing that to the store each time,
+ * activity is held here and written at most once per cookie every
+ * touch_interval seconds.  the store's idle time is never more than
+ * about touch_interval behind, and this process adds what it's holding
+ * back with touch_itime() before judging a cookie idle.
+ *
+ * the table is direct mapped: a cookie that lands on a slot held by
+ * another has the other written out first.
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+
+#include "store.h"
+#include "touch.h"
+#include "journal.h"
+
+struct touch {
+    time_t	t_since;	/* when this became pending, 0 if empty */
+    time_t	t_last;		/* the most recent activity */
+    char	t_login[ 256 ];
+};
+
+static struct touch	touch_table[ TOUCH_SLOTS ];
+static time_t		touch_swept = 0;
+static int		touch_count = 0;
+
+static void	touch_write( struct touch * );
+
+    static void
+touch_write( struct touch *t )
+{
+    (void)store->so_touch( t->t_login, t->t_last );
+    (void)journal_note( t->t_login );
+    t->t_since = 0;
+    touch_count--;
+}
+
+/*
+ * note activity on login at now.  itime is the idle time as the store
+ * has it; if that's already touch_interval old, write through.
+ */
+    void
+touch_note( char *login, time_t itime, time_t now )
+{
+    struct touch	*t;
+
+    if ( strlen( login ) >= sizeof( t->t_login )) {
+	(void)store->so_touch( login, now );
+	(void)journal_note( login );
+	return;
+    }
+
+    t = &touch_table[ store_hash( login ) & ( TOUCH_SLOTS - 1 ) ];
+    if ( t->t_since != 0 && strcmp( t->t_login, login ) != 0 ) {
+	touch_write( t );
+    }
+
+    if ( now - itime >= touch_interval ) {
+	if ( t->t_since != 0 ) {
+	    t->t_since = 0;
+	    touch_count--;
+	}
+	(void)store->so_touch( login, now );
+	(void)journal_note( login );
+	return;
+    }
+
+    if ( t->t_since == 0 ) {
+	strcpy( t->t_login, login );
+	t->t_since = now;
+	touch_count++;
+    }
+    t->t_last = now;
+}
+
+/* the idle time of login, counting activity not yet written */
+    time_t
+touch_itime( char *login, time_t itime )
+{
+    struct touch	*t;
+
+    if ( touch_count == 0 ) {
+	return( itime );
+    }
+    t = &touch_table[ store_hash( login ) & ( TOUCH_SLOTS - 1 ) ];
+    if ( t->t_since != 0 && t->t_last > itime &&
+	    strcmp( t->t_login, login ) == 0 ) {
+	return( t->t_last );
+    }
+    return( itime );
+}
+
+/* how many cookies have activity waiting to be written */
+    int
+touch_pending( void )
+{
+    return( touch_count );
+}
+
+/*
+ * write activity that's been pending for touch_interval, or with all,
+ * everything.  cheap enough to call after every command: the table is
+ * only walked once a second.
+ */
+    void
+touch_flush( time_t now, int all )
+{
+    int			i;
+
+    if ( touch_count == 0 || ( !all && now == touch_swept )) {
+	return;
+    }
+    touch_swept = now;
+
+    for ( i = 0; i < TOUCH_SLOTS && touch_count > 0; i++ ) {
+	if ( touch_table[ i ].t_since == 0 ) {
+	    continue;
+	}
+	if ( all || now - touch_table[ i ].t_since >= touch_interval ) {
+	    touch_write( &touch_table[ i ] );
+	}
+    }
+}
@@ -0,0 +1,14 @@
+/*
+ * Copyright (c) 2004 Regents of The University of Michigan.
+ * All Rights Reserved.  See LICENSE.
+ */
+
+/* pending activity, per process.  must be a power of two */
+#define TOUCH_SLOTS	4096
+
+extern int	touch_interval;
+
+void	touch_note( char *, time_t, time_t );
+time_t	touch_itime( char *, time_t );
+void	touch_flush( time_t, int );
+int	touch_pending( void );
@@ -0,0 +1,507 @@
+/*
+ * Copyright (c) 2004 Regents of The University of Michigan.
+ * All Rights Reserved.  See LICENSE.
+ */
+
+/*
+ * indexes kept beside the store, whichever that is.  "users" says which
+ * login cookies each user has, so that SESSIONS and LOGOUTUSER take
+ * time in proportion to the user's sessions rather than to the store.
+ * "services" says which service cookies were registered to each login
+ * cookie, so that monster can expire them with the login cookie rather
+ * than reading the login cookie once for each of them.  "expire" is a
+ * timer wheel: login cookies are filed under the EINDEX_SLOT second
+ * slot in which they were created or logged out, so that monster reads
+ * only those that may have expired, rather than every one in the store.
+ * each slot is split over EINDEX_SHARDS files by the cookie's hash, so
+ * that logins aren't all appending to one file under one lock.
+ *
+ * each is a directory in cosigndb holding a file per key, spread over
+ * 256 directories by the key's hash, with a cookie per line.  adding
+ * appends, and removing rewrites the file without the cookie, removing
+ * the file once it's empty.  every change is made under flock().  a
+ * rewrite is done in place and truncated after, so a crash can leave a
+ * line too many, never one too few, and iterating drops lines for
+ * cookies that have gone.
+ *
+ * a store with so_index_add() keeps them itself instead, as the shm and
+ * log stores do, so that they make no files beside the store.
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/file.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "store.h"
+#include "uindex.h"
+
+#define UINDEX_NAMELEN	255
+
+static int	uindex_path( char *, char *, char *, int );
+static int	uindex_match( char *, void * );
+static int	uindex_open( char *, char *, char *, int );
+static int	uindex_rewrite( int, char *, int (*)( char *, void * ),
+			void * );
+static int	uindex_append( int, char *, char * );
+static int	uindex_drop( int, char *, char * );
+static int	uindex_walk( int, char *, int (*)( char *, void * ),
+			void * );
+static int	eindex_key( char *, void * );
+static int	eindex_collect( char *, void * );
+static int	eindex_cmp( const void *, const void * );
+
+/* by so_index_*() index */
+static char	*uindex_dirs[ STORE_INDEXES ] = {
+    UINDEX_DIR,
+    SINDEX_DIR,
+    EINDEX_DIR,
+};
+
+struct eindex_before {
+    time_t		eb_slot;
+    int			(*eb_fn)( char *, void * );
+    void		*eb_arg;
+    int			eb_rc;
+    unsigned long	*eb_keys;	/* slot and shard, from a store */
+    int			eb_nkeys;
+    int			eb_size;
+};
+
+/*
+ * dir/XX/name, with anything in the key but letters, digits and
+ * "@._+-" written as %XX, as is a leading ".".
+ */
+    static int
+uindex_path( char *dir, char *key, char *path, int len )
+{
+    char		name[ UINDEX_NAMELEN + 1 ];
+    unsigned char	*u;
+    int			n = 0;
+
+    for ( u = (unsigned char *)key; *u != '\0'; u++ ) {
+	if ( n + 4 > (int)sizeof( name )) {
+	    syslog( LOG_ERR, "uindex_path: %s: name too long", key );
+	    errno = ENAMETOOLONG;
+	    return( -1 );
+	}
+	if (( *u >= 'a' && *u <= 'z' ) || ( *u >= 'A' && *u <= 'Z' ) ||
+		( *u >= '0' && *u <= '9' ) || ( *u == '.' && n > 0 ) ||
+		*u == '@' || *u == '_' || *u == '+' || *u == '-' ) {
+	    name[ n++ ] = *u;
+	} else {
+	    n += sprintf( name + n, "%%%02X", *u );
+	}
+    }
+    name[ n ] = '\0';
+    if ( n == 0 ) {
+	errno = EINVAL;
+	return( -1 );
+    }
+
+    if ( snprintf( path, len, "%s/%02x/%s", dir,
+	    store_hash( key ) & 0xff, name ) >= len ) {
+	syslog( LOG_ERR, "uindex_path: %s: path too long", key );
+	errno = ENAMETOOLONG;
+	return( -1 );
+    }
+    return( 0 );
+}
+
+/*
+ * opens and locks the key's file, making it if create is set.  returns
+ * -1 on error, or with errno ENOENT if there's no file and no create.
+ * a file unlinked while we waited for the lock is opened again.
+ */
+    static int
+uindex_open( char *dir, char *key, char *path, int create )
+{
+    struct stat		st;
+    char		*p;
+    int			fd;
+
+    if ( uindex_path( dir, key, path, MAXPATHLEN ) < 0 ) {
+	return( -1 );
+    }
+
+    for (;;) {
+	if (( fd = open( path, O_RDWR | ( create ? O_CREAT : 0 ),
+		0600 )) < 0 ) {
+	    if ( errno != ENOENT || !create ) {
+		if ( errno != ENOENT ) {
+		    syslog( LOG_ERR, "uindex_open: %s: %m", path );
+		}
+		return( -1 );
+	    }
+
+	    /* dir/XX, then dir */
+	    p = strrchr( path, '/' );
+	    *p = '\0';
+	    if ( mkdir( path, 0700 ) < 0 && errno == ENOENT ) {
+		if ( mkdir( dir, 0700 ) < 0 && errno != EEXIST ) {
+		    syslog( LOG_ERR, "uindex_open: mkdir %s: %m", dir );
+		    *p = '/';
+		    return( -1 );
+		}
+		(void)mkdir( path, 0700 );
+	    }
+	    *p = '/';
+	    if (( fd = open( path, O_RDWR | O_CREAT, 0600 )) < 0 ) {
+		syslog( LOG_ERR, "uindex_open: %s: %m", path );
+		return( -1 );
+	    }
+	}
+
+	if ( flock( fd, LOCK_EX ) < 0 ) {
+	    syslog( LOG_ERR, "uindex_open: flock %s: %m", path );
+	    (void)close( fd );
+	    return( -1 );
+	}
+	if ( fstat( fd, &st ) < 0 ) {
+	    syslog( LOG_ERR, "uindex_open: fstat %s: %m", path );
+	    (void)close( fd );
+	    return( -1 );
+	}
+	if ( st.st_nlink > 0 ) {
+	    return( fd );
+	}
+	(void)close( fd );
+    }
+}
+
+/*
+ * rewrites the locked file without the lines for which fn returns
+ * more than 0, stopping early if fn returns less than 0.
+ */
+    static int
+uindex_rewrite( int fd, char *path, int (*fn)( char *, void * ), void *arg )
+{
+    struct stat		st;
+    char		*buf, *line, *nl, *out;
+    ssize_t		len;
+    int			rc = 0, drop, changed = 0;
+
+    if ( fstat( fd, &st ) < 0 ) {
+	syslog( LOG_ERR, "uindex_rewrite: fstat %s: %m", path );
+	return( -1 );
+    }
+    if (( buf = malloc( st.st_size + 1 )) == NULL ) {
+	syslog( LOG_ERR, "uindex_rewrite: malloc: %m" );
+	return( -1 );
+    }
+    if (( len = pread( fd, buf, st.st_size, 0 )) < 0 ) {
+	syslog( LOG_ERR, "uindex_rewrite: pread %s: %m", path );
+	free( buf );
+	return( -1 );
+    }
+    buf[ len ] = '\0';
+
+    /* kept lines are moved down over dropped ones */
+    out = buf;
+    for ( line = buf; line < buf + len; line = nl + 1 ) {
+	if (( nl = strchr( line, '\n' )) == NULL ) {
+	    /* a partial line, from a crash mid-append */
+	    changed = 1;
+	    break;
+	}
+	*nl = '\0';
+	drop = 0;
+	if ( rc >= 0 && *line != '\0' ) {
+	    if (( drop = (*fn)( line, arg )) < 0 ) {
+		rc = drop;
+		drop = 0;
+	    }
+	} else if ( *line == '\0' ) {
+	    drop = 1;
+	}
+	if ( drop > 0 ) {
+	    changed = 1;
+	    continue;
+	}
+	memmove( out, line, nl - line );
+	out += nl - line;
+	*out++ = '\n';
+    }
+
+    if ( changed ) {
+	if ( out == buf ) {
+	    if ( unlink( path ) < 0 ) {
+		syslog( LOG_ERR, "uindex_rewrite: unlink %s: %m", path );
+		rc = -1;
+	    }
+	} else if ( pwrite( fd, buf, out - buf, 0 ) != out - buf ||
+		ftruncate( fd, out - buf ) < 0 ) {
+	    syslog( LOG_ERR, "uindex_rewrite: %s: %m", path );
+	    rc = -1;
+	}
+    }
+    free( buf );
+    return( rc < 0 ? rc : 0 );
+}
+
+    static int
+uindex_append( int index, char *key, char *cookie )
+{
+    char		path[ MAXPATHLEN ], line[ MAXPATHLEN ];
+    int			fd, len, rc = 0;
+
+    if ( store->so_index_add != NULL ) {
+	return( (*store->so_index_add)( index, key, cookie ));
+    }
+
+    if (( len = snprintf( line, sizeof( line ), "%s\n", cookie ))
+	    >= (int)sizeof( line )) {
+	return( -1 );
+    }
+    if (( fd = uindex_open( uindex_dirs[ index ], key, path, 1 )) < 0 ) {
+	return( -1 );
+    }
+    if ( lseek( fd, 0, SEEK_END ) < 0 || write( fd, line, len ) != len ) {
+	syslog( LOG_ERR, "uindex_append: %s: %m", path );
+	rc = -1;
+    }
+    (void)close( fd );
+    return( rc );
+}
+
+    static int
+uindex_match( char *line, void *cookie )
+{
+    return( strcmp( line, (char *)cookie ) == 0 );
+}
+
+/* drops cookie from under key.  it needn't be there */
+    static int
+uindex_drop( int index, char *key, char *cookie )
+{
+    return( uindex_walk( index, key, uindex_match, cookie ));
+}
+
+/*
+ * calls fn with each of key's cookies, under the lock if the index is
+ * in files.  a cookie for which fn returns more than 0 is dropped from
+ * the index.
+ */
+    static int
+uindex_walk( int index, char *key, int (*fn)( char *, void * ), void *arg )
+{
+    char		path[ MAXPATHLEN ];
+    int			fd, rc;
+
+    if ( store->so_index_iterate != NULL ) {
+	return( (*store->so_index_iterate)( index, key, fn, arg ));
+    }
+
+    if (( fd = uindex_open( uindex_dirs[ index ], key, path, 0 )) < 0 ) {
+	return( errno == ENOENT ? 0 : -1 );
+    }
+    rc = uindex_rewrite( fd, path, fn, arg );
+    (void)close( fd );
+    return( rc );
+}
+
+    int
+uindex_add( char *user, char *cookie )
+{
+    return( uindex_append( STORE_USERS, user, cookie ));
+}
+
+    int
+uindex_remove( char *user, char *cookie )
+{
+    return( uindex_drop( STORE_USERS, user, cookie ));
+}
+
+/* each of the user's login cookies */
+    int
+uindex_iterate( char *user, int (*fn)( char *, void * ), void *arg )
+{
+    return( uindex_walk( STORE_USERS, user, fn, arg ));
+}
+
+    int
+sindex_add( char *login, char *service )
+{
+    return( uindex_append( STORE_SERVICES, login, service ));
+}
+
+    int
+sindex_remove( char *login, char *service )
+{
+    return( uindex_drop( STORE_SERVICES, login, service ));
+}
+
+/* each of the service cookies registered to login */
+    int
+sindex_iterate( char *login, int (*fn)( char *, void * ), void *arg )
+{
+    return( uindex_walk( STORE_SERVICES, login, fn, arg ));
+}
+
+/* files login under the slot holding when, in the shard its hash picks */
+    int
+eindex_add( time_t when, char *login )
+{
+    char		key[ 32 ];
+
+    snprintf( key, sizeof( key ), "%lu.%u",
+	    (unsigned long)( when / EINDEX_SLOT ),
+	    store_hash( login ) % EINDEX_SHARDS );
+    return( uindex_append( STORE_EXPIRE, key, login ));
+}
+
+/*
+ * each of the login cookies filed under slot, each shard of which is
+ * removed once fn has returned more than 0 for all of its cookies.
+ */
+    int
+eindex_iterate( time_t slot, int (*fn)( char *, void * ), void *arg )
+{
+    char		key[ 32 ];
+    int			i, rc = 0;
+
+    for ( i = 0; i < EINDEX_SHARDS; i++ ) {
+	snprintf( key, sizeof( key ), "%lu.%d", (unsigned long)slot, i );
+	if ( uindex_walk( STORE_EXPIRE, key, fn, arg ) < 0 ) {
+	    rc = -1;
+	}
+    }
+    return( rc );
+}
+
+/* walks a key of the expire index, if it's a slot before eb_slot */
+    static int
+eindex_key( char *key, void *arg )
+{
+    struct eindex_before	*eb = (struct eindex_before *)arg;
+    char			*end;
+    unsigned long		n;
+
+    n = strtoul( key, &end, 10 );
+    if ( end == key || ( *end != '.' && *end != '\0' ) ||
+	    n >= (unsigned long)eb->eb_slot ) {
+	return( 0 );
+    }
+    if ( uindex_walk( STORE_EXPIRE, key, eb->eb_fn, eb->eb_arg ) < 0 ) {
+	eb->eb_rc = -1;
+    }
+    return( 0 );
+}
+
+/*
+ * notes a key of the expire index, if it's a slot before eb_slot.  a
+ * store may give the same key more than once, so they're collected
+ * and sorted, to walk each only once.
+ */
+    static int
+eindex_collect( char *key, void *arg )
+{
+    struct eindex_before	*eb = (struct eindex_before *)arg;
+    unsigned long		*k, n, shard;
+    char			*end;
+
+    n = strtoul( key, &end, 10 );
+    if ( end == key || *end != '.' || n >= (unsigned long)eb->eb_slot ) {
+	return( 0 );
+    }
+    shard = strtoul( end + 1, &end, 10 );
+    if ( *end != '\0' ) {
+	return( 0 );
+    }
+    if ( eb->eb_nkeys >= eb->eb_size ) {
+	eb->eb_size = eb->eb_size * 2 + 256;
+	if (( k = (unsigned long *)realloc( eb->eb_keys,
+		eb->eb_size * 2 * sizeof( unsigned long ))) == NULL ) {
+	    syslog( LOG_ERR, "eindex_collect: realloc: %m" );
+	    return( -1 );
+	}
+	eb->eb_keys = k;
+    }
+    eb->eb_keys[ eb->eb_nkeys * 2 ] = n;
+    eb->eb_keys[ eb->eb_nkeys * 2 + 1 ] = shard;
+    eb->eb_nkeys++;
+    return( 0 );
+}
+
+    static int
+eindex_cmp( const void *a, const void *b )
+{
+    const unsigned long	*x = a, *y = b;
+
+    if ( x[ 0 ] != y[ 0 ] ) {
+	return( x[ 0 ] < y[ 0 ] ? -1 : 1 );
+    }
+    return( x[ 1 ] < y[ 1 ] ? -1 : x[ 1 ] > y[ 1 ] );
+}
+
+/*
+ * as eindex_iterate(), for every slot before slot that has cookies
+ * filed under it.  a sweep starts from the oldest slot that could hold
+ * a live cookie, so this is how the first finds the slots left behind
+ * while neither cosignd nor monster was sweeping.
+ */
+    int
+eindex_before( time_t slot, int (*fn)( char *, void * ), void *arg )
+{
+    struct eindex_before	eb;
+    DIR				*dirp;
+    struct dirent		*de;
+    char			path[ MAXPATHLEN ];
+    int				i;
+
+    memset( &eb, 0, sizeof( struct eindex_before ));
+    eb.eb_slot = slot;
+    eb.eb_fn = fn;
+    eb.eb_arg = arg;
+
+    if ( store->so_index_keys != NULL ) {
+	if ( (*store->so_index_keys)( STORE_EXPIRE, eindex_collect,
+		&eb ) < 0 ) {
+	    eb.eb_rc = -1;
+	}
+	if ( eb.eb_nkeys > 0 ) {
+	    qsort( eb.eb_keys, eb.eb_nkeys, 2 * sizeof( unsigned long ),
+		    eindex_cmp );
+	}
+	for ( i = 0; i < eb.eb_nkeys; i++ ) {
+	    if ( i > 0 && eindex_cmp( &eb.eb_keys[ i * 2 ],
+		    &eb.eb_keys[ ( i - 1 ) * 2 ] ) == 0 ) {
+		continue;
+	    }
+	    snprintf( path, sizeof( path ), "%lu.%lu",
+		    eb.eb_keys[ i * 2 ], eb.eb_keys[ i * 2 + 1 ] );
+	    if ( uindex_walk( STORE_EXPIRE, path, fn, arg ) < 0 ) {
+		eb.eb_rc = -1;
+	    }
+	}
+	free( eb.eb_keys );
+	return( eb.eb_rc );
+    }
+
+    for ( i = 0; i < 256; i++ ) {
+	snprintf( path, sizeof( path ), "%s/%02x", EINDEX_DIR, i );
+	if (( dirp = opendir( path )) == NULL ) {
+	    if ( errno != ENOENT ) {
+		syslog( LOG_ERR, "eindex_before: %s: %m", path );
+		eb.eb_rc = -1;
+	    }
+	    continue;
+	}
+	while (( de = readdir( dirp )) != NULL ) {
+	    (void)eindex_key( de->d_name, &eb );
+	}
+	(void)closedir( dirp );
+    }
+    return( eb.eb_rc );
+}
@@ -0,0 +1,21 @@
+/*
+ * Copyright (c) 2004 Regents of The University of Michigan.
+ * All Rights Reserved.  See LICENSE.
+ */
+
+#define UINDEX_DIR	"users"
+#define SINDEX_DIR	"services"
+#define EINDEX_DIR	"expire"
+
+#define EINDEX_SLOT	60	/* seconds in each slot of the wheel */
+#define EINDEX_SHARDS	16	/* files each slot is split over */
+
+int	uindex_add( char *, char * );
+int	uindex_remove( char *, char * );
+int	uindex_iterate( char *, int (*)( char *, void * ), void * );
+int	sindex_add( char *, char * );
+int	sindex_remove( char *, char * );
+int	sindex_iterate( char *, int (*)( char *, void * ), void * );
+int	eindex_add( time_t, char * );
+int	eindex_iterate( time_t, int (*)( char *, void * ), void * );
+int	eindex_before( time_t, int (*)( char *, void * ), void * );
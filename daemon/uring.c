@@ -0,0 +1,410 @@
+/*
+ * Copyright (c) 2004 Regents of The University of Michigan.
+ * All Rights Reserved.  See LICENSE.
+ */
+
+/*
+ * reads cookie files through io_uring, when cosigndfileio is "uring".
+ * a lookup is submitted as one linked chain: openat() into a slot of
+ * the ring's own file table, statx(), read() from the slot and
+ * close() of it.  a cookie costs one trip into the kernel rather than
+ * four, and one not in the dentry cache is looked up and read there
+ * without our coming back between steps.  the links are hard, so
+ * every step completes and the slot is always closed.  statx() is by
+ * name, after the open: a cookie renamed over between the two would
+ * pair the new file's mode and mtime with the old contents, which a
+ * rename only does on a repeated LOGIN.
+ *
+ * each process sets up its own ring the first time it reads a cookie,
+ * since one inherited across fork() would be shared.  where io_uring
+ * or any of the operations isn't there, cookies are read the usual
+ * way, by cookie_slurp(), from then on.
+ *
+ * an event worker runs each command to completion, so its lookups are
+ * still made one at a time.  before it does, it looks through the
+ * CHECKs and MCHECKs its ready connections have sent, and has the store
+ * hand uring_prefetch() the files they'll read, which submits all of
+ * their lookups at once and waits for them together.  what's read is
+ * thrown away: the point is that the lookups that follow find their
+ * dentries and pages already cached.
+ */
+
+#include "config.h"
+
+#ifdef HAVE_LINUX_IO_URING_H
+/* struct statx is a GNU extension in glibc */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif /* _GNU_SOURCE */
+#endif /* HAVE_LINUX_IO_URING_H */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <strings.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#ifdef HAVE_LINUX_IO_URING_H
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif /* HAVE_LINUX_IO_URING_H */
+
+#include "uring.h"
+
+static int		uring_mode = 0;
+
+#ifdef HAVE_LINUX_IO_URING_H
+/* the steps of a lookup, by their user_data */
+#define URING_OPEN	0
+#define URING_STATX	1
+#define URING_READ	2
+#define URING_CLOSE	3
+#define URING_STEPS	4
+
+static struct uring {
+    int			u_fd;
+    pid_t		u_pid;
+    void		*u_ring;
+    size_t		u_ringlen;
+    struct io_uring_sqe	*u_sqes;
+    size_t		u_sqeslen;
+    unsigned		*u_sq_tail;
+    unsigned		*u_sq_mask;
+    unsigned		*u_sq_array;
+    unsigned		*u_cq_head;
+    unsigned		*u_cq_tail;
+    unsigned		*u_cq_mask;
+    struct io_uring_cqe	*u_cqes;
+} ur = { -1, 0, NULL, 0, NULL, 0 };
+
+/* where uring_prefetch() reads to, a page being enough to warm */
+static struct statx	uring_stx[ URING_BATCH ];
+static char		uring_scratch[ URING_BATCH ][ 512 ];
+
+static int	uring_open( void );
+static void	uring_close( void );
+static void	uring_fail( char * );
+static void	uring_chain( char *, int, char *, int, struct statx *,
+			unsigned );
+static int	uring_wait( char *, int, int * );
+#endif /* HAVE_LINUX_IO_URING_H */
+
+/*
+ * name is cosigndfileio: "sync", the default, or "uring".  returns 0,
+ * 1 if io_uring isn't supported here, or -1 for any other name.
+ */
+    int
+uring_config( char *name )
+{
+    if ( name == NULL || strcasecmp( name, "sync" ) == 0 ) {
+	uring_mode = 0;
+	return( 0 );
+    }
+    if ( strcasecmp( name, "uring" ) != 0 ) {
+	return( -1 );
+    }
+#ifdef HAVE_LINUX_IO_URING_H
+    uring_mode = 1;
+    return( 0 );
+#else /* HAVE_LINUX_IO_URING_H */
+    return( 1 );
+#endif /* HAVE_LINUX_IO_URING_H */
+}
+
+/* whether cookies are being read through io_uring in this process */
+    int
+uring_ready( void )
+{
+    return( uring_mode );
+}
+
+#ifdef HAVE_LINUX_IO_URING_H
+    static void
+uring_close( void )
+{
+    if ( ur.u_sqes != NULL ) {
+	(void)munmap( ur.u_sqes, ur.u_sqeslen );
+	ur.u_sqes = NULL;
+    }
+    if ( ur.u_ring != NULL ) {
+	(void)munmap( ur.u_ring, ur.u_ringlen );
+	ur.u_ring = NULL;
+    }
+    if ( ur.u_fd >= 0 ) {
+	(void)close( ur.u_fd );
+	ur.u_fd = -1;
+    }
+}
+
+/* gives up on io_uring in this process */
+    static void
+uring_fail( char *what )
+{
+    syslog( LOG_NOTICE, "uring: %s: %m: reading cookies without io_uring",
+	    what );
+    uring_close();
+    uring_mode = 0;
+}
+
+    static int
+uring_open( void )
+{
+    struct io_uring_params	p;
+    size_t			sqlen, cqlen;
+    char			*ring;
+    int				i, files[ URING_BATCH ];
+
+    /* a ring from before fork() is our parent's */
+    if ( ur.u_pid == getpid()) {
+	return( 0 );
+    }
+    uring_close();
+    ur.u_pid = getpid();
+
+    memset( &p, 0, sizeof( struct io_uring_params ));
+    if (( ur.u_fd = (int)syscall( __NR_io_uring_setup, URING_ENTRIES,
+	    &p )) < 0 ) {
+	uring_fail( "io_uring_setup" );
+	return( -1 );
+    }
+    if (( p.features & IORING_FEAT_SINGLE_MMAP ) == 0 ) {
+	errno = ENOSYS;
+	uring_fail( "io_uring_setup" );
+	return( -1 );
+    }
+
+    sqlen = p.sq_off.array + p.sq_entries * sizeof( unsigned );
+    cqlen = p.cq_off.cqes + p.cq_entries * sizeof( struct io_uring_cqe );
+    ur.u_ringlen = ( sqlen > cqlen ) ? sqlen : cqlen;
+    if (( ring = mmap( NULL, ur.u_ringlen, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, ur.u_fd, IORING_OFF_SQ_RING ))
+	    == MAP_FAILED ) {
+	uring_fail( "mmap" );
+	return( -1 );
+    }
+    ur.u_ring = ring;
+    ur.u_sqeslen = p.sq_entries * sizeof( struct io_uring_sqe );
+    if (( ur.u_sqes = mmap( NULL, ur.u_sqeslen, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, ur.u_fd, IORING_OFF_SQES ))
+	    == MAP_FAILED ) {
+	ur.u_sqes = NULL;
+	uring_fail( "mmap" );
+	return( -1 );
+    }
+
+    ur.u_sq_tail = (unsigned *)( ring + p.sq_off.tail );
+    ur.u_sq_mask = (unsigned *)( ring + p.sq_off.ring_mask );
+    ur.u_sq_array = (unsigned *)( ring + p.sq_off.array );
+    ur.u_cq_head = (unsigned *)( ring + p.cq_off.head );
+    ur.u_cq_tail = (unsigned *)( ring + p.cq_off.tail );
+    ur.u_cq_mask = (unsigned *)( ring + p.cq_off.ring_mask );
+    ur.u_cqes = (struct io_uring_cqe *)( ring + p.cq_off.cqes );
+
+    /* the slots lookups open their files into, one each */
+    for ( i = 0; i < URING_BATCH; i++ ) {
+	files[ i ] = -1;
+    }
+    if ( syscall( __NR_io_uring_register, ur.u_fd, IORING_REGISTER_FILES,
+	    files, URING_BATCH ) < 0 ) {
+	uring_fail( "io_uring_register" );
+	return( -1 );
+    }
+
+    return( 0 );
+}
+
+/*
+ * queues the lookup of path as a linked chain, opening it into the
+ * ring's slot, reading up to size bytes of it into buf and its mode and
+ * mtime into stx.  each step's user_data is data plus the step.
+ */
+    static void
+uring_chain( char *path, int slot, char *buf, int size, struct statx *stx,
+	unsigned data )
+{
+    struct io_uring_sqe		*sqe;
+    unsigned			tail, idx;
+    int				i;
+
+    tail = *ur.u_sq_tail;
+    for ( i = 0; i < URING_STEPS; i++ ) {
+	idx = ( tail + i ) & *ur.u_sq_mask;
+	sqe = &ur.u_sqes[ idx ];
+	memset( sqe, 0, sizeof( struct io_uring_sqe ));
+	sqe->user_data = data + i;
+	if ( i < URING_STEPS - 1 ) {
+	    sqe->flags = IOSQE_IO_HARDLINK;
+	}
+	switch ( i ) {
+	case URING_OPEN :
+	    sqe->opcode = IORING_OP_OPENAT;
+	    sqe->fd = AT_FDCWD;
+	    sqe->addr = (unsigned long)path;
+	    sqe->open_flags = O_RDONLY;
+	    sqe->file_index = slot + 1;
+	    break;
+
+	case URING_STATX :
+	    sqe->opcode = IORING_OP_STATX;
+	    sqe->fd = AT_FDCWD;
+	    sqe->addr = (unsigned long)path;
+	    sqe->len = STATX_MODE | STATX_MTIME;
+	    sqe->off = (unsigned long)stx;
+	    break;
+
+	case URING_READ :
+	    sqe->opcode = IORING_OP_READ;
+	    sqe->flags |= IOSQE_FIXED_FILE;
+	    sqe->fd = slot;
+	    sqe->addr = (unsigned long)buf;
+	    sqe->len = size;
+	    sqe->off = 0;
+	    break;
+
+	case URING_CLOSE :
+	    sqe->opcode = IORING_OP_CLOSE;
+	    sqe->file_index = slot + 1;
+	    break;
+	}
+	ur.u_sq_array[ idx ] = idx;
+    }
+    __atomic_store_n( ur.u_sq_tail, tail + URING_STEPS, __ATOMIC_RELEASE );
+}
+
+/*
+ * submits the n steps queued, and waits for all of them, filling in
+ * res by user_data.  returns 0, or -1 if the ring is no longer usable.
+ */
+    static int
+uring_wait( char *fn, int n, int *res )
+{
+    struct io_uring_cqe		*cqe;
+    unsigned			head;
+    long			rc;
+    int				i, todo, done;
+
+    for ( i = 0; i < n; i++ ) {
+	res[ i ] = -ECANCELED;
+    }
+    todo = n;
+    for ( done = 0; done < n; ) {
+	if (( rc = syscall( __NR_io_uring_enter, ur.u_fd, todo, n - done,
+		IORING_ENTER_GETEVENTS, NULL, 0 )) < 0 ) {
+	    if ( errno == EINTR ) {
+		continue;
+	    }
+	    syslog( LOG_ERR, "%s: io_uring_enter: %m", fn );
+	    uring_close();
+	    ur.u_pid = 0;
+	    return( -1 );
+	}
+	/* what's submitted is taken off what's left to submit */
+	todo = ( rc < todo ) ? todo - (int)rc : 0;
+
+	head = *ur.u_cq_head;
+	while ( head != __atomic_load_n( ur.u_cq_tail, __ATOMIC_ACQUIRE )) {
+	    cqe = &ur.u_cqes[ head & *ur.u_cq_mask ];
+	    if ( cqe->user_data < (unsigned)n ) {
+		res[ cqe->user_data ] = cqe->res;
+	    }
+	    head++;
+	    done++;
+	}
+	__atomic_store_n( ur.u_cq_head, head, __ATOMIC_RELEASE );
+    }
+    return( 0 );
+}
+#endif /* HAVE_LINUX_IO_URING_H */
+
+/*
+ * as cookie_slurp(): reads path whole into buf, returning the length
+ * read, 0 if there's no such file, or -1, and fills in st's mode and
+ * mtime.  returns URING_UNAVAIL if it wasn't tried.
+ */
+    int
+uring_slurp( char *path, char *buf, int size, struct stat *st )
+{
+#ifdef HAVE_LINUX_IO_URING_H
+    struct statx		stx;
+    int				i, res[ URING_STEPS ];
+
+    if ( !uring_mode || uring_open() < 0 ) {
+	return( URING_UNAVAIL );
+    }
+
+    uring_chain( path, 0, buf, size, &stx, 0 );
+    if ( uring_wait( "uring_slurp", URING_STEPS, res ) < 0 ) {
+	return( -1 );
+    }
+
+    if ( res[ URING_OPEN ] < 0 ) {
+	if ( res[ URING_OPEN ] == -ENOENT ) {
+	    return( 0 );
+	}
+	errno = -res[ URING_OPEN ];
+	if ( errno == EINVAL || errno == EOPNOTSUPP ) {
+	    /* a kernel without direct opens */
+	    uring_fail( "openat" );
+	    return( URING_UNAVAIL );
+	}
+	syslog( LOG_ERR, "cookie_slurp: %s: %m", path );
+	return( -1 );
+    }
+    for ( i = URING_STATX; i < URING_STEPS; i++ ) {
+	if ( res[ i ] < 0 ) {
+	    errno = -res[ i ];
+	    syslog( LOG_ERR, "cookie_slurp: %s: %m", path );
+	    return( -1 );
+	}
+    }
+    if ( res[ URING_READ ] >= size ) {
+	syslog( LOG_ERR, "cookie_slurp: %s: too long", path );
+	return( -1 );
+    }
+
+    memset( st, 0, sizeof( struct stat ));
+    st->st_mode = stx.stx_mode;
+    st->st_mtime = stx.stx_mtime.tv_sec;
+    st->st_size = res[ URING_READ ];
+    return( res[ URING_READ ] );
+#else /* HAVE_LINUX_IO_URING_H */
+    return( URING_UNAVAIL );
+#endif /* HAVE_LINUX_IO_URING_H */
+}
+
+/*
+ * looks up as many as URING_BATCH paths at once, for the caching it
+ * does, ahead of their being read.  returns 0, or URING_UNAVAIL if it
+ * wasn't tried.
+ */
+    int
+uring_prefetch( char **paths, int n )
+{
+#ifdef HAVE_LINUX_IO_URING_H
+    int				i, res[ URING_BATCH * URING_STEPS ];
+
+    if ( !uring_mode || uring_open() < 0 ) {
+	return( URING_UNAVAIL );
+    }
+    if ( n > URING_BATCH ) {
+	n = URING_BATCH;
+    }
+
+    for ( i = 0; i < n; i++ ) {
+	uring_chain( paths[ i ], i, uring_scratch[ i ],
+		sizeof( uring_scratch[ i ] ), &uring_stx[ i ],
+		i * URING_STEPS );
+    }
+    if ( n > 0 && uring_wait( "uring_prefetch", n * URING_STEPS,
+	    res ) < 0 ) {
+	return( URING_UNAVAIL );
+    }
+    return( 0 );
+#else /* HAVE_LINUX_IO_URING_H */
+    return( URING_UNAVAIL );
+#endif /* HAVE_LINUX_IO_URING_H */
+}
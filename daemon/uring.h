@@ -0,0 +1,15 @@
+/*
+ * Copyright (c) 2004 Regents of The University of Michigan.
+ * All Rights Reserved.  See LICENSE.
+ */
+
+#define URING_BATCH	16	/* lookups uring_prefetch() submits at once */
+#define URING_ENTRIES	64	/* a lookup takes 4 */
+
+/* uring_slurp() returns this when cookies must be read the usual way */
+#define URING_UNAVAIL	-2
+
+int	uring_config( char * );
+int	uring_ready( void );
+int	uring_slurp( char *, char *, int, struct stat * );
+int	uring_prefetch( char **, int );
@@ -1148,6 +1148,7 @@ set_cosign_host( cmd_parms *params, void *mconfig, const char *arg )
 	memcpy( &new->conn_sin.sin_addr.s_addr,
 		he->h_addr_list[ i ], ( unsigned int)he->h_length );
 	new->conn_sn = NULL;
+	new->conn_sess = NULL;
 	*cur = new;
 	cur = &new->conn_next;
     }
@@ -36,6 +36,7 @@
 #endif /* LIGHTTPD */
 
 #include "argcargv.h"
+#include "atomfile.h"
 #include "sparse.h"
 #include "cosign.h"
 #include "mkcookie.h"
@@ -48,6 +49,8 @@
 #endif 
 
 static int connect_sn( struct connlist *, cosign_host_config *, void * );
+static int netcheck_reply( char *, char **, struct sinfo *, struct connlist *,
+	void *, cosign_host_config * );
 static void close_sn( struct connlist *, void * );
 static void (*logger)( char * ) = NULL;
 
@@ -62,15 +65,14 @@ struct capability		caps[] = {
     /* name, name length, mask, callback */
     { "FACTORS", 7, COSIGN_CAPA_FACTORS, NULL },
     { "REKEY",  5, COSIGN_CAPA_REKEY, NULL },
+    { "MCHECK", 6, COSIGN_CAPA_MCHECK, NULL },
 };
 
     static int
 netcheck_cookie( char *scookie, char **rekey, struct sinfo *si,
 	struct connlist *conn, void *s, cosign_host_config *cfg )
 {
-    int			i, j, ac, rc, mf, fc = cfg->reqfc;
-    char		*p, *line, **av, **fv = cfg->reqfv;
-    char		*rekeyed_cookie = NULL;
+    char		*line;
     char		*cmd = "CHECK";
     struct timeval      tv;
     SNET		*sn = conn->conn_sn;
@@ -96,6 +98,19 @@ netcheck_cookie( char *scookie, char **rekey, struct sinfo *si,
 	return( COSIGN_ERROR );
     }
 
+    return( netcheck_reply( line, rekey, si, conn, s, cfg ));
+}
+
+/* parse the reply to a single CHECK or REKEY */
+    static int
+netcheck_reply( char *line, char **rekey, struct sinfo *si,
+	struct connlist *conn, void *s, cosign_host_config *cfg )
+{
+    int			i, j, ac, rc, mf, fc = cfg->reqfc;
+    char		*p, **av, **fv = cfg->reqfv;
+    char		*rekeyed_cookie = NULL;
+    extern int		errno;
+
     switch( *line ) {
     case '2':
 	if (( rate = rate_tick( &checkpass )) != 0.0 ) {
@@ -246,9 +261,10 @@ netcheck_cookie( char *scookie, char **rekey, struct sinfo *si,
 netretr_proxy( char *scookie, struct sinfo *si, SNET *sn, char *proxydb,
 	void *s )
 {
-    int			fd;
+    int			fd, rc;
     char		*line;
-    char                path[ MAXPATHLEN ], tmppath[ MAXPATHLEN ];
+    char                path[ MAXPATHLEN ];
+    struct atomfile	af;
     struct timeval      tv;
     FILE                *tmpfile;
 
@@ -267,28 +283,16 @@ netretr_proxy( char *scookie, struct sinfo *si, SNET *sn, char *proxydb,
         return( COSIGN_ERROR );
     }
 
-    if ( gettimeofday( &tv, NULL ) < 0 ) {
-	perror( "gettimeofday" );
-	return( COSIGN_ERROR );
-    }
-
-    if ( snprintf( tmppath, sizeof( tmppath ), "%s/%x%x.%i",
-	    proxydb, (int)tv.tv_sec, (int)tv.tv_usec, (int)getpid()) >=
-	    sizeof( tmppath )) {
-	cosign_log( APLOG_ERR, s,
-		"mod_cosign: netretr_proxy: tmppath too long");
-        return( COSIGN_ERROR );
-    }
-
-    if (( fd = open( tmppath, O_CREAT|O_EXCL|O_WRONLY, 0644 )) < 0 ) {
-        perror( tmppath );
+    if (( fd = atomfile_open( &af, proxydb, 0644, 0 )) < 0 ) {
+        perror( proxydb );
         return( COSIGN_ERROR );
     }
 
     if (( tmpfile = fdopen( fd, "w" )) == NULL ) {
-        perror( tmppath );
-        if ( unlink( tmppath ) != 0 ) {
-            perror( tmppath );
+        perror( af.af_tmp );
+	(void)close( fd );
+        if ( atomfile_abort( &af ) != 0 ) {
+            perror( af.af_tmp );
         }
         return( COSIGN_ERROR );
     }
@@ -298,7 +302,8 @@ netretr_proxy( char *scookie, struct sinfo *si, SNET *sn, char *proxydb,
 	if (( line = snet_getline( sn, &tv )) == NULL ) {
 	    cosign_log( APLOG_ERR, s,
 		    "mod_cosign: netretr_proxy: snet_getline failed" );
-	    return ( COSIGN_ERROR );
+	    rc = COSIGN_ERROR;
+	    goto error;
 	}
 
 	switch( *line ) {
@@ -307,28 +312,33 @@ netretr_proxy( char *scookie, struct sinfo *si, SNET *sn, char *proxydb,
 
 	case '4':
 	    cosign_log( APLOG_ERR, s, "mod_cosign: netretr_proxy: %s", line );
-	    return( COSIGN_LOGGED_OUT );
+	    rc = COSIGN_LOGGED_OUT;
+	    goto error;
 
 	case '5':
 	    /* choose another connection */
 	    cosign_log( APLOG_ERR, s, "mod_cosign: netretr_proxy: 5xx" );
-	    return( COSIGN_RETRY );
+	    rc = COSIGN_RETRY;
+	    goto error;
 
 	default:
 	    cosign_log( APLOG_ERR, s, "mod_cosign: netretr_proxy: %s", line );
-	    return( COSIGN_ERROR );
+	    rc = COSIGN_ERROR;
+	    goto error;
 	}
 
 	if ( strlen( line ) < 3 ) {
 	    cosign_log( APLOG_ERR, s,
 		    "mod_cosign: netretr_proxy: short line: %s", line );
-	    return( COSIGN_ERROR );
+	    rc = COSIGN_ERROR;
+	    goto error;
 	}
         if ( !isdigit( (int)line[ 1 ] ) ||
                 !isdigit( (int)line[ 2 ] )) {
 	    cosign_log( APLOG_ERR, s,
 		    "mod_cosign: netretr_proxy: bad response: %s", line );
-	    return( COSIGN_ERROR );
+	    rc = COSIGN_ERROR;
+	    goto error;
         }
 
 	if ( line[ 3 ] != '\0' &&
@@ -336,7 +346,8 @@ netretr_proxy( char *scookie, struct sinfo *si, SNET *sn, char *proxydb,
 		line [ 3 ] != '-' ) {
 	    cosign_log( APLOG_ERR, s,
 		    "mod_cosign: netretr_proxy: bad response: %s", line );
-	    return( COSIGN_ERROR );
+	    rc = COSIGN_ERROR;
+	    goto error;
 	}
 
 	if ( line[ 3 ] == '-' ) {
@@ -345,27 +356,27 @@ netretr_proxy( char *scookie, struct sinfo *si, SNET *sn, char *proxydb,
 
     } while ( line[ 3 ] == '-' );
 
-    if ( fclose ( tmpfile ) != 0 ) {
-        perror( tmppath );
-        if ( unlink( tmppath ) != 0 ) {
-            perror( tmppath );
-        }
-        return( COSIGN_ERROR );
-    }
-
-    if ( link( tmppath, path ) != 0 ) {
-        perror( tmppath );
-        if ( unlink( tmppath ) != 0 ) {
-            perror( tmppath );
-        }
-        return( COSIGN_ERROR );
+    if ( fflush( tmpfile ) != 0 ) {
+        perror( af.af_tmp );
+	rc = COSIGN_ERROR;
+	goto error;
     }
 
-    if ( unlink( tmppath ) != 0 ) {
-        perror( tmppath );
+    if ( atomfile_link( &af, path, 0 ) != 0 ) {
+        perror( path );
+	rc = COSIGN_ERROR;
+	goto error;
     }
+    (void)fclose( tmpfile );
 
     return( COSIGN_OK );
+
+error:
+    if ( atomfile_abort( &af ) != 0 ) {
+	perror( af.af_tmp );
+    }
+    (void)fclose( tmpfile );
+    return( rc );
 }
 
 #ifdef KRB
@@ -738,6 +749,7 @@ connect_sn( struct connlist *cl, cosign_host_config *cfg, void *s )
     int			sock, zero = 0, ac = 0, state;
     char		*line, buf[ 1024 ], **av;
     X509		*peer;
+    SSL_SESSION		*sess;
     struct timeval      tv;
     struct protoent	*proto;
 
@@ -767,6 +779,8 @@ connect_sn( struct connlist *cl, cosign_host_config *cfg, void *s )
 	(void)close( sock );
 	return( -1 );
     }
+    /* requests are written together, and flushed when we read a reply */
+    snet_writebuffer( cl->conn_sn, 1 );
 
     tv = timeout;
     if (( line = snet_getline( cl->conn_sn, &tv )) == NULL ) {
@@ -842,6 +856,15 @@ connect_sn( struct connlist *cl, cosign_host_config *cfg, void *s )
        goto done;
     }
 
+    /* offer the last session with this server, to skip a full handshake */
+    if ( cl->conn_sess != NULL ) {
+	if ( snet_setsession( cl->conn_sn, cfg->ctx, cl->conn_sess ) != 1 ) {
+	    cosign_log( APLOG_ERR, s, "mod_cosign: snet_setsession: %s",
+		    ERR_error_string( ERR_get_error(), NULL ));
+	    ERR_clear_error();
+	}
+    }
+
     if ( snet_starttls( cl->conn_sn, cfg->ctx, 0 ) != 1 ) {
 	cosign_log( APLOG_ERR, s, "mod_cosign: snet_starttls: %s",
 		ERR_error_string( ERR_get_error(), NULL ));
@@ -877,6 +900,18 @@ connect_sn( struct connlist *cl, cosign_host_config *cfg, void *s )
 	}
     }
 
+    /*
+     * keep the session for the next connection to this server.  with
+     * TLS 1.3 the server's ticket arrives after the handshake, and is
+     * only seen once we've read the reply above.
+     */
+    if (( sess = SSL_get1_session( cl->conn_sn->sn_ssl )) != NULL ) {
+	if ( cl->conn_sess != NULL ) {
+	    SSL_SESSION_free( cl->conn_sess );
+	}
+	cl->conn_sess = sess;
+    }
+
     return( 0 );
 done:
     if ( snet_close( cl->conn_sn ) != 0 ) {
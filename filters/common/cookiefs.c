@@ -32,6 +32,7 @@
 #endif /* LIGHTTPD */
 
 #include "argcargv.h"
+#include "atomfile.h"
 #include "sparse.h"
 #include "mkcookie.h"
 #include "log.h"
@@ -49,7 +50,8 @@ cosign_cookie_valid( cosign_host_config *cfg, char *cookie, char **rekey,
     int			rc, fd, ac;
     int			i, j, newfile = 0;
     struct timeval	tv;
-    char		path[ MAXPATHLEN ], tmppath[ MAXPATHLEN ];
+    struct atomfile	af;
+    char		path[ MAXPATHLEN ];
     char		**av, *p;
     FILE		*tmpf;
     extern int		errno;
@@ -236,30 +238,24 @@ storecookie:
 	}
     }
 
-    if ( snprintf( tmppath, sizeof( tmppath ), "%s/%x%x.%i", cfg->filterdb,
-	    (int)tv.tv_sec, (int)tv.tv_usec, (int)getpid()) >=
-	    sizeof( tmppath )) {
+    if (( fd = atomfile_open( &af, cfg->filterdb, 0644,
+	    newfile ? 0 : ATOMFILE_REPLACE )) < 0 ) {
 	cosign_log( APLOG_ERR, s, "mod_cosign: cosign_cookie_valid: "
-		"tmppath too long" );
-	return( COSIGN_ERROR );
-    }
-
-    if (( fd = open( tmppath, O_CREAT|O_EXCL|O_WRONLY, 0644 )) < 0 ) {
-	cosign_log( APLOG_ERR, s, "mod_cosign: cosign_cookie_valid: "
-		"could not open %s", tmppath );
-	perror( tmppath );
+		"could not open tmp file in %s", cfg->filterdb );
+	perror( cfg->filterdb );
 	return( COSIGN_ERROR );
     }
 
     if (( tmpf = fdopen( fd, "w" )) == NULL ) {
-	if ( unlink( tmppath ) != 0 ) {
+	(void)close( fd );
+	if ( atomfile_abort( &af ) != 0 ) {
             cosign_log( APLOG_ERR, s, "mod_cosign: cosign_cookie_valid: "
-		"could not unlink %s", tmppath ); 
-	    perror( tmppath );
+		"could not unlink %s", af.af_tmp ); 
+	    perror( af.af_tmp );
 	}
         cosign_log( APLOG_ERR, s, "mod_cosign: cosign_cookie_valid: "
-	    "could not fdopen %s", tmppath ); 
-	perror( tmppath );
+	    "could not fdopen %s", af.af_tmp ); 
+	perror( af.af_tmp );
 	return( COSIGN_ERROR );
     }
 
@@ -277,41 +273,38 @@ storecookie:
     }
 #endif /* KRB */
 
-    if ( fclose ( tmpf ) != 0 ) {
-	if ( unlink( tmppath ) != 0 ) {
+    if ( fflush( tmpf ) != 0 ) {
+	if ( atomfile_abort( &af ) != 0 ) {
             cosign_log( APLOG_ERR, s, "mod_cosign: cosign_cookie_valid: "
-	        "could not unlink(2) %s", tmppath ); 
-	    perror( tmppath );
+	        "could not unlink(2) %s", af.af_tmp ); 
+	    perror( af.af_tmp );
 	}
+	(void)fclose( tmpf );
         cosign_log( APLOG_ERR, s, "mod_cosign: cosign_cookie_valid: "
-	    "could not fclose %s", tmppath ); 
-	perror( tmppath );
+	    "could not write %s", af.af_tmp ); 
+	perror( af.af_tmp );
 	return( COSIGN_ERROR );
     }
 
     if ( !newfile ) {
-        if ( rename( tmppath, path ) != 0 ) {
+        if ( atomfile_link( &af, path, ATOMFILE_REPLACE ) != 0 ) {
             cosign_log( APLOG_ERR, s, "mod_cosign: cosign_cookie_valid: "
-	        "could not rename %s", tmppath ); 
-	    perror( tmppath );
+	        "could not rename %s", af.af_tmp ); 
+	    perror( af.af_tmp );
+	    (void)atomfile_abort( &af );
+	    (void)fclose( tmpf );
 	    return( COSIGN_ERROR );
         }
-    } else {
-	if ( link( tmppath, path ) != 0 ) {
-	    if ( unlink( tmppath ) != 0 ) {
-                cosign_log( APLOG_ERR, s, "mod_cosign: cosign_cookie_valid: "
-	            "could not unlink(3) %s", tmppath ); 
-		perror( tmppath );
-	    }
-	    goto retry;
-	}
-
-	if ( unlink( tmppath ) != 0 ) {
+    } else if ( atomfile_link( &af, path, 0 ) != 0 ) {
+	if ( atomfile_abort( &af ) != 0 ) {
             cosign_log( APLOG_ERR, s, "mod_cosign: cosign_cookie_valid: "
-	        "could not unlink(4) %s", tmppath ); 
-	    perror( tmppath );
+	        "could not unlink(3) %s", af.af_tmp ); 
+	    perror( af.af_tmp );
 	}
+	(void)fclose( tmpf );
+	goto retry;
     }
+    (void)fclose( tmpf );
 
     return( COSIGN_OK );
 }
@@ -53,6 +53,7 @@ typedef struct {
 struct connlist {
     struct sockaddr_in  conn_sin;
     SNET                *conn_sn;
+    SSL_SESSION		*conn_sess;
     unsigned int	conn_capa;
     unsigned int	conn_proto;
     struct connlist     *conn_next;
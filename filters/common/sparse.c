@@ -13,6 +13,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <fcntl.h>
+#include <unistd.h>
 
 
 #include <openssl/ssl.h>
@@ -32,36 +33,93 @@
 
 #define MAXLEN 256
 
+/* a local cookie is small enough to read in one go */
+#define SCOOKIE_MAX	( MAXPATHLEN + 1024 )
+
+    static int
+scookie_field( char *dst, int size, char *p, int len )
+{
+    if ( len >= size ) {
+	return( -1 );
+    }
+    memcpy( dst, p, len );
+    dst[ len ] = '\0';
+    return( 0 );
+}
+
+/*
+ * reads the whole file with one pread() and parses it in place, rather
+ * than a line at a time through an SNET.
+ */
     int
 read_scookie( char *path, struct sinfo *si, void *s )
 {
-    SNET	*sn;
     struct stat	st;
-    char	*p, *line;
+    char	buf[ SCOOKIE_MAX ];
+    char	*p, *end, *line, *nl;
+    ssize_t	rc;
+    int		fd, len, err;
 
-    memset( si, 0, sizeof( struct sinfo ));
+    si->si_protocol = 0;
+    *si->si_ipaddr = *si->si_user = *si->si_realm = *si->si_factor = '\0';
+#ifdef KRB
+    *si->si_krb5tkt = '\0';
+#endif /* KRB */
 
-    if (( sn = snet_open( path, O_RDONLY, 0, 0 )) == NULL ) {
+    if (( fd = open( path, O_RDONLY, 0 )) < 0 ) {
 	if ( errno != ENOENT ) {
 	    perror( path );
 	}
 	return( 1 );
     }
 
-    if ( fstat( snet_fd( sn ), &st ) != 0 ) {
-	(void)snet_close( sn );
+    if ( fstat( fd, &st ) != 0 ) {
+	(void)close( fd );
 	perror( path );
 	return( -1 );
     }
+    if ( st.st_size >= (off_t)sizeof( buf )) {
+	(void)close( fd );
+	cosign_log( APLOG_ERR, s, "mod_cosign: read_scookie: %s: too long",
+		path );
+	return( -1 );
+    }
+    if (( rc = pread( fd, buf, st.st_size, 0 )) != st.st_size ) {
+	(void)close( fd );
+	cosign_log( APLOG_ERR, s, "mod_cosign: read_scookie: %s: short read",
+		path );
+	return( -1 );
+    }
+    if ( close( fd ) != 0 ) {
+	cosign_log( APLOG_ERR, s, "mod_cosign: read_scookie: %s", path );
+	return( -1 );
+    }
 
     si->si_itime = st.st_mtime;
 
-    while (( line = snet_getline( sn, NULL )) != NULL ) {
+    for ( p = buf, end = buf + rc; p < end; p = nl + 1 ) {
+	line = p;
+	if (( nl = memchr( line, '\n', end - line )) == NULL ) {
+	    nl = end;
+	}
+	/* as snet_getline(), a "\r\n" ends a line too */
+	len = nl - line;
+	if ( len > 0 && line[ len - 1 ] == '\r' ) {
+	    len--;
+	}
+	if ( len == 0 ) {
+	    cosign_log( APLOG_ERR, s,
+		    "mod_cosign: read_scookie: unknown key" );
+	    return( -1 );
+	}
 	p = line + 1;
+	len--;
+	err = 0;
 
 	switch( line[0] ) {
 
 	case 'v':
+	    line[ len + 1 ] = '\0';
 	    errno = 0;
             si->si_protocol = strtol( p, (char **)NULL, 10 );
             if ( errno ) {
@@ -73,37 +131,41 @@ read_scookie( char *path, struct sinfo *si, void *s )
 	    break;
 
 	case 'i':
-	    strcpy( si->si_ipaddr, p );
+	    err = scookie_field( si->si_ipaddr, sizeof( si->si_ipaddr ),
+		    p, len );
 	    break;
 
 	case 'p':
-	    strcpy( si->si_user, p );
+	    err = scookie_field( si->si_user, sizeof( si->si_user ), p, len );
 	    break;
 
 	case 'r':
-	    strcpy( si->si_realm, p );
+	    err = scookie_field( si->si_realm, sizeof( si->si_realm ),
+		    p, len );
 	    break;
 
 	case 'f':
-	    strcpy( si->si_factor, p );
+	    err = scookie_field( si->si_factor, sizeof( si->si_factor ),
+		    p, len );
 	    break;
 #ifdef KRB
 	case 'k':
-	    strcpy( si->si_krb5tkt, p );
+	    err = scookie_field( si->si_krb5tkt, sizeof( si->si_krb5tkt ),
+		    p, len );
 	    break;
 #endif /* KRB */
 
 	default:
 	    cosign_log( APLOG_ERR, s,
 		    "mod_cosign: read_scookie: unknown key %c", line[0] );
-	    (void)snet_close( sn );
+	    return( -1 );
+	}
+	if ( err ) {
+	    cosign_log( APLOG_ERR, s,
+		    "mod_cosign: read_scookie: %c line too long", line[0] );
 	    return( -1 );
 	}
     }
 
-    if ( snet_close( sn ) != 0 ) {
-	cosign_log( APLOG_ERR, s, "mod_cosign: read_scookie: %s", path );
-	return( -1 );
-    }
     return( 0 );
 }
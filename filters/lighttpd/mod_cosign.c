@@ -183,6 +183,9 @@ FREE_FUNC( mod_cosign_free )
 	for ( cur = p->pd_cfg->cl; *cur != NULL; cur = tmp ) {
 	    tmp = &(*cur)->conn_next;
 
+	    if ( (*cur)->conn_sess != NULL ) {
+		SSL_SESSION_free( (*cur)->conn_sess );
+	    }
 	    free( *cur );
 	    *cur = NULL;
 	}
@@ -454,6 +457,7 @@ cosign_set_host( server *srv, plugin_data *p_d, buffer *host )
 	memcpy( &new->conn_sin.sin_addr.s_addr,
 		he->h_addr_list[ i ], (unsigned int)he->h_length );
 	new->conn_sn = NULL;
+	new->conn_sess = NULL;
 	*cur = new;
 	cur = &new->conn_next;
     }
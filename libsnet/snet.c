@@ -39,6 +39,9 @@
 
 #define SNET_BUFLEN	4096
 
+/* buffered output is sent once there's a full TLS record's worth */
+#define SNET_WFLUSHLEN	16384
+
 /*
  * BOL is beginning of line, FUZZY is after a CR but before a possible LF,
  * IN is past BOL, but before the end of a line.
@@ -48,6 +51,8 @@
 #define SNET_IN		2
 
 static ssize_t snet_readread ___P(( SNET *, char *, size_t, struct timeval * ));
+static ssize_t snet_writeraw ___P(( SNET *, char *, size_t, struct timeval * ));
+static ssize_t snet_writesome ___P(( SNET * ));
 
 /*
  * This routine is necessary, since snet_getline() doesn't differentiate
@@ -85,8 +90,12 @@ snet_attach( fd, max )
 	return( NULL );
     }
     sn->sn_wbuflen = SNET_BUFLEN;
+    sn->sn_wlen = 0;
 
     sn->sn_flag = 0;
+#ifdef HAVE_LIBSSL
+    sn->sn_ssl = NULL;
+#endif /* HAVE_LIBSSL */
 
     return( sn );
 }
@@ -111,6 +120,22 @@ snet_close( SNET *sn )
     int			fd;
 
     fd = sn->sn_fd;
+
+    /* the peer may already be gone, so this is best effort */
+    if ( sn->sn_wlen > 0 ) {
+	(void)snet_flush( sn, NULL );
+    }
+
+#ifdef HAVE_LIBSSL
+    if ( sn->sn_ssl != NULL ) {
+	/*
+	 * don't send close_notify, the peer may already be gone.  marking
+	 * the connection as shut down keeps the session resumable.
+	 */
+	SSL_set_shutdown( sn->sn_ssl, SSL_SENT_SHUTDOWN|SSL_RECEIVED_SHUTDOWN );
+	SSL_free( sn->sn_ssl );
+    }
+#endif /* HAVE_LIBSSL */
     free( sn->sn_wbuf );
     free( sn->sn_rbuf );
     free( sn );
@@ -136,9 +161,15 @@ snet_timeout( SNET *sn, int flag, struct timeval *tv )
 
 #ifdef HAVE_LIBSSL
 /*
- * Returns 0 on success, and all further communication is through
- * the OpenSSL layer.  Returns -1 on failure, check the OpenSSL error
+ * Returns 1 on success, and all further communication is through
+ * the OpenSSL layer.  Returns <= 0 on failure, check the OpenSSL error
  * stack for specific errors.
+ *
+ * On a non-blocking socket the handshake may not finish in one call.
+ * sn->sn_ssl is then left set, SSL_get_error() on the return value
+ * says whether to wait for read or write, and calling snet_starttls()
+ * again continues the handshake.  After any other failure sn->sn_ssl
+ * is NULL.
  */
     int
 snet_starttls( sn, sslctx, sslaccept )
@@ -148,11 +179,20 @@ snet_starttls( sn, sslctx, sslaccept )
 {
     int			rc;
 
-    if (( sn->sn_ssl = SSL_new( sslctx )) == NULL ) {
+    /* anything buffered goes out in the clear, before the handshake */
+    if ( sn->sn_wlen > 0 && snet_flush( sn, NULL ) < 0 ) {
 	return( -1 );
     }
-    if (( rc = SSL_set_fd( sn->sn_ssl, sn->sn_fd )) != 1 ) {
-	return( rc );
+
+    if ( sn->sn_ssl == NULL ) {
+	if (( sn->sn_ssl = SSL_new( sslctx )) == NULL ) {
+	    return( -1 );
+	}
+	if (( rc = SSL_set_fd( sn->sn_ssl, sn->sn_fd )) != 1 ) {
+	    SSL_free( sn->sn_ssl );
+	    sn->sn_ssl = NULL;
+	    return( rc );
+	}
     }
     if ( sslaccept ) {
 	rc = SSL_accept( sn->sn_ssl );
@@ -161,9 +201,49 @@ snet_starttls( sn, sslctx, sslaccept )
     }
     if ( rc == 1 ) {
 	sn->sn_flag |= SNET_TLS;
+	return( rc );
+    }
+
+    switch ( SSL_get_error( sn->sn_ssl, rc )) {
+    case SSL_ERROR_WANT_READ :
+    case SSL_ERROR_WANT_WRITE :
+	errno = EAGAIN;
+	break;
+
+    default :
+	SSL_free( sn->sn_ssl );
+	sn->sn_ssl = NULL;
+	break;
     }
     return( rc );
 }
+
+/*
+ * Offers sslsession, saved from an earlier connection to the same
+ * server, in the next snet_starttls() client handshake.  If the server
+ * still has it, the session is resumed rather than negotiated afresh.
+ * Returns 1 on success, <= 0 on failure.
+ */
+    int
+snet_setsession( sn, sslctx, sslsession )
+    SNET		*sn;
+    SSL_CTX		*sslctx;
+    SSL_SESSION		*sslsession;
+{
+    int			rc;
+
+    if ( sn->sn_ssl == NULL ) {
+	if (( sn->sn_ssl = SSL_new( sslctx )) == NULL ) {
+	    return( -1 );
+	}
+	if (( rc = SSL_set_fd( sn->sn_ssl, sn->sn_fd )) != 1 ) {
+	    SSL_free( sn->sn_ssl );
+	    sn->sn_ssl = NULL;
+	    return( rc );
+	}
+    }
+    return( SSL_set_session( sn->sn_ssl, sslsession ));
+}
 #endif /* HAVE_LIBSSL */
 
 #ifdef HAVE_LIBSASL
@@ -248,7 +328,8 @@ snet_writeftv( sn, tv, format, va_alist )
 		end = sn->sn_wbuf + sn->sn_wbuflen;			\
 	    }		
 
-    cur = sn->sn_wbuf;
+    /* format after anything already buffered */
+    cur = sn->sn_wbuf + sn->sn_wlen;
     end = sn->sn_wbuf + sn->sn_wbuflen;
 
     for ( ; *format; format++ ) {
@@ -443,7 +524,80 @@ modifier:
 
     va_end( vl );
 
-    return( snet_write( sn, sn->sn_wbuf, cur - sn->sn_wbuf, tv ));
+    len = ( cur - sn->sn_wbuf ) - sn->sn_wlen;
+    sn->sn_wlen = cur - sn->sn_wbuf;
+    if (( sn->sn_flag & SNET_WRITE_BUFFER ) &&
+	    sn->sn_wlen < SNET_WFLUSHLEN ) {
+	return( len );
+    }
+    if ( snet_flush( sn, tv ) < 0 ) {
+	return( -1 );
+    }
+    return( len );
+}
+
+/*
+ * With buffering on, snet_writef() and snet_write() only queue their
+ * output, which goes out in as few writes as possible: when enough has
+ * built up, when snet_flush() is called, and before reading anything
+ * more from the network, since a reply may depend on what's queued.
+ * Turning buffering off flushes the queue.
+ */
+    void
+snet_writebuffer( sn, on )
+    SNET		*sn;
+    int			on;
+{
+    if ( on ) {
+	sn->sn_flag |= SNET_WRITE_BUFFER;
+    } else {
+	sn->sn_flag &= ~( SNET_WRITE_BUFFER | SNET_WRITE_QUEUE );
+	if ( sn->sn_wlen > 0 ) {
+	    (void)snet_flush( sn, NULL );
+	}
+    }
+}
+
+/*
+ * For a non-blocking socket.  Output is buffered, but snet_flush()
+ * writes only what the socket will take without waiting, and keeps
+ * the rest queued, so a peer that's slow to read can't hold up the
+ * caller.  While snet_wpending() is non-zero, the caller waits for
+ * the socket to be writable and calls snet_flush() again.
+ */
+    void
+snet_writequeue( sn )
+    SNET		*sn;
+{
+    sn->sn_flag |= SNET_WRITE_BUFFER | SNET_WRITE_QUEUE;
+}
+
+/*
+ * Writes out everything queued.  Returns the number of bytes written,
+ * or -1 on error, when anything still queued is discarded.
+ */
+    ssize_t
+snet_flush( sn, tv )
+    SNET		*sn;
+    struct timeval	*tv;
+{
+    ssize_t		rc;
+    size_t		off = 0;
+
+    if ( sn->sn_flag & SNET_WRITE_QUEUE ) {
+	return( snet_writesome( sn ));
+    }
+
+    while ( off < sn->sn_wlen ) {
+	if (( rc = snet_writeraw( sn, sn->sn_wbuf + off,
+		sn->sn_wlen - off, tv )) <= 0 ) {
+	    sn->sn_wlen = 0;
+	    return( -1 );
+	}
+	off += rc;
+    }
+    sn->sn_wlen = 0;
+    return( off );
 }
 
 /*
@@ -503,6 +657,58 @@ snet_write( sn, buf, len, tv )
     char		*buf;
     size_t		len;
     struct timeval	*tv;
+{
+    char		*wbuf;
+    size_t		size;
+
+    if (( sn->sn_flag & SNET_WRITE_BUFFER ) == 0 && sn->sn_wlen == 0 ) {
+	return( snet_writeraw( sn, buf, len, tv ));
+    }
+
+    if ( sn->sn_flag & SNET_WRITE_QUEUE ) {
+	if ( sn->sn_wlen + len > sn->sn_wbuflen ) {
+	    size = sn->sn_wlen + len + SNET_BUFLEN;
+	    if (( wbuf = (char *)realloc( sn->sn_wbuf, size )) == NULL ) {
+		return( -1 );
+	    }
+	    sn->sn_wbuf = wbuf;
+	    sn->sn_wbuflen = size;
+	}
+	memcpy( sn->sn_wbuf + sn->sn_wlen, buf, len );
+	sn->sn_wlen += len;
+	if ( sn->sn_wlen >= SNET_WFLUSHLEN && snet_flush( sn, tv ) < 0 ) {
+	    return( -1 );
+	}
+	return( len );
+    }
+
+    if ( sn->sn_wlen + len > sn->sn_wbuflen ) {
+	if ( sn->sn_wlen > 0 && snet_flush( sn, tv ) < 0 ) {
+	    return( -1 );
+	}
+	/* too big to be worth queueing */
+	if ( len >= SNET_WFLUSHLEN || len > sn->sn_wbuflen ) {
+	    return( snet_writeraw( sn, buf, len, tv ));
+	}
+    }
+    memcpy( sn->sn_wbuf + sn->sn_wlen, buf, len );
+    sn->sn_wlen += len;
+
+    if (( sn->sn_flag & SNET_WRITE_BUFFER ) == 0 ||
+	    sn->sn_wlen >= SNET_WFLUSHLEN ) {
+	if ( snet_flush( sn, tv ) < 0 ) {
+	    return( -1 );
+	}
+    }
+    return( len );
+}
+
+    static ssize_t
+snet_writeraw( sn, buf, len, tv )
+    SNET		*sn;
+    char		*buf;
+    size_t		len;
+    struct timeval	*tv;
 {
     fd_set		fds;
     int			rc, oflags;
@@ -620,6 +826,66 @@ snet_write( sn, buf, len, tv )
     return( rlen );
 }
 
+/*
+ * Writes from the queue what the socket will take now, and moves what's
+ * left to the front.  Returns the number of bytes written, or -1 on
+ * error, when the queue is discarded.
+ */
+    static ssize_t
+snet_writesome( sn )
+    SNET		*sn;
+{
+    ssize_t		rc;
+    size_t		off = 0;
+
+    while ( off < sn->sn_wlen ) {
+	if ( sn->sn_flag & SNET_TLS ) {
+#ifdef HAVE_LIBSSL
+	    /*
+	     * a record OpenSSL couldn't send is sent again from wherever
+	     * the queue has been moved to, and the queue may have grown.
+	     */
+	    SSL_set_mode( sn->sn_ssl, SSL_MODE_ENABLE_PARTIAL_WRITE |
+		    SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER );
+
+	    if (( rc = SSL_write( sn->sn_ssl, sn->sn_wbuf + off,
+		    sn->sn_wlen - off )) <= 0 ) {
+		switch ( SSL_get_error( sn->sn_ssl, rc )) {
+		case SSL_ERROR_WANT_READ :
+		case SSL_ERROR_WANT_WRITE :
+		    rc = 0;
+		    break;
+
+		default :
+		    sn->sn_wlen = 0;
+		    return( -1 );
+		}
+	    }
+#else
+	    sn->sn_wlen = 0;
+	    return( -1 );
+#endif /* HAVE_LIBSSL */
+	} else if (( rc = write( snet_fd( sn ), sn->sn_wbuf + off,
+		sn->sn_wlen - off )) < 0 ) {
+	    if ( errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR ) {
+		sn->sn_wlen = 0;
+		return( -1 );
+	    }
+	    rc = 0;
+	}
+	if ( rc == 0 ) {
+	    break;
+	}
+	off += rc;
+    }
+
+    if ( off > 0 ) {
+	memmove( sn->sn_wbuf, sn->sn_wbuf + off, sn->sn_wlen - off );
+	sn->sn_wlen -= off;
+    }
+    return( off );
+}
+
     static ssize_t
 snet_readread( sn, buf, len, tv )
     SNET		*sn;
@@ -633,6 +899,11 @@ snet_readread( sn, buf, len, tv )
     extern int		errno;
     int			haveinput = 0;
 
+    /* the peer may be waiting on what we've queued before it says more */
+    if ( sn->sn_wlen > 0 && snet_flush( sn, NULL ) < 0 ) {
+	return( -1 );
+    }
+
     if (( tv == NULL ) && ( sn->sn_flag & SNET_READ_TIMEOUT )) {
 	default_tv = sn->sn_read_timeout;
 	tv = &default_tv;
@@ -668,7 +939,18 @@ snet_readread( sn, buf, len, tv )
 	 * and SSL_MODE_AUTO_RETRY for possible ways to deal with these
 	 * differences in call semantics.
 	 */
-	rc = SSL_read( sn->sn_ssl, buf, len );
+	if (( rc = SSL_read( sn->sn_ssl, buf, len )) < 0 ) {
+	    switch ( SSL_get_error( sn->sn_ssl, rc )) {
+	    case SSL_ERROR_WANT_READ :
+	    case SSL_ERROR_WANT_WRITE :
+		/* non-blocking, and only part of a record has arrived */
+		errno = EAGAIN;
+		break;
+
+	    default :
+		break;
+	    }
+	}
 #else /* HAVE_LIBSSL */
 	rc = -1;
 #endif /* HAVE_LIBSSL */
@@ -718,6 +1000,50 @@ snet_hasdata( sn )
     return( 0 );
 }
 
+/*
+ * Reads whatever has arrived onto the end of the read buffer, without
+ * taking a line, so that the caller can look ahead from sn_rcur to
+ * sn_rend.  Returns the number of bytes read, 0 on EOF, or -1.
+ */
+    ssize_t
+snet_fill( sn )
+    SNET		*sn;
+{
+    ssize_t		rc;
+    extern int		errno;
+
+    /* pullup */
+    if ( sn->sn_rcur > sn->sn_rbuf ) {
+	if ( sn->sn_rcur < sn->sn_rend ) {
+	    memmove( sn->sn_rbuf, sn->sn_rcur,
+		    (unsigned)( sn->sn_rend - sn->sn_rcur ));
+	}
+	sn->sn_rend = sn->sn_rbuf + ( sn->sn_rend - sn->sn_rcur );
+	sn->sn_rcur = sn->sn_rbuf;
+    }
+
+    /* expand */
+    if ( sn->sn_rend == sn->sn_rbuf + sn->sn_rbuflen ) {
+	if ( sn->sn_maxlen != 0 && sn->sn_rbuflen >= sn->sn_maxlen ) {
+	    errno = ENOMEM;
+	    return( -1 );
+	}
+	if (( sn->sn_rbuf = (char *)realloc( sn->sn_rbuf,
+		sn->sn_rbuflen + SNET_BUFLEN )) == NULL ) {
+	    exit( 1 );
+	}
+	sn->sn_rbuflen += SNET_BUFLEN;
+	sn->sn_rend = sn->sn_rbuf + ( sn->sn_rend - sn->sn_rcur );
+	sn->sn_rcur = sn->sn_rbuf;
+    }
+
+    if (( rc = snet_readread( sn, sn->sn_rend,
+	    sn->sn_rbuflen - ( sn->sn_rend - sn->sn_rbuf ), NULL )) > 0 ) {
+	sn->sn_rend += rc;
+    }
+    return( rc );
+}
+
 /*
  * External entry point for reading with the snet library.  Compatible
  * with snet_getline()'s buffering.
@@ -19,6 +19,7 @@ typedef struct {
     int			sn_rstate;
     char		*sn_wbuf;
     int			sn_wbuflen;
+    int			sn_wlen;
     int			sn_flag;
     struct timeval	sn_read_timeout;
     struct timeval	sn_write_timeout;
@@ -40,9 +41,12 @@ typedef struct {
 #endif /* HAVE_LIBSASL */
 #define SNET_WRITE_TIMEOUT	(1<<3)
 #define SNET_READ_TIMEOUT	(1<<4)
+#define SNET_WRITE_BUFFER	(1<<5)
+#define SNET_WRITE_QUEUE	(1<<6)
 
 #define snet_fd( sn )	((sn)->sn_fd)
 #define snet_saslssf( sn )	((sn)->sn_saslssf)
+#define snet_wpending( sn )	((sn)->sn_wlen)
 
 #define snet_writef( sn, ... )	snet_writeftv((sn),NULL, __VA_ARGS__ )
 
@@ -56,10 +60,15 @@ char	*snet_getline_multi ___P(( SNET *, void (*)(char *),
 		struct timeval * ));
 void	snet_timeout ___P(( SNET *, int, struct timeval * ));
 int	snet_hasdata ___P(( SNET * ));
+ssize_t	snet_fill ___P(( SNET * ));
 ssize_t	snet_read ___P(( SNET *, char *, size_t, struct timeval * ));
 ssize_t	snet_write ___P(( SNET *, char *, size_t, struct timeval * ));
+void	snet_writebuffer ___P(( SNET *, int ));
+void	snet_writequeue ___P(( SNET * ));
+ssize_t	snet_flush ___P(( SNET *, struct timeval * ));
 #ifdef HAVE_LIBSSL
 int	snet_starttls ___P(( SNET *, SSL_CTX *, int ));
+int	snet_setsession ___P(( SNET *, SSL_CTX *, SSL_SESSION * ));
 #endif /* HAVE_LIBSSL */
 #ifdef HAVE_LIBSASL
 int	snet_setsasl  ___P(( SNET *, sasl_conn_t * ));
@@ -705,6 +705,35 @@ cosignd_start() {
     fi
 }
 
+# a second cosignd, on port 33667 and without TLS, sharing the first's
+# store.  its "cgi NOTLS" access line lets tests speak the protocol.
+cosignd_notls_start() {
+    cosign_conf="$(pwd)/cosign/etc/cosign-notls.conf"
+    cosignd_path="$(pwd)/../daemon/cosignd"
+
+    # with no CN to match service cookies against, skip strict checks.
+    { sed -e 's/^cgi .*/cgi NOTLS/' < "$(pwd)/cosign/etc/cosign.conf";
+      echo "set cosignstrictcheck	off"; } \
+		> "${cosign_conf}" || die "failed to create ${cosign_conf}"
+
+    "${cosignd_path}" -X -p 33667 -c "${cosign_conf}" \
+		-x "$(pwd)/certs/CA" \
+		-y "$(pwd)/certs/localhost.crt" \
+		-z "$(pwd)/certs/localhost.key"
+}
+
+# sends the commands on stdin to the NOTLS cosignd, and prints its
+# replies after a blank line, as headers_trim expects.
+cosignd_session() {
+    exec 3<>/dev/tcp/127.0.0.1/33667 || return 1
+
+    { cat; echo "QUIT"; } | awk '{ printf "%s\r\n", $0 }' >&3
+    echo
+    sed -e 1d <&3 | tr -d '\r'
+
+    exec 3<&-
+}
+
 cosignd_stop() {
     cosignd_path="$(pwd)/../daemon/cosignd"
 